@@ -0,0 +1,190 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+#pragma once
+#include "credit.h"
+#include "rdma_atomic.h"
+#include "submit_queue.h"
+#include "utils.h"
+#include "wr_batch.h"
+
+/* 基准测试的默认参数 */
+#define BENCH_DEFAULT_MIN_SIZE (2)
+#define BENCH_DEFAULT_MAX_SIZE (8 << 20)
+#define BENCH_DEFAULT_ITERATIONS (1000)
+#define BENCH_MAX_ITER_COUNTS (8)
+#define BENCH_REG_DEFAULT_MIN_SIZE (64UL << 20)
+#define BENCH_REG_DEFAULT_MAX_SIZE (1UL << 30)
+/* 注册基准中吞吐测试每个WRITE的大小 */
+#define BENCH_REG_CHUNK_SIZE (1 << 20)
+/* 原子基准中各线程独占的字之间的间隔, 避免落在同一缓存行 */
+#define BENCH_ATOMIC_STRIDE (64)
+/* 提交队列基准的默认提交线程数 */
+#define BENCH_DEFAULT_SUBMIT_THREADS (4)
+
+/* 参与测试的操作类型, 可按位组合 */
+enum bench_op
+{
+    BENCH_OP_WRITE = 1 << 0,
+    BENCH_OP_READ  = 1 << 1,
+    BENCH_OP_SEND  = 1 << 2,
+    BENCH_OP_ALL   = BENCH_OP_WRITE | BENCH_OP_READ | BENCH_OP_SEND,
+    /* 原子操作只由run_atomic_benchmark()测试 */
+    BENCH_OP_FAA    = 1 << 3,
+    BENCH_OP_CAS    = 1 << 4,
+    BENCH_OP_LOCK   = 1 << 5,
+    BENCH_OP_ATOMIC = BENCH_OP_FAA | BENCH_OP_CAS | BENCH_OP_LOCK,
+};
+
+/* 客户端运行的基准测试 */
+enum bench_mode
+{
+    BENCH_MODE_NONE,   /* 不运行基准测试 */
+    BENCH_MODE_OPS,    /* 各操作的延迟与吞吐 (--bench) */
+    BENCH_MODE_REG,    /* 内存注册 (--bench-reg) */
+    BENCH_MODE_POST,   /* 投递方式 (--bench-post) */
+    BENCH_MODE_ATOMIC, /* 原子操作争用, 每个QP一个线程 (--bench-atomic) */
+    BENCH_MODE_ODP,    /* 按需分页注册 (--bench-odp) */
+    BENCH_MODE_SUBMIT, /* 多线程共用QP的提交队列 (--bench-submit) */
+};
+
+/* 结果输出格式 */
+enum bench_format
+{
+    BENCH_FORMAT_TEXT,
+    BENCH_FORMAT_CSV,
+    BENCH_FORMAT_JSON,
+};
+
+/* 基准测试配置 */
+struct bench_config
+{
+    uint32_t ops;
+    uint32_t min_size, max_size;
+    uint32_t iterations[BENCH_MAX_ITER_COUNTS];
+    int num_iteration_counts;
+    enum bench_format format;
+    /* 注册基准的缓冲区大小范围 */
+    uint64_t reg_min_size, reg_max_size;
+    /* 提交队列基准的最大提交线程数 */
+    uint32_t submit_threads;
+};
+
+/* 基准测试使用的已建立连接及其缓冲区 */
+struct bench_target
+{
+    struct ibv_qp *qp;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    struct ibv_mr *src_mr, *dst_mr;
+    struct rdma_buffer_attr *remote;
+    uint32_t depth;
+    struct ibv_pd *pd;
+    struct send_credits *credits; /* SEND的信用, NULL表示不做流控 */
+};
+
+/* 单个 (操作, 大小, 次数) 组合的测试结果 */
+struct bench_result
+{
+    const char *op;
+    uint32_t size, iterations, depth;
+    int inlined; /* 是否以IBV_SEND_INLINE投递 */
+    double gbps, mops;
+    double lat_min_us, lat_avg_us, lat_p50_us, lat_p99_us, lat_p999_us, lat_max_us;
+};
+
+/**
+ * @brief: 用默认参数初始化基准测试配置
+ * @param: cfg 配置
+ */
+void bench_config_init(struct bench_config *cfg);
+
+/**
+ * @brief: 解析逗号分隔的操作列表, 如 "write,read,send" 或 "faa,cas,lock"
+ * @param: str 字符串
+ * @param: ops 解析结果, enum bench_op的按位组合
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_bench_ops(const char *str, uint32_t *ops);
+
+/**
+ * @brief: 解析逗号分隔的迭代次数列表, 如 "100,1000,10000"
+ * @param: str 字符串
+ * @param: cfg 配置, 结果写入iterations与num_iteration_counts
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_bench_iterations(const char *str, struct bench_config *cfg);
+
+/**
+ * @brief: 解析输出格式名称 ("text", "csv", "json")
+ * @param: str 字符串
+ * @param: format 解析结果
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_bench_format(const char *str, enum bench_format *format);
+
+/**
+ * @brief: 按配置遍历操作类型、消息大小与迭代次数, 测量带宽、消息速率与延迟分位数,
+ * 结果输出到stdout。延迟为单个WR从投递到本地完成的时间 (深度为1),
+ * 带宽与消息速率在target->depth个WR在途时测得。不超过内联阈值的SEND/WRITE以内联方式投递。
+ * @param: target 已建立的连接, src_mr/dst_mr与remote都至少为cfg->max_size字节
+ * @param: cfg 配置
+ * @return: 0表示成功，否则表示失败
+ */
+int run_benchmark(struct bench_target *target, struct bench_config *cfg);
+
+/**
+ * @brief: 对每种页面来源 (heap/thp/2m/1g) 与cfg->reg_min_size到cfg->reg_max_size的缓冲区大小,
+ * 测量分配、首次访问、ibv_reg_mr与ibv_dereg_mr的耗时, 以及以RDMA WRITE流式发送整个缓冲区的吞吐,
+ * 结果输出到stdout。大页不可用时报告实际回退到的页面来源。
+ * @param: target 已建立的连接, 远端缓冲区循环复用
+ * @param: cfg 配置
+ * @return: 0表示成功，否则表示失败
+ */
+int run_reg_benchmark(struct bench_target *target, struct bench_config *cfg);
+
+/**
+ * @brief: 对每种设备支持的注册方式 (pinned/explicit/implicit) 与cfg->reg_min_size到cfg->reg_max_size的
+ * 缓冲区大小, 在未访问过的内存上测量注册耗时、首次以RDMA WRITE流式发送整个缓冲区 (ODP下伴随缺页)
+ * 与再次发送 (稳态) 的吞吐以及注销耗时, 结果输出到stdout
+ * @param: target 已建立的连接, 远端缓冲区循环复用
+ * @param: cfg 配置
+ * @return: 0表示成功，否则表示失败
+ */
+int run_odp_benchmark(struct bench_target *target, struct bench_config *cfg);
+
+/**
+ * @brief: 对每种操作类型与消息大小, 分别以每个WR单独投递 (批大小1) 和按get_post_batch()的批大小
+ * 链接投递的方式执行cfg->iterations[0]次操作, 比较消息速率与带宽, 结果输出到stdout
+ * @param: target 已建立的连接, src_mr/dst_mr与remote都至少为cfg->max_size字节
+ * @param: cfg 配置
+ * @return: 0表示成功，否则表示失败
+ */
+int run_post_benchmark(struct bench_target *target, struct bench_config *cfg);
+
+/**
+ * @brief: 原子操作的争用测试。每个target (QP) 由一个线程驱动, 对cfg->ops中的每种原子操作
+ * (未指定时全部测试) 先让所有线程访问同一个字, 再让每个线程访问各自的字, 每个线程执行
+ * cfg->iterations[0]次操作, 报告总消息速率、成功率, 并读回远端的字校验结果, 输出到stdout。
+ *  - faa: 流水线FETCH_AND_ADD加1;
+ *  - cas: 流水线CMP_AND_SWP, 以最近一次看到的值为比较值加1, 成功率反映争用程度;
+ *  - lock: 获取rdma_spin_lock()后以READ/WRITE递增锁之后的字, 再释放锁。
+ * @param: targets 同一会话的连接, remote至少为num_targets * BENCH_ATOMIC_STRIDE字节,
+ * 其内容会被覆盖
+ * @param: num_targets 连接数, 即线程数
+ * @param: cfg 配置
+ * @return: 0表示成功，否则表示失败
+ */
+int run_atomic_benchmark(struct bench_target *targets, uint32_t num_targets,
+                         struct bench_config *cfg);
+
+/**
+ * @brief: 提交队列的并发测试。对每种操作类型与消息大小, 以1, 2, 4...直到cfg->submit_threads个
+ * 提交线程共用target的QP, 经由submit_queue提交cfg->iterations[0]次操作 (每个线程), 报告总消息速率、
+ * 带宽以及每次门铃平均投递的WR数, 结果输出到stdout
+ * @param: target 已建立的连接, src_mr/dst_mr与remote都至少为cfg->max_size字节
+ * @param: cfg 配置
+ * @return: 0表示成功，否则表示失败
+ */
+int run_submit_benchmark(struct bench_target *target, struct bench_config *cfg);
+
+#endif  // BENCH_H_
@@ -1,36 +1,159 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 #pragma once
+#include <getopt.h>
+#include <pthread.h>
+#include "bench.h"
+#include "credit.h"
+#include "file_stream.h"
+#include "kv.h"
+#include "latency.h"
+#include "mr_pool.h"
+#include "port_counters.h"
+#include "ring.h"
 #include "utils.h"
 
-/* RDMA管理资源声明 */
+/* 客户端连接建立的阶段 */
+enum client_setup_phase
+{
+    CLIENT_SETUP_ADDR,     /* rdma_resolve_addr */
+    CLIENT_SETUP_ROUTE,    /* rdma_resolve_route */
+    CLIENT_SETUP_PD,       /* PD、内存池与ODP, 只有第一个QP需要 */
+    CLIENT_SETUP_CQ,       /* 完成通道与CQ */
+    CLIENT_SETUP_QP,       /* QP */
+    CLIENT_SETUP_CONNECT,  /* 投递元数据接收与rdma_connect直到ESTABLISHED */
+    CLIENT_SETUP_METADATA, /* 元数据交换 */
+    CLIENT_SETUP_NUM_PHASES,
+};
+
+/* 会话中每个QP独占的资源, 每个QP由各自的线程驱动 */
+struct client_qp_ctx
+{
+    uint16_t index;
+    struct rdma_cm_id *cm_id;
+    struct ibv_comp_channel *io_completion_channel;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    struct setup_timer setup;
+
+    /* 元数据交换 */
+    struct ibv_mr *client_metadata_mr, *server_metadata_mr;
+    struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
+    struct ibv_send_wr client_send_wr, *bad_client_send_wr;
+    struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr;
+    struct ibv_sge client_send_sge, server_recv_sge;
+
+    /* 服务端为本QP的SEND授予的信用 */
+    struct send_credits credits;
+
+    /* 本QP负责的条带: [stripe_offset, stripe_offset + stripe_length) */
+    pthread_t thread;
+    enum ibv_wr_opcode opcode;
+    struct ibv_mr *local_mr;
+    uint64_t stripe_offset, stripe_length;
+    int ret;
+};
+
+/* RDMA管理资源声明, 所有QP共用一个CM事件通道与PD */
 static struct rdma_event_channel *cm_channel = NULL;
-static struct rdma_cm_id *cm_client_id = NULL;
 static struct ibv_pd *pd = NULL;
-static struct ibv_comp_channel *io_completion_channel = NULL;
-static struct ibv_cq *client_cq = NULL;
-static struct ibv_qp_init_attr qp_init_attr;
-static struct ibv_qp *client_qp = NULL;
+
+/* 每个逻辑连接的QP数 (-q) 与会话标识 */
+static struct client_qp_ctx *qp_ctxs = NULL;
+static uint32_t num_qps = 1;
+static uint64_t session_id = 0;
 
 /* RDMA内存资源声明 */
-static struct ibv_mr *client_metadata_mr = NULL,
-                    *server_metadata_mr = NULL,
-                    *client_src_mr = NULL,
-                    *client_dst_mr = NULL;
-static struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
-static struct ibv_send_wr client_send_wr, *bad_client_send_wr = NULL;
-static struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr = NULL;
-static struct ibv_sge client_send_sge, server_recv_sge;
+static struct ibv_mr *client_src_mr = NULL, *client_dst_mr = NULL;
+
+/* 队列深度与每种单边操作的执行次数 */
+static uint32_t queue_depth = DEFAULT_QUEUE_DEPTH, num_iterations = 1;
+static uint8_t max_rd_atomic = 0;
+
+/* 内存池arena大小 (-P, 0表示不使用内存池与注册缓存) */
+static size_t mr_pool_arena_size = MR_POOL_DEFAULT_ARENA_SIZE;
+
+/* 内存注册方式 (-O), 启用ODP时注册不钉住页面 */
+static enum mr_odp_mode odp_mode = MR_ODP_OFF;
 
 /* 源缓冲区和目标缓冲区 */
+static struct host_buffer src_buf, dst_buf;
 static char *src = NULL, *dst = NULL;
+static uint64_t buffer_length = 0;
+
+/* 分块传输时每个WR的大小 (-c) */
+static uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+
+/* 基准测试模式 (--bench*) */
+static enum bench_mode bench_mode = BENCH_MODE_NONE;
+static struct bench_config bench_cfg;
+
+/* KV模式下按命令行顺序执行的操作 (--kv-put/--kv-get), 非空时不进行缓冲区读写 */
+#define MAX_KV_CLI_OPS (32)
+struct kv_cli_op
+{
+    int put;
+    const char *arg; /* GET为键, PUT为 键=值 */
+};
+static struct kv_cli_op kv_ops[MAX_KV_CLI_OPS];
+static int num_kv_ops = 0;
+
+/* 环形通道模式下发送的消息数 (--ring, 0表示不启用) 与消息大小 (--ring-msg-size) */
+static uint64_t ring_messages = 0;
+static uint32_t ring_msg_size = RING_DEFAULT_MSG_SIZE;
+static struct ring_sender ring_sender;
+
+/* 文件模式下推送的文件 (-f, NULL表示不启用) 与每次注册的分片大小 (--file-slice) */
+static const char *file_path     = NULL;
+static uint64_t file_slice_size  = FILE_DEFAULT_SLICE_SIZE;
+static struct mapped_file file_src = {.fd = -1};
+static struct file_request file_request;
+static struct file_response file_response;
+
+/* 端口计数器的采样间隔 (-M, 毫秒, 0表示不采样) 与第一个QP所在端口的采样器 */
+static uint32_t counter_interval_ms = 0;
+static struct port_sampler *port_sampler = NULL;
+
+/* 以-DRDMA_LATENCY_TRACE=ON构建时每个WR延迟分解的JSON输出文件 (--lat-json, NULL表示stderr) */
+static const char *lat_json_path = NULL;
+
+/* 仅有长选项的命令行参数 */
+enum long_option
+{
+    OPT_BENCH = 256,
+    OPT_BENCH_OPS,
+    OPT_BENCH_MIN_SIZE,
+    OPT_BENCH_MAX_SIZE,
+    OPT_BENCH_ITERS,
+    OPT_BENCH_FORMAT,
+    OPT_BENCH_REG,
+    OPT_BENCH_REG_MIN_SIZE,
+    OPT_BENCH_REG_MAX_SIZE,
+    OPT_BENCH_POST,
+    OPT_BENCH_ATOMIC,
+    OPT_BENCH_ODP,
+    OPT_BENCH_SUBMIT,
+    OPT_BENCH_THREADS,
+    OPT_KV_PUT,
+    OPT_KV_GET,
+    OPT_RING,
+    OPT_RING_MSG_SIZE,
+    OPT_FILE_SLICE,
+    OPT_LAT_JSON,
+};
 
 static int check_src_dst();
-static int start_rdma_clilent(struct sockaddr_in *s_addr);
-static int pre_post_recv();
-static int connect_to_server();
-static int exchange_metadata();
+static int start_rdma_client(struct sockaddr_in *s_addr);
+static int setup_qp_ctx(struct client_qp_ctx *ctx, struct sockaddr_in *s_addr);
+static int pre_post_recv(struct client_qp_ctx *ctx);
+static int connect_to_server(struct client_qp_ctx *ctx);
+static int exchange_metadata(struct client_qp_ctx *ctx);
+static int striped_transfer(enum ibv_wr_opcode opcode, struct ibv_mr *local_mr);
 static int remote_memory_ops();
+static int run_client_benchmark();
+static int run_kv_ops();
+static int run_ring_messages();
+static int run_file_stream();
 static int disconnect_and_cleanup();
 
 #endif // CLIENT_H
\ No newline at end of file
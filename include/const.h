@@ -1,10 +1,43 @@
 #ifndef CONST_H_
 #define CONST_H_
 
-/* RDMA连接参数声明 */
-#define CQ_CAPACITY (16)
+/* RDMA连接参数声明, 队列深度在运行时由 -d 指定 */
+#define DEFAULT_QUEUE_DEPTH (8)
 #define MAX_SGE (2)
-#define MAX_WR (8)
+/* 发送队列与接收队列共用一个CQ, 容量为两者之和 */
+#define CQ_CAPACITY(depth) (2 * (depth))
+/* 单次ibv_poll_cq最多取出的完成数 */
+#define WC_BATCH (16)
 #define DEFAULT_PORT (18515)
+/* 默认的内联阈值, 不超过该大小的SEND/WRITE由CPU拷贝进WQE, 网卡无需再DMA读取负载 */
+#define DEFAULT_MAX_INLINE_DATA (64)
+
+/* SRQ模式下每个共享接收缓冲区的默认大小 */
+#define DEFAULT_SRQ_RECV_SIZE (4096)
+/* SRQ中已投递的接收少于该值时批量补充 */
+#define SRQ_LOW_WATERMARK(depth) ((depth) / 4)
+
+/*
+ * 连接的重试参数。经由CM建立连接时, 一端在rdma_connect()/rdma_accept()中给出的
+ * rnr_retry_count作用于对端的QP, 因此双方都要设置。
+ * RNR重试为7表示无限重试, 供未做信用流控的SEND与WRITE_WITH_IMM兜底;
+ * retry_count是丢包或ACK超时的传输重试次数, 取最大值以免有损网络下QP直接进入错误状态。
+ */
+#define RDMA_RETRY_COUNT (7)
+#define RDMA_RNR_RETRY_COUNT (7)
+
+/* 一个逻辑连接 (会话) 最多包含的QP数 */
+#define MAX_QPS_PER_SESSION (64)
+
+/* 分块传输时每个WR的默认大小 */
+#define DEFAULT_CHUNK_SIZE (1 << 20)
+
+/* 自适应完成模式下回退到完成通道前的默认忙轮询时长 (微秒) */
+#define DEFAULT_SPIN_BUDGET_US (100)
+
+/* CQ中断合并 (-E) 未给出时长时的默认合并时长 (微秒) */
+#define DEFAULT_CQ_MOD_PERIOD_US (20)
+/* 完成事件攒到这么多个才一次ibv_ack_cq_events() */
+#define CQ_EVENT_ACK_BATCH (64)
 
 #endif // CONST_H_
\ No newline at end of file
@@ -0,0 +1,128 @@
+#ifndef CREDIT_H_
+#define CREDIT_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include "utils.h"
+
+/*
+ * 双边SEND/RECV的信用流控。
+ * 发送端在注册内存中提供一个8字节的信用字, 连接时告诉接收端其位置; 接收端在rdma_accept()中
+ * 告知初始信用 (为发送端预先投递的接收数), 之后每补充一批接收, 就把累计投递的接收数以
+ * RDMA WRITE写回信用字。发送端已发出的SEND数不超过信用字, 因此SEND到达时接收总是已投递,
+ * 不会触发RNR NAK及其退避。
+ * 信用写回不消耗发送端的接收, 与环形通道 (ring.h) 写回head的方式相同。
+ */
+
+/* 接收端每消费初始信用的1/RECV_CREDIT_FRACTION就批量补充接收并写回信用 */
+#define RECV_CREDIT_FRACTION (4)
+/* 发送端等待信用的上限, 超过时认为接收端已失去响应 */
+#define SEND_CREDIT_TIMEOUT_MS (10000)
+
+/* 发送端 */
+struct send_credits
+{
+    struct ibv_mr *mr; /* 接收端写回的累计信用, NULL表示接收端不做流控 */
+    uint64_t used;     /* 已发出的SEND数 */
+};
+
+/* 接收端 */
+struct recv_credits
+{
+    struct ibv_qp *qp;
+    /* 发送端的信用字, credit_rkey为0表示发送端不做流控 */
+    uint64_t credit_addr;
+    uint32_t credit_rkey;
+    uint64_t posted;          /* 累计为发送端投递的接收数 */
+    struct ibv_mr *credit_mr; /* 写回信用的源, 见rdma_write_u64_prepare() */
+    uint32_t batch;
+};
+
+/**
+ * @brief: 分配并注册发送端的信用字, 在连接之前调用
+ * @param: c 发送端
+ * @param: pd 保护域
+ * @param: attr 返回信用字的位置与rkey, 放入rdma_session_hello
+ * @return: 0表示成功，否则表示失败
+ */
+int send_credits_init(struct send_credits *c, struct ibv_pd *pd, struct rdma_buffer_attr *attr);
+
+/**
+ * @brief: 按接收端在rdma_accept()中告知的初始信用启用流控, 在连接建立之后、第一个SEND之前调用
+ * @param: c 发送端
+ * @param: initial 初始信用, 0表示接收端不做流控, 此时释放信用字
+ */
+void send_credits_start(struct send_credits *c, uint32_t initial);
+
+/**
+ * @brief: 释放发送端的信用字
+ * @param: c 发送端
+ */
+void send_credits_destroy(struct send_credits *c);
+
+/* 是否启用了流控 */
+static inline int send_credits_enabled(const struct send_credits *c)
+{
+    return c && c->mr;
+}
+
+/* 剩余可发出的SEND数, 信用字由接收端的RDMA WRITE更新 */
+static inline uint64_t send_credits_available(const struct send_credits *c)
+{
+    return *(volatile uint64_t *)c->mr->addr - c->used;
+}
+
+/* 发出n个SEND后扣除信用 */
+static inline void send_credits_use(struct send_credits *c, uint32_t n)
+{
+    c->used += n;
+}
+
+/**
+ * @brief: 忙等直到至少有一个信用, 调用方须确保没有等待完成的SEND (否则应先收集完成)
+ * @param: c 发送端
+ * @return: 0表示成功, 超过SEND_CREDIT_TIMEOUT_MS时返回-ETIMEDOUT
+ */
+int send_credits_wait(struct send_credits *c);
+
+/**
+ * @brief: 初始化接收端, 之后通过recv_credits_grant()补充信用
+ * @param: r 接收端
+ * @param: pd 保护域
+ * @param: qp 写回信用所用的队列对
+ * @param: credit 发送端信用字的位置与rkey, rkey为0表示发送端不做流控
+ * @param: initial 将为发送端预先投递的接收数, 即在rdma_accept()中告知的初始信用,
+ * 0表示这些接收不做流控
+ * @return: 0表示成功，否则表示失败
+ */
+int recv_credits_init(struct recv_credits *r,
+                      struct ibv_pd *pd,
+                      struct ibv_qp *qp,
+                      const struct rdma_buffer_attr *credit,
+                      uint32_t initial);
+
+/**
+ * @brief: 补充的接收攒满多少个后一次投递并写回信用; 发送端不做流控时为1, 即逐个补充
+ * @param: r 接收端
+ * @return: 批大小
+ */
+static inline uint32_t recv_credits_batch(const struct recv_credits *r)
+{
+    return r->batch;
+}
+
+/**
+ * @brief: 调用方已再投递n个接收, 以RDMA WRITE把累计投递数写回发送端
+ * @param: r 接收端
+ * @param: n 新投递的接收数
+ * @return: 0表示成功，否则表示失败
+ */
+int recv_credits_grant(struct recv_credits *r, uint32_t n);
+
+/**
+ * @brief: 释放接收端的资源
+ * @param: r 接收端
+ */
+void recv_credits_destroy(struct recv_credits *r);
+
+#endif  // CREDIT_H_
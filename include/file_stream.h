@@ -0,0 +1,130 @@
+#ifndef FILE_STREAM_H_
+#define FILE_STREAM_H_
+#pragma once
+#include <fcntl.h>
+#include <infiniband/verbs.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+/*
+ * 零拷贝的文件传输。客户端把源文件mmap后按分片注册, 以流水线的RDMA WRITE直接写入服务端;
+ * 服务端把目标文件以MAP_SHARED映射并注册, 网卡直接写入目标文件的页缓存, 两端都没有用户态拷贝。
+ * 每个分片完成后客户端以RDMA WRITE更新服务端进度文件 (<文件名>.rdma-progress) 中的偏移,
+ * 中断后以相同的文件名与大小重新发送时, 服务端返回该偏移, 客户端从此处继续。
+ * 进度达到文件大小时服务端删除进度文件。
+ */
+
+#define FILE_NAME_MAX (256)
+#define FILE_PROGRESS_SUFFIX ".rdma-progress"
+/* 客户端每次注册并传输的分片大小, 完成一个分片记录一次进度 */
+#define FILE_DEFAULT_SLICE_SIZE (1UL << 30)
+
+/* 文件模式下客户端的元数据 */
+struct __attribute__((__packed__)) file_request
+{
+    struct rdma_buffer_attr attr; /* 与普通模式相同, 服务端不使用 */
+    uint64_t size;
+    char name[FILE_NAME_MAX]; /* 不含目录的文件名, 以'\0'结尾 */
+};
+
+/* 文件模式下服务端的元数据 */
+struct __attribute__((__packed__)) file_response
+{
+    int32_t status;                   /* 0表示成功, 否则为服务端的错误码 */
+    struct rdma_buffer_attr attr;     /* 目标文件的映射 */
+    struct rdma_buffer_attr progress; /* 进度字, 8字节 */
+    uint64_t resume_offset;           /* 已经写入的字节数 */
+};
+
+/* 映射到内存的文件 */
+struct mapped_file
+{
+    int fd;
+    void *addr; /* 空文件不映射, 为NULL */
+    uint64_t size;
+};
+
+/* 服务端正在接收的文件 */
+struct file_sink
+{
+    int active;
+    struct mapped_file data, progress;
+    struct ibv_mr *data_mr, *progress_mr;
+    char path[PATH_MAX];
+};
+
+/**
+ * @brief: 以只读方式打开并映射文件
+ * @param: f 映射结果
+ * @param: path 文件路径
+ * @return: 0表示成功，否则表示失败
+ */
+int mapped_file_open_read(struct mapped_file *f, const char *path);
+
+/**
+ * @brief: 创建或打开文件, 调整为size字节后以MAP_SHARED读写映射
+ * @param: f 映射结果
+ * @param: path 文件路径
+ * @param: size 文件大小
+ * @param: truncate 非0时先清空原有内容
+ * @return: 0表示成功，否则表示失败
+ */
+int mapped_file_open_write(struct mapped_file *f, const char *path, uint64_t size, int truncate);
+
+/**
+ * @brief: 解除映射并关闭文件
+ * @param: f 文件
+ * @param: sync 非0时先把修改同步到磁盘
+ */
+void mapped_file_close(struct mapped_file *f, int sync);
+
+/**
+ * @brief: 按客户端的请求在dir下打开目标文件与进度文件并注册, 填写响应。
+ * 目标文件已存在、大小相同且有进度文件时从记录的进度继续, 否则从头写入。
+ * @param: sink 接收状态
+ * @param: pd 保护域
+ * @param: dir 输出目录
+ * @param: req 客户端的请求
+ * @param: resp 响应, 失败时只填写status
+ * @return: 0表示成功，否则表示失败
+ */
+int file_sink_open(struct file_sink *sink,
+                   struct ibv_pd *pd,
+                   const char *dir,
+                   const struct file_request *req,
+                   struct file_response *resp);
+
+/**
+ * @brief: 注销并关闭目标文件, 进度达到文件大小时删除进度文件, 否则保留以便继续。
+ * 调用前QP必须已经销毁。
+ * @param: sink 接收状态, 未打开时不做任何事
+ */
+void file_sink_close(struct file_sink *sink);
+
+/**
+ * @brief: 从resp->resume_offset开始把文件推送到服务端。每次注册slice_size字节的分片,
+ * 以rdma_chunked_transfer()流水线地WRITE到目标文件的相同偏移, 完成后写回进度并输出吞吐。
+ * @param: qp 队列对
+ * @param: comp_channel 工作完成通道
+ * @param: cq 发送完成队列
+ * @param: pd 保护域
+ * @param: f 已映射的源文件
+ * @param: resp 服务端的响应
+ * @param: slice_size 分片大小
+ * @param: chunk_size 每个WR的字节数
+ * @param: depth 在途WR的上限
+ * @return: 0表示成功，否则表示失败
+ */
+int file_stream_push(struct ibv_qp *qp,
+                     struct ibv_comp_channel *comp_channel,
+                     struct ibv_cq *cq,
+                     struct ibv_pd *pd,
+                     struct mapped_file *f,
+                     struct file_response *resp,
+                     uint64_t slice_size,
+                     uint32_t chunk_size,
+                     uint32_t depth);
+
+#endif  // FILE_STREAM_H_
@@ -0,0 +1,207 @@
+#ifndef KV_H_
+#define KV_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include "utils.h"
+
+/*
+ * 单边读取的键值存储。服务端在一个注册区域中依次存放:
+ *   kv_header | kv_bucket[num_buckets + probe_window - 1] | 值日志 (log_size字节)
+ * 并把区域的地址与rkey作为服务端元数据发布。
+ * 客户端的GET只用两次RDMA READ: 读取探测窗口内的桶, 再读取桶所指的日志条目,
+ * 桶与条目各自带有校验和, 条目的版本必须与桶一致, 不一致视为撕裂读并重试。
+ * PUT通过SEND交给服务端, 由服务端追加日志条目后更新桶。
+ */
+
+#define KV_MAGIC (0x4b56535452444d41ULL) /* "AMDRTSVK" */
+#define KV_DEFAULT_LOG_SIZE (64UL << 20)
+/* 一个键的所有候选桶都在从哈希位置开始的窗口内, 一次READ即可取回 */
+#define KV_PROBE_WINDOW (8)
+#define KV_MAX_KEY_SIZE (256)
+/* PUT请求与日志条目的大小上限, 也是服务端每个请求接收缓冲区的大小 */
+#define KV_MAX_MSG_SIZE (4096)
+/* GET遇到撕裂读时的重试次数 */
+#define KV_MAX_RETRIES (16)
+
+enum kv_op
+{
+    KV_OP_PUT = 1,
+};
+
+struct __attribute__((__packed__)) kv_header
+{
+    uint64_t magic;
+    uint32_t num_buckets;
+    uint32_t probe_window;
+    uint64_t bucket_offset; /* 相对区域起始 */
+    uint64_t log_offset;
+    uint64_t log_size;
+};
+
+struct __attribute__((__packed__)) kv_bucket
+{
+    uint64_t key_hash; /* 0表示空桶 */
+    uint64_t entry_offset;
+    uint32_t entry_len;
+    uint32_t version;
+    uint64_t checksum; /* 覆盖之前的所有字段 */
+};
+
+struct __attribute__((__packed__)) kv_entry
+{
+    uint64_t checksum; /* 覆盖之后的所有字段与数据 */
+    uint32_t version;
+    uint16_t key_len;
+    uint16_t reserved;
+    uint32_t value_len;
+    char data[]; /* 键之后紧跟值 */
+};
+
+/* 客户端发给服务端的请求, 之后紧跟键与值 */
+struct __attribute__((__packed__)) kv_request
+{
+    uint32_t op;
+    uint16_t key_len;
+    uint16_t reserved;
+    uint32_t value_len;
+    char data[];
+};
+
+struct __attribute__((__packed__)) kv_response
+{
+    int32_t status; /* 0或负的errno */
+    uint32_t version;
+};
+
+/* 服务端的表 */
+struct kv_table
+{
+    struct ibv_mr *mr;
+    struct kv_header *header;
+    struct kv_bucket *buckets;
+    char *log;
+    uint64_t log_tail;
+};
+
+/* 客户端的连接, scratch中依次存放桶窗口、条目、请求与响应 */
+struct kv_client
+{
+    struct ibv_qp *qp;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    struct rdma_buffer_attr region;
+    struct kv_header header;
+    struct ibv_mr *scratch_mr;
+};
+
+/**
+ * @brief: 计算64位FNV-1a哈希, 用作键的哈希与校验和
+ * @param: seed 初始值, 用于把多段数据串联起来
+ * @param: data 数据
+ * @param: len 长度
+ * @return: 哈希值
+ */
+uint64_t kv_hash64(uint64_t seed, const void *data, size_t len);
+
+/**
+ * @brief: 在保护域上创建键值表, 区域只允许远端读取
+ * @param: pd 保护域
+ * @param: num_buckets 桶数
+ * @param: log_size 值日志大小
+ * @return: 键值表，错误时则为 NULL
+ */
+struct kv_table *kv_table_create(struct ibv_pd *pd, uint32_t num_buckets, uint64_t log_size);
+
+/**
+ * @brief: 释放键值表
+ * @param: table 键值表
+ */
+void kv_table_destroy(struct kv_table *table);
+
+/**
+ * @brief: 写入或覆盖一个键。条目先完整追加到日志, 再原地更新桶, 读者看到的要么是旧条目要么是新条目。
+ * 日志只追加不回收, 写满后返回-ENOSPC。
+ * @param: table 键值表
+ * @param: key 键
+ * @param: key_len 键长度
+ * @param: value 值
+ * @param: value_len 值长度
+ * @param: version 返回新条目的版本
+ * @return: 0表示成功，否则表示失败
+ */
+int kv_table_put(struct kv_table *table,
+                 const void *key,
+                 uint16_t key_len,
+                 const void *value,
+                 uint32_t value_len,
+                 uint32_t *version);
+
+/**
+ * @brief: 处理客户端发来的一个请求
+ * @param: table 键值表
+ * @param: msg 请求消息
+ * @param: len 消息长度
+ * @param: resp 响应
+ */
+void kv_serve_request(struct kv_table *table,
+                      const void *msg,
+                      uint32_t len,
+                      struct kv_response *resp);
+
+/**
+ * @brief: 打开服务端发布的键值表: 分配本地缓冲区并用RDMA READ读取表头
+ * @param: kv 客户端
+ * @param: pd 保护域
+ * @param: qp 队列对, 其CQ上不能有其他未取走的完成
+ * @param: comp_channel 工作完成通道
+ * @param: cq 完成队列
+ * @param: region 服务端元数据中的区域信息
+ * @return: 0表示成功，否则表示失败
+ */
+int kv_client_open(struct kv_client *kv,
+                   struct ibv_pd *pd,
+                   struct ibv_qp *qp,
+                   struct ibv_comp_channel *comp_channel,
+                   struct ibv_cq *cq,
+                   struct rdma_buffer_attr *region);
+
+/**
+ * @brief: 释放客户端的本地缓冲区
+ * @param: kv 客户端
+ */
+void kv_client_close(struct kv_client *kv);
+
+/**
+ * @brief: 只用RDMA READ查找一个键, 不占用服务端CPU
+ * @param: kv 客户端
+ * @param: key 键
+ * @param: key_len 键长度
+ * @param: value 值的输出缓冲区
+ * @param: value_cap 输出缓冲区大小
+ * @param: value_len 返回值的长度
+ * @return: 0表示成功, 键不存在时返回-ENOENT, 重试后仍读到撕裂数据时返回-EAGAIN
+ */
+int kv_get(struct kv_client *kv,
+           const void *key,
+           uint16_t key_len,
+           void *value,
+           uint32_t value_cap,
+           uint32_t *value_len);
+
+/**
+ * @brief: 通过服务端写入一个键, 等待服务端的响应
+ * @param: kv 客户端
+ * @param: key 键
+ * @param: key_len 键长度
+ * @param: value 值
+ * @param: value_len 值长度
+ * @return: 0表示成功，否则为服务端或本地的错误码
+ */
+int kv_put(struct kv_client *kv,
+           const void *key,
+           uint16_t key_len,
+           const void *value,
+           uint32_t value_len);
+
+#endif  // KV_H_
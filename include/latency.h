@@ -0,0 +1,182 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "dbg.h"
+
+/*
+ * 每个WR的延迟分解。以TSC (或aarch64的虚拟计数器) 在三个时刻打点:
+ * WR加入批 (post)、所在的链由ibv_post_send()投递 (doorbell)、ibv_poll_cq()取到覆盖它的CQE (reaped),
+ * 以及这批完成处理完毕 (done)。各阶段的耗时计入每个线程独占的对数-线性直方图,
+ * 记录只有单写者的普通读写, 不需要锁或原子读改写指令。
+ *
+ * 以 -DRDMA_LATENCY_TRACE=ON 构建时启用, 否则LAT_ENABLED为0, 打点代码在编译期被消除。
+ */
+#ifdef RDMA_LATENCY_TRACE
+#    define LAT_ENABLED (1)
+#else
+#    define LAT_ENABLED (0)
+#endif
+
+/* 每个2的幂区间分成 2^LAT_SUB_BITS 个桶, 相对误差约6% */
+#define LAT_SUB_BITS (4)
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+/* 最大可区分2^LAT_MAX_EXP纳秒 (约39小时), 更大的值计入最后一个桶 */
+#define LAT_MAX_EXP (47)
+#define LAT_NUM_BUCKETS ((LAT_MAX_EXP - LAT_SUB_BITS + 2) * LAT_SUB_BUCKETS)
+
+/* 延迟分解的阶段 */
+enum lat_stage
+{
+    LAT_STAGE_POST,   /* post -> doorbell: 构造WR与在批中等待投递 */
+    LAT_STAGE_WIRE,   /* doorbell -> reaped: 网卡、网络、对端与等待完成 (含事件模式的唤醒) */
+    LAT_STAGE_HANDLE, /* reaped -> done: 处理同一批完成 */
+    LAT_STAGE_TOTAL,  /* post -> done */
+    LAT_NUM_STAGES,
+};
+
+struct lat_histogram
+{
+    _Atomic uint64_t count, sum_ns, min_ns, max_ns;
+    _Atomic uint64_t buckets[LAT_NUM_BUCKETS];
+};
+
+/* 一个线程的直方图, 首次记录时注册到全局链表, 线程退出后仍保留以便输出 */
+struct lat_thread
+{
+    uint32_t id;
+    struct lat_histogram stages[LAT_NUM_STAGES];
+    struct lat_thread *next;
+};
+
+/* 一个在途WR的时间戳 (计数器刻度) */
+struct lat_stamp
+{
+    uint64_t post, doorbell;
+};
+
+extern __thread struct lat_thread *lat_self;
+extern double lat_ns_per_tick;
+
+/**
+ * @brief: 注册调用线程的直方图
+ * @return: 直方图, 内存不足时返回NULL
+ */
+struct lat_thread *lat_thread_register();
+
+/**
+ * @brief: 校准计数器频率, 在调用线程屏蔽SIGUSR1并启动等待它的输出线程, 退出时也输出一次。
+ * 必须在创建其他线程之前调用, 使它们继承信号屏蔽字。未启用RDMA_LATENCY_TRACE时只在指定了path时告警。
+ * @param: path JSON输出文件, 每次输出覆盖为累计至今的快照; NULL表示输出到stderr
+ * @return: 0表示成功，否则表示失败
+ */
+int lat_init(const char *path);
+
+/**
+ * @brief: 以JSON输出所有线程与合并后的直方图及分位数
+ */
+void lat_dump();
+
+/* 读取单调递增的周期计数器 */
+static inline uint64_t lat_now()
+{
+#if !LAT_ENABLED
+    return 0;
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* 桶的序号: 小于LAT_SUB_BUCKETS的值各占一个桶, 之后每个2的幂区间LAT_SUB_BUCKETS个桶 */
+static inline uint32_t lat_bucket(uint64_t ns)
+{
+    int exp;
+    if (ns < LAT_SUB_BUCKETS)
+    {
+        return (uint32_t)ns;
+    }
+    exp = 63 - __builtin_clzll(ns);
+    if (exp > LAT_MAX_EXP)
+    {
+        return LAT_NUM_BUCKETS - 1;
+    }
+    return (uint32_t)(exp - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS +
+           (uint32_t)((ns >> (exp - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+}
+
+/* 单写者的累加: 只有所属线程写, 输出线程读到的是某一时刻的值 */
+static inline void lat_add(_Atomic uint64_t *v, uint64_t delta)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+/**
+ * @brief: 把一个以计数器刻度表示的耗时计入调用线程的直方图
+ * @param: stage 阶段
+ * @param: ticks 耗时
+ */
+static inline void lat_record(enum lat_stage stage, uint64_t ticks)
+{
+    struct lat_histogram *h;
+    uint64_t ns = (uint64_t)((double)ticks * lat_ns_per_tick);
+    if (!lat_self && !lat_thread_register())
+    {
+        return;
+    }
+    h = &lat_self->stages[stage];
+    lat_add(&h->count, 1);
+    lat_add(&h->sum_ns, ns);
+    lat_add(&h->buckets[lat_bucket(ns)], 1);
+    if (ns < atomic_load_explicit(&h->min_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&h->min_ns, ns, memory_order_relaxed);
+    }
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief: 给[*from, to)之间的WR打上投递时间戳, 之后*from为to
+ * @param: stamps 按WR序号对n取模存放的时间戳
+ * @param: n stamps的个数, 不小于在途WR数
+ * @param: from 第一个尚未投递的WR序号
+ * @param: to 已经投递的WR数
+ */
+static inline void lat_stamp_doorbell(struct lat_stamp *stamps, uint32_t n, uint64_t *from,
+                                      uint64_t to)
+{
+    uint64_t now = lat_now();
+    for (; *from < to; (*from)++)
+    {
+        stamps[*from % n].doorbell = now;
+    }
+}
+
+/**
+ * @brief: 记录一个已完成WR各阶段的耗时
+ * @param: s WR的时间戳
+ * @param: reaped 取到覆盖它的CQE的时刻
+ * @param: done 这批完成处理完毕的时刻
+ */
+static inline void lat_record_wr(const struct lat_stamp *s, uint64_t reaped, uint64_t done)
+{
+    lat_record(LAT_STAGE_POST, s->doorbell - s->post);
+    lat_record(LAT_STAGE_WIRE, reaped - s->doorbell);
+    lat_record(LAT_STAGE_HANDLE, done - reaped);
+    lat_record(LAT_STAGE_TOTAL, done - s->post);
+}
+
+#endif  // LATENCY_H_
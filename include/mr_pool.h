@@ -0,0 +1,126 @@
+#ifndef MR_POOL_H_
+#define MR_POOL_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "utils.h"
+
+/* 最小与最大的slab大小 (2的幂), 超过最大值的分配直接注册 */
+#define MR_POOL_MIN_SLAB_SHIFT (6)
+#define MR_POOL_MAX_SLAB_SHIFT (24)
+#define MR_POOL_NUM_CLASSES (MR_POOL_MAX_SLAB_SHIFT - MR_POOL_MIN_SLAB_SHIFT + 1)
+/* 默认的arena大小, 每个arena是一个大的MR, slab从中切分 */
+#define MR_POOL_DEFAULT_ARENA_SIZE (64UL << 20)
+/* 注册缓存中最多保留的空闲 (引用计数为0) 条目数 */
+#define MR_CACHE_MAX_IDLE_ENTRIES (256)
+/* 每个级别最多保留的空闲远端缓冲区数 */
+#define MR_POOL_MAX_IDLE_REMOTE (16)
+/*
+ * arena只授予本地权限, 只有仅本地访问的分配从池中切分。带远端权限的缓冲区各自注册,
+ * 发布给对端的rkey只覆盖这一个缓冲区, 且只有请求的权限。
+ */
+#define MR_POOL_ACCESS (IBV_ACCESS_LOCAL_WRITE)
+
+/* rdma_buffer_alloc()/rdma_buffer_register()返回的MR的来源 */
+enum rdma_mr_kind
+{
+    RDMA_MR_DIRECT,   /* 独立的ibv_reg_mr注册 */
+    RDMA_MR_SLAB,     /* 从内存池的arena中切分的slab */
+    RDMA_MR_REMOTE,   /* 带远端权限、单独注册的缓冲区, 释放后回收到内存池 */
+    RDMA_MR_CACHED,   /* 注册缓存中某个条目的子区间 */
+    RDMA_MR_IMPLICIT, /* 隐式ODP MR的子区间, 注销时只释放句柄 */
+};
+
+struct mr_cache_entry;
+struct mr_pool;
+
+/*
+ * 返回给调用方的MR句柄。调用方看到的是view, 其addr/length为请求的范围,
+ * lkey/rkey来自backing; 只有utils/mr_pool会访问其余字段。
+ */
+struct rdma_mr_handle
+{
+    struct ibv_mr view;
+    enum rdma_mr_kind kind;
+    struct ibv_mr *backing;
+    int owns_buffer;
+    struct host_buffer buffer; /* owns_buffer时由rdma_buffer_free()释放 */
+    union
+    {
+        struct mr_cache_entry *entry; /* RDMA_MR_CACHED */
+        int slab_class;               /* RDMA_MR_SLAB与RDMA_MR_REMOTE */
+    } u;
+    struct rdma_mr_handle *next_free;
+};
+
+/* 内存池统计 */
+struct mr_pool_stats
+{
+    uint64_t arena_bytes;     /* 已注册的arena总大小 */
+    uint64_t slab_bytes_used; /* 已分配出去的slab总大小 */
+    uint64_t slab_allocs, slab_hits;
+    uint64_t remote_allocs, remote_hits; /* 带远端权限的分配与其中复用空闲缓冲区的次数 */
+    uint64_t cache_lookups, cache_hits;
+    uint32_t cache_entries;
+};
+
+/**
+ * @brief: 为保护域创建内存池与注册缓存。之后在该PD上仅本地访问的rdma_buffer_alloc()从预注册的
+ * slab中分配, rdma_buffer_register()优先复用已缓存的注册。arena在首次分配时才注册。
+ * @param: pd 保护域
+ * @param: arena_size 每个arena的大小, 0表示只启用注册缓存
+ * @return: 0表示成功，否则表示失败
+ */
+int mr_pool_create(struct ibv_pd *pd, size_t arena_size);
+
+/**
+ * @brief: 销毁保护域的内存池与注册缓存, 必须在ibv_dealloc_pd()之前调用。
+ * 仍被引用的slab与注册会被强制释放。
+ * @param: pd 保护域
+ */
+void mr_pool_destroy(struct ibv_pd *pd);
+
+/**
+ * @brief: 使与[addr, addr + len)重叠的空闲缓存注册失效。
+ * 调用方释放 (free/munmap) 曾注册过的内存之前必须调用, 否则之后同一地址上的新内存会命中旧的页面注册。
+ * @param: addr 起始地址
+ * @param: len 长度
+ */
+void mr_cache_invalidate(void *addr, size_t len);
+
+/**
+ * @brief: 获取保护域上内存池的统计
+ * @param: pd 保护域
+ * @param: stats 统计结果
+ * @return: 0表示成功, 该PD没有内存池时返回-ENOENT
+ */
+int mr_pool_get_stats(struct ibv_pd *pd, struct mr_pool_stats *stats);
+
+/**
+ * @brief: 在保护域上启用按需分页 (ODP) 注册。之后该PD上的rdma_buffer_register()与不从slab分配的
+ * rdma_buffer_alloc()不再钉住页面, 设备不支持时按device_odp_mode()回退。
+ * 隐式MR只用于仅本地访问的注册, 带远端权限的注册仍各自注册, 远端只能访问发布出去的区间。
+ * @param: pd 保护域
+ * @param: mode 请求的注册方式
+ * @return: 实际启用的注册方式, 错误时为负数
+ */
+int mr_odp_enable(struct ibv_pd *pd, enum mr_odp_mode mode);
+
+/**
+ * @brief: 停用保护域上的ODP注册, 必须在该PD上的隐式注册全部注销之后、ibv_dealloc_pd()之前调用
+ * @param: pd 保护域
+ */
+void mr_odp_disable(struct ibv_pd *pd);
+
+/* 以下由utils.c调用, 返回NULL/非0表示该请求不由内存池处理 */
+struct ibv_mr *mr_pool_alloc(struct ibv_pd *pd, size_t size, int access);
+int mr_pool_free(struct rdma_mr_handle *handle);
+struct ibv_mr *mr_pool_alloc_remote(struct ibv_pd *pd, size_t size, int access);
+void mr_pool_free_remote(struct rdma_mr_handle *handle);
+struct ibv_mr *mr_cache_register(struct ibv_pd *pd, void *addr, size_t size, int access);
+int mr_cache_deregister(struct rdma_mr_handle *handle);
+struct ibv_mr *mr_odp_register(struct ibv_pd *pd, void *addr, size_t size, int access);
+
+#endif  // MR_POOL_H_
@@ -0,0 +1,99 @@
+#ifndef PORT_COUNTERS_H_
+#define PORT_COUNTERS_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "dbg.h"
+
+/*
+ * 端口计数器采样: 后台线程按固定间隔读取 /sys/class/infiniband/<dev>/ports/<port>/
+ * 下counters与hw_counters中的计数器, 与应用层完成的字节数一起按区间输出增量,
+ * 用于判断传输变慢是重传、RNR NAK还是拥塞。计数器名因驱动而异 (mlx5与rxe等),
+ * 按下表归入几类, 设备没有的类别输出为"-"。
+ */
+
+/* 默认的采样间隔 (毫秒) */
+#define PORT_SAMPLER_DEFAULT_INTERVAL_MS (1000)
+#define PORT_SAMPLER_MAX_COUNTERS (16)
+
+/* 计数器的类别 */
+enum port_counter_kind
+{
+    PORT_COUNTER_TX_BYTES,
+    PORT_COUNTER_RX_BYTES,
+    PORT_COUNTER_TX_PACKETS,
+    PORT_COUNTER_RX_PACKETS,
+    PORT_COUNTER_RETRANSMITS,     /* 本端请求方的重传: ACK超时与收到的序号NAK */
+    PORT_COUNTER_OUT_OF_SEQUENCE, /* 本端响应方收到的乱序包 */
+    PORT_COUNTER_RNR_NAKS,        /* 收发的RNR NAK或RNR重试耗尽 */
+    PORT_NUM_COUNTER_KINDS,
+};
+
+/* 一个已打开的sysfs计数器文件 */
+struct port_counter
+{
+    int fd;
+    enum port_counter_kind kind;
+    uint32_t scale; /* IB的port_*_data以4字节为单位 */
+    uint64_t last;
+};
+
+struct port_sampler
+{
+    char name[64]; /* <dev>/<port> */
+    struct port_counter counters[PORT_SAMPLER_MAX_COUNTERS];
+    uint32_t num_counters;
+    int available[PORT_NUM_COUNTER_KINDS];
+    _Atomic uint64_t totals[PORT_NUM_COUNTER_KINDS]; /* 采样线程写, 其他线程可随时读取 */
+    uint64_t interval_ns, start_ns, last_ns;
+    uint64_t app_last, app_start;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+};
+
+/* 应用层已完成的字节数, 由数据路径在每批完成后累加 */
+extern _Atomic uint64_t port_app_bytes;
+
+/**
+ * @brief: 累加应用层完成的字节数, 供采样线程计算应用吞吐
+ * @param: bytes 字节数
+ */
+static inline void port_sampler_account(uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&port_app_bytes, bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief: 打开设备端口的计数器并启动采样线程
+ * @param: verbs 设备, 通常为cm_id->verbs
+ * @param: port_num 端口号, 通常为cm_id->port_num
+ * @param: interval_ms 采样间隔 (毫秒)
+ * @return: 采样器, 设备没有可用的计数器或失败时返回NULL
+ */
+struct port_sampler *port_sampler_start(struct ibv_context *verbs,
+                                        uint8_t port_num,
+                                        uint32_t interval_ms);
+
+/**
+ * @brief: 读取采样开始以来某类计数器的累计增量
+ * @param: s 采样器
+ * @param: kind 类别
+ * @return: 累计增量, 设备没有该类计数器时为0
+ */
+static inline uint64_t port_sampler_total(struct port_sampler *s, enum port_counter_kind kind)
+{
+    return atomic_load_explicit(&s->totals[kind], memory_order_relaxed);
+}
+
+/**
+ * @brief: 停止采样线程, 输出最后一个不完整区间与整个运行期间的合计, 然后释放采样器
+ * @param: s 采样器, NULL时不做任何事
+ */
+void port_sampler_stop(struct port_sampler *s);
+
+#endif  // PORT_COUNTERS_H_
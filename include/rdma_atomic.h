@@ -0,0 +1,121 @@
+#ifndef RDMA_ATOMIC_H_
+#define RDMA_ATOMIC_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include "utils.h"
+
+/* 自旋锁获取失败后的退避时间上限 (微秒), 退避从1微秒开始倍增 */
+#define RDMA_SPIN_LOCK_MAX_BACKOFF_US (64)
+
+/*
+ * 远端的一个8字节对齐的字, 以及接收其旧值的本地缓冲区。
+ * 远端MR需带有IBV_ACCESS_REMOTE_ATOMIC; 同一时间只能有一个线程使用一个rdma_atomic_word。
+ */
+struct rdma_atomic_word
+{
+    struct ibv_qp *qp;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    struct ibv_mr *result_mr; /* 8字节 */
+    uint64_t remote_addr;
+    uint32_t rkey;
+};
+
+/**
+ * @brief: 投递一个原子操作, 总是请求完成
+ * @param: qp 队列对
+ * @param: opcode IBV_WR_ATOMIC_FETCH_AND_ADD或IBV_WR_ATOMIC_CMP_AND_SWP
+ * @param: result 接收旧值的8字节本地缓冲区
+ * @param: remote_addr 远端地址, 必须8字节对齐
+ * @param: rkey 远端MR的rkey
+ * @param: compare_add FETCH_AND_ADD的加数, 或CMP_AND_SWP的比较值
+ * @param: swap CMP_AND_SWP比较相等时写入的值
+ * @param: wr_id 工作请求标识
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_post_atomic(struct ibv_qp *qp,
+                     enum ibv_wr_opcode opcode,
+                     struct ibv_sge *result,
+                     uint64_t remote_addr,
+                     uint32_t rkey,
+                     uint64_t compare_add,
+                     uint64_t swap,
+                     uint64_t wr_id);
+
+/**
+ * @brief: 绑定远端缓冲区中offset处的字并分配本地结果缓冲区
+ * @param: word 原子字
+ * @param: pd 保护域
+ * @param: qp 队列对, 其CQ上不能有其他未取走的完成
+ * @param: comp_channel 工作完成通道
+ * @param: cq 完成队列
+ * @param: remote 远端缓冲区
+ * @param: offset 字在远端缓冲区中的偏移, 必须8字节对齐
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_atomic_word_init(struct rdma_atomic_word *word,
+                          struct ibv_pd *pd,
+                          struct ibv_qp *qp,
+                          struct ibv_comp_channel *comp_channel,
+                          struct ibv_cq *cq,
+                          struct rdma_buffer_attr *remote,
+                          uint64_t offset);
+
+/**
+ * @brief: 释放本地结果缓冲区
+ * @param: word 原子字
+ */
+void rdma_atomic_word_destroy(struct rdma_atomic_word *word);
+
+/**
+ * @brief: 远端原子加, 同步等待完成
+ * @param: word 原子字
+ * @param: add 加数
+ * @param: old 返回加之前的值, 可为NULL
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_fetch_add(struct rdma_atomic_word *word, uint64_t add, uint64_t *old);
+
+/**
+ * @brief: 远端原子比较交换, 同步等待完成
+ * @param: word 原子字
+ * @param: compare 比较值
+ * @param: swap 相等时写入的值
+ * @param: old 返回操作之前的值, 与compare相等表示交换成功, 可为NULL
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_compare_swap(struct rdma_atomic_word *word,
+                      uint64_t compare,
+                      uint64_t swap,
+                      uint64_t *old);
+
+/**
+ * @brief: 分布式计数器: 把远端字加delta并取回之前的值, 多个客户端并发调用时取回的值互不重复,
+ * delta为1时即为全局序号发生器
+ * @param: word 计数器所在的字
+ * @param: delta 增量
+ * @param: value 返回增加之前的计数
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_counter_next(struct rdma_atomic_word *word, uint64_t delta, uint64_t *value);
+
+/**
+ * @brief: 获取分布式自旋锁: 以CMP_AND_SWP把字从0改为owner, 失败后指数退避重试
+ * @param: word 锁所在的字, 0表示空闲
+ * @param: owner 持有者标识, 不能为0
+ * @param: attempts 返回获取锁所用的CMP_AND_SWP次数, 可为NULL
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_spin_lock(struct rdma_atomic_word *word, uint64_t owner, uint64_t *attempts);
+
+/**
+ * @brief: 释放分布式自旋锁。同一QP上之前的WRITE在响应端先于本次CMP_AND_SWP执行,
+ * 临界区内的写入在锁释放前对其他客户端可见。
+ * @param: word 锁所在的字
+ * @param: owner 持有者标识
+ * @return: 0表示成功, 锁不由owner持有时返回-EPERM
+ */
+int rdma_spin_unlock(struct rdma_atomic_word *word, uint64_t owner);
+
+#endif  // RDMA_ATOMIC_H_
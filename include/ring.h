@@ -0,0 +1,152 @@
+#ifndef RING_H_
+#define RING_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include "utils.h"
+
+/*
+ * 基于RDMA WRITE_WITH_IMM的单向消息通道。
+ * 接收端在注册内存中提供一个环形缓冲区, 发送端把消息直接写到环尾, 立即数携带消息的偏移与长度,
+ * 接收端从CQ得知消息到达后原地处理, 不做拷贝。
+ * 接收端每消费环大小的1/RING_CREDIT_FRACTION就把已消费的总字节数 (head) 以RDMA WRITE写回
+ * 发送端的信用字, 发送端据此判断剩余空间。
+ * 消息在环中按RING_SLOT_ALIGN对齐且不跨越环尾, 放不下时跳到环首, 跳过的部分一并计入消费。
+ */
+
+#define RING_SLOT_ALIGN (64)
+/* 立即数: 高20位为以RING_SLOT_ALIGN为单位的偏移, 低12位为消息长度 */
+#define RING_IMM_LEN_BITS (12)
+#define RING_MAX_MSG_SIZE ((1 << RING_IMM_LEN_BITS) - 1)
+#define RING_MAX_SIZE ((uint64_t)RING_SLOT_ALIGN << (32 - RING_IMM_LEN_BITS))
+#define RING_DEFAULT_SIZE (1 << 20)
+#define RING_DEFAULT_MSG_SIZE (64)
+#define RING_CREDIT_FRACTION (4)
+
+/* 消息在环中占用的字节数 */
+static inline uint32_t ring_slot_size(uint32_t len)
+{
+    return ((len ? len : 1) + RING_SLOT_ALIGN - 1) & ~(RING_SLOT_ALIGN - 1);
+}
+
+/* 接收端 */
+struct ring_receiver
+{
+    struct ibv_qp *qp;
+    struct ibv_mr *ring_mr;
+    uint64_t size;
+    uint64_t head;     /* 已消费的总字节数 */
+    uint64_t credited; /* 最近一次写回发送端的head */
+    /* 发送端的信用字 */
+    uint64_t credit_addr;
+    uint32_t credit_rkey;
+    struct ibv_mr *credit_mr; /* 写回head的源, 见rdma_write_u64_prepare() */
+    uint64_t messages, bytes;
+};
+
+/* 发送端 */
+struct ring_sender
+{
+    struct ibv_qp *qp;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    uint64_t ring_addr, size;
+    uint32_t ring_rkey;
+    uint64_t tail;            /* 已写入的总字节数, 含跳过的部分 */
+    struct ibv_mr *credit_mr; /* 接收端写回的head */
+    /* 不能内联的消息先拷贝到staging_mr中对应的槽, 槽在WR完成前不会复用 */
+    struct ibv_mr *staging_mr;
+    uint32_t depth, signal_interval;
+    uint64_t posted, completed, last_signaled;
+};
+
+/**
+ * @brief: 分配并注册接收端的环形缓冲区
+ * @param: r 接收端
+ * @param: pd 保护域
+ * @param: qp 写回信用所用的队列对
+ * @param: size 环大小, RING_SLOT_ALIGN的整数倍且不超过RING_MAX_SIZE
+ * @return: 0表示成功，否则表示失败
+ */
+int ring_receiver_init(struct ring_receiver *r, struct ibv_pd *pd, struct ibv_qp *qp, uint64_t size);
+
+/**
+ * @brief: 设置发送端信用字的位置, 收到发送端的元数据后调用
+ * @param: r 接收端
+ * @param: credit 信用字的地址与rkey
+ * @return: 0表示成功，否则表示失败
+ */
+int ring_receiver_set_credit(struct ring_receiver *r, struct rdma_buffer_attr *credit);
+
+/**
+ * @brief: 释放接收端的资源
+ * @param: r 接收端
+ */
+void ring_receiver_destroy(struct ring_receiver *r);
+
+/**
+ * @brief: 根据WRITE_WITH_IMM完成的立即数定位消息并推进head。
+ * 返回的指针直接指向环中的数据, 在调用ring_receiver_return_credits()之前有效。
+ * @param: r 接收端
+ * @param: imm 网络字节序的立即数 (wc.imm_data)
+ * @param: len 返回消息长度
+ * @return: 消息的地址，立即数非法时则为 NULL
+ */
+const void *ring_receiver_consume(struct ring_receiver *r, uint32_t imm, uint32_t *len);
+
+/**
+ * @brief: 未写回的消费量达到环大小的1/RING_CREDIT_FRACTION时, 把head写回发送端
+ * @param: r 接收端
+ * @return: 0表示成功，否则表示失败
+ */
+int ring_receiver_return_credits(struct ring_receiver *r);
+
+/**
+ * @brief: 初始化发送端, 分配接收信用的字与staging缓冲区
+ * @param: s 发送端
+ * @param: pd 保护域
+ * @param: qp 队列对, 发送期间其CQ只能由发送端使用
+ * @param: comp_channel 工作完成通道
+ * @param: cq 完成队列
+ * @param: depth 在途WR上限
+ * @return: 0表示成功，否则表示失败
+ */
+int ring_sender_init(struct ring_sender *s,
+                     struct ibv_pd *pd,
+                     struct ibv_qp *qp,
+                     struct ibv_comp_channel *comp_channel,
+                     struct ibv_cq *cq,
+                     uint32_t depth);
+
+/**
+ * @brief: 设置接收端环形缓冲区的位置, 收到接收端的元数据后调用
+ * @param: s 发送端
+ * @param: ring 环的地址、长度与rkey
+ * @return: 0表示成功，否则表示失败
+ */
+int ring_sender_set_ring(struct ring_sender *s, struct rdma_buffer_attr *ring);
+
+/**
+ * @brief: 释放发送端的资源, 调用前应先ring_sender_flush()
+ * @param: s 发送端
+ */
+void ring_sender_destroy(struct ring_sender *s);
+
+/**
+ * @brief: 追加一条消息。环满时轮询信用字等待接收端消费, 发送队列满时回收完成。
+ * 不超过内联阈值的消息直接内联, 否则先拷贝到staging缓冲区。
+ * @param: s 发送端
+ * @param: msg 消息
+ * @param: len 消息长度, 不超过RING_MAX_MSG_SIZE
+ * @return: 0表示成功，否则表示失败
+ */
+int ring_send(struct ring_sender *s, const void *msg, uint32_t len);
+
+/**
+ * @brief: 等待所有已投递的消息完成
+ * @param: s 发送端
+ * @return: 0表示成功，否则表示失败
+ */
+int ring_sender_flush(struct ring_sender *s);
+
+#endif  // RING_H_
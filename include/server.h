@@ -1,28 +1,278 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 #pragma once
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include "credit.h"
+#include "file_stream.h"
+#include "kv.h"
+#include "mr_pool.h"
+#include "port_counters.h"
+#include "ring.h"
+#include "server_stats.h"
 #include "utils.h"
 
+/* 单次epoll_wait最多处理的事件数 */
+#define MAX_EPOLL_EVENTS (64)
+
+/* 共享CQ的容量上限, 不超过设备的max_cqe; 每个QP按CQ_CAPACITY(队列深度)占用 */
+#define SHARED_CQ_MAX_SIZE (65536)
+/* 按qp_num查找连接的哈希桶数, 必须是2的幂 */
+#define QP_TABLE_SIZE (1024)
+
+/* epoll事件的data.ptr指向以此开头的结构体, NULL表示CM事件通道 */
+enum epoll_source
+{
+    EPOLL_SOURCE_CONN,      /* 连接独占的完成通道, 指向client_conn */
+    EPOLL_SOURCE_SHARED_CQ, /* 设备共享CQ的完成通道, 指向shared_cq */
+};
+
+/* 接收WR的用途, 记录在wr_id中 */
+enum recv_wr_kind
+{
+    RECV_WR_METADATA,   /* 接收客户端缓冲区信息 */
+    RECV_WR_SINK,       /* 作为SEND的接收端, 数据写入服务端缓冲区后直接丢弃 */
+    RECV_WR_KV_REQUEST, /* KV模式下接收客户端的PUT请求 */
+    RECV_WR_RING,       /* 环形通道模式下供WRITE_WITH_IMM消耗, 不带缓冲区 */
+};
+
+/* KV请求接收的wr_id低8位为用途, 其余位为请求缓冲区的序号 */
+#define RECV_WR_INDEX_SHIFT (8)
+#define RECV_WR_KIND(wr_id) ((wr_id) & ((1ULL << RECV_WR_INDEX_SHIFT) - 1))
+
+/* SRQ接收的wr_id带有此标志, 低位为接收缓冲区的序号 */
+#define SRQ_WR_ID_FLAG (1ULL << 63)
+
+/* 服务端连接建立的阶段, 从收到CONNECT_REQUEST到发出服务端元数据 */
+enum server_setup_phase
+{
+    SERVER_SETUP_DEVICE,    /* 查找或创建设备上下文 */
+    SERVER_SETUP_CQ,        /* 完成通道与CQ, 或从池中取出资源包 */
+    SERVER_SETUP_QP,        /* 创建QP, 或把池中的QP迁移到RTS */
+    SERVER_SETUP_ACCEPT,    /* 会话、投递元数据接收与rdma_accept */
+    SERVER_SETUP_ESTABLISH, /* 等待RDMA_CM_EVENT_ESTABLISHED */
+    SERVER_SETUP_METADATA,  /* 等待客户端元数据并发送服务端元数据 */
+    SERVER_SETUP_NUM_PHASES,
+};
+
+/* 设备上由所有连接共享的CQ之一 (-C), 完成按qp_num分发给连接 */
+struct shared_cq
+{
+    enum epoll_source source;
+    struct server_device *dev;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    uint32_t load;           /* 已绑定的QP占用的CQE数, 不超过cq->cqe */
+    uint32_t unacked_events; /* 已取出但尚未确认的完成事件 */
+};
+
+/* 预先创建的连接资源包, 连接建立时取出, 断开后把QP复位并放回所属设备的池中 */
+struct conn_bundle
+{
+    /* 启用共享CQ时comp_channel为NULL, cq属于shared_cq */
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    struct shared_cq *shared_cq;
+    struct ibv_qp *qp; /* 不绑定cm_id, 由attach_bundle_qp()迁移状态 */
+    struct conn_bundle *next;
+};
+
+/* 每个RDMA设备共享的资源, PD及其上的内存池在所有连接之间复用 */
+struct server_device
+{
+    struct ibv_context *verbs;
+    struct ibv_pd *pd;
+    int atomic_access; /* 设备支持原子操作时为IBV_ACCESS_REMOTE_ATOMIC */
+
+    /* SRQ模式下所有连接共享的接收队列, 接收缓冲区从srq_buffer_mr中按序号切分 */
+    struct ibv_srq *srq;
+    struct ibv_mr *srq_buffer_mr;
+    struct ibv_recv_wr *srq_wrs;
+    struct ibv_sge *srq_sges;
+    uint32_t *srq_free; /* 空闲 (未投递) 缓冲区序号的栈 */
+    uint32_t srq_depth, srq_num_free;
+
+    /* KV模式下所有连接共享的键值表 */
+    struct kv_table *kv;
+
+    /* 共享CQ (-C) 及按qp_num查找连接的哈希表, 不启用时每个连接有自己的CQ */
+    struct shared_cq *shared_cqs;
+    uint32_t num_shared_cqs;
+    struct client_conn *qp_table[QP_TABLE_SIZE];
+
+    /* 预热的连接资源包 (-w), 补充失败后bundle_target降为当前数量 */
+    struct conn_bundle *bundles;
+    uint32_t num_bundles, bundle_target;
+    uint32_t bundle_depth;
+    uint8_t bundle_rd_atomic;
+
+    /* 端口计数器采样器 (-M), 采样该设备上第一个连接所在的端口 */
+    struct port_sampler *sampler;
+    int sampler_tried;
+
+    /* 统计区域在该设备PD上的注册, 其rkey随rdma_accept()发布 */
+    struct ibv_mr *stats_mr;
+
+    struct server_device *next;
+};
+
+/* 同一客户端会话的多个QP连接共享的资源, 最后一个连接释放时销毁 */
+struct client_session
+{
+    uint64_t id;
+    uint16_t num_qps;
+    uint32_t refs; /* 仍引用该会话的连接数 */
+    struct server_device *dev;
+    struct ibv_mr *server_buffer_mr;
+    struct client_session *next;
+};
+
+/* 每个客户端连接独占的RDMA资源, 通过cm_id->context与rdma_cm_id关联 */
+struct client_conn
+{
+    enum epoll_source source; /* 始终为EPOLL_SOURCE_CONN */
+    struct rdma_cm_id *cm_id;
+    enum conn_state state;
+
+    /* RDMA管理资源, pd属于所在设备 */
+    struct server_device *dev;
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *io_completion_channel;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    uint32_t unacked_events;       /* 已取出但尚未确认的完成事件 */
+    struct shared_cq *shared_cq;   /* 即时创建的QP绑定的共享CQ, 其余情况为NULL */
+    struct client_conn *qp_next;   /* qp_table中同一桶的下一个连接 */
+    int disconnecting;             /* 已主动断开, 之后的完成只归还SRQ缓冲区 */
+    uint32_t queue_depth;
+    uint8_t max_rd_atomic;
+    uint8_t rd_atomic; /* 与客户端协商后的在途READ/原子操作数 */
+    struct conn_bundle *bundle; /* -w启用时非NULL, 断开时归还而不是销毁 */
+    int pre_warmed;             /* 资源包取自池中而不是即时创建 */
+    struct setup_timer setup;
+    struct server_conn_stats *stats; /* 统计区域中的槽位, 没有空闲槽位时为stats_overflow */
+
+    /* 所属会话及本连接在会话中的序号, 服务端缓冲区属于会话 */
+    struct client_session *session;
+    uint16_t qp_index;
+    int metadata_received; /* SRQ模式下据此区分元数据与之后的SEND */
+
+    /* RDMA内存资源 */
+    struct ibv_mr *client_metadata_mr, *server_metadata_mr;
+    struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
+    struct ibv_recv_wr client_recv_wr, *bad_client_recv_wr;
+    struct ibv_send_wr server_send_wr, *bad_server_send_wr;
+    struct ibv_sge client_recv_sge, server_send_sge;
+
+    /*
+     * SEND基准的接收: queue_depth个WR共用一个sge, 都写入服务端缓冲区;
+     * 消耗的接收攒满一批后链接起来一次投递, 并把信用写回客户端
+     */
+    struct ibv_recv_wr *sink_recv_wrs, *bad_sink_recv_wr;
+    struct ibv_sge sink_recv_sge;
+    uint32_t sink_pending;
+    struct recv_credits credits;
+
+    /* KV模式: 每个接收对应kv_request_mr中的一个请求缓冲区, 响应通常内联发送 */
+    struct ibv_mr *kv_request_mr, *kv_response_mr;
+    struct kv_response kv_response;
+    struct ibv_send_wr kv_send_wr;
+    struct ibv_sge kv_send_sge;
+
+    /* 环形通道模式: 客户端以WRITE_WITH_IMM写入的环, 客户端元数据描述其信用字 */
+    struct ring_receiver ring;
+
+    /* 文件接收模式: 客户端元数据带有文件名与大小, 响应中是目标文件映射的位置与进度字 */
+    struct file_request file_request;
+    struct file_response file_response;
+    struct file_sink file_sink;
+
+    struct client_conn *prev, *next;
+};
+
 /* RDMA管理资源声明 */
 static struct rdma_event_channel *cm_channel = NULL;
-static struct rdma_cm_id *cm_server_id = NULL, *cm_client_id = NULL;
-static struct ibv_pd *pd = NULL;
-static struct ibv_comp_channel *io_completion_channel = NULL;
-static struct ibv_cq *cq = NULL;
-static struct ibv_qp_init_attr qp_init_attr;
-static struct ibv_qp *client_qp = NULL;
-
-/* RDMA内存资源声明 */
-static struct ibv_mr *client_metadata_mr = NULL, *server_metadata_mr = NULL, *server_buffer_mr = NULL;
-static struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
-static struct ibv_recv_wr client_recv_wr, *bad_client_recv_wr = NULL;
-static struct ibv_send_wr server_send_wr, *bad_server_send_wr = NULL;
-static struct ibv_sge client_recv_sge, server_send_sge;
-
-static int init_client_resources();
+static struct rdma_cm_id *cm_server_id = NULL;
+
+/* 事件循环资源声明 */
+static int epoll_fd = -1;
+static struct client_conn *active_conns = NULL, *zombie_conns = NULL;
+static struct client_session *sessions  = NULL;
+static volatile sig_atomic_t server_stop = 0;
+
+/* 每个连接的队列深度, 由 -d 指定 */
+static uint32_t queue_depth = DEFAULT_QUEUE_DEPTH;
+
+/* 设备列表与内存池arena大小 (-P, 0表示不使用内存池) */
+static struct server_device *devices = NULL;
+static size_t mr_pool_arena_size     = MR_POOL_DEFAULT_ARENA_SIZE;
+
+/* 内存注册方式 (-O), 启用ODP时会话缓冲区等注册不钉住页面 */
+static enum mr_odp_mode odp_mode = MR_ODP_OFF;
+
+/* SRQ深度 (-S, 0表示每个连接各自投递接收) 与每个接收缓冲区的大小 (-R) */
+static uint32_t srq_depth     = 0;
+static uint32_t srq_recv_size = DEFAULT_SRQ_RECV_SIZE;
+
+/* KV模式的桶数 (-K, 0表示不启用) 与值日志大小 (-V) */
+static uint32_t kv_num_buckets = 0;
+static uint64_t kv_log_size    = KV_DEFAULT_LOG_SIZE;
+
+/* 环形通道模式下每个连接的环大小 (-W, 0表示不启用) */
+static uint64_t ring_size = 0;
+
+/* 每个设备共享的CQ数 (-C, 0表示每个连接各自创建CQ) */
+static uint32_t num_shared_cqs = 0;
+
+/* 每个设备预热的连接资源包数 (-w, 0表示每个连接各自创建) */
+static uint32_t prewarm_bundles = 0;
+
+/* 端口计数器的采样间隔 (-M, 毫秒, 0表示不采样) */
+static uint32_t counter_interval_ms = 0;
+
+/* RDMA可读的实时统计区域, 头部之后是每个连接的槽位 */
+static struct host_buffer stats_buf;
+static struct server_stats *live_stats = NULL;
+static struct server_conn_stats stats_overflow;
+static uint64_t stats_refreshed_ns = 0, stats_start_ns = 0, stats_next_conn_id = 0;
+
+/* 所有连接各阶段的累计耗时, 退出时输出平均值 */
+static struct setup_timer setup_totals;
+static uint64_t setup_conns = 0, setup_pooled_conns = 0;
+
+/* 文件接收模式的输出目录 (-o, NULL表示不启用) */
+static const char *output_dir = NULL;
+
 static int start_rdma_server(struct sockaddr_in *server_addr);
-static int accept_client_connection();
-static int send_server_metadata();
-static int disconnect_and_cleanup();
+static struct server_device *get_server_device(struct ibv_context *verbs);
+static int create_device_srq(struct server_device *dev);
+static int srq_replenish(struct server_device *dev);
+static struct client_session *get_client_session(struct server_device *dev,
+                                                 struct rdma_session_hello *hello);
+static void put_client_session(struct client_session *session);
+static int create_server_stats();
+static void refresh_server_stats();
+static void refill_conn_bundles(struct server_device *dev);
+static void release_conn_bundle(struct server_device *dev, struct conn_bundle *bundle);
+static int init_client_resources(struct client_conn *conn, uint8_t initiator_depth);
+static int accept_client_connection(struct client_conn *conn);
+static int send_server_metadata(struct client_conn *conn);
+static int post_sink_recvs(struct client_conn *conn, uint32_t n);
+static int setup_kv_service(struct client_conn *conn);
+static int serve_kv_request(struct client_conn *conn, const void *msg, uint32_t len);
+static int setup_ring_channel(struct client_conn *conn);
+static int handle_ring_message(struct client_conn *conn, struct ibv_wc *wc);
+static int disconnect_and_cleanup(struct client_conn *conn);
+static int handle_connect_request(struct rdma_cm_id *cm_id,
+                                  struct rdma_conn_param *req,
+                                  struct rdma_session_hello *hello);
+static int process_cm_events();
+static int poll_shared_cq(struct shared_cq *scq);
+static int process_cq_events(struct client_conn *conn);
+static int process_shared_cq_events(struct shared_cq *scq);
+static int run_event_loop();
+static void shutdown_server();
 
-#endif // SERVER_H_
\ No newline at end of file
+#endif // SERVER_H_
@@ -0,0 +1,90 @@
+#ifndef SERVER_STATS_H_
+#define SERVER_STATS_H_
+#pragma once
+#include <stdint.h>
+
+/*
+ * 服务端的实时统计区域。服务端在注册内存中维护全局与每个连接的计数器, 并在rdma_accept()的
+ * private_data (struct rdma_server_hello) 中发布其位置与rkey, 监控端以单边RDMA READ读取,
+ * 不占用服务端CPU。
+ *
+ * 所有字段都是8字节对齐的64位整数, 由服务端事件循环单线程地逐个写入。一次READ得到的不是
+ * 同一时刻的快照, 但每个字段本身是完整的, 计数器单调递增, 足以按区间计算速率。
+ * 槽位被新连接复用时conn_id改变, 监控端据此丢弃旧的基准值。
+ */
+
+#define SERVER_STATS_MAGIC (0x52444d4153544154ULL) /* "RDMASTAT" */
+#define SERVER_STATS_VERSION (1)
+/* 有统计槽位的连接数上限, 更多的连接只计入全局计数器 */
+#define SERVER_STATS_MAX_CONNS (256)
+/* 全局的用量 (内存池、SRQ等) 最多每隔这么久刷新一次 */
+#define SERVER_STATS_REFRESH_NS (1000000ULL)
+
+/* 每个客户端连接的状态机, 也记录在统计槽位中 */
+enum conn_state
+{
+    CONN_STATE_CONNECTING,    /* 已收到CONNECT_REQUEST, 资源已创建, 等待连接建立 */
+    CONN_STATE_ESTABLISHED,   /* 连接已建立, 等待客户端发送元数据 */
+    CONN_STATE_METADATA_SENT, /* 已发送服务端缓冲区信息, 等待SEND完成 */
+    CONN_STATE_SERVING,       /* 元数据交换完成, 客户端对服务端缓冲区进行单边读写 */
+    CONN_STATE_DISCONNECTED,  /* 连接已断开, 等待本轮事件处理结束后释放 */
+};
+
+/* 一个连接的统计, in_use为0的槽位空闲 */
+struct server_conn_stats
+{
+    uint64_t conn_id; /* 服务端分配的连接序号, 从1开始 */
+    uint64_t in_use;
+    uint64_t state; /* enum conn_state */
+    uint64_t qp_num;
+    uint64_t session_id, qp_index;
+    uint64_t connected_ns; /* 收到连接请求时的uptime_ns */
+    /* 服务端可见的双边流量: 收到的SEND/WRITE_WITH_IMM与发出的SEND */
+    uint64_t recv_msgs, recv_bytes;
+    uint64_t send_msgs, send_bytes;
+    uint64_t kv_ops, ring_msgs;
+};
+
+/* 统计区域的头部, 之后紧跟max_conns个struct server_conn_stats */
+struct server_stats
+{
+    uint64_t magic, version, max_conns;
+    uint64_t update_seq; /* 每次刷新用量时加一, 监控端据此判断服务端是否存活 */
+    uint64_t uptime_ns;
+
+    /* 连接 */
+    uint64_t active_conns, active_qps, sessions;
+    uint64_t total_conns, rejected_conns;
+
+    /* 所有连接的双边流量之和, 包括已断开的 */
+    uint64_t recv_msgs, recv_bytes;
+    uint64_t send_msgs, send_bytes;
+    uint64_t kv_ops, ring_msgs;
+
+    /*
+     * 单边READ/WRITE不经过服务端CPU, 只能由端口计数器 (-M) 得到, 为所有设备的累计值;
+     * 未启用采样时counters_available为0
+     */
+    uint64_t counters_available;
+    uint64_t port_tx_bytes, port_rx_bytes;
+    uint64_t port_retransmits, port_rnr_naks;
+
+    /* 资源用量, 为所有设备之和 */
+    uint64_t devices;
+    uint64_t pool_arena_bytes, pool_used_bytes, cache_entries;
+    uint64_t srq_depth, srq_free;
+    uint64_t bundles_free;
+    uint64_t shared_cq_load, shared_cq_capacity;
+};
+
+/* 统计区域的总大小 */
+#define SERVER_STATS_SIZE(max_conns) \
+    (sizeof(struct server_stats) + (uint64_t)(max_conns) * sizeof(struct server_conn_stats))
+
+/* 统计区域中第i个连接的槽位 */
+static inline struct server_conn_stats *server_stats_conn(struct server_stats *stats, uint64_t i)
+{
+    return (struct server_conn_stats *)(stats + 1) + i;
+}
+
+#endif  // SERVER_STATS_H_
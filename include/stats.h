@@ -0,0 +1,32 @@
+#ifndef STATS_H_
+#define STATS_H_
+#pragma once
+#include <signal.h>
+#include "server_stats.h"
+#include "utils.h"
+
+/* 默认的刷新间隔 (毫秒) */
+#define STATS_DEFAULT_INTERVAL_MS (1000)
+
+/* RDMA管理资源声明 */
+static struct rdma_event_channel *cm_channel = NULL;
+static struct rdma_cm_id *cm_client_id       = NULL;
+static struct ibv_pd *pd                     = NULL;
+static struct ibv_cq *cq                     = NULL;
+
+/* 服务端发布的统计区域, 与读取它的本地缓冲区 (本次与上次的快照) */
+static struct rdma_buffer_attr remote_stats;
+static struct ibv_mr *stats_mr = NULL;
+static struct server_stats *prev_stats = NULL;
+
+/* 刷新间隔 (-i) 与次数 (-n, 0表示直到中断) */
+static uint32_t interval_ms  = STATS_DEFAULT_INTERVAL_MS;
+static uint32_t num_samples  = 0;
+static volatile sig_atomic_t stats_stop = 0;
+
+static int connect_to_server(struct sockaddr_in *s_addr);
+static int read_server_stats();
+static void render_server_stats(const struct server_stats *cur, const struct server_stats *prev);
+static void disconnect_and_cleanup();
+
+#endif  // STATS_H_
@@ -0,0 +1,116 @@
+#ifndef SUBMIT_QUEUE_H_
+#define SUBMIT_QUEUE_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "utils.h"
+#include "wr_batch.h"
+
+/*
+ * 多个应用线程共用一个QP的无锁提交队列。提交者把请求放入有界的MPSC环 (Vyukov算法,
+ * 每个槽一个序号, 入队只有一次CAS), 唯一的投递线程按发送队列的空位取出请求, 以wr_batch
+ * 链接成链后一次ibv_post_send()投递, 并独占地轮询CQ, 把每个完成交还给提交它的线程。
+ * 热路径上没有互斥锁, 也不需要每个线程一个QP。
+ */
+
+/* 提交环的默认槽数, 向上取整为2的幂 */
+#define SUBMIT_DEFAULT_CAPACITY (1024)
+
+/* 一个提交者 (应用线程) 的完成计数, 由投递线程更新 */
+struct submit_client
+{
+    _Atomic uint64_t completed; /* 已完成的请求数, 包括出错的 */
+    _Atomic uint64_t errors;    /* 完成状态不是IBV_WC_SUCCESS的请求数 */
+};
+
+/*
+ * 一个提交的操作。提交者填写wr的opcode、wr.rdma等字段与sge, 从submit_post()到完成之前
+ * 请求归投递线程所有, 不能修改或释放。wr_id、sg_list、next与IBV_SEND_SIGNALED由队列填写。
+ */
+struct submit_request
+{
+    struct ibv_send_wr wr;
+    struct ibv_sge sge[MAX_SGE];
+    struct submit_client *client;
+    enum ibv_wc_status status;
+    _Atomic int done;
+};
+
+/* 环中的一个槽, seq等于入队位置时可写, 等于入队位置+1时可读 */
+struct submit_slot
+{
+    _Atomic uint64_t seq;
+    struct submit_request *req;
+};
+
+struct submit_queue
+{
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+    struct submit_slot *slots;
+    uint64_t mask;
+    /* 提交者竞争的入队位置与投递线程独占的出队位置放在不同的缓存行 */
+    _Atomic uint64_t tail __attribute__((aligned(64)));
+    uint64_t head __attribute__((aligned(64)));
+    uint32_t depth, inflight; /* 发送队列深度与在途的WR数 */
+    struct wr_batch batch;
+    uint64_t posted;
+    pthread_t poster;
+    _Atomic int stop;
+    _Atomic int ret; /* 投递线程出错时的错误码, 之后的提交与等待都返回它 */
+};
+
+/**
+ * @brief: 初始化提交队列并启动投递线程。启动后直到submit_queue_destroy(), qp的发送与cq的轮询
+ * 只能由投递线程进行。
+ * @param: q 提交队列
+ * @param: qp 队列对
+ * @param: cq qp的发送完成队列
+ * @param: capacity 环的槽数, 向上取整为2的幂
+ * @param: depth 在途WR的上限, 通常为发送队列深度
+ * @return: 0表示成功，否则表示失败
+ */
+int submit_queue_init(struct submit_queue *q,
+                      struct ibv_qp *qp,
+                      struct ibv_cq *cq,
+                      uint32_t capacity,
+                      uint32_t depth);
+
+/**
+ * @brief: 等待环中与在途的请求全部完成, 停止投递线程并释放队列
+ * @param: q 提交队列
+ * @return: 投递线程的错误码, 0表示成功
+ */
+int submit_queue_destroy(struct submit_queue *q);
+
+/**
+ * @brief: 把一个请求放入提交环, 任意线程可并发调用, 不阻塞
+ * @param: q 提交队列
+ * @param: req 请求, 完成前不能修改
+ * @param: client 提交者, 完成时其计数加一
+ * @return: 0表示成功, -EAGAIN表示环已满需稍后重试, 其他表示投递线程已出错
+ */
+int submit_post(struct submit_queue *q, struct submit_request *req, struct submit_client *client);
+
+/**
+ * @brief: 自旋等待提交者的完成数达到target
+ * @param: q 提交队列
+ * @param: client 提交者
+ * @param: target 等待的完成数
+ * @return: 0表示成功，否则为投递线程的错误码
+ */
+int submit_wait(struct submit_queue *q, struct submit_client *client, uint64_t target);
+
+/**
+ * @brief: 请求是否已经完成, 完成后status有效
+ * @param: req 请求
+ * @return: 非0表示已完成
+ */
+static inline int submit_request_done(struct submit_request *req)
+{
+    return atomic_load_explicit(&req->done, memory_order_acquire);
+}
+
+#endif  // SUBMIT_QUEUE_H_
@@ -10,16 +10,61 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 #include "dbg.h"
 #include "const.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#    define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#    define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#    define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* 工作完成 (WC) 的获取方式 */
+enum wc_poll_mode
+{
+    WC_MODE_EVENT,    /* 阻塞在完成通道上, 每次完成都需要一次中断和系统调用 */
+    WC_MODE_POLL,     /* 在ibv_poll_cq上纯忙轮询, 不使用完成通道 */
+    WC_MODE_ADAPTIVE, /* 先忙轮询spin_budget_us微秒, 预算耗尽后回退到完成通道 */
+};
+
+/* 主机缓冲区的页面来源, 越靠后页面越大, 分配失败时依次回退到前一种 */
+enum buffer_backing
+{
+    BUFFER_BACKING_HEAP,    /* calloc, 普通4 KiB页 */
+    BUFFER_BACKING_THP,     /* 2 MiB对齐的匿名映射并madvise(MADV_HUGEPAGE), 由透明大页合并 */
+    BUFFER_BACKING_HUGE_2M, /* MAP_HUGETLB 2 MiB大页, 需预留 vm.nr_hugepages */
+    BUFFER_BACKING_HUGE_1G, /* MAP_HUGETLB 1 GiB大页, 需在启动参数中预留 */
+};
+
+/* 内存注册方式 */
+enum mr_odp_mode
+{
+    MR_ODP_OFF,      /* ibv_reg_mr()时即钉住全部页面 */
+    MR_ODP_EXPLICIT, /* 注册带IBV_ACCESS_ON_DEMAND, 页面在网卡首次访问时才缺页调入 */
+    MR_ODP_IMPLICIT, /* 在EXPLICIT之上, 仅本地访问的注册取自覆盖整个地址空间的隐式MR */
+};
+
+/* 由host_buffer_alloc()分配的主机内存 */
+struct host_buffer
+{
+    void *addr;
+    size_t size;        /* 请求的大小 */
+    size_t mapped_size; /* 实际映射的大小 (按页大小取整) */
+    enum buffer_backing backing;
+};
+
 /** __attribute__((__packed__))表示取消对齐 */
 struct __attribute__((__packed__)) rdma_buffer_attr
 {
     uint64_t address;
-    uint32_t length;
+    uint64_t length;
     union stag
     {
         uint32_t local_stag;
@@ -27,6 +72,30 @@ struct __attribute__((__packed__)) rdma_buffer_attr
     } stag;
 };
 
+/*
+ * 客户端在rdma_connect()的private_data中携带的会话信息。
+ * 同一会话的num_qps个连接共享服务端的同一个缓冲区, session_id为0表示单独成为一个会话。
+ * credit为SEND信用字 (credit.h) 的位置与rkey, rkey为0表示不做流控。
+ */
+struct __attribute__((__packed__)) rdma_session_hello
+{
+    uint64_t session_id;
+    uint16_t qp_index;
+    uint16_t num_qps;
+    struct rdma_buffer_attr credit;
+};
+
+/*
+ * 服务端在rdma_accept()的private_data中携带的信息: 统计区域 (struct server_stats) 的位置与rkey,
+ * 服务端未发布统计区域时length为0; 以及为客户端的SEND预先投递的接收数 (初始信用),
+ * 0表示服务端不做流控。
+ */
+struct __attribute__((__packed__)) rdma_server_hello
+{
+    struct rdma_buffer_attr stats;
+    uint32_t recv_credits;
+};
+
 /**
  * @brief: 获取目的RDMA地址
  * @param: dst 目的IP地址
@@ -46,9 +115,100 @@ int process_rdma_cm_event(struct rdma_event_channel *echannel,
                           enum rdma_cm_event_type expected_event,
                           struct rdma_cm_event **cm_event);
 
+/**
+ * @brief: 按设备能力裁剪队列深度, 并返回设备允许的RDMA READ/原子操作并发上限
+ * @param: verbs 设备上下文
+ * @param: depth 期望的队列深度, 返回时为裁剪后的值
+ * @param: rd_atomic 非NULL时返回作为发起端与响应端都支持的在途READ上限
+ * @return: 0表示成功，否则表示失败
+ */
+int fit_queue_depth(struct ibv_context *verbs, uint32_t *depth, uint8_t *rd_atomic);
+
+/**
+ * @brief: 按端口能力调整分块大小: 不超过max_msg_sz, 并向下取整为路径MTU的整数倍,
+ * 使每个分块恰好拆成整数个数据包
+ * @param: verbs 设备上下文
+ * @param: port_num 端口号
+ * @param: chunk_size 期望的分块大小, 返回时为调整后的值
+ * @return: 0表示成功，否则表示失败
+ */
+int fit_chunk_size(struct ibv_context *verbs, uint8_t port_num, uint32_t *chunk_size);
+
+/**
+ * @brief: 查询设备是否支持远端原子操作
+ * @param: verbs 设备上下文
+ * @return: 支持时返回IBV_ACCESS_REMOTE_ATOMIC, 不支持或查询失败时返回0
+ */
+int device_atomic_access(struct ibv_context *verbs);
+
+/**
+ * @brief: 查询设备对RC的按需分页 (ODP) 支持, 不支持所请求的方式时回退到更弱的方式
+ * @param: verbs 设备上下文
+ * @param: requested 请求的注册方式
+ * @param: access 返回ODP注册可以使用的访问权限
+ * @return: 实际可用的注册方式
+ */
+enum mr_odp_mode device_odp_mode(struct ibv_context *verbs,
+                                 enum mr_odp_mode requested,
+                                 int *access);
+
+/**
+ * @brief: 解析注册方式名称 ("off", "explicit", "implicit")
+ * @param: str 名称
+ * @param: mode 解析结果
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_mr_odp_mode(const char *str, enum mr_odp_mode *mode);
+
+/**
+ * @brief: 返回注册方式的名称
+ */
+const char *mr_odp_mode_str(enum mr_odp_mode mode);
+
+/**
+ * @brief: 解析页面来源名称 ("heap", "thp", "2m", "1g")
+ * @param: str 名称
+ * @param: backing 解析结果
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_buffer_backing(const char *str, enum buffer_backing *backing);
+
+/**
+ * @brief: 返回页面来源的名称
+ */
+const char *buffer_backing_str(enum buffer_backing backing);
+
+/**
+ * @brief: 设置rdma_buffer_alloc()与内存池arena默认使用的页面来源
+ * @param: backing 页面来源
+ */
+void set_buffer_backing(enum buffer_backing backing);
+
+/**
+ * @brief: 获取默认的页面来源
+ */
+enum buffer_backing get_buffer_backing();
+
+/**
+ * @brief: 分配清零的主机内存, 大页不可用时透明地回退到更小的页
+ * @param: buf 分配结果, buf->backing为实际使用的页面来源
+ * @param: size 大小
+ * @param: backing 期望的页面来源
+ * @return: 0表示成功，否则表示失败
+ */
+int host_buffer_alloc(struct host_buffer *buf, size_t size, enum buffer_backing backing);
+
+/**
+ * @brief: 释放host_buffer_alloc()分配的主机内存
+ * @param: buf 主机内存
+ */
+void host_buffer_free(struct host_buffer *buf);
+
 /**
  * @brief: 分配大小为 "length "的 RDMA 缓冲区，权限为 permission,
  * 函数还将注册内存，并返回一个内存区域 (MR)。
+ * 该PD已通过mr_pool_create()创建内存池时, 仅本地访问的缓冲区从预注册的slab中分配,
+ * 带远端权限的缓冲区复用之前释放的单独注册。
  * @param: pd 应分配缓冲区的保护域
  * @param: size 缓冲区大小
  * @param: permission 枚举 ibv_access_flags 所定义的 IBV_ACCESS_* 权限的 OR 组合
@@ -56,7 +216,7 @@ int process_rdma_cm_event(struct rdma_event_channel *echannel,
  *
  */
 struct ibv_mr *rdma_buffer_alloc(struct ibv_pd *pd,
-                                 uint32_t size,
+                                 uint64_t size,
                                  enum ibv_access_flags permission);
 
 /**
@@ -67,6 +227,7 @@ void rdma_buffer_free(struct ibv_mr *mr);
 
 /**
  * @brief: 注册内存区域，返回一个内存区域 (MR)。
+ * 该PD已创建注册缓存时, 优先复用覆盖该区间的已有注册。
  * @param: pd 应分配缓冲区的保护域
  * @param: addr 缓存区地址
  * @param: size 缓冲区大小
@@ -75,25 +236,327 @@ void rdma_buffer_free(struct ibv_mr *mr);
  */
 struct ibv_mr *rdma_buffer_register(struct ibv_pd *pd,
                                     void *addr,
-                                    uint32_t size,
+                                    uint64_t size,
                                     enum ibv_access_flags permission);
 
 /**
- * @brief: 注销先前注册的内存区域。
+ * @brief: 注销先前由rdma_buffer_register()注册的内存区域。
  * @param: mr 即将注销的内存区域。
  */
 void rdma_buffer_deregister(struct ibv_mr *mr);
 
 /**
- * @brief: 处理工作完成 (WC) 通知
+ * @brief: 获取单调时钟的当前时间
+ * @return: 纳秒
+ */
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* 连接建立各阶段的计时, 阶段由调用方定义 */
+#define SETUP_MAX_PHASES (8)
+struct setup_timer
+{
+    uint64_t start, last;
+    uint64_t ns[SETUP_MAX_PHASES];
+};
+
+/**
+ * @brief: 开始计时, 清空各阶段的耗时
+ * @param: t 计时器
+ */
+static inline void setup_timer_start(struct setup_timer *t)
+{
+    bzero(t, sizeof(*t));
+    t->start = t->last = now_ns();
+}
+
+/**
+ * @brief: 把上次标记以来的耗时计入phase
+ * @param: t 计时器
+ * @param: phase 阶段序号, 小于SETUP_MAX_PHASES
+ */
+static inline void setup_timer_mark(struct setup_timer *t, int phase)
+{
+    uint64_t now = now_ns();
+    t->ns[phase] += now - t->last;
+    t->last = now;
+}
+
+/**
+ * @brief: 跳过上次标记以来的时间, 不计入任何阶段
+ * @param: t 计时器
+ */
+static inline void setup_timer_skip(struct setup_timer *t)
+{
+    t->last = now_ns();
+}
+
+/**
+ * @brief: 以一行日志输出各阶段的耗时 (微秒) 与总和
+ * @param: t 计时器
+ * @param: names 各阶段的名称
+ * @param: num_phases 阶段数
+ * @param: label 日志前缀
+ */
+void setup_timer_log(const struct setup_timer *t,
+                     const char *const *names,
+                     int num_phases,
+                     const char *label);
+
+/**
+ * @brief: 设置进程内所有CQ的工作完成获取方式
+ * @param: mode 获取方式
+ * @param: spin_budget_us WC_MODE_ADAPTIVE下回退到完成通道前的忙轮询时长 (微秒)
+ */
+void set_wc_poll_mode(enum wc_poll_mode mode, uint32_t spin_budget_us);
+
+/**
+ * @brief: 获取当前的工作完成获取方式
+ * @param: spin_budget_us 非NULL时返回忙轮询预算 (微秒)
+ * @return: 当前获取方式
+ */
+enum wc_poll_mode get_wc_poll_mode(uint32_t *spin_budget_us);
+
+/**
+ * @brief: 设置内联阈值, 之后创建的QP按此申请max_inline_data,
+ * 不超过该大小的SEND/RDMA WRITE以IBV_SEND_INLINE投递
+ * @param: bytes 阈值, 0表示不使用内联
+ */
+void set_inline_threshold(uint32_t bytes);
+
+/**
+ * @brief: 获取内联阈值
+ * @return: 字节数
+ */
+uint32_t get_inline_threshold();
+
+/**
+ * @brief: 按内联阈值设置attr->cap.max_inline_data并创建QP。
+ * 设备不支持该内联大小时关闭内联 (阈值置0) 并重试。
+ * @param: id rdma_cm_id
+ * @param: pd 保护域
+ * @param: attr QP属性
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_create_qp_inline(struct rdma_cm_id *id, struct ibv_pd *pd, struct ibv_qp_init_attr *attr);
+
+/**
+ * @brief: 与rdma_create_qp_inline()相同, 但直接以ibv_create_qp()创建不绑定cm_id的QP,
+ * 之后由调用方按rdma_init_qp_attr()迁移状态
+ * @param: pd 保护域
+ * @param: attr QP属性, cap.max_inline_data由本函数填写
+ * @return: QP, 错误时为NULL
+ */
+struct ibv_qp *create_qp_inline(struct ibv_pd *pd, struct ibv_qp_init_attr *attr);
+
+/**
+ * @brief: 设置流式传输的选择性完成间隔: 每interval个WR中只有一个请求完成 (IBV_SEND_SIGNALED)
+ * @param: interval 间隔, 0表示取队列深度的一半, 1表示每个WR都请求完成
+ */
+void set_signal_interval(uint32_t interval);
+
+/**
+ * @brief: 获取给定队列深度下实际使用的完成间隔, 不超过队列深度
+ * @param: depth 在途WR的上限
+ * @return: 间隔
+ */
+uint32_t get_signal_interval(uint32_t depth);
+
+/**
+ * @brief: 解析命令行中的获取方式名称 ("event", "poll", "adaptive")
+ * @param: str 名称
+ * @param: mode 解析结果
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_wc_poll_mode(const char *str, enum wc_poll_mode *mode);
+
+/**
+ * @brief: 按当前获取方式为新建的CQ请求完成通知, WC_MODE_POLL下不请求
+ * @param: cq 完成队列
+ * @return: 0表示成功，否则表示失败
+ */
+int arm_cq_notification(struct ibv_cq *cq);
+
+/**
+ * @brief: 设置CQ的中断合并: 攒够count个完成或第一个完成之后超过period_us才产生一次事件,
+ * 一次唤醒处理一批完成。之后创建的CQ由moderate_cq()交给网卡, 不支持时在唤醒后由软件合并
+ * @param: count 合并的完成数, 0表示不合并
+ * @param: period_us 最长的合并时长 (微秒)
+ */
+void set_cq_moderation(uint16_t count, uint16_t period_us);
+
+/**
+ * @brief: 解析命令行中的 "count[,period-us]", 省略时长时取DEFAULT_CQ_MOD_PERIOD_US
+ * @param: str 字符串
+ * @param: count 合并的完成数
+ * @param: period_us 合并时长 (微秒)
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_cq_moderation(const char *str, uint16_t *count, uint16_t *period_us);
+
+/**
+ * @brief: 按set_cq_moderation()的设置以ibv_modify_cq()为新建的CQ启用中断合并,
+ * 设备不支持时改为软件合并; 未设置或WC_MODE_POLL下不做任何事
+ * @param: cq 完成队列
+ */
+void moderate_cq(struct ibv_cq *cq);
+
+/**
+ * @brief: 软件合并时, 事件唤醒后是否继续轮询同一个CQ, 直到攒够一批或超过合并时长
+ * @param: handled 本次唤醒后已取得的完成数
+ * @param: woke_ns 唤醒的时刻, 即now_ns()
+ * @return: 非0表示继续轮询
+ */
+int cq_coalesce_continue(int handled, uint64_t woke_ns);
+
+/**
+ * @brief: 确认cq上的一个完成事件。ibv_ack_cq_events()需要加锁,
+ * 因此先累计在*pending中, 满CQ_EVENT_ACK_BATCH个才一次确认
+ * @param: cq 完成队列
+ * @param: pending 该CQ尚未确认的事件数
+ */
+void ack_cq_event(struct ibv_cq *cq, uint32_t *pending);
+
+/**
+ * @brief: 确认累计的所有完成事件, 销毁CQ之前必须调用, 否则ibv_destroy_cq()会一直等待
+ * @param: cq 完成队列, *pending为0时可以为NULL
+ * @param: pending 该CQ尚未确认的事件数, 返回时为0
+ */
+void flush_cq_events(struct ibv_cq *cq, uint32_t *pending);
+
+/**
+ * @brief: 确认本线程在collect_work_completions()中累计的完成事件。
+ * 线程退出时自动调用; 仍存活的线程在销毁它等待过的CQ之前须显式调用
+ */
+void flush_thread_cq_events();
+
+/**
+ * @brief: 按当前获取方式等待并收集工作完成 (WC)
+ * @param: comp_channel 工作完成通道
+ * @param: cq 完成队列, 忙轮询时直接在其上轮询
+ * @param: wc 工作完成事件
+ * @param: min_wc 至少等待的工作完成数
+ * @param: max_wc 最多返回的工作完成数
+ * @return: 获取到的工作完成数, 错误时为负数
+ */
+int collect_work_completions(struct ibv_comp_channel *comp_channel,
+                             struct ibv_cq *cq,
+                             struct ibv_wc *wc,
+                             int min_wc,
+                             int max_wc);
+
+/**
+ * @brief: 处理工作完成 (WC) 通知, 按当前获取方式阻塞、忙轮询或自适应等待
  * @param: comp_channel 工作完成通道
+ * @param: cq 完成队列, 忙轮询时直接在其上轮询
  * @param: wc 工作完成事件
  * @param: max_wc 最大工作完成事件数
+ * @return: 获取到的工作完成数, 错误时为负数
  */
 int process_work_completion_events(struct ibv_comp_channel *comp_channel,
+                                   struct ibv_cq *cq,
                                    struct ibv_wc *wc,
                                    int max_wc);
 
+/* 发送端的信用, 见credit.h */
+struct send_credits;
+
+/**
+ * @brief: 为rdma_write_u64()准备源缓冲区。8字节不超过内联阈值时内联投递, 无需注册, *mr为NULL;
+ * 否则分配一个8字节的注册缓冲区, 由rdma_buffer_free()释放
+ * @param: pd 保护域
+ * @param: mr 返回源缓冲区
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_write_u64_prepare(struct ibv_pd *pd, struct ibv_mr **mr);
+
+/**
+ * @brief: 以一个RDMA WRITE把8字节的值写入远端, 用于写回信用与进度这类单调递增的计数器
+ * @param: qp 队列对
+ * @param: mr rdma_write_u64_prepare()返回的源缓冲区, NULL时内联投递
+ * @param: value 写入的值
+ * @param: remote_addr 远端地址, 8字节对齐
+ * @param: rkey 远端的rkey
+ * @param: send_flags 额外的发送标志, 如IBV_SEND_SIGNALED
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_write_u64(struct ibv_qp *qp,
+                   struct ibv_mr *mr,
+                   uint64_t value,
+                   uint64_t remote_addr,
+                   uint32_t rkey,
+                   int send_flags);
+
+/**
+ * @brief: 流水线地执行num_ops次操作, 每次在local_mr起始处的length字节与remote之间传输,
+ * 完成到达后立即补充新的WR, 始终保持最多depth个WR在途, 按选择性完成间隔请求完成
+ * @param: qp 队列对
+ * @param: comp_channel 工作完成通道
+ * @param: cq 发送完成队列
+ * @param: opcode IBV_WR_RDMA_WRITE、IBV_WR_RDMA_READ 或 IBV_WR_SEND
+ * @param: local_mr 本地内存区域
+ * @param: length 每次操作的字节数
+ * @param: remote 远端缓冲区信息, IBV_WR_SEND时不使用
+ * @param: num_ops 操作次数
+ * @param: depth 在途WR的上限, 不应超过QP的max_send_wr
+ * @param: credits IBV_WR_SEND时发送端的信用, NULL表示不做流控
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_pipelined_ops(struct ibv_qp *qp,
+                       struct ibv_comp_channel *comp_channel,
+                       struct ibv_cq *cq,
+                       enum ibv_wr_opcode opcode,
+                       struct ibv_mr *local_mr,
+                       uint32_t length,
+                       struct rdma_buffer_attr *remote,
+                       uint32_t num_ops,
+                       uint32_t depth,
+                       struct send_credits *credits);
+
+/**
+ * @brief: 把local_mr起始处length字节的区域拆成chunk_size大小的分块, 与remote中相同偏移处传输,
+ * 整个区域重复num_passes遍。分块流水线地投递, 始终保持最多depth个WR在途,
+ * 只有每get_signal_interval(depth)个WR请求一次完成, 由其wr_id一并回收之前的发送队列槽位,
+ * WR按set_post_batch()的批大小链接后一次投递, 不超过内联阈值的分块以IBV_SEND_INLINE投递,
+ * 并累计已完成的字节数, 全部分块完成后才返回。
+ * IBV_WR_SEND且给出credits时, 已发出的SEND数不超过接收端授予的信用, 信用用尽时等待接收端写回。
+ * @param: qp 队列对
+ * @param: comp_channel 工作完成通道
+ * @param: cq 发送完成队列
+ * @param: opcode IBV_WR_RDMA_WRITE、IBV_WR_RDMA_READ 或 IBV_WR_SEND
+ * @param: local_mr 本地内存区域, 至少length字节
+ * @param: remote 远端缓冲区信息, 至少length字节, IBV_WR_SEND时不使用
+ * @param: length 区域大小, 可以超过4 GiB
+ * @param: chunk_size 每个WR的字节数, 最后一个分块可能更小
+ * @param: num_passes 重复次数
+ * @param: depth 在途WR的上限, 不应超过QP的max_send_wr
+ * @param: credits IBV_WR_SEND时发送端的信用, NULL表示不做流控
+ * @return: 0表示成功，否则表示失败
+ */
+int rdma_chunked_transfer(struct ibv_qp *qp,
+                          struct ibv_comp_channel *comp_channel,
+                          struct ibv_cq *cq,
+                          enum ibv_wr_opcode opcode,
+                          struct ibv_mr *local_mr,
+                          struct rdma_buffer_attr *remote,
+                          uint64_t length,
+                          uint32_t chunk_size,
+                          uint32_t num_passes,
+                          uint32_t depth,
+                          struct send_credits *credits);
+
+/**
+ * @brief: 解析带K/M/G (1024进制) 后缀的大小, 如 "8M"
+ * @param: str 字符串
+ * @param: size 解析结果 (字节)
+ * @return: 0表示成功，否则表示失败
+ */
+int parse_size(const char *str, uint64_t *size);
+
 void print_rdma_buffer_attr(struct rdma_buffer_attr *attr);
 
 #endif  // UTILS_H_
\ No newline at end of file
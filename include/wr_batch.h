@@ -0,0 +1,85 @@
+#ifndef WR_BATCH_H_
+#define WR_BATCH_H_
+#pragma once
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include "utils.h"
+
+/* 默认的批大小与刷新超时 (微秒), 批大小为1即每个WR单独敲一次门铃 */
+#define DEFAULT_POST_BATCH_SIZE (16)
+#define DEFAULT_POST_FLUSH_US (10)
+
+/*
+ * 发送WR的批处理: WR先拷贝进批中并通过next链接成链, 批满、最老的WR超过刷新超时,
+ * 或调用方显式刷新时, 整条链由一次ibv_post_send()投递, 只敲一次门铃。
+ */
+struct wr_batch
+{
+    struct ibv_qp *qp;
+    struct ibv_send_wr *wrs;
+    struct ibv_sge *sges; /* 每个WR MAX_SGE个 */
+    uint32_t capacity, count;
+    uint64_t flush_timeout_ns; /* 0表示不按时间刷新 */
+    uint64_t first_ns;         /* 批中第一个WR加入的时间 */
+    uint64_t doorbells;        /* 已投递的链数 */
+};
+
+/**
+ * @brief: 设置wr_batch_init_default()使用的批大小与刷新超时
+ * @param: batch_size 批大小, 1表示不批处理
+ * @param: flush_timeout_us 刷新超时 (微秒), 0表示只在批满或显式刷新时投递
+ */
+void set_post_batch(uint32_t batch_size, uint32_t flush_timeout_us);
+
+/**
+ * @brief: 获取默认的批大小
+ * @param: flush_timeout_us 非NULL时返回刷新超时 (微秒)
+ * @return: 批大小
+ */
+uint32_t get_post_batch(uint32_t *flush_timeout_us);
+
+/**
+ * @brief: 初始化批处理
+ * @param: batch 批处理
+ * @param: qp 投递的队列对
+ * @param: batch_size 批大小
+ * @param: flush_timeout_us 刷新超时 (微秒), 0表示不按时间刷新
+ * @return: 0表示成功，否则表示失败
+ */
+int wr_batch_init(struct wr_batch *batch,
+                  struct ibv_qp *qp,
+                  uint32_t batch_size,
+                  uint32_t flush_timeout_us);
+
+/**
+ * @brief: 用set_post_batch()设置的参数初始化批处理, 批大小不超过max_size
+ * @param: batch 批处理
+ * @param: qp 投递的队列对
+ * @param: max_size 批大小上限, 通常为发送队列深度
+ * @return: 0表示成功，否则表示失败
+ */
+int wr_batch_init_default(struct wr_batch *batch, struct ibv_qp *qp, uint32_t max_size);
+
+/**
+ * @brief: 释放批处理, 未投递的WR被丢弃
+ * @param: batch 批处理
+ */
+void wr_batch_destroy(struct wr_batch *batch);
+
+/**
+ * @brief: 拷贝一个WR (及其sg_list) 到批中, 批满或超时则投递整条链。
+ * wr->next被忽略, 调用方之后可以复用wr与其sg_list。
+ * @param: batch 批处理
+ * @param: wr 发送WR, num_sge不超过MAX_SGE
+ * @return: 0表示成功，否则表示失败
+ */
+int wr_batch_add(struct wr_batch *batch, const struct ibv_send_wr *wr);
+
+/**
+ * @brief: 投递批中所有WR, 调用方在等待完成之前必须调用
+ * @param: batch 批处理
+ * @return: 0表示成功，否则表示失败
+ */
+int wr_batch_flush(struct wr_batch *batch);
+
+#endif  // WR_BATCH_H_
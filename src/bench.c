@@ -0,0 +1,1446 @@
+#include "bench.h"
+#include <pthread.h>
+
+/* 正式测量前的预热次数上限 */
+#define BENCH_WARMUP_ITERATIONS (100)
+
+static const struct
+{
+    enum bench_op op;
+    enum ibv_wr_opcode opcode;
+    const char *name;
+} bench_ops[] = {
+    {BENCH_OP_WRITE, IBV_WR_RDMA_WRITE, "write"},
+    {BENCH_OP_READ, IBV_WR_RDMA_READ, "read"},
+    {BENCH_OP_SEND, IBV_WR_SEND, "send"},
+};
+
+static const struct
+{
+    enum bench_op op;
+    const char *name;
+} atomic_ops[] = {
+    {BENCH_OP_FAA, "faa"},
+    {BENCH_OP_CAS, "cas"},
+    {BENCH_OP_LOCK, "lock"},
+};
+
+void bench_config_init(struct bench_config *cfg)
+{
+    bzero(cfg, sizeof(*cfg));
+    cfg->ops                  = BENCH_OP_ALL;
+    cfg->min_size             = BENCH_DEFAULT_MIN_SIZE;
+    cfg->max_size             = BENCH_DEFAULT_MAX_SIZE;
+    cfg->iterations[0]        = BENCH_DEFAULT_ITERATIONS;
+    cfg->num_iteration_counts = 1;
+    cfg->format               = BENCH_FORMAT_TEXT;
+    cfg->reg_min_size         = BENCH_REG_DEFAULT_MIN_SIZE;
+    cfg->reg_max_size         = BENCH_REG_DEFAULT_MAX_SIZE;
+    cfg->submit_threads       = BENCH_DEFAULT_SUBMIT_THREADS;
+}
+
+int parse_bench_ops(const char *str, uint32_t *ops)
+{
+    char buf[64], *tok, *saveptr = NULL;
+    size_t i;
+    *ops = 0;
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        if (!strcmp(tok, "all"))
+        {
+            *ops |= BENCH_OP_ALL;
+            continue;
+        }
+        for (i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++)
+        {
+            if (!strcmp(tok, bench_ops[i].name))
+            {
+                *ops |= bench_ops[i].op;
+                break;
+            }
+        }
+        if (i < sizeof(bench_ops) / sizeof(bench_ops[0]))
+        {
+            continue;
+        }
+        for (i = 0; i < sizeof(atomic_ops) / sizeof(atomic_ops[0]); i++)
+        {
+            if (!strcmp(tok, atomic_ops[i].name))
+            {
+                *ops |= atomic_ops[i].op;
+                break;
+            }
+        }
+        if (i == sizeof(atomic_ops) / sizeof(atomic_ops[0]))
+        {
+            log_err("Unknown benchmark operation: %s ", tok);
+            return -EINVAL;
+        }
+    }
+    return *ops ? 0 : -EINVAL;
+}
+
+int parse_bench_iterations(const char *str, struct bench_config *cfg)
+{
+    char buf[128], *tok, *saveptr = NULL;
+    unsigned long val;
+    cfg->num_iteration_counts = 0;
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (tok = strtok_r(buf, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        if (cfg->num_iteration_counts == BENCH_MAX_ITER_COUNTS)
+        {
+            log_err("At most %d iteration counts are supported ", BENCH_MAX_ITER_COUNTS);
+            return -EINVAL;
+        }
+        val = strtoul(tok, NULL, 0);
+        if (!val)
+        {
+            log_err("Invalid iteration count: %s ", tok);
+            return -EINVAL;
+        }
+        cfg->iterations[cfg->num_iteration_counts++] = (uint32_t)val;
+    }
+    return cfg->num_iteration_counts ? 0 : -EINVAL;
+}
+
+int parse_bench_format(const char *str, enum bench_format *format)
+{
+    if (!strcmp(str, "text"))
+    {
+        *format = BENCH_FORMAT_TEXT;
+    }
+    else if (!strcmp(str, "csv"))
+    {
+        *format = BENCH_FORMAT_CSV;
+    }
+    else if (!strcmp(str, "json"))
+    {
+        *format = BENCH_FORMAT_JSON;
+    }
+    else
+    {
+        log_err("Unknown benchmark output format: %s ", str);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* 已排序样本的分位数 (最近秩法), 单位为微秒 */
+static double percentile_us(const uint64_t *sorted, uint32_t n, double p)
+{
+    uint32_t idx = (uint32_t)(p * n);
+    if (idx >= n)
+    {
+        idx = n - 1;
+    }
+    return (double)sorted[idx] / 1e3;
+}
+
+/* 深度为1逐个投递, 记录每个WR从投递到完成的时间 */
+static int measure_latency(struct bench_target *t,
+                           enum ibv_wr_opcode opcode,
+                           struct ibv_mr *mr,
+                           uint32_t size,
+                           uint32_t iterations,
+                           struct bench_result *res)
+{
+    struct ibv_wc wc;
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    uint64_t *samples = NULL, start, sum = 0;
+    uint32_t i;
+    int ret = -1;
+    samples = calloc(iterations, sizeof(*samples));
+    if (!samples)
+    {
+        log_err("Failed to allocate latency samples, -ENOMEM ");
+        return -ENOMEM;
+    }
+    sge.addr   = (uint64_t)mr->addr;
+    sge.length = size;
+    sge.lkey   = mr->lkey;
+    bzero(&wr, sizeof(wr));
+    wr.sg_list    = &sge;
+    wr.num_sge    = 1;
+    wr.opcode     = opcode;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    if (opcode != IBV_WR_SEND)
+    {
+        wr.wr.rdma.rkey        = t->remote->stag.remote_stag;
+        wr.wr.rdma.remote_addr = t->remote->address;
+    }
+    /* 与rdma_chunked_transfer()的规则一致, 使延迟与带宽在相同的投递方式下测得 */
+    res->inlined = opcode != IBV_WR_RDMA_READ && size <= get_inline_threshold();
+    if (res->inlined)
+    {
+        wr.send_flags |= IBV_SEND_INLINE;
+    }
+    for (i = 0; i < iterations; i++)
+    {
+        /* 深度为1时上一个SEND已完成, 没有信用时只需等待接收端写回 */
+        if (opcode == IBV_WR_SEND && send_credits_enabled(t->credits))
+        {
+            ret = send_credits_wait(t->credits);
+            if (ret)
+            {
+                goto out;
+            }
+            send_credits_use(t->credits, 1);
+        }
+        wr.wr_id = i;
+        start    = now_ns();
+        ret      = ibv_post_send(t->qp, &wr, &bad_wr);
+        if (ret)
+        {
+            log_err("Failed to post send, errno: %d ", ret);
+            ret = -ret;
+            goto out;
+        }
+        ret = collect_work_completions(t->comp_channel, t->cq, &wc, 1, 1);
+        if (ret != 1)
+        {
+            log_err("Failed to get 1 work completion, ret = %d ", ret);
+            goto out;
+        }
+        samples[i] = now_ns() - start;
+        sum += samples[i];
+    }
+    qsort(samples, iterations, sizeof(*samples), cmp_u64);
+    res->lat_min_us  = (double)samples[0] / 1e3;
+    res->lat_avg_us  = (double)sum / iterations / 1e3;
+    res->lat_p50_us  = percentile_us(samples, iterations, 0.50);
+    res->lat_p99_us  = percentile_us(samples, iterations, 0.99);
+    res->lat_p999_us = percentile_us(samples, iterations, 0.999);
+    res->lat_max_us  = (double)samples[iterations - 1] / 1e3;
+    ret              = 0;
+out:
+    free(samples);
+    return ret;
+}
+
+/* 保持depth个WR在途, 测量带宽与消息速率 */
+static int measure_bandwidth(struct bench_target *t,
+                             enum ibv_wr_opcode opcode,
+                             struct ibv_mr *mr,
+                             uint32_t size,
+                             uint32_t iterations,
+                             struct bench_result *res)
+{
+    uint64_t start, elapsed;
+    double secs;
+    int ret;
+    start = now_ns();
+    ret   = rdma_pipelined_ops(t->qp, t->comp_channel, t->cq, opcode, mr, size, t->remote,
+                               iterations, t->depth, t->credits);
+    if (ret)
+    {
+        return ret;
+    }
+    elapsed   = now_ns() - start;
+    secs      = elapsed ? (double)elapsed / 1e9 : 1e-9;
+    res->gbps = (double)size * iterations * 8 / secs / 1e9;
+    res->mops = (double)iterations / secs / 1e6;
+    return 0;
+}
+
+static void print_header(enum bench_format format)
+{
+    switch (format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("op,bytes,iterations,depth,inline,bw_gbps,msg_rate_mops,lat_min_us,lat_avg_us,"
+                   "lat_p50_us,lat_p99_us,lat_p99_9_us,lat_max_us\n");
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("[\n");
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-6s %10s %10s %6s %6s %12s %12s %10s %10s %10s %10s\n", "op", "bytes",
+                   "iters", "depth", "inline", "BW[Gb/s]", "Rate[Mops]", "avg[us]", "p50[us]",
+                   "p99[us]", "p99.9[us]");
+            break;
+    }
+}
+
+static void print_result(enum bench_format format, struct bench_result *r, int first)
+{
+    switch (format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("%s,%u,%u,%u,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", r->op, r->size,
+                   r->iterations, r->depth, r->inlined, r->gbps, r->mops, r->lat_min_us,
+                   r->lat_avg_us, r->lat_p50_us, r->lat_p99_us, r->lat_p999_us, r->lat_max_us);
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("%s  {\"op\": \"%s\", \"bytes\": %u, \"iterations\": %u, \"depth\": %u, "
+                   "\"inline\": %s, \"bw_gbps\": %.3f, \"msg_rate_mops\": %.3f, "
+                   "\"lat_min_us\": %.3f, \"lat_avg_us\": %.3f, \"lat_p50_us\": %.3f, "
+                   "\"lat_p99_us\": %.3f, \"lat_p99_9_us\": %.3f, \"lat_max_us\": %.3f}",
+                   first ? "" : ",\n", r->op, r->size, r->iterations, r->depth,
+                   r->inlined ? "true" : "false", r->gbps, r->mops, r->lat_min_us, r->lat_avg_us,
+                   r->lat_p50_us, r->lat_p99_us, r->lat_p999_us, r->lat_max_us);
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-6s %10u %10u %6u %6s %12.3f %12.3f %10.2f %10.2f %10.2f %10.2f\n", r->op,
+                   r->size, r->iterations, r->depth, r->inlined ? "yes" : "no", r->gbps, r->mops,
+                   r->lat_avg_us, r->lat_p50_us, r->lat_p99_us, r->lat_p999_us);
+            break;
+    }
+    fflush(stdout);
+}
+
+static void print_footer(enum bench_format format)
+{
+    if (format == BENCH_FORMAT_JSON)
+    {
+        printf("\n]\n");
+    }
+}
+
+int run_benchmark(struct bench_target *target, struct bench_config *cfg)
+{
+    struct bench_result res;
+    struct ibv_mr *mr;
+    uint32_t size, iters, warmup;
+    size_t i;
+    int j, ret, first = 1;
+    if (cfg->min_size == 0 || cfg->min_size > cfg->max_size ||
+        cfg->max_size > target->src_mr->length || cfg->max_size > target->remote->length)
+    {
+        log_err("Invalid benchmark size range [%u, %u] ", cfg->min_size, cfg->max_size);
+        return -EINVAL;
+    }
+    print_header(cfg->format);
+    for (i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++)
+    {
+        if (!(cfg->ops & bench_ops[i].op))
+        {
+            continue;
+        }
+        /* READ把远端数据拉取到dst, 其余操作从src推送 */
+        mr = bench_ops[i].op == BENCH_OP_READ ? target->dst_mr : target->src_mr;
+        for (size = cfg->min_size;; size <<= 1)
+        {
+            if (size > cfg->max_size)
+            {
+                size = cfg->max_size;
+            }
+            for (j = 0; j < cfg->num_iteration_counts; j++)
+            {
+                iters = cfg->iterations[j];
+                bzero(&res, sizeof(res));
+                res.op         = bench_ops[i].name;
+                res.size       = size;
+                res.iterations = iters;
+                res.depth      = target->depth;
+                warmup = iters < BENCH_WARMUP_ITERATIONS ? iters : BENCH_WARMUP_ITERATIONS;
+                ret    = rdma_pipelined_ops(target->qp, target->comp_channel, target->cq,
+                                            bench_ops[i].opcode, mr, size, target->remote,
+                                            warmup, target->depth, target->credits);
+                if (ret)
+                {
+                    log_err("Warmup of %s/%u failed, ret = %d ", res.op, size, ret);
+                    return ret;
+                }
+                ret = measure_latency(target, bench_ops[i].opcode, mr, size, iters, &res);
+                if (ret)
+                {
+                    log_err("Latency test of %s/%u failed, ret = %d ", res.op, size, ret);
+                    return ret;
+                }
+                ret = measure_bandwidth(target, bench_ops[i].opcode, mr, size, iters, &res);
+                if (ret)
+                {
+                    log_err("Bandwidth test of %s/%u failed, ret = %d ", res.op, size, ret);
+                    return ret;
+                }
+                print_result(cfg->format, &res, first);
+                first = 0;
+            }
+            if (size == cfg->max_size)
+            {
+                break;
+            }
+        }
+    }
+    print_footer(cfg->format);
+    return 0;
+}
+
+/*
+ * 以chunk大小的RDMA WRITE流式发送整个本地区域, 保持depth个WR在途,
+ * 远端偏移在远端缓冲区内循环。
+ */
+static int stream_region(struct bench_target *t, struct ibv_mr *mr, uint64_t len, uint32_t chunk)
+{
+    struct ibv_wc wc[WC_BATCH];
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    uint64_t window = t->remote->length / chunk * chunk;
+    uint64_t nchunks = (len + chunk - 1) / chunk, posted = 0, completed = 0;
+    uint32_t inflight = 0;
+    int ret;
+    bzero(&wr, sizeof(wr));
+    wr.sg_list      = &sge;
+    wr.num_sge      = 1;
+    wr.opcode       = IBV_WR_RDMA_WRITE;
+    wr.send_flags   = IBV_SEND_SIGNALED;
+    wr.wr.rdma.rkey = t->remote->stag.remote_stag;
+    sge.lkey        = mr->lkey;
+    while (completed < nchunks)
+    {
+        while (posted < nchunks && inflight < t->depth)
+        {
+            uint64_t offset        = posted * chunk;
+            sge.addr               = (uint64_t)mr->addr + offset;
+            sge.length             = len - offset < chunk ? (uint32_t)(len - offset) : chunk;
+            wr.wr.rdma.remote_addr = t->remote->address + offset % window;
+            wr.wr_id               = posted;
+            ret                    = ibv_post_send(t->qp, &wr, &bad_wr);
+            if (ret)
+            {
+                log_err("Failed to post send, errno: %d ", ret);
+                return -ret;
+            }
+            posted++;
+            inflight++;
+        }
+        ret = collect_work_completions(t->comp_channel, t->cq, wc, 1,
+                                       inflight < WC_BATCH ? (int)inflight : WC_BATCH);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        completed += ret;
+        inflight -= ret;
+    }
+    return 0;
+}
+
+static void print_reg_header(enum bench_format format)
+{
+    switch (format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("requested_backing,backing,bytes,alloc_us,touch_us,reg_us,dereg_us,"
+                   "write_bw_gbps\n");
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("[\n");
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-9s %-8s %14s %12s %12s %12s %12s %12s\n", "requested", "backing", "bytes",
+                   "alloc[us]", "touch[us]", "reg[us]", "dereg[us]", "BW[Gb/s]");
+            break;
+    }
+}
+
+int run_reg_benchmark(struct bench_target *target, struct bench_config *cfg)
+{
+    static const enum buffer_backing backings[] = {
+        BUFFER_BACKING_HEAP, BUFFER_BACKING_THP, BUFFER_BACKING_HUGE_2M, BUFFER_BACKING_HUGE_1G};
+    const int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    struct host_buffer buf;
+    struct ibv_mr *mr;
+    uint64_t size, t0, alloc_ns, touch_ns, reg_ns, dereg_ns, write_ns;
+    uint32_t chunk = BENCH_REG_CHUNK_SIZE;
+    double gbps;
+    size_t i;
+    int ret, first = 1;
+    if (!cfg->reg_min_size || cfg->reg_min_size > cfg->reg_max_size)
+    {
+        log_err("Invalid registration benchmark size range ");
+        return -EINVAL;
+    }
+    if (target->remote->length < chunk)
+    {
+        chunk = (uint32_t)target->remote->length;
+    }
+    print_reg_header(cfg->format);
+    for (i = 0; i < sizeof(backings) / sizeof(backings[0]); i++)
+    {
+        for (size = cfg->reg_min_size; size <= cfg->reg_max_size; size <<= 1)
+        {
+            t0  = now_ns();
+            ret = host_buffer_alloc(&buf, size, backings[i]);
+            if (ret)
+            {
+                return ret;
+            }
+            alloc_ns = now_ns() - t0;
+            /* 首次访问触发缺页, 大页下缺页次数减少为1/512或更少 */
+            t0 = now_ns();
+            memset(buf.addr, 0x5a, size);
+            touch_ns = now_ns() - t0;
+            /* 绕过注册缓存, 测量真实的注册开销 */
+            t0 = now_ns();
+            mr = ibv_reg_mr(target->pd, buf.addr, size, access);
+            if (!mr)
+            {
+                log_err("Failed to register %lu bytes, errno: %d ", size, -errno);
+                host_buffer_free(&buf);
+                return -errno;
+            }
+            reg_ns = now_ns() - t0;
+            t0     = now_ns();
+            ret    = stream_region(target, mr, size, chunk);
+            if (ret)
+            {
+                ibv_dereg_mr(mr);
+                host_buffer_free(&buf);
+                return ret;
+            }
+            write_ns = now_ns() - t0;
+            t0       = now_ns();
+            ibv_dereg_mr(mr);
+            dereg_ns = now_ns() - t0;
+            host_buffer_free(&buf);
+            gbps = write_ns ? (double)size * 8 / ((double)write_ns / 1e9) / 1e9 : 0.0;
+            switch (cfg->format)
+            {
+                case BENCH_FORMAT_CSV:
+                    printf("%s,%s,%lu,%.1f,%.1f,%.1f,%.1f,%.3f\n", buffer_backing_str(backings[i]),
+                           buffer_backing_str(buf.backing), size, alloc_ns / 1e3, touch_ns / 1e3,
+                           reg_ns / 1e3, dereg_ns / 1e3, gbps);
+                    break;
+                case BENCH_FORMAT_JSON:
+                    printf("%s  {\"requested_backing\": \"%s\", \"backing\": \"%s\", "
+                           "\"bytes\": %lu, \"alloc_us\": %.1f, \"touch_us\": %.1f, "
+                           "\"reg_us\": %.1f, \"dereg_us\": %.1f, \"write_bw_gbps\": %.3f}",
+                           first ? "" : ",\n", buffer_backing_str(backings[i]),
+                           buffer_backing_str(buf.backing), size, alloc_ns / 1e3, touch_ns / 1e3,
+                           reg_ns / 1e3, dereg_ns / 1e3, gbps);
+                    break;
+                case BENCH_FORMAT_TEXT:
+                default:
+                    printf("%-9s %-8s %14lu %12.1f %12.1f %12.1f %12.1f %12.3f\n",
+                           buffer_backing_str(backings[i]), buffer_backing_str(buf.backing), size,
+                           alloc_ns / 1e3, touch_ns / 1e3, reg_ns / 1e3, dereg_ns / 1e3, gbps);
+                    break;
+            }
+            fflush(stdout);
+            first = 0;
+        }
+    }
+    print_footer(cfg->format);
+    return 0;
+}
+
+static void print_odp_header(enum bench_format format)
+{
+    switch (format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("mode,bytes,reg_us,first_write_us,first_bw_gbps,steady_bw_gbps,dereg_us\n");
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("[\n");
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-9s %14s %12s %14s %14s %14s %12s\n", "mode", "bytes", "reg[us]",
+                   "first[us]", "first[Gb/s]", "steady[Gb/s]", "dereg[us]");
+            break;
+    }
+}
+
+/* 注册一个区域, MR_ODP_IMPLICIT时注册的是整个地址空间, view填写为该区域 */
+static struct ibv_mr *odp_bench_register(struct ibv_pd *pd,
+                                         enum mr_odp_mode mode,
+                                         void *addr,
+                                         uint64_t size,
+                                         struct ibv_mr *view)
+{
+    struct ibv_mr *mr;
+    switch (mode)
+    {
+        case MR_ODP_IMPLICIT:
+            mr = ibv_reg_mr(pd, NULL, SIZE_MAX, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND);
+            break;
+        case MR_ODP_EXPLICIT:
+            mr = ibv_reg_mr(pd, addr, size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND);
+            break;
+        case MR_ODP_OFF:
+        default:
+            mr = ibv_reg_mr(pd, addr, size, IBV_ACCESS_LOCAL_WRITE);
+            break;
+    }
+    if (!mr)
+    {
+        log_err("Failed to register %lu bytes (%s), errno: %d ", size, mr_odp_mode_str(mode),
+                -errno);
+        return NULL;
+    }
+    *view        = *mr;
+    view->addr   = addr;
+    view->length = size;
+    return mr;
+}
+
+int run_odp_benchmark(struct bench_target *target, struct bench_config *cfg)
+{
+    struct host_buffer buf;
+    struct ibv_mr *mr, view;
+    enum mr_odp_mode supported, mode;
+    uint64_t size, t0, reg_ns, first_ns, steady_ns = 0, dereg_ns;
+    uint32_t chunk = BENCH_REG_CHUNK_SIZE;
+    double first_gbps, steady_gbps;
+    int access, ret, first = 1;
+    if (!cfg->reg_min_size || cfg->reg_min_size > cfg->reg_max_size)
+    {
+        log_err("Invalid registration benchmark size range ");
+        return -EINVAL;
+    }
+    if (target->remote->length < chunk)
+    {
+        chunk = (uint32_t)target->remote->length;
+    }
+    supported = device_odp_mode(target->pd->context, MR_ODP_IMPLICIT, &access);
+    print_odp_header(cfg->format);
+    for (mode = MR_ODP_OFF; mode <= supported; mode++)
+    {
+        for (size = cfg->reg_min_size; size <= cfg->reg_max_size; size <<= 1)
+        {
+            /* 始终用普通页的calloc, 大块内存由mmap得到且从未访问, 缺页留给注册或网卡 */
+            ret = host_buffer_alloc(&buf, size, BUFFER_BACKING_HEAP);
+            if (ret)
+            {
+                return ret;
+            }
+            t0 = now_ns();
+            mr = odp_bench_register(target->pd, mode, buf.addr, size, &view);
+            if (!mr)
+            {
+                host_buffer_free(&buf);
+                return -errno;
+            }
+            reg_ns   = now_ns() - t0;
+            t0       = now_ns();
+            ret      = stream_region(target, &view, size, chunk);
+            first_ns = now_ns() - t0;
+            if (!ret)
+            {
+                t0        = now_ns();
+                ret       = stream_region(target, &view, size, chunk);
+                steady_ns = now_ns() - t0;
+            }
+            t0 = now_ns();
+            ibv_dereg_mr(mr);
+            dereg_ns = now_ns() - t0;
+            host_buffer_free(&buf);
+            if (ret)
+            {
+                return ret;
+            }
+            first_gbps  = first_ns ? (double)size * 8 / first_ns : 0.0;
+            steady_gbps = steady_ns ? (double)size * 8 / steady_ns : 0.0;
+            switch (cfg->format)
+            {
+                case BENCH_FORMAT_CSV:
+                    printf("%s,%lu,%.1f,%.1f,%.3f,%.3f,%.1f\n", mr_odp_mode_str(mode), size,
+                           reg_ns / 1e3, first_ns / 1e3, first_gbps, steady_gbps, dereg_ns / 1e3);
+                    break;
+                case BENCH_FORMAT_JSON:
+                    printf("%s  {\"mode\": \"%s\", \"bytes\": %lu, \"reg_us\": %.1f, "
+                           "\"first_write_us\": %.1f, \"first_bw_gbps\": %.3f, "
+                           "\"steady_bw_gbps\": %.3f, \"dereg_us\": %.1f}",
+                           first ? "" : ",\n", mr_odp_mode_str(mode), size, reg_ns / 1e3,
+                           first_ns / 1e3, first_gbps, steady_gbps, dereg_ns / 1e3);
+                    break;
+                case BENCH_FORMAT_TEXT:
+                default:
+                    printf("%-9s %14lu %12.1f %14.1f %14.3f %14.3f %12.1f\n", mr_odp_mode_str(mode),
+                           size, reg_ns / 1e3, first_ns / 1e3, first_gbps, steady_gbps,
+                           dereg_ns / 1e3);
+                    break;
+            }
+            fflush(stdout);
+            first = 0;
+        }
+    }
+    print_footer(cfg->format);
+    return 0;
+}
+
+/* 以给定的批大小执行一轮流水线操作, 返回耗时 (纳秒), 出错时返回0 */
+static uint64_t timed_pipelined_ops(struct bench_target *t,
+                                    enum ibv_wr_opcode opcode,
+                                    struct ibv_mr *mr,
+                                    uint32_t size,
+                                    uint32_t iterations,
+                                    uint32_t batch_size,
+                                    uint32_t flush_timeout_us)
+{
+    uint64_t start;
+    set_post_batch(batch_size, flush_timeout_us);
+    start = now_ns();
+    if (rdma_pipelined_ops(t->qp, t->comp_channel, t->cq, opcode, mr, size, t->remote,
+                           iterations, t->depth, t->credits))
+    {
+        return 0;
+    }
+    return now_ns() - start;
+}
+
+static void print_post_header(enum bench_format format)
+{
+    switch (format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("op,bytes,iterations,depth,batch,single_mops,batched_mops,single_bw_gbps,"
+                   "batched_bw_gbps,speedup\n");
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("[\n");
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-6s %10s %10s %6s %6s %12s %12s %12s %12s %8s\n", "op", "bytes", "iters",
+                   "depth", "batch", "1WR[Mops]", "chain[Mops]", "1WR[Gb/s]", "chain[Gb/s]",
+                   "speedup");
+            break;
+    }
+}
+
+int run_post_benchmark(struct bench_target *target, struct bench_config *cfg)
+{
+    struct ibv_mr *mr;
+    uint32_t size, iters = cfg->iterations[0], warmup, batch_size, default_batch, flush_timeout_us;
+    uint64_t single_ns, batched_ns;
+    double single_mops, batched_mops;
+    size_t i;
+    int first = 1;
+    if (cfg->min_size == 0 || cfg->min_size > cfg->max_size ||
+        cfg->max_size > target->src_mr->length || cfg->max_size > target->remote->length)
+    {
+        log_err("Invalid benchmark size range [%u, %u] ", cfg->min_size, cfg->max_size);
+        return -EINVAL;
+    }
+    default_batch = get_post_batch(&flush_timeout_us);
+    batch_size    = default_batch;
+    if (batch_size > target->depth)
+    {
+        batch_size = target->depth;
+    }
+    print_post_header(cfg->format);
+    for (i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++)
+    {
+        if (!(cfg->ops & bench_ops[i].op))
+        {
+            continue;
+        }
+        mr = bench_ops[i].op == BENCH_OP_READ ? target->dst_mr : target->src_mr;
+        for (size = cfg->min_size;; size <<= 1)
+        {
+            if (size > cfg->max_size)
+            {
+                size = cfg->max_size;
+            }
+            /* 预热后依次测量两种投递方式, 结束时恢复默认的批大小 */
+            warmup     = iters < BENCH_WARMUP_ITERATIONS ? iters : BENCH_WARMUP_ITERATIONS;
+            single_ns  = 0;
+            batched_ns = 0;
+            if (timed_pipelined_ops(target, bench_ops[i].opcode, mr, size, warmup, batch_size,
+                                    flush_timeout_us))
+            {
+                single_ns = timed_pipelined_ops(target, bench_ops[i].opcode, mr, size, iters, 1,
+                                                flush_timeout_us);
+            }
+            if (single_ns)
+            {
+                batched_ns = timed_pipelined_ops(target, bench_ops[i].opcode, mr, size, iters,
+                                                 batch_size, flush_timeout_us);
+            }
+            set_post_batch(default_batch, flush_timeout_us);
+            if (!single_ns || !batched_ns)
+            {
+                log_err("Post benchmark of %s/%u failed ", bench_ops[i].name, size);
+                return -EIO;
+            }
+            single_mops  = (double)iters / ((double)single_ns / 1e3);
+            batched_mops = (double)iters / ((double)batched_ns / 1e3);
+            switch (cfg->format)
+            {
+                case BENCH_FORMAT_CSV:
+                    printf("%s,%u,%u,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f\n", bench_ops[i].name, size,
+                           iters, target->depth, batch_size, single_mops, batched_mops,
+                           single_mops * size * 8 / 1e3, batched_mops * size * 8 / 1e3,
+                           batched_mops / single_mops);
+                    break;
+                case BENCH_FORMAT_JSON:
+                    printf("%s  {\"op\": \"%s\", \"bytes\": %u, \"iterations\": %u, "
+                           "\"depth\": %u, \"batch\": %u, \"single_mops\": %.3f, "
+                           "\"batched_mops\": %.3f, \"single_bw_gbps\": %.3f, "
+                           "\"batched_bw_gbps\": %.3f, \"speedup\": %.3f}",
+                           first ? "" : ",\n", bench_ops[i].name, size, iters, target->depth,
+                           batch_size, single_mops, batched_mops, single_mops * size * 8 / 1e3,
+                           batched_mops * size * 8 / 1e3, batched_mops / single_mops);
+                    break;
+                case BENCH_FORMAT_TEXT:
+                default:
+                    printf("%-6s %10u %10u %6u %6u %12.3f %12.3f %12.3f %12.3f %8.2f\n",
+                           bench_ops[i].name, size, iters, target->depth, batch_size, single_mops,
+                           batched_mops, single_mops * size * 8 / 1e3,
+                           batched_mops * size * 8 / 1e3, batched_mops / single_mops);
+                    break;
+            }
+            fflush(stdout);
+            first = 0;
+            if (size == cfg->max_size)
+            {
+                break;
+            }
+        }
+    }
+    print_footer(cfg->format);
+    return 0;
+}
+
+/* 原子基准中一个线程的参数与结果 */
+struct atomic_worker
+{
+    struct bench_target *t;
+    enum bench_op op;
+    uint32_t iterations, depth;
+    uint64_t offset; /* 所用的字在远端缓冲区中的偏移 */
+    volatile int *start; /* 0: 等待, 1: 开始, -1: 放弃 */
+    struct ibv_mr *result_mr; /* depth个8字节的槽 */
+    uint64_t *compares;       /* 每个槽上CMP_AND_SWP的比较值 */
+    uint64_t elapsed_ns, attempts, successes;
+    int ret;
+};
+
+/* 流水线执行FETCH_AND_ADD或CMP_AND_SWP, 保持depth个在途 */
+static int atomic_pipeline(struct atomic_worker *w)
+{
+    struct bench_target *t = w->t;
+    enum ibv_wr_opcode opcode =
+        w->op == BENCH_OP_FAA ? IBV_WR_ATOMIC_FETCH_AND_ADD : IBV_WR_ATOMIC_CMP_AND_SWP;
+    volatile uint64_t *results = w->result_mr->addr;
+    uint64_t remote_addr = t->remote->address + w->offset, posted = 0, completed = 0, expected = 0;
+    uint64_t slot, old;
+    struct ibv_wc wc[WC_BATCH];
+    struct ibv_sge sge;
+    int ret = -1;
+    sge.length = sizeof(uint64_t);
+    sge.lkey   = w->result_mr->lkey;
+    while (completed < w->iterations)
+    {
+        while (posted < w->iterations && posted - completed < w->depth)
+        {
+            slot              = posted % w->depth;
+            sge.addr          = (uint64_t)&results[slot];
+            w->compares[slot] = expected;
+            ret = rdma_post_atomic(t->qp, opcode, &sge, remote_addr, t->remote->stag.remote_stag,
+                                   opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ? 1 : expected,
+                                   expected + 1, posted);
+            if (ret)
+            {
+                return ret;
+            }
+            posted++;
+        }
+        ret = collect_work_completions(t->comp_channel, t->cq, wc, 1, WC_BATCH);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        /* 同一QP上的原子操作按序执行, 后完成的结果反映更新的值 */
+        for (int i = 0; i < ret; i++)
+        {
+            slot = wc[i].wr_id % w->depth;
+            old  = results[slot];
+            if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD || old == w->compares[slot])
+            {
+                w->successes++;
+                expected = old + 1;
+            }
+            else
+            {
+                expected = old;
+            }
+        }
+        completed += ret;
+    }
+    w->attempts = w->iterations;
+    return 0;
+}
+
+/* 同步读写远端缓冲区中offset处的8字节 */
+static int word_transfer(struct bench_target *t,
+                         enum ibv_wr_opcode opcode,
+                         struct ibv_mr *mr,
+                         uint64_t offset)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    struct ibv_wc wc;
+    int ret    = -1;
+    sge.addr   = (uint64_t)mr->addr;
+    sge.length = sizeof(uint64_t);
+    sge.lkey   = mr->lkey;
+    bzero(&wr, sizeof(wr));
+    wr.sg_list             = &sge;
+    wr.num_sge             = 1;
+    wr.opcode              = opcode;
+    wr.send_flags          = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = t->remote->address + offset;
+    wr.wr.rdma.rkey        = t->remote->stag.remote_stag;
+    ret                    = ibv_post_send(t->qp, &wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post word transfer, errno: %d ", ret);
+        return -ret;
+    }
+    ret = collect_work_completions(t->comp_channel, t->cq, &wc, 1, 1);
+    return ret < 0 ? ret : 0;
+}
+
+/* 在锁的保护下以非原子的READ/WRITE递增锁之后的字, 锁失效时校验会发现丢失的更新 */
+static int atomic_lock_loop(struct atomic_worker *w)
+{
+    struct bench_target *t = w->t;
+    struct rdma_atomic_word lock;
+    volatile uint64_t *data = w->result_mr->addr;
+    uint64_t owner = (uint64_t)(uintptr_t)w, tries;
+    int ret        = -1;
+    ret = rdma_atomic_word_init(&lock, t->pd, t->qp, t->comp_channel, t->cq, t->remote, w->offset);
+    if (ret)
+    {
+        goto out;
+    }
+    for (uint32_t i = 0; i < w->iterations; i++)
+    {
+        ret = rdma_spin_lock(&lock, owner, &tries);
+        if (ret)
+        {
+            goto out;
+        }
+        w->attempts += tries;
+        ret = word_transfer(t, IBV_WR_RDMA_READ, w->result_mr, w->offset + sizeof(uint64_t));
+        if (ret)
+        {
+            goto out;
+        }
+        (*data)++;
+        ret = word_transfer(t, IBV_WR_RDMA_WRITE, w->result_mr, w->offset + sizeof(uint64_t));
+        if (ret)
+        {
+            goto out;
+        }
+        ret = rdma_spin_unlock(&lock, owner);
+        if (ret)
+        {
+            goto out;
+        }
+        w->successes++;
+    }
+out:
+    rdma_atomic_word_destroy(&lock);
+    return ret;
+}
+
+static void *atomic_worker_main(void *arg)
+{
+    struct atomic_worker *w = arg;
+    uint64_t start;
+    /* 所有线程创建完成后同时开始 */
+    while (!*w->start)
+        ;
+    if (*w->start < 0)
+    {
+        return NULL;
+    }
+    start         = now_ns();
+    w->ret        = w->op == BENCH_OP_LOCK ? atomic_lock_loop(w) : atomic_pipeline(w);
+    w->elapsed_ns = now_ns() - start;
+    return NULL;
+}
+
+static void print_atomic_header(enum bench_format format)
+{
+    switch (format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("op,words,threads,iterations,depth,rate_mops,success_pct,check\n");
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("[\n");
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-6s %9s %8s %10s %6s %12s %11s %6s\n", "op", "words", "threads", "iters",
+                   "depth", "Rate[Mops]", "success[%]", "check");
+            break;
+    }
+}
+
+/*
+ * 以num_targets个线程执行一轮原子测试。先清零远端的字, 结束后读回,
+ * 与各线程成功的操作数之和比较。
+ */
+static int run_atomic_round(struct bench_target *targets,
+                            uint32_t num_targets,
+                            struct bench_config *cfg,
+                            struct atomic_worker *workers,
+                            struct ibv_mr *check_mr,
+                            enum bench_op op,
+                            const char *name,
+                            int shared,
+                            int first)
+{
+    uint64_t len = (uint64_t)num_targets * BENCH_ATOMIC_STRIDE, total = 0, max_ns = 0;
+    uint64_t *words = check_mr->addr, attempts = 0, expected, actual;
+    uint32_t check_offset = op == BENCH_OP_LOCK ? 1 : 0, i, num_started;
+    pthread_t *threads = NULL;
+    volatile int start = 0;
+    int ret = -1, ok = 1;
+    memset(words, 0, len);
+    ret = rdma_pipelined_ops(targets[0].qp, targets[0].comp_channel, targets[0].cq,
+                             IBV_WR_RDMA_WRITE, check_mr, (uint32_t)len, targets[0].remote, 1, 1,
+                             NULL);
+    if (ret)
+    {
+        return ret;
+    }
+    threads = calloc(num_targets, sizeof(*threads));
+    if (!threads)
+    {
+        return -ENOMEM;
+    }
+    for (i = 0; i < num_targets; i++)
+    {
+        workers[i].op         = op;
+        workers[i].depth      = op == BENCH_OP_LOCK ? 1 : workers[i].t->depth;
+        workers[i].offset     = shared ? 0 : (uint64_t)i * BENCH_ATOMIC_STRIDE;
+        workers[i].start      = &start;
+        workers[i].elapsed_ns = workers[i].attempts = workers[i].successes = 0;
+        workers[i].ret        = 0;
+        if (pthread_create(&threads[i], NULL, atomic_worker_main, &workers[i]))
+        {
+            log_err("Failed to create atomic worker %u ", i);
+            ret = -EAGAIN;
+            break;
+        }
+    }
+    num_started = i;
+    start       = ret ? -1 : 1;
+    for (i = 0; i < num_started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (workers[i].ret)
+        {
+            ret = workers[i].ret;
+        }
+        total += workers[i].successes;
+        attempts += workers[i].attempts;
+        max_ns = workers[i].elapsed_ns > max_ns ? workers[i].elapsed_ns : max_ns;
+    }
+    free(threads);
+    if (ret)
+    {
+        log_err("Atomic benchmark of %s failed, ret = %d ", name, ret);
+        return ret;
+    }
+    ret = rdma_pipelined_ops(targets[0].qp, targets[0].comp_channel, targets[0].cq,
+                             IBV_WR_RDMA_READ, check_mr, (uint32_t)len, targets[0].remote, 1, 1,
+                             NULL);
+    if (ret)
+    {
+        return ret;
+    }
+    for (i = 0; i < num_targets && ok; i++)
+    {
+        /* 共享时所有线程的成功数都累加在第一个字上 */
+        expected = shared ? total : workers[i].successes;
+        actual   = words[workers[i].offset / sizeof(uint64_t) + check_offset];
+        if (actual != expected)
+        {
+            log_err("Atomic %s check failed: word %u is %lu, expected %lu ", name, i, actual,
+                    expected);
+            ok = 0;
+        }
+        if (shared)
+        {
+            break;
+        }
+    }
+
+    switch (cfg->format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("%s,%s,%u,%u,%u,%.3f,%.2f,%s\n", name, shared ? "shared" : "distinct",
+                   num_targets, workers[0].iterations, workers[0].depth,
+                   (double)total / ((double)max_ns / 1e3), 100.0 * total / attempts,
+                   ok ? "ok" : "fail");
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("%s  {\"op\": \"%s\", \"words\": \"%s\", \"threads\": %u, "
+                   "\"iterations\": %u, \"depth\": %u, \"rate_mops\": %.3f, "
+                   "\"success_pct\": %.2f, \"check\": %s}",
+                   first ? "" : ",\n", name, shared ? "shared" : "distinct", num_targets,
+                   workers[0].iterations, workers[0].depth, (double)total / ((double)max_ns / 1e3),
+                   100.0 * total / attempts, ok ? "true" : "false");
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-6s %9s %8u %10u %6u %12.3f %11.2f %6s\n", name,
+                   shared ? "shared" : "distinct", num_targets, workers[0].iterations,
+                   workers[0].depth, (double)total / ((double)max_ns / 1e3),
+                   100.0 * total / attempts, ok ? "ok" : "FAIL");
+            break;
+    }
+    fflush(stdout);
+    return ok ? 0 : -EIO;
+}
+
+int run_atomic_benchmark(struct bench_target *targets, uint32_t num_targets,
+                         struct bench_config *cfg)
+{
+    struct atomic_worker *workers = NULL;
+    struct ibv_mr *check_mr       = NULL;
+    uint64_t len                  = (uint64_t)num_targets * BENCH_ATOMIC_STRIDE;
+    uint32_t ops                  = cfg->ops & BENCH_OP_ATOMIC, i;
+    size_t k;
+    int ret = -1, first = 1;
+    if (!num_targets || len > targets[0].remote->length || len > UINT32_MAX)
+    {
+        log_err("Remote buffer is too small for %u atomic workers ", num_targets);
+        return -EINVAL;
+    }
+    if (!ops)
+    {
+        ops = BENCH_OP_ATOMIC;
+    }
+    workers  = calloc(num_targets, sizeof(*workers));
+    check_mr = rdma_buffer_alloc(targets[0].pd, len, IBV_ACCESS_LOCAL_WRITE);
+    if (!workers || !check_mr)
+    {
+        log_err("Failed to allocate atomic benchmark resources, -ENOMEM ");
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < num_targets; i++)
+    {
+        workers[i].t          = &targets[i];
+        workers[i].iterations = cfg->iterations[0];
+        workers[i].result_mr  = rdma_buffer_alloc(
+            targets[i].pd, targets[i].depth * sizeof(uint64_t), IBV_ACCESS_LOCAL_WRITE);
+        workers[i].compares   = calloc(targets[i].depth, sizeof(uint64_t));
+        if (!workers[i].result_mr || !workers[i].compares)
+        {
+            log_err("Failed to allocate atomic result buffers, -ENOMEM ");
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    print_atomic_header(cfg->format);
+    for (k = 0; k < sizeof(atomic_ops) / sizeof(atomic_ops[0]); k++)
+    {
+        if (!(ops & atomic_ops[k].op))
+        {
+            continue;
+        }
+        /* 先测所有线程争用同一个字, 再测各自独占一个字 */
+        for (int shared = 1; shared >= 0; shared--)
+        {
+            ret = run_atomic_round(targets, num_targets, cfg, workers, check_mr, atomic_ops[k].op,
+                                   atomic_ops[k].name, shared, first);
+            if (ret)
+            {
+                goto out;
+            }
+            first = 0;
+        }
+    }
+    print_footer(cfg->format);
+    ret = 0;
+out:
+    for (i = 0; workers && i < num_targets; i++)
+    {
+        if (workers[i].result_mr)
+        {
+            rdma_buffer_free(workers[i].result_mr);
+        }
+        free(workers[i].compares);
+    }
+    free(workers);
+    if (check_mr)
+    {
+        rdma_buffer_free(check_mr);
+    }
+    return ret;
+}
+
+/* 提交队列基准中一个提交线程的参数与结果 */
+struct submit_worker
+{
+    struct submit_queue *q;
+    struct submit_client client;
+    struct submit_request *reqs; /* window个, 循环使用 */
+    uint32_t window, iterations;
+    enum ibv_wr_opcode opcode;
+    struct ibv_mr *mr;
+    uint32_t size;
+    struct rdma_buffer_attr *remote;
+    volatile int *start; /* 0: 等待, 1: 开始, -1: 放弃 */
+    uint64_t elapsed_ns;
+    int ret;
+};
+
+/* 保持window个请求在途, 请求i复用请求i - window的槽, 同一QP上的完成按投递顺序到达 */
+static int submit_worker_loop(struct submit_worker *w)
+{
+    struct submit_request *req;
+    int ret = -1;
+    for (uint32_t i = 0; i < w->iterations; i++)
+    {
+        req = &w->reqs[i % w->window];
+        if (i >= w->window)
+        {
+            ret = submit_wait(w->q, &w->client, i - w->window + 1);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        bzero(&req->wr, sizeof(req->wr));
+        req->sge[0].addr            = (uint64_t)w->mr->addr;
+        req->sge[0].length          = w->size;
+        req->sge[0].lkey            = w->mr->lkey;
+        req->wr.num_sge             = 1;
+        req->wr.opcode              = w->opcode;
+        req->wr.wr.rdma.remote_addr = w->remote->address;
+        req->wr.wr.rdma.rkey        = w->remote->stag.remote_stag;
+        if (w->opcode != IBV_WR_RDMA_READ && w->size <= get_inline_threshold())
+        {
+            req->wr.send_flags = IBV_SEND_INLINE;
+        }
+        while ((ret = submit_post(w->q, req, &w->client)) == -EAGAIN)
+            ;
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    ret = submit_wait(w->q, &w->client, w->iterations);
+    if (ret)
+    {
+        return ret;
+    }
+    return atomic_load(&w->client.errors) ? -EIO : 0;
+}
+
+static void *submit_worker_main(void *arg)
+{
+    struct submit_worker *w = arg;
+    uint64_t start;
+    while (!*w->start)
+        ;
+    if (*w->start < 0)
+    {
+        return NULL;
+    }
+    start         = now_ns();
+    w->ret        = submit_worker_loop(w);
+    w->elapsed_ns = now_ns() - start;
+    return NULL;
+}
+
+static void print_submit_header(enum bench_format format)
+{
+    switch (format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("op,bytes,threads,iterations,depth,rate_mops,bw_gbps,wrs_per_doorbell\n");
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("[\n");
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-6s %10s %8s %10s %6s %12s %12s %10s\n", "op", "bytes", "threads", "iters",
+                   "depth", "Rate[Mops]", "BW[Gb/s]", "WR/bell");
+            break;
+    }
+}
+
+/* 以num_threads个提交线程经由一个提交队列执行一轮操作, 输出一行结果 */
+static int run_submit_round(struct bench_target *t,
+                            struct bench_config *cfg,
+                            struct submit_worker *workers,
+                            uint32_t num_threads,
+                            size_t op,
+                            uint32_t size,
+                            int first)
+{
+    struct submit_queue q;
+    pthread_t *threads;
+    volatile int start = 0;
+    uint64_t max_ns = 0, total;
+    uint32_t i, num_started;
+    double mops, wrs_per_bell;
+    int ret = -1, qret;
+    threads = calloc(num_threads, sizeof(*threads));
+    if (!threads)
+    {
+        return -ENOMEM;
+    }
+    ret = submit_queue_init(&q, t->qp, t->cq, SUBMIT_DEFAULT_CAPACITY, t->depth);
+    if (ret)
+    {
+        free(threads);
+        return ret;
+    }
+    for (i = 0; i < num_threads; i++)
+    {
+        workers[i].q          = &q;
+        workers[i].iterations = cfg->iterations[0];
+        workers[i].opcode     = bench_ops[op].opcode;
+        workers[i].mr         = bench_ops[op].op == BENCH_OP_READ ? t->dst_mr : t->src_mr;
+        workers[i].size       = size;
+        workers[i].remote     = t->remote;
+        workers[i].start      = &start;
+        workers[i].elapsed_ns = 0;
+        workers[i].ret        = 0;
+        atomic_init(&workers[i].client.completed, 0);
+        atomic_init(&workers[i].client.errors, 0);
+        if (pthread_create(&threads[i], NULL, submit_worker_main, &workers[i]))
+        {
+            log_err("Failed to create submit worker %u ", i);
+            ret = -EAGAIN;
+            break;
+        }
+    }
+    num_started = i;
+    start       = ret ? -1 : 1;
+    for (i = 0; i < num_started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (workers[i].ret)
+        {
+            ret = workers[i].ret;
+        }
+        max_ns = workers[i].elapsed_ns > max_ns ? workers[i].elapsed_ns : max_ns;
+    }
+    free(threads);
+    qret = submit_queue_destroy(&q);
+    ret  = ret ? ret : qret;
+    if (ret)
+    {
+        log_err("Submit benchmark of %s/%u with %u threads failed, ret = %d ", bench_ops[op].name,
+                size, num_threads, ret);
+        return ret;
+    }
+    total        = (uint64_t)num_threads * cfg->iterations[0];
+    mops         = (double)total / ((double)max_ns / 1e3);
+    wrs_per_bell = q.batch.doorbells ? (double)q.posted / q.batch.doorbells : 0;
+    switch (cfg->format)
+    {
+        case BENCH_FORMAT_CSV:
+            printf("%s,%u,%u,%u,%u,%.3f,%.3f,%.2f\n", bench_ops[op].name, size, num_threads,
+                   cfg->iterations[0], t->depth, mops, mops * size * 8 / 1e3, wrs_per_bell);
+            break;
+        case BENCH_FORMAT_JSON:
+            printf("%s  {\"op\": \"%s\", \"bytes\": %u, \"threads\": %u, \"iterations\": %u, "
+                   "\"depth\": %u, \"rate_mops\": %.3f, \"bw_gbps\": %.3f, "
+                   "\"wrs_per_doorbell\": %.2f}",
+                   first ? "" : ",\n", bench_ops[op].name, size, num_threads, cfg->iterations[0],
+                   t->depth, mops, mops * size * 8 / 1e3, wrs_per_bell);
+            break;
+        case BENCH_FORMAT_TEXT:
+        default:
+            printf("%-6s %10u %8u %10u %6u %12.3f %12.3f %10.2f\n", bench_ops[op].name, size,
+                   num_threads, cfg->iterations[0], t->depth, mops, mops * size * 8 / 1e3,
+                   wrs_per_bell);
+            break;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int run_submit_benchmark(struct bench_target *target, struct bench_config *cfg)
+{
+    struct submit_worker *workers = NULL;
+    uint32_t size, threads, i;
+    int ret = -1, first = 1;
+    if (cfg->min_size == 0 || cfg->min_size > cfg->max_size ||
+        cfg->max_size > target->src_mr->length || cfg->max_size > target->remote->length)
+    {
+        log_err("Invalid benchmark size range [%u, %u] ", cfg->min_size, cfg->max_size);
+        return -EINVAL;
+    }
+    workers = calloc(cfg->submit_threads, sizeof(*workers));
+    if (!workers)
+    {
+        return -ENOMEM;
+    }
+    for (i = 0; i < cfg->submit_threads; i++)
+    {
+        /* 每个线程自己的窗口即可填满发送队列, 投递线程按深度限流 */
+        workers[i].window = target->depth;
+        workers[i].reqs   = calloc(target->depth, sizeof(*workers[i].reqs));
+        if (!workers[i].reqs)
+        {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    print_submit_header(cfg->format);
+    for (size_t op = 0; op < sizeof(bench_ops) / sizeof(bench_ops[0]); op++)
+    {
+        if (!(cfg->ops & bench_ops[op].op))
+        {
+            continue;
+        }
+        for (size = cfg->min_size;; size <<= 1)
+        {
+            if (size > cfg->max_size)
+            {
+                size = cfg->max_size;
+            }
+            /* 线程数按1, 2, 4...倍增, 最后一轮为submit_threads */
+            for (threads = 1;; threads <<= 1)
+            {
+                if (threads > cfg->submit_threads)
+                {
+                    threads = cfg->submit_threads;
+                }
+                ret = run_submit_round(target, cfg, workers, threads, op, size, first);
+                if (ret)
+                {
+                    goto out;
+                }
+                first = 0;
+                if (threads == cfg->submit_threads)
+                {
+                    break;
+                }
+            }
+            if (size == cfg->max_size)
+            {
+                break;
+            }
+        }
+    }
+    print_footer(cfg->format);
+    ret = 0;
+out:
+    for (i = 0; i < cfg->submit_threads; i++)
+    {
+        free(workers[i].reqs);
+    }
+    free(workers);
+    return ret;
+}
@@ -3,29 +3,84 @@
 void usage()
 {
     printf("Usage:\n");
-    printf("    client -s string (required) [-a <server-address>] [-p <server-port>] \n");
+    printf("    client -s string | -L <length> (required) [-a <server-address>] [-p <server-port>] \n");
+    printf("           [-m <event|poll|adaptive>] [-u <spin-budget-us>] \n");
+    printf("           [-d <queue-depth>] [-n <iterations>] [-P <mr-pool-arena-size>] \n");
+    printf("           [-c <chunk-size>] [-q <num-qps>] [-N <signal-interval>] \n");
+    printf("           [-b <post-batch-size>] [-T <post-flush-timeout-us>] [-I <inline-bytes>] \n");
+    printf("    client --bench [--bench-ops write,read,send] [--bench-min-size <bytes>] \n");
+    printf("           [--bench-max-size <bytes>] [--bench-iters <n>[,<n>...]] \n");
+    printf("           [--bench-format text|csv|json] [other options above] \n");
+    printf("    client --bench-reg [--bench-reg-min-size <bytes>] [--bench-reg-max-size <bytes>] \n");
+    printf("           [--bench-format text|csv|json] [other options above] \n");
+    printf("    client --bench-odp [--bench-reg-min-size <bytes>] [--bench-reg-max-size <bytes>]\n");
+    printf("           [--bench-format text|csv|json] [other options above] \n");
+    printf("    client --bench-post [--bench-ops ...] [--bench-min-size <bytes>] \n");
+    printf("           [--bench-max-size <bytes>] [--bench-iters <n>] [other options above] \n");
+    printf("    client --bench-atomic [--bench-ops faa,cas,lock] [--bench-iters <n>] \n");
+    printf("           [-q <threads>] [--bench-format text|csv|json] [other options above] \n");
+    printf("    client --bench-submit [--bench-threads <n>] [--bench-ops ...] \n");
+    printf("           [--bench-min-size <bytes>] [--bench-max-size <bytes>] [--bench-iters <n>] \n");
+    printf("           [other options above] \n");
+    printf("    client --ring <num-messages> [--ring-msg-size <bytes>] [other options above] \n");
+    printf("           against a server started with -W, requires -q 1 \n");
+    printf("    client -f <file> [--file-slice <bytes>] [other options above] \n");
+    printf("           against a server started with -o, requires -q 1, resumes interrupted sends\n");
+    printf("    client --kv-put <key>=<value> | --kv-get <key> [...] [other options above] \n");
+    printf("           against a server started with -K, operations run in order \n");
+    printf("    client [--lat-json <file>] per-WR latency histograms, dumped at exit and on \n");
+    printf("           SIGUSR1, requires a build with -DRDMA_LATENCY_TRACE=ON \n");
+    printf("options for both client and server: [-H <heap|thp|2m|1g>] page backing of buffers \n");
+    printf("                                    [-O <off|explicit|implicit>] on-demand paging \n");
+    printf("                                    [-M <interval-ms>] sample port counters \n");
+    printf("                                    [-E <count>[,<period-us>]] CQ moderation \n");
     printf("default IP: 127.0.0.1, default port: %d\n", DEFAULT_PORT);
+    printf("default completion mode: event, default spin budget: %d us\n", DEFAULT_SPIN_BUDGET_US);
+    printf("default CQ moderation: 0 (off), default moderation period: %d us\n",
+           DEFAULT_CQ_MOD_PERIOD_US);
+    printf("default queue depth: %d, default iterations: 1\n", DEFAULT_QUEUE_DEPTH);
+    printf("default chunk size: %d bytes, default QPs: 1 (max %d)\n", DEFAULT_CHUNK_SIZE,
+           MAX_QPS_PER_SESSION);
+    printf("default signal interval: 0, signal every (queue depth / 2) WRs\n");
+    printf("default post batch: %d WRs per doorbell, flush timeout %d us\n",
+           DEFAULT_POST_BATCH_SIZE, DEFAULT_POST_FLUSH_US);
+    printf("default inline threshold: %d bytes, 0 disables inline sends\n",
+           DEFAULT_MAX_INLINE_DATA);
+    printf("default memory pool arena: %lu bytes, 0 disables the pool\n",
+           MR_POOL_DEFAULT_ARENA_SIZE);
+    printf("default file slice: %lu bytes registered and recorded as progress at a time\n",
+           FILE_DEFAULT_SLICE_SIZE);
+    printf("default benchmark: all ops, %d B - %d B, %d iterations, text output\n",
+           BENCH_DEFAULT_MIN_SIZE, BENCH_DEFAULT_MAX_SIZE, BENCH_DEFAULT_ITERATIONS);
+    printf("default submit threads: %d, sharing the first QP\n", BENCH_DEFAULT_SUBMIT_THREADS);
+    printf("default counter sampling: 0 (off), e.g. -M %d\n", PORT_SAMPLER_DEFAULT_INTERVAL_MS);
     exit(1);
 }
 
-static int start_rdma_client(struct sockaddr_in *s_addr)
+static const char *const setup_phase_names[CLIENT_SETUP_NUM_PHASES] = {
+    [CLIENT_SETUP_ADDR]     = "addr",
+    [CLIENT_SETUP_ROUTE]    = "route",
+    [CLIENT_SETUP_PD]       = "pd",
+    [CLIENT_SETUP_CQ]       = "cq",
+    [CLIENT_SETUP_QP]       = "qp",
+    [CLIENT_SETUP_CONNECT]  = "connect",
+    [CLIENT_SETUP_METADATA] = "metadata",
+};
+
+/* 为一个QP创建cm_id并解析地址与路由, 然后在共用的PD上创建CQ与QP */
+static int setup_qp_ctx(struct client_qp_ctx *ctx, struct sockaddr_in *s_addr)
 {
     struct rdma_cm_event *cm_event = NULL;
-    int ret                        = -1;
-    cm_channel                     = rdma_create_event_channel();
-    if (!cm_channel)
-    {
-        log_err("Creating cm event channel failed with errno: %d ", -errno);
-        return -errno;
-    }
-    debug("RDMA CM event channel is created at %p ", cm_channel);
-    ret = rdma_create_id(cm_channel, &cm_client_id, NULL, RDMA_PS_TCP);
+    struct ibv_qp_init_attr qp_init_attr;
+    int ret = -1;
+    setup_timer_start(&ctx->setup);
+    ret = rdma_create_id(cm_channel, &ctx->cm_id, ctx, RDMA_PS_TCP);
     if (ret)
     {
         log_err("Creating cm id failed with errno: %d ", -errno);
         return -errno;
     }
-    ret = rdma_resolve_addr(cm_client_id, NULL, (struct sockaddr *)s_addr, 2000);
+    ret = rdma_resolve_addr(ctx->cm_id, NULL, (struct sockaddr *)s_addr, 2000);
     if (ret)
     {
         log_err("Failed to resolve addr, errno: %d ", -errno);
@@ -45,8 +100,9 @@ static int start_rdma_client(struct sockaddr_in *s_addr)
         return -errno;
     }
     debug("RDMA address is resolved ");
+    setup_timer_mark(&ctx->setup, CLIENT_SETUP_ADDR);
 
-    ret = rdma_resolve_route(cm_client_id, 2000);
+    ret = rdma_resolve_route(ctx->cm_id, 2000);
     if (ret)
     {
         log_err("Failed to resolve route, errno: %d ", -errno);
@@ -65,75 +121,156 @@ static int start_rdma_client(struct sockaddr_in *s_addr)
         log_err("Failed to acknowledge the cm event, errno: %d ", -errno);
         return -errno;
     }
-    log_info("Trying to connect to server at %s:%d ", inet_ntoa(s_addr->sin_addr),
-             ntohs(s_addr->sin_port));
-    pd = ibv_alloc_pd(cm_client_id->verbs);
+    setup_timer_mark(&ctx->setup, CLIENT_SETUP_ROUTE);
     if (!pd)
     {
-        log_err("Failed to alloc pd, errno: %d ", -errno);
-        return -errno;
+        /* 第一个QP决定设备, 按设备能力调整参数并创建共用的PD与内存池 */
+        ret = fit_queue_depth(ctx->cm_id->verbs, &queue_depth, &max_rd_atomic);
+        if (ret)
+        {
+            return ret;
+        }
+        ret = fit_chunk_size(ctx->cm_id->verbs, ctx->cm_id->port_num, &chunk_size);
+        if (ret)
+        {
+            return ret;
+        }
+        pd = ibv_alloc_pd(ctx->cm_id->verbs);
+        if (!pd)
+        {
+            log_err("Failed to alloc pd, errno: %d ", -errno);
+            return -errno;
+        }
+        debug("PD allocated at %p ", pd);
+        if (mr_pool_arena_size)
+        {
+            ret = mr_pool_create(pd, mr_pool_arena_size);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        if (odp_mode != MR_ODP_OFF)
+        {
+            ret = mr_odp_enable(pd, odp_mode);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
     }
-    debug("PD allocated at %p ", pd);
-    io_completion_channel = ibv_create_comp_channel(cm_client_id->verbs);
-    if (!io_completion_channel)
+    else if (pd->context != ctx->cm_id->verbs)
+    {
+        log_err("QP %u resolved to a different device than QP 0 ", ctx->index);
+        return -EINVAL;
+    }
+    setup_timer_mark(&ctx->setup, CLIENT_SETUP_PD);
+    ctx->io_completion_channel = ibv_create_comp_channel(ctx->cm_id->verbs);
+    if (!ctx->io_completion_channel)
     {
         log_err("Failed to create IO completion event channel, errno: %d ", -errno);
         return -errno;
     }
-    debug("Completion event channel created at %p ", io_completion_channel);
+    debug("Completion event channel created at %p ", ctx->io_completion_channel);
 
-    client_cq = ibv_create_cq(cm_client_id->verbs, CQ_CAPACITY, NULL, io_completion_channel, 0);
-    if (!client_cq)
+    ctx->cq = ibv_create_cq(ctx->cm_id->verbs, CQ_CAPACITY(queue_depth), NULL,
+                            ctx->io_completion_channel, 0);
+    if (!ctx->cq)
     {
         log_err("Failed to create CQ, errno: %d ", -errno);
         return -errno;
     }
-    debug("CQ created at %p with %d entries ", client_cq, client_cq->cqe);
-    ret = ibv_req_notify_cq(client_cq, 0);
+    moderate_cq(ctx->cq);
+    debug("CQ created at %p with %d entries ", ctx->cq, ctx->cq->cqe);
+    ret = arm_cq_notification(ctx->cq);
     if (ret)
     {
-        log_err("Failed to request notifications on CQ, errno: %d ", -errno);
-        return -errno;
+        return ret;
     }
+    setup_timer_mark(&ctx->setup, CLIENT_SETUP_CQ);
     bzero(&qp_init_attr, sizeof(qp_init_attr));
     qp_init_attr.qp_type          = IBV_QPT_RC;
-    qp_init_attr.cap.max_send_wr  = MAX_WR;
-    qp_init_attr.cap.max_recv_wr  = MAX_WR;
+    qp_init_attr.cap.max_send_wr  = queue_depth;
+    qp_init_attr.cap.max_recv_wr  = queue_depth;
     qp_init_attr.cap.max_send_sge = MAX_SGE;
     qp_init_attr.cap.max_recv_sge = MAX_SGE;
-    qp_init_attr.send_cq          = client_cq;
-    qp_init_attr.recv_cq          = client_cq;
+    qp_init_attr.send_cq          = ctx->cq;
+    qp_init_attr.recv_cq          = ctx->cq;
 
-    ret = rdma_create_qp(cm_client_id, pd, &qp_init_attr);
+    ret = rdma_create_qp_inline(ctx->cm_id, pd, &qp_init_attr);
     if (ret)
     {
-        log_err("Failed to create QP, errno: %d ", -errno);
-        return -errno;
+        return ret;
     }
+    ctx->qp = ctx->cm_id->qp;
+    debug("QP %u created at %p ", ctx->index, ctx->qp);
+    setup_timer_mark(&ctx->setup, CLIENT_SETUP_QP);
+    return 0;
+}
 
-    client_qp = cm_client_id->qp;
-    debug("QP created at %p ", client_qp);
+static int start_rdma_client(struct sockaddr_in *s_addr)
+{
+    int ret    = -1;
+    cm_channel = rdma_create_event_channel();
+    if (!cm_channel)
+    {
+        log_err("Creating cm event channel failed with errno: %d ", -errno);
+        return -errno;
+    }
+    debug("RDMA CM event channel is created at %p ", cm_channel);
+    log_info("Trying to connect to server at %s:%d with %u QPs ", inet_ntoa(s_addr->sin_addr),
+             ntohs(s_addr->sin_port), num_qps);
+    qp_ctxs = calloc(num_qps, sizeof(*qp_ctxs));
+    if (!qp_ctxs)
+    {
+        log_err("Failed to allocate QP contexts, -ENOMEM ");
+        return -ENOMEM;
+    }
+    /* 同一会话的QP在服务端共享缓冲区, 会话标识只需在服务端的存活会话中唯一 */
+    session_id = now_ns() ^ ((uint64_t)getpid() << 32);
+    for (uint32_t i = 0; i < num_qps; i++)
+    {
+        qp_ctxs[i].index = (uint16_t)i;
+        ret              = setup_qp_ctx(&qp_ctxs[i], s_addr);
+        if (ret)
+        {
+            return ret;
+        }
+    }
     return 0;
 }
 
-static int pre_post_recv()
+static int pre_post_recv(struct client_qp_ctx *ctx)
 {
-    int ret            = -1;
-    server_metadata_mr = rdma_buffer_register(
-        pd, &server_metadata_attr, sizeof(server_metadata_attr), (IBV_ACCESS_LOCAL_WRITE));
+    int ret = -1;
+    /* 之后的QP在本QP连接之前创建, 其耗时不计入本QP */
+    setup_timer_skip(&ctx->setup);
+    /* 文件模式下服务端的元数据还带有进度字与继续的偏移 */
+    if (file_path)
+    {
+        ctx->server_metadata_mr =
+            rdma_buffer_register(pd, &file_response, sizeof(file_response),
+                                 (IBV_ACCESS_LOCAL_WRITE));
+    }
+    else
+    {
+        ctx->server_metadata_mr = rdma_buffer_register(pd, &ctx->server_metadata_attr,
+                                                       sizeof(ctx->server_metadata_attr),
+                                                       (IBV_ACCESS_LOCAL_WRITE));
+    }
 
-    if (!server_metadata_mr)
+    if (!ctx->server_metadata_mr)
     {
         log_err("Failed to register server metadata buffer, -ENOMEM ");
         return -ENOMEM;
     }
-    server_recv_sge.addr   = (uint64_t)server_metadata_mr->addr;
-    server_recv_sge.length = (uint32_t)server_metadata_mr->length;
-    server_recv_sge.lkey   = (uint32_t)server_metadata_mr->lkey;
-    bzero(&server_recv_wr, sizeof(server_recv_wr));
-    server_recv_wr.sg_list = &server_recv_sge;
-    server_recv_wr.num_sge = 1;
-    ret                    = ibv_post_recv(client_qp, &server_recv_wr, &bad_server_recv_wr);
+    ctx->server_recv_sge.addr   = (uint64_t)ctx->server_metadata_mr->addr;
+    ctx->server_recv_sge.length = (uint32_t)ctx->server_metadata_mr->length;
+    ctx->server_recv_sge.lkey   = (uint32_t)ctx->server_metadata_mr->lkey;
+    bzero(&ctx->server_recv_wr, sizeof(ctx->server_recv_wr));
+    ctx->server_recv_wr.sg_list = &ctx->server_recv_sge;
+    ctx->server_recv_wr.num_sge = 1;
+    ret = ibv_post_recv(ctx->qp, &ctx->server_recv_wr, &ctx->bad_server_recv_wr);
     if (ret)
     {
         log_err("Failed to pre-post recv buffer, errno: %d ", ret);
@@ -143,16 +280,33 @@ static int pre_post_recv()
     return 0;
 }
 
-static int connect_to_server()
+static int connect_to_server(struct client_qp_ctx *ctx)
 {
     struct rdma_conn_param conn_param;
+    struct rdma_session_hello hello;
+    struct rdma_server_hello server_hello;
     struct rdma_cm_event *cm_event = NULL;
     int ret                        = -1;
     bzero(&conn_param, sizeof(conn_param));
-    conn_param.initiator_depth     = 3;
-    conn_param.retry_count         = 3;
-    conn_param.responder_resources = 3;
-    ret                            = rdma_connect(cm_client_id, &conn_param);
+    /* 在途RDMA READ数受initiator_depth限制, 尽量与队列深度匹配 */
+    conn_param.initiator_depth     = queue_depth < max_rd_atomic ? queue_depth : max_rd_atomic;
+    conn_param.retry_count         = RDMA_RETRY_COUNT;
+    /* 作用于服务端的QP: 本端的接收 (如KV响应) 未及时投递时无限重试, 而不是报错 */
+    conn_param.rnr_retry_count     = RDMA_RNR_RETRY_COUNT;
+    conn_param.responder_resources = conn_param.initiator_depth;
+    /* 服务端据此把同一会话的QP归到一起, 并把SEND的信用写回信用字 */
+    bzero(&hello, sizeof(hello));
+    hello.session_id = session_id;
+    hello.qp_index   = ctx->index;
+    hello.num_qps    = (uint16_t)num_qps;
+    ret              = send_credits_init(&ctx->credits, pd, &hello.credit);
+    if (ret)
+    {
+        return ret;
+    }
+    conn_param.private_data     = &hello;
+    conn_param.private_data_len = sizeof(hello);
+    ret                         = rdma_connect(ctx->cm_id, &conn_param);
     if (ret)
     {
         log_err("Failed to connect to remote host, errno: %d ", -errno);
@@ -165,141 +319,387 @@ static int connect_to_server()
         log_err("Failed to get cm event, ret: %d ", ret);
         return ret;
     }
+    /* private_data在确认事件后失效, 先拷贝; 旧服务端不携带时不做流控 */
+    bzero(&server_hello, sizeof(server_hello));
+    if (cm_event->param.conn.private_data &&
+        cm_event->param.conn.private_data_len >= sizeof(server_hello))
+    {
+        memcpy(&server_hello, cm_event->param.conn.private_data, sizeof(server_hello));
+    }
     ret = rdma_ack_cm_event(cm_event);
     if (ret)
     {
         log_err("Failed to acknowledge the cm event, errno: %d ", -errno);
         return -errno;
     }
-    log_info("Connection established ");
+    send_credits_start(&ctx->credits, server_hello.recv_credits);
+    log_info("Connection of QP %u established, %u send credits ", ctx->index,
+             server_hello.recv_credits);
+    setup_timer_mark(&ctx->setup, CLIENT_SETUP_CONNECT);
     return 0;
 }
 
-static int exchange_metadata()
+static int exchange_metadata(struct client_qp_ctx *ctx)
 {
     struct ibv_wc wc[2];
-    int ret       = -1;
-    client_src_mr = rdma_buffer_register(
-        pd, src, strlen(src),
-        (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE));
-
+    char label[32];
+    void *payload        = &ctx->client_metadata_attr;
+    uint32_t payload_len = sizeof(ctx->client_metadata_attr);
+    int ret              = -1;
+    /* 所有QP共用同一个源缓冲区的注册 */
     if (!client_src_mr)
     {
-        log_err("Failed to register client src buffer, -ENOMEM ");
-        return -ENOMEM;
+        client_src_mr = rdma_buffer_register(
+            pd, src, buffer_length,
+            (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE));
+        if (!client_src_mr)
+        {
+            log_err("Failed to register client src buffer, -ENOMEM ");
+            return -ENOMEM;
+        }
     }
-    client_metadata_attr.address         = (uint64_t)client_src_mr->addr;
-    client_metadata_attr.length          = (uint32_t)client_src_mr->length;
-    client_metadata_attr.stag.local_stag = client_src_mr->lkey;
-    client_metadata_mr                   = rdma_buffer_register(
-                          pd, &client_metadata_attr, sizeof(client_metadata_attr), (IBV_ACCESS_LOCAL_WRITE));
-    if (!client_metadata_mr)
+    ctx->client_metadata_attr.address          = (uint64_t)client_src_mr->addr;
+    ctx->client_metadata_attr.length           = client_src_mr->length;
+    ctx->client_metadata_attr.stag.remote_stag = client_src_mr->rkey;
+    if (ring_messages)
     {
-        log_err("Failed to register client metadata buffer, ret = %d ", ret);
-        return ret;
+        /* 环形通道模式下告诉服务端信用字的位置, 服务端以RDMA WRITE写回已消费的字节数 */
+        ret = ring_sender_init(&ring_sender, pd, ctx->qp, ctx->io_completion_channel, ctx->cq,
+                               queue_depth);
+        if (ret)
+        {
+            return ret;
+        }
+        ctx->client_metadata_attr.address          = (uint64_t)ring_sender.credit_mr->addr;
+        ctx->client_metadata_attr.length           = ring_sender.credit_mr->length;
+        ctx->client_metadata_attr.stag.remote_stag = ring_sender.credit_mr->rkey;
+    }
+    if (file_path)
+    {
+        /* 文件模式下服务端按文件名与大小映射目标文件 */
+        memcpy(&file_request.attr, &ctx->client_metadata_attr, sizeof(file_request.attr));
+        payload     = &file_request;
+        payload_len = sizeof(file_request);
+    }
+    bzero(&ctx->client_send_wr, sizeof(ctx->client_send_wr));
+    ctx->client_send_wr.sg_list    = &ctx->client_send_sge;
+    ctx->client_send_wr.num_sge    = 1;
+    ctx->client_send_wr.opcode     = IBV_WR_SEND;
+    ctx->client_send_wr.send_flags = IBV_SEND_SIGNALED;
+    ctx->client_send_sge.addr      = (uint64_t)payload;
+    ctx->client_send_sge.length    = payload_len;
+    if (payload_len <= get_inline_threshold())
+    {
+        /* 内联发送时负载在投递时就拷贝进WQE, 不需要注册 */
+        ctx->client_send_wr.send_flags |= IBV_SEND_INLINE;
+    }
+    else
+    {
+        ctx->client_metadata_mr =
+            rdma_buffer_register(pd, payload, payload_len, (IBV_ACCESS_LOCAL_WRITE));
+        if (!ctx->client_metadata_mr)
+        {
+            log_err("Failed to register client metadata buffer, -ENOMEM ");
+            return -ENOMEM;
+        }
+        ctx->client_send_sge.lkey = ctx->client_metadata_mr->lkey;
     }
 
-    client_send_sge.addr   = (uint64_t)client_metadata_mr->addr;
-    client_send_sge.length = (uint32_t)client_metadata_mr->length;
-    client_send_sge.lkey   = client_metadata_mr->lkey;
-    bzero(&client_send_wr, sizeof(client_send_wr));
-    client_send_wr.sg_list    = &client_send_sge;
-    client_send_wr.num_sge    = 1;
-    client_send_wr.opcode     = IBV_WR_SEND;
-    client_send_wr.send_flags = IBV_SEND_SIGNALED;
-
-    ret = ibv_post_send(client_qp, &client_send_wr, &bad_client_send_wr);
+    ret = ibv_post_send(ctx->qp, &ctx->client_send_wr, &ctx->bad_client_send_wr);
     if (ret)
     {
         log_err("Failed to post send, errno: %d ", -errno);
         return -errno;
     }
 
-    ret = process_work_completion_events(io_completion_channel, wc, 2);
+    ret = process_work_completion_events(ctx->io_completion_channel, ctx->cq, wc, 2);
     if (ret != 2)
     {
         log_err("Failed to get 2 work completions, ret = %d ", ret);
         return ret;
     }
     debug("Server sent us buffer location and credentials ");
-    print_rdma_buffer_attr(&server_metadata_attr);
+    setup_timer_mark(&ctx->setup, CLIENT_SETUP_METADATA);
+    snprintf(label, sizeof(label), "QP %u setup", ctx->index);
+    setup_timer_log(&ctx->setup, setup_phase_names, CLIENT_SETUP_NUM_PHASES, label);
+    if (file_path)
+    {
+        memcpy(&ctx->server_metadata_attr, &file_response.attr, sizeof(ctx->server_metadata_attr));
+    }
+    if (ctx->index == 0)
+    {
+        print_rdma_buffer_attr(&ctx->server_metadata_attr);
+    }
     return 0;
 }
 
+static void report_throughput(const char *op, uint64_t elapsed_ns, uint64_t bytes)
+{
+    uint64_t ops = (buffer_length + chunk_size - 1) / chunk_size * num_iterations;
+    double secs  = (double)elapsed_ns / 1e9;
+    log_info("%s: %u passes over %u QPs, %lu ops of <= %u bytes, %lu bytes in %.3f us, "
+             "%.3f Gbit/s, %.3f Mops/s ",
+             op, num_iterations, num_qps, ops, chunk_size, bytes, (double)elapsed_ns / 1e3,
+             secs > 0 ? (double)bytes * 8 / secs / 1e9 : 0.0,
+             secs > 0 ? (double)ops / secs / 1e6 : 0.0);
+}
+
+/* 每个QP的线程在自己的CQ上传输自己的条带 */
+static void *stripe_worker(void *arg)
+{
+    struct client_qp_ctx *ctx = arg;
+    struct ibv_mr local       = *ctx->local_mr;
+    struct rdma_buffer_attr remote;
+    /* 本地MR与远端缓冲区都截取为本条带的视图, lkey/rkey不变 */
+    local.addr     = (char *)local.addr + ctx->stripe_offset;
+    local.length   = ctx->stripe_length;
+    remote         = ctx->server_metadata_attr;
+    remote.address = remote.address + ctx->stripe_offset;
+    remote.length  = ctx->stripe_length;
+    ctx->ret = rdma_chunked_transfer(ctx->qp, ctx->io_completion_channel, ctx->cq, ctx->opcode,
+                                     &local, &remote, ctx->stripe_length, chunk_size,
+                                     num_iterations, queue_depth, NULL);
+    return NULL;
+}
+
+/*
+ * 把缓冲区按分块大小对齐切成num_qps个连续的条带, 每个QP一个线程并行传输。
+ * 缓冲区不足以切分时, 靠后的QP没有条带。
+ */
+static int striped_transfer(enum ibv_wr_opcode opcode, struct ibv_mr *local_mr)
+{
+    uint64_t stripe = (buffer_length + num_qps - 1) / num_qps;
+    uint64_t offset = 0;
+    uint32_t i, started = 0;
+    int ret = 0;
+    stripe  = (stripe + chunk_size - 1) / chunk_size * chunk_size;
+    for (i = 0; i < num_qps && offset < buffer_length; i++)
+    {
+        struct client_qp_ctx *ctx = &qp_ctxs[i];
+        ctx->opcode               = opcode;
+        ctx->local_mr             = local_mr;
+        ctx->stripe_offset        = offset;
+        ctx->stripe_length        = buffer_length - offset < stripe ? buffer_length - offset : stripe;
+        ctx->ret                  = 0;
+        offset += ctx->stripe_length;
+        ret = pthread_create(&ctx->thread, NULL, stripe_worker, ctx);
+        if (ret)
+        {
+            log_err("Failed to create worker thread for QP %u, errno: %d ", i, -ret);
+            ret = -ret;
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(qp_ctxs[i].thread, NULL);
+        if (qp_ctxs[i].ret && !ret)
+        {
+            log_err("Transfer on QP %u failed, ret = %d ", i, qp_ctxs[i].ret);
+            ret = qp_ctxs[i].ret;
+        }
+    }
+    return ret;
+}
+
 static int remote_memory_ops()
 {
-    struct ibv_wc wc;
+    uint64_t start, bytes;
     int ret       = -1;
     client_dst_mr = rdma_buffer_register(
-        pd, dst, strlen(dst),
+        pd, dst, buffer_length,
         (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE));
     if (!client_dst_mr)
     {
         log_err("Failed to register client dst buffer, -ENOMEM ");
         return -ENOMEM;
     }
-    client_send_sge.addr   = (uint64_t)client_src_mr->addr;
-    client_send_sge.length = (uint32_t)client_src_mr->length;
-    client_send_sge.lkey   = client_src_mr->lkey;
-    bzero(&client_send_wr, sizeof(client_send_wr));
-    client_send_wr.sg_list             = &client_send_sge;
-    client_send_wr.num_sge             = 1;
-    client_send_wr.opcode              = IBV_WR_RDMA_WRITE;
-    client_send_wr.send_flags          = IBV_SEND_SIGNALED;
-    client_send_wr.wr.rdma.rkey        = server_metadata_attr.stag.remote_stag;
-    client_send_wr.wr.rdma.remote_addr = server_metadata_attr.address;
-
-    ret = ibv_post_send(client_qp, &client_send_wr, &bad_client_send_wr);
+    bytes = buffer_length * num_iterations;
+
+    start = now_ns();
+    ret   = striped_transfer(IBV_WR_RDMA_WRITE, client_src_mr);
     if (ret)
     {
-        log_err("Failed to post send, errno: %d ", -errno);
-        return -errno;
+        log_err("Failed to perform striped WRITE, ret = %d ", ret);
+        return ret;
     }
+    report_throughput("WRITE", now_ns() - start, bytes);
+    debug("Client side WRITE is completed ");
 
-    ret = process_work_completion_events(io_completion_channel, &wc, 1);
-
-    if (ret != 1)
+    start = now_ns();
+    ret   = striped_transfer(IBV_WR_RDMA_READ, client_dst_mr);
+    if (ret)
     {
-        log_err("Failed to get 1 work completions, ret = %d ", ret);
+        log_err("Failed to perform striped READ, ret = %d ", ret);
         return ret;
     }
+    report_throughput("READ", now_ns() - start, bytes);
+    debug("Client side READ is completed ");
+    return 0;
+}
 
-    debug("Client side WRITE is completed ");
-    client_send_sge.addr   = (uint64_t)client_dst_mr->addr;
-    client_send_sge.length = (uint32_t)client_dst_mr->length;
-    client_send_sge.lkey   = client_dst_mr->lkey;
-    bzero(&client_send_wr, sizeof(client_send_wr));
-    client_send_wr.sg_list             = &client_send_sge;
-    client_send_wr.num_sge             = 1;
-    client_send_wr.opcode              = IBV_WR_RDMA_READ;
-    client_send_wr.send_flags          = IBV_SEND_SIGNALED;
-    client_send_wr.wr.rdma.rkey        = server_metadata_attr.stag.remote_stag;
-    client_send_wr.wr.rdma.remote_addr = server_metadata_attr.address;
-    ret = ibv_post_send(client_qp, &client_send_wr, &bad_client_send_wr);
-    if (ret)
+static int run_client_benchmark()
+{
+    struct bench_target target, *targets;
+    int ret;
+    client_dst_mr = rdma_buffer_register(
+        pd, dst, buffer_length,
+        (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE));
+    if (!client_dst_mr)
     {
-        log_err("Failed to post send, errno: %d ", -errno);
-        return -errno;
+        log_err("Failed to register client dst buffer, -ENOMEM ");
+        return -ENOMEM;
+    }
+    /* 基准测试只在第一个QP上运行 */
+    bzero(&target, sizeof(target));
+    target.qp           = qp_ctxs[0].qp;
+    target.comp_channel = qp_ctxs[0].io_completion_channel;
+    target.cq           = qp_ctxs[0].cq;
+    target.src_mr       = client_src_mr;
+    target.dst_mr       = client_dst_mr;
+    target.remote       = &qp_ctxs[0].server_metadata_attr;
+    target.depth        = queue_depth;
+    target.pd           = pd;
+    target.credits      = &qp_ctxs[0].credits;
+    switch (bench_mode)
+    {
+        case BENCH_MODE_REG:
+            return run_reg_benchmark(&target, &bench_cfg);
+        case BENCH_MODE_ODP:
+            return run_odp_benchmark(&target, &bench_cfg);
+        case BENCH_MODE_POST:
+            return run_post_benchmark(&target, &bench_cfg);
+        case BENCH_MODE_SUBMIT:
+            return run_submit_benchmark(&target, &bench_cfg);
+        case BENCH_MODE_ATOMIC:
+            /* 原子基准在每个QP上各运行一个线程, 模拟多个客户端争用 */
+            targets = calloc(num_qps, sizeof(*targets));
+            if (!targets)
+            {
+                return -ENOMEM;
+            }
+            for (uint32_t i = 0; i < num_qps; i++)
+            {
+                targets[i]              = target;
+                targets[i].qp           = qp_ctxs[i].qp;
+                targets[i].comp_channel = qp_ctxs[i].io_completion_channel;
+                targets[i].cq           = qp_ctxs[i].cq;
+                targets[i].remote       = &qp_ctxs[i].server_metadata_attr;
+                targets[i].credits      = &qp_ctxs[i].credits;
+            }
+            ret = run_atomic_benchmark(targets, num_qps, &bench_cfg);
+            free(targets);
+            return ret;
+        default:
+            return run_benchmark(&target, &bench_cfg);
     }
+}
 
-    ret = process_work_completion_events(io_completion_channel, &wc, 1);
-    if (ret != 1)
+/* 以WRITE_WITH_IMM向服务端的环发送ring_messages条消息, 每条以序号开头 */
+static int run_ring_messages()
+{
+    uint64_t start, elapsed, seq;
+    int ret = ring_sender_set_ring(&ring_sender, &qp_ctxs[0].server_metadata_attr);
+    if (ret)
     {
-        log_err("Failed to get 1 work completions, ret = %d ", ret);
         return ret;
     }
-    debug("Client side READ is completed ");
+    start = now_ns();
+    for (seq = 0; seq < ring_messages; seq++)
+    {
+        if (ring_msg_size >= sizeof(seq))
+        {
+            memcpy(src, &seq, sizeof(seq));
+        }
+        ret = ring_send(&ring_sender, src, ring_msg_size);
+        if (ret)
+        {
+            log_err("Failed to send ring message %lu, ret = %d ", seq, ret);
+            return ret;
+        }
+    }
+    ret = ring_sender_flush(&ring_sender);
+    if (ret)
+    {
+        return ret;
+    }
+    elapsed = now_ns() - start;
+    log_info("Ring: %lu messages of %u bytes in %.3f ms, %.3f Mmsg/s, %.3f Gb/s ", ring_messages,
+             ring_msg_size, elapsed / 1e6, (double)ring_messages / (elapsed / 1e3),
+             (double)ring_messages * ring_msg_size * 8 / elapsed);
     return 0;
 }
 
-static int disconnect_and_cleanup()
+/* 把映射的文件从服务端记录的进度开始推送到服务端的目标文件 */
+static int run_file_stream()
+{
+    return file_stream_push(qp_ctxs[0].qp, qp_ctxs[0].io_completion_channel, qp_ctxs[0].cq, pd,
+                            &file_src, &file_response, file_slice_size, chunk_size, queue_depth);
+}
+
+/* 在第一个QP上按顺序执行KV操作, GET只使用RDMA READ, PUT由服务端执行 */
+static int run_kv_ops()
+{
+    struct kv_client kv;
+    char value[KV_MAX_MSG_SIZE + 1];
+    const char *arg, *sep;
+    uint32_t value_len;
+    uint64_t start;
+    int ret = -1;
+    ret     = kv_client_open(&kv, pd, qp_ctxs[0].qp, qp_ctxs[0].io_completion_channel,
+                             qp_ctxs[0].cq, &qp_ctxs[0].server_metadata_attr);
+    if (ret)
+    {
+        log_err("Failed to open the KV table, ret = %d ", ret);
+        goto out;
+    }
+    for (int i = 0; i < num_kv_ops; i++)
+    {
+        arg   = kv_ops[i].arg;
+        start = now_ns();
+        if (kv_ops[i].put)
+        {
+            sep = strchr(arg, '=');
+            ret = kv_put(&kv, arg, (uint16_t)(sep - arg), sep + 1, strlen(sep + 1));
+            if (ret)
+            {
+                goto out;
+            }
+            log_info("PUT %.*s in %.2f us ", (int)(sep - arg), arg, (now_ns() - start) / 1e3);
+            continue;
+        }
+        ret = kv_get(&kv, arg, (uint16_t)strlen(arg), value, KV_MAX_MSG_SIZE, &value_len);
+        if (ret == -ENOENT)
+        {
+            log_info("GET %s: not found, %.2f us ", arg, (now_ns() - start) / 1e3);
+            continue;
+        }
+        if (ret)
+        {
+            goto out;
+        }
+        value[value_len] = '\0';
+        log_info("GET %s = %s in %.2f us ", arg, value, (now_ns() - start) / 1e3);
+    }
+    ret = 0;
+out:
+    kv_client_close(&kv);
+    return ret;
+}
+
+static void cleanup_qp_ctx(struct client_qp_ctx *ctx)
 {
     struct rdma_cm_event *cm_event = NULL;
     int ret                        = -1;
-    ret                            = rdma_disconnect(cm_client_id);
+    if (!ctx->cm_id)
+    {
+        return;
+    }
+    ret = rdma_disconnect(ctx->cm_id);
     if (ret)
     {
-        log_err("Failed to disconnect, errno: %d ", -errno);
+        log_err("Failed to disconnect QP %u, errno: %d ", ctx->index, -errno);
     }
 
     ret = process_rdma_cm_event(cm_channel, RDMA_CM_EVENT_DISCONNECTED, &cm_event);
@@ -307,39 +707,81 @@ static int disconnect_and_cleanup()
     {
         log_err("Failed to get disconnect event, ret = %d ", ret);
     }
-
-    ret = rdma_ack_cm_event(cm_event);
-    if (ret)
+    else
     {
-        log_err("Failed to acknowledge cm event, errno: %d ", -errno);
+        ret = rdma_ack_cm_event(cm_event);
+        if (ret)
+        {
+            log_err("Failed to acknowledge cm event, errno: %d ", -errno);
+        }
     }
 
-    rdma_destroy_qp(cm_client_id);
+    if (ctx->qp)
+    {
+        rdma_destroy_qp(ctx->cm_id);
+    }
+    send_credits_destroy(&ctx->credits);
 
-    ret = rdma_destroy_id(cm_client_id);
+    ret = rdma_destroy_id(ctx->cm_id);
     if (ret)
     {
         log_err("Failed to destroy cm id, errno: %d ", -errno);
     }
 
-    ret = ibv_destroy_cq(client_cq);
-    if (ret)
+    if (ctx->cq)
     {
-        log_err("Failed to destroy client cq, errno: %d ", -errno);
+        /* 工作线程退出时已确认各自的事件, 这里确认主线程累计的 */
+        flush_thread_cq_events();
+        ret = ibv_destroy_cq(ctx->cq);
+        if (ret)
+        {
+            log_err("Failed to destroy client cq, errno: %d ", -errno);
+        }
     }
 
-    ret = ibv_destroy_comp_channel(io_completion_channel);
-    if (ret)
+    if (ctx->io_completion_channel)
+    {
+        ret = ibv_destroy_comp_channel(ctx->io_completion_channel);
+        if (ret)
+        {
+            log_err("Failed to destroy client completion channel, errno: %d ", -errno);
+        }
+    }
+
+    if (ctx->server_metadata_mr)
+    {
+        rdma_buffer_deregister(ctx->server_metadata_mr);
+    }
+    if (ctx->client_metadata_mr)
     {
-        log_err("Failed to destroy client completion channel, errno: %d ", -errno);
+        rdma_buffer_deregister(ctx->client_metadata_mr);
     }
+}
+
+static int disconnect_and_cleanup()
+{
+    int ret = -1;
+    port_sampler_stop(port_sampler);
+    port_sampler = NULL;
+    for (uint32_t i = 0; i < num_qps; i++)
+    {
+        cleanup_qp_ctx(&qp_ctxs[i]);
+    }
+    /* qp_ctxs中的元数据曾被注册, 释放前使注册缓存中对应的区间失效 */
+    mr_cache_invalidate(qp_ctxs, num_qps * sizeof(*qp_ctxs));
+    free(qp_ctxs);
+    qp_ctxs = NULL;
 
     rdma_buffer_deregister(client_src_mr);
     rdma_buffer_deregister(client_dst_mr);
-    rdma_buffer_deregister(server_metadata_mr);
-    rdma_buffer_deregister(client_metadata_mr);
-    free(src);
-    free(dst);
+    mr_cache_invalidate(src, buffer_length);
+    mr_cache_invalidate(dst, buffer_length);
+    ring_sender_destroy(&ring_sender);
+    mapped_file_close(&file_src, 0);
+    host_buffer_free(&src_buf);
+    host_buffer_free(&dst_buf);
+    mr_odp_disable(pd);
+    mr_pool_destroy(pd);
 
     ret = ibv_dealloc_pd(pd);
     if (ret)
@@ -353,37 +795,91 @@ static int disconnect_and_cleanup()
 
 static int check_src_dst()
 {
-    return memcmp((void *)src, (void *)dst, strlen(src));
+    return memcmp((void *)src, (void *)dst, buffer_length);
+}
+
+/* 分配长度为len的源缓冲区与目标缓冲区 */
+static int alloc_src_dst(uint64_t len)
+{
+    if (host_buffer_alloc(&src_buf, len, get_buffer_backing()))
+    {
+        log_err("Failed to allocate src memory : -ENOMEM");
+        return -ENOMEM;
+    }
+    if (host_buffer_alloc(&dst_buf, len, get_buffer_backing()))
+    {
+        log_err("Failed to allocate dst memory : -ENOMEM");
+        host_buffer_free(&src_buf);
+        return -ENOMEM;
+    }
+    src           = src_buf.addr;
+    dst           = dst_buf.addr;
+    buffer_length = len;
+    return 0;
+}
+
+/* 以8字节为单位写入其偏移, 分块错位或丢失时校验能够发现 */
+static void fill_src_pattern()
+{
+    uint64_t i, *words = (uint64_t *)src;
+    for (i = 0; i < buffer_length / sizeof(uint64_t); i++)
+    {
+        words[i] = i * sizeof(uint64_t);
+    }
+    for (i = i * sizeof(uint64_t); i < buffer_length; i++)
+    {
+        src[i] = (char)i;
+    }
 }
 
 int main(int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        {"bench", no_argument, NULL, OPT_BENCH},
+        {"bench-ops", required_argument, NULL, OPT_BENCH_OPS},
+        {"bench-min-size", required_argument, NULL, OPT_BENCH_MIN_SIZE},
+        {"bench-max-size", required_argument, NULL, OPT_BENCH_MAX_SIZE},
+        {"bench-iters", required_argument, NULL, OPT_BENCH_ITERS},
+        {"bench-format", required_argument, NULL, OPT_BENCH_FORMAT},
+        {"bench-reg", no_argument, NULL, OPT_BENCH_REG},
+        {"bench-reg-min-size", required_argument, NULL, OPT_BENCH_REG_MIN_SIZE},
+        {"bench-reg-max-size", required_argument, NULL, OPT_BENCH_REG_MAX_SIZE},
+        {"bench-post", no_argument, NULL, OPT_BENCH_POST},
+        {"bench-atomic", no_argument, NULL, OPT_BENCH_ATOMIC},
+        {"bench-odp", no_argument, NULL, OPT_BENCH_ODP},
+        {"bench-submit", no_argument, NULL, OPT_BENCH_SUBMIT},
+        {"bench-threads", required_argument, NULL, OPT_BENCH_THREADS},
+        {"kv-put", required_argument, NULL, OPT_KV_PUT},
+        {"kv-get", required_argument, NULL, OPT_KV_GET},
+        {"ring", required_argument, NULL, OPT_RING},
+        {"ring-msg-size", required_argument, NULL, OPT_RING_MSG_SIZE},
+        {"file-slice", required_argument, NULL, OPT_FILE_SLICE},
+        {"lat-json", required_argument, NULL, OPT_LAT_JSON},
+        {NULL, 0, NULL, 0},
+    };
     struct sockaddr_in server_sockaddr;
+    enum wc_poll_mode wc_mode      = WC_MODE_EVENT;
+    enum buffer_backing backing    = BUFFER_BACKING_HEAP;
+    const char *send_string        = NULL;
+    const char *name;
+    uint32_t spin_budget_us        = DEFAULT_SPIN_BUDGET_US;
+    uint32_t post_batch_size       = DEFAULT_POST_BATCH_SIZE;
+    uint32_t post_flush_timeout_us = DEFAULT_POST_FLUSH_US;
+    uint64_t size, length = 0;
+    uint16_t cq_mod_count, cq_mod_period_us;
     int ret, option;
     bzero(&server_sockaddr, sizeof(server_sockaddr));
     server_sockaddr.sin_family      = AF_INET;
     server_sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     src = dst = NULL;
-    while ((option = getopt(argc, argv, "s:a:p:")) != -1)
+    bench_config_init(&bench_cfg);
+    while ((option = getopt_long(argc, argv, "s:a:p:m:u:E:d:n:P:H:c:L:q:N:b:T:I:f:O:M:", long_options, NULL)) != -1)
     {
         switch (option)
         {
             case 's':
                 log_info("send string: %s, len: %u", optarg, (unsigned int)strlen(optarg));
-                src = calloc(strlen(optarg), 1);
-                if (!src)
-                {
-                    log_err("Failed to allocate src memory : -ENOMEM");
-                    return -ENOMEM;
-                }
-                strncpy(src, optarg, strlen(optarg));
-                dst = calloc(strlen(optarg), 1);
-                if (!dst)
-                {
-                    log_err("Failed to allocate dst memory : -ENOMEM");
-                    free(src);
-                    return -ENOMEM;
-                }
+                send_string = optarg;
                 break;
 
             case 'a':
@@ -397,6 +893,206 @@ int main(int argc, char **argv)
             case 'p':
                 server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
                 break;
+            case 'm':
+                ret = parse_wc_poll_mode(optarg, &wc_mode);
+                if (ret)
+                {
+                    usage();
+                }
+                break;
+            case 'u':
+                spin_budget_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'E':
+                if (parse_cq_moderation(optarg, &cq_mod_count, &cq_mod_period_us))
+                {
+                    usage();
+                }
+                set_cq_moderation(cq_mod_count, cq_mod_period_us);
+                break;
+            case 'd':
+                queue_depth = strtoul(optarg, NULL, 0);
+                if (!queue_depth)
+                {
+                    usage();
+                }
+                break;
+            case 'n':
+                num_iterations = strtoul(optarg, NULL, 0);
+                if (!num_iterations)
+                {
+                    usage();
+                }
+                break;
+            case 'P':
+                if (parse_size(optarg, &size))
+                {
+                    usage();
+                }
+                mr_pool_arena_size = size;
+                break;
+            case 'H':
+                if (parse_buffer_backing(optarg, &backing))
+                {
+                    usage();
+                }
+                break;
+            case 'O':
+                if (parse_mr_odp_mode(optarg, &odp_mode))
+                {
+                    usage();
+                }
+                break;
+            case 'M':
+                counter_interval_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                if (parse_size(optarg, &size) || !size || size > UINT32_MAX)
+                {
+                    usage();
+                }
+                chunk_size = (uint32_t)size;
+                break;
+            case 'L':
+                if (parse_size(optarg, &length) || !length)
+                {
+                    usage();
+                }
+                break;
+            case 'b':
+                post_batch_size = strtoul(optarg, NULL, 0);
+                if (!post_batch_size)
+                {
+                    usage();
+                }
+                break;
+            case 'T':
+                post_flush_timeout_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'I':
+                set_inline_threshold(strtoul(optarg, NULL, 0));
+                break;
+            case 'N':
+                set_signal_interval(strtoul(optarg, NULL, 0));
+                break;
+            case 'q':
+                num_qps = strtoul(optarg, NULL, 0);
+                if (!num_qps || num_qps > MAX_QPS_PER_SESSION)
+                {
+                    usage();
+                }
+                break;
+            case OPT_BENCH:
+                bench_mode = BENCH_MODE_OPS;
+                break;
+            case OPT_BENCH_REG:
+                bench_mode = BENCH_MODE_REG;
+                break;
+            case OPT_BENCH_POST:
+                bench_mode = BENCH_MODE_POST;
+                break;
+            case OPT_BENCH_ATOMIC:
+                bench_mode = BENCH_MODE_ATOMIC;
+                break;
+            case OPT_BENCH_ODP:
+                bench_mode = BENCH_MODE_ODP;
+                break;
+            case OPT_BENCH_SUBMIT:
+                bench_mode = BENCH_MODE_SUBMIT;
+                break;
+            case OPT_BENCH_THREADS:
+                bench_cfg.submit_threads = strtoul(optarg, NULL, 0);
+                if (!bench_cfg.submit_threads)
+                {
+                    usage();
+                }
+                break;
+            case OPT_RING:
+                ring_messages = strtoull(optarg, NULL, 0);
+                if (!ring_messages)
+                {
+                    usage();
+                }
+                break;
+            case 'f':
+                file_path = optarg;
+                break;
+            case OPT_FILE_SLICE:
+                if (parse_size(optarg, &size) || !size)
+                {
+                    usage();
+                }
+                file_slice_size = size;
+                break;
+            case OPT_RING_MSG_SIZE:
+                if (parse_size(optarg, &size) || size > RING_MAX_MSG_SIZE)
+                {
+                    usage();
+                }
+                ring_msg_size = (uint32_t)size;
+                break;
+            case OPT_KV_PUT:
+            case OPT_KV_GET:
+                size = strcspn(optarg, option == OPT_KV_PUT ? "=" : "");
+                if (num_kv_ops == MAX_KV_CLI_OPS || !size || size > KV_MAX_KEY_SIZE ||
+                    (option == OPT_KV_PUT && !strchr(optarg, '=')))
+                {
+                    usage();
+                }
+                kv_ops[num_kv_ops].put   = option == OPT_KV_PUT;
+                kv_ops[num_kv_ops++].arg = optarg;
+                break;
+            case OPT_BENCH_REG_MIN_SIZE:
+            case OPT_BENCH_REG_MAX_SIZE:
+                if (parse_size(optarg, &size) || !size)
+                {
+                    usage();
+                }
+                if (option == OPT_BENCH_REG_MIN_SIZE)
+                {
+                    bench_cfg.reg_min_size = size;
+                }
+                else
+                {
+                    bench_cfg.reg_max_size = size;
+                }
+                break;
+            case OPT_BENCH_OPS:
+                if (parse_bench_ops(optarg, &bench_cfg.ops))
+                {
+                    usage();
+                }
+                break;
+            case OPT_BENCH_MIN_SIZE:
+            case OPT_BENCH_MAX_SIZE:
+                if (parse_size(optarg, &size) || !size || size > UINT32_MAX)
+                {
+                    usage();
+                }
+                if (option == OPT_BENCH_MIN_SIZE)
+                {
+                    bench_cfg.min_size = (uint32_t)size;
+                }
+                else
+                {
+                    bench_cfg.max_size = (uint32_t)size;
+                }
+                break;
+            case OPT_BENCH_ITERS:
+                if (parse_bench_iterations(optarg, &bench_cfg))
+                {
+                    usage();
+                }
+                break;
+            case OPT_BENCH_FORMAT:
+                if (parse_bench_format(optarg, &bench_cfg.format))
+                {
+                    usage();
+                }
+                break;
+            case OPT_LAT_JSON:
+                lat_json_path = optarg;
+                break;
 
             default:
                 usage();
@@ -409,52 +1105,205 @@ int main(int argc, char **argv)
         server_sockaddr.sin_port = htons(DEFAULT_PORT);
     }
 
-    if (src == NULL)
+    set_buffer_backing(backing);
+    if (file_path)
     {
-        log_err("Should specify the string to send");
+        if (send_string || length || bench_mode != BENCH_MODE_NONE || num_kv_ops ||
+            ring_messages || num_qps != 1)
+        {
+            log_err("-f is exclusive with -s/-L, --bench, --kv-*, --ring and -q > 1");
+            usage();
+        }
+        name = strrchr(file_path, '/');
+        name = name ? name + 1 : file_path;
+        if (!name[0] || strlen(name) >= FILE_NAME_MAX)
+        {
+            log_err("Invalid file name %s ", file_path);
+            usage();
+        }
+        ret = mapped_file_open_read(&file_src, file_path);
+        if (ret)
+        {
+            return ret;
+        }
+        strcpy(file_request.name, name);
+        file_request.size = file_src.size;
+        /* 数据直接从文件映射发出, src只用于满足元数据交换 */
+        ret = alloc_src_dst(1);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    else if (ring_messages)
+    {
+        if (send_string || length || bench_mode != BENCH_MODE_NONE || num_kv_ops || num_qps != 1)
+        {
+            log_err("--ring is exclusive with -s/-L, --bench, --kv-* and -q > 1");
+            usage();
+        }
+        /* 消息内容取自src, 长度为0时仍分配一个字节 */
+        ret = alloc_src_dst(ring_msg_size ? ring_msg_size : 1);
+        if (ret)
+        {
+            return ret;
+        }
+        fill_src_pattern();
+    }
+    else if (num_kv_ops)
+    {
+        /* KV模式不使用服务端缓冲区, 只需满足元数据交换 */
+        if (send_string || length || bench_mode != BENCH_MODE_NONE)
+        {
+            log_err("--kv-put/--kv-get are exclusive with -s/-L and --bench");
+            usage();
+        }
+        ret = alloc_src_dst(KV_MAX_MSG_SIZE);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    else if (bench_mode != BENCH_MODE_NONE)
+    {
+        /* 基准测试使用覆盖最大消息的缓冲区, 服务端按此大小分配远端缓冲区 */
+        if (send_string || length)
+        {
+            log_err("-s/-L and --bench are mutually exclusive");
+            usage();
+        }
+        ret = alloc_src_dst(bench_cfg.max_size);
+        if (ret)
+        {
+            return ret;
+        }
+        memset(src, 0xa5, buffer_length);
+    }
+    else if (send_string && length)
+    {
+        log_err("-s and -L are mutually exclusive");
         usage();
     }
-
-    ret = start_rdma_client(&server_sockaddr);
-    if (ret)
+    else if (length)
     {
-        log_err("RDMA client failed to start cleanly, ret = %d ", ret);
-        return ret;
+        ret = alloc_src_dst(length);
+        if (ret)
+        {
+            return ret;
+        }
+        fill_src_pattern();
     }
-    ret = pre_post_recv();
-    if (ret)
+    else if (send_string == NULL)
     {
-        log_err("Failed to pre-post recv, ret = %d ", ret);
-        return ret;
+        log_err("Should specify the string to send");
+        usage();
+    }
+    else
+    {
+        ret = alloc_src_dst(strlen(send_string));
+        if (ret)
+        {
+            return ret;
+        }
+        memcpy(src, send_string, buffer_length);
     }
-    ret = connect_to_server();
+    set_wc_poll_mode(wc_mode, spin_budget_us);
+    set_post_batch(post_batch_size, post_flush_timeout_us);
+    /* 必须在创建传输线程之前, 使它们继承SIGUSR1的屏蔽 */
+    ret = lat_init(lat_json_path);
     if (ret)
     {
-        log_err("Failed to connect to server, ret = %d ", ret);
         return ret;
     }
 
-    ret = exchange_metadata();
+    ret = start_rdma_client(&server_sockaddr);
     if (ret)
     {
-        log_err("Failed to exchange metadata, ret = %d ", ret);
+        log_err("RDMA client failed to start cleanly, ret = %d ", ret);
         return ret;
     }
+    for (uint32_t i = 0; i < num_qps; i++)
+    {
+        ret = pre_post_recv(&qp_ctxs[i]);
+        if (ret)
+        {
+            log_err("Failed to pre-post recv, ret = %d ", ret);
+            return ret;
+        }
+        ret = connect_to_server(&qp_ctxs[i]);
+        if (ret)
+        {
+            log_err("Failed to connect to server, ret = %d ", ret);
+            return ret;
+        }
 
-    ret = remote_memory_ops();
-    if (ret)
+        ret = exchange_metadata(&qp_ctxs[i]);
+        if (ret)
+        {
+            log_err("Failed to exchange metadata, ret = %d ", ret);
+            return ret;
+        }
+    }
+    /* 采样失败 (如没有sysfs计数器) 不影响传输 */
+    if (counter_interval_ms)
     {
-        log_err("Failed to perform remote memory ops, ret = %d ", ret);
-        return ret;
+        port_sampler = port_sampler_start(qp_ctxs[0].cm_id->verbs, qp_ctxs[0].cm_id->port_num,
+                                          counter_interval_ms);
     }
 
-    if (check_src_dst())
+    if (file_path)
+    {
+        ret = run_file_stream();
+        if (ret)
+        {
+            log_err("File streaming failed, ret = %d ", ret);
+            return ret;
+        }
+    }
+    else if (ring_messages)
+    {
+        ret = run_ring_messages();
+        if (ret)
+        {
+            log_err("Ring messaging failed, ret = %d ", ret);
+            return ret;
+        }
+    }
+    else if (num_kv_ops)
+    {
+        ret = run_kv_ops();
+        if (ret)
+        {
+            log_err("KV operations failed, ret = %d ", ret);
+            return ret;
+        }
+    }
+    else if (bench_mode != BENCH_MODE_NONE)
     {
-        log_err("src and dst buffers don't match");
+        ret = run_client_benchmark();
+        if (ret)
+        {
+            log_err("Benchmark failed, ret = %d ", ret);
+            return ret;
+        }
     }
     else
     {
-        log_info("src and dst buffers match");
+        ret = remote_memory_ops();
+        if (ret)
+        {
+            log_err("Failed to perform remote memory ops, ret = %d ", ret);
+            return ret;
+        }
+
+        if (check_src_dst())
+        {
+            log_err("src and dst buffers don't match");
+        }
+        else
+        {
+            log_info("src and dst buffers match");
+        }
     }
 
     ret = disconnect_and_cleanup();
@@ -0,0 +1,124 @@
+#include "credit.h"
+
+int send_credits_init(struct send_credits *c, struct ibv_pd *pd, struct rdma_buffer_attr *attr)
+{
+    bzero(c, sizeof(*c));
+    c->mr = rdma_buffer_alloc(pd, sizeof(uint64_t),
+                              (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    if (!c->mr)
+    {
+        log_err("Failed to allocate send credit word ");
+        return -ENOMEM;
+    }
+    *(volatile uint64_t *)c->mr->addr = 0;
+    attr->address                     = (uint64_t)c->mr->addr;
+    attr->length                      = c->mr->length;
+    attr->stag.remote_stag            = c->mr->rkey;
+    return 0;
+}
+
+void send_credits_start(struct send_credits *c, uint32_t initial)
+{
+    c->used = 0;
+    if (!initial)
+    {
+        debug("Receiver does not grant send credits, relying on RNR retries ");
+        send_credits_destroy(c);
+        return;
+    }
+    *(volatile uint64_t *)c->mr->addr = initial;
+    debug("Send credits start at %u ", initial);
+}
+
+void send_credits_destroy(struct send_credits *c)
+{
+    if (c->mr)
+    {
+        rdma_buffer_free(c->mr);
+        c->mr = NULL;
+    }
+}
+
+int send_credits_wait(struct send_credits *c)
+{
+    uint64_t deadline = 0;
+    uint32_t spins    = 0;
+    while (!send_credits_available(c))
+    {
+        /* 先纯忙等, 只偶尔读取时钟 */
+        if (++spins % 1024)
+        {
+            cpu_relax();
+            continue;
+        }
+        if (!deadline)
+        {
+            deadline = now_ns() + (uint64_t)SEND_CREDIT_TIMEOUT_MS * 1000000;
+        }
+        else if (now_ns() > deadline)
+        {
+            log_err("No send credit after %d ms, %lu SENDs issued ", SEND_CREDIT_TIMEOUT_MS,
+                    c->used);
+            return -ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+int recv_credits_init(struct recv_credits *r,
+                      struct ibv_pd *pd,
+                      struct ibv_qp *qp,
+                      const struct rdma_buffer_attr *credit,
+                      uint32_t initial)
+{
+    bzero(r, sizeof(*r));
+    r->qp     = qp;
+    r->posted = initial;
+    r->batch  = 1;
+    if (!initial || !credit->stag.remote_stag)
+    {
+        return 0;
+    }
+    if (credit->length < sizeof(uint64_t) || credit->address % sizeof(uint64_t))
+    {
+        log_err("Invalid send credit word at 0x%lx, length %lu ", credit->address,
+                credit->length);
+        return -EINVAL;
+    }
+    if (rdma_write_u64_prepare(pd, &r->credit_mr))
+    {
+        return -ENOMEM;
+    }
+    r->credit_addr = credit->address;
+    r->credit_rkey = credit->stag.remote_stag;
+    r->batch       = initial / RECV_CREDIT_FRACTION ? initial / RECV_CREDIT_FRACTION : 1;
+    return 0;
+}
+
+int recv_credits_grant(struct recv_credits *r, uint32_t n)
+{
+    int ret = -1;
+    r->posted += n;
+    if (!r->credit_rkey)
+    {
+        return 0;
+    }
+    ret = rdma_write_u64(r->qp, r->credit_mr, r->posted, r->credit_addr, r->credit_rkey,
+                         IBV_SEND_SIGNALED);
+    if (ret)
+    {
+        log_err("Failed to grant receive credits ");
+        return ret;
+    }
+    return 0;
+}
+
+void recv_credits_destroy(struct recv_credits *r)
+{
+    if (r->credit_mr)
+    {
+        rdma_buffer_free(r->credit_mr);
+        r->credit_mr = NULL;
+    }
+    r->credit_rkey = 0;
+}
@@ -0,0 +1,336 @@
+#include "file_stream.h"
+
+int mapped_file_open_read(struct mapped_file *f, const char *path)
+{
+    struct stat st;
+    bzero(f, sizeof(*f));
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0)
+    {
+        log_err("Failed to open %s, errno: %d ", path, -errno);
+        return -errno;
+    }
+    if (fstat(f->fd, &st) || !S_ISREG(st.st_mode))
+    {
+        log_err("%s is not a regular file ", path);
+        mapped_file_close(f, 0);
+        return -EINVAL;
+    }
+    f->size = st.st_size;
+    if (!f->size)
+    {
+        return 0;
+    }
+    f->addr = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (f->addr == MAP_FAILED)
+    {
+        log_err("Failed to map %lu bytes of %s, errno: %d ", f->size, path, -errno);
+        f->addr = NULL;
+        mapped_file_close(f, 0);
+        return -errno;
+    }
+    /* 按顺序推送, 提示内核预读 */
+    madvise(f->addr, f->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+int mapped_file_open_write(struct mapped_file *f, const char *path, uint64_t size, int truncate)
+{
+    bzero(f, sizeof(*f));
+    f->fd = open(path, O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (f->fd < 0)
+    {
+        log_err("Failed to open %s, errno: %d ", path, -errno);
+        return -errno;
+    }
+    if (ftruncate(f->fd, size))
+    {
+        log_err("Failed to resize %s to %lu bytes, errno: %d ", path, size, -errno);
+        mapped_file_close(f, 0);
+        return -errno;
+    }
+    f->size = size;
+    if (!f->size)
+    {
+        return 0;
+    }
+    f->addr = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+    if (f->addr == MAP_FAILED)
+    {
+        log_err("Failed to map %lu bytes of %s, errno: %d ", f->size, path, -errno);
+        f->addr = NULL;
+        mapped_file_close(f, 0);
+        return -errno;
+    }
+    return 0;
+}
+
+void mapped_file_close(struct mapped_file *f, int sync)
+{
+    if (f->addr)
+    {
+        if (sync && msync(f->addr, f->size, MS_SYNC))
+        {
+            log_err("Failed to sync %lu mapped bytes, errno: %d ", f->size, -errno);
+        }
+        munmap(f->addr, f->size);
+        f->addr = NULL;
+    }
+    if (f->fd >= 0)
+    {
+        close(f->fd);
+        f->fd = -1;
+    }
+}
+
+/* 文件名只能是输出目录下的一项, 不能含有路径分隔符 */
+static int file_name_valid(const char *name)
+{
+    return memchr(name, '\0', FILE_NAME_MAX) && name[0] && !strchr(name, '/') &&
+           strcmp(name, ".") && strcmp(name, "..");
+}
+
+static int progress_path(char *dst, const char *path)
+{
+    int len = snprintf(dst, PATH_MAX, "%s%s", path, FILE_PROGRESS_SUFFIX);
+    return (len < 0 || len >= PATH_MAX) ? -ENAMETOOLONG : 0;
+}
+
+/* 注销内存区域并关闭两个文件, 不处理进度文件 */
+static void file_sink_release(struct file_sink *sink)
+{
+    if (sink->data_mr)
+    {
+        ibv_dereg_mr(sink->data_mr);
+        sink->data_mr = NULL;
+    }
+    if (sink->progress_mr)
+    {
+        ibv_dereg_mr(sink->progress_mr);
+        sink->progress_mr = NULL;
+    }
+    mapped_file_close(&sink->data, 1);
+    mapped_file_close(&sink->progress, 1);
+    sink->active = 0;
+}
+
+int file_sink_open(struct file_sink *sink,
+                   struct ibv_pd *pd,
+                   const char *dir,
+                   const struct file_request *req,
+                   struct file_response *resp)
+{
+    char path[PATH_MAX];
+    struct stat st, pst;
+    uint64_t *progress;
+    int len, resume, ret = -1;
+    bzero(sink, sizeof(*sink));
+    bzero(resp, sizeof(*resp));
+    sink->data.fd = sink->progress.fd = -1;
+    if (!file_name_valid(req->name))
+    {
+        log_err("Invalid file name in the client request ");
+        resp->status = -EINVAL;
+        return -EINVAL;
+    }
+    len = snprintf(sink->path, sizeof(sink->path), "%s/%s", dir, req->name);
+    if (len < 0 || len >= (int)sizeof(sink->path) || progress_path(path, sink->path))
+    {
+        log_err("Path of %s is too long ", req->name);
+        resp->status = -ENAMETOOLONG;
+        return -ENAMETOOLONG;
+    }
+    /* 只有大小相同且留有进度文件的目标文件才能继续, 否则视为新的传输 */
+    resume = !stat(sink->path, &st) && (uint64_t)st.st_size == req->size && !stat(path, &pst) &&
+             pst.st_size == sizeof(*progress);
+    sink->active = 1;
+    ret          = mapped_file_open_write(&sink->progress, path, sizeof(*progress), !resume);
+    if (ret)
+    {
+        goto err;
+    }
+    progress = sink->progress.addr;
+    if (*progress > req->size)
+    {
+        log_err("Progress %lu of %s exceeds its size, restarting ", *progress, sink->path);
+        resume = 0;
+    }
+    if (!resume)
+    {
+        *progress = 0;
+    }
+    ret = mapped_file_open_write(&sink->data, sink->path, req->size, !resume);
+    if (ret)
+    {
+        goto err;
+    }
+
+    /*
+     * 目标文件的页缓存直接作为RDMA WRITE的目标。注册会钉住整个文件的页面,
+     * 不经过注册缓存, 连接结束时立即注销。
+     */
+    if (sink->data.size)
+    {
+        sink->data_mr = ibv_reg_mr(pd, sink->data.addr, sink->data.size,
+                                   (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+        if (!sink->data_mr)
+        {
+            log_err("Failed to register %lu bytes of %s, errno: %d ", sink->data.size,
+                    sink->path, -errno);
+            ret = -errno;
+            goto err;
+        }
+        resp->attr.address          = (uint64_t)sink->data_mr->addr;
+        resp->attr.length           = sink->data.size;
+        resp->attr.stag.remote_stag = sink->data_mr->rkey;
+    }
+    sink->progress_mr = ibv_reg_mr(pd, progress, sizeof(*progress),
+                                   (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    if (!sink->progress_mr)
+    {
+        log_err("Failed to register the progress of %s, errno: %d ", sink->path, -errno);
+        ret = -errno;
+        goto err;
+    }
+    resp->progress.address          = (uint64_t)progress;
+    resp->progress.length           = sizeof(*progress);
+    resp->progress.stag.remote_stag = sink->progress_mr->rkey;
+    resp->resume_offset             = *progress;
+    log_info("Receiving %s, %lu bytes, %s at %lu ", sink->path, req->size,
+             resume ? "resuming" : "starting", *progress);
+    return 0;
+err:
+    file_sink_release(sink);
+    bzero(&resp->attr, sizeof(resp->attr));
+    bzero(&resp->progress, sizeof(resp->progress));
+    resp->status = ret;
+    return ret;
+}
+
+void file_sink_close(struct file_sink *sink)
+{
+    char path[PATH_MAX];
+    uint64_t done, size = sink->data.size;
+    if (!sink->active)
+    {
+        return;
+    }
+    done = *(volatile uint64_t *)sink->progress.addr;
+    file_sink_release(sink);
+    if (done != size)
+    {
+        log_info("File %s is incomplete at %lu of %lu bytes, send it again to resume ",
+                 sink->path, done, size);
+        return;
+    }
+    if (!progress_path(path, sink->path) && unlink(path))
+    {
+        log_err("Failed to remove %s, errno: %d ", path, -errno);
+    }
+    log_info("File %s is complete, %lu bytes ", sink->path, size);
+}
+
+/* 以RDMA WRITE把已完成的字节数写入服务端的进度字, 等待其完成 */
+static int file_stream_commit(struct ibv_qp *qp,
+                              struct ibv_comp_channel *comp_channel,
+                              struct ibv_cq *cq,
+                              struct ibv_mr *value_mr,
+                              struct rdma_buffer_attr *progress,
+                              uint64_t offset)
+{
+    struct ibv_wc wc;
+    int ret = rdma_write_u64(qp, value_mr, offset, progress->address, progress->stag.remote_stag,
+                             IBV_SEND_SIGNALED);
+    if (ret)
+    {
+        log_err("Failed to post file progress ");
+        return ret;
+    }
+    ret = collect_work_completions(comp_channel, cq, &wc, 1, 1);
+    return ret < 0 ? ret : 0;
+}
+
+int file_stream_push(struct ibv_qp *qp,
+                     struct ibv_comp_channel *comp_channel,
+                     struct ibv_cq *cq,
+                     struct ibv_pd *pd,
+                     struct mapped_file *f,
+                     struct file_response *resp,
+                     uint64_t slice_size,
+                     uint32_t chunk_size,
+                     uint32_t depth)
+{
+    struct rdma_buffer_attr remote;
+    struct ibv_mr *slice_mr, *value_mr = NULL;
+    uint64_t offset = resp->resume_offset, length, start, slice_start, elapsed;
+    int ret         = 0;
+    if (resp->status)
+    {
+        log_err("Server refused the file, status: %d ", resp->status);
+        return resp->status;
+    }
+    if (offset > f->size || resp->attr.length < f->size ||
+        resp->progress.length < sizeof(uint64_t))
+    {
+        log_err("Server region of %lu bytes, resume offset %lu do not fit a %lu byte file ",
+                resp->attr.length, offset, f->size);
+        return -EPROTO;
+    }
+    if (rdma_write_u64_prepare(pd, &value_mr))
+    {
+        return -ENOMEM;
+    }
+    if (offset)
+    {
+        log_info("File: resuming at %lu of %lu bytes ", offset, f->size);
+    }
+    start = now_ns();
+    while (offset < f->size)
+    {
+        length = f->size - offset < slice_size ? f->size - offset : slice_size;
+        /* 分片传输完即注销, 不经过注册缓存, 避免整个文件的页面一直被钉住; 只作为WRITE的源 */
+        slice_mr = ibv_reg_mr(pd, (char *)f->addr + offset, length, 0);
+        if (!slice_mr)
+        {
+            log_err("Failed to register file slice [%lu, +%lu), errno: %d ", offset, length,
+                    -errno);
+            ret = -errno;
+            break;
+        }
+        remote.address          = resp->attr.address + offset;
+        remote.length           = length;
+        remote.stag.remote_stag = resp->attr.stag.remote_stag;
+        slice_start             = now_ns();
+        ret = rdma_chunked_transfer(qp, comp_channel, cq, IBV_WR_RDMA_WRITE, slice_mr, &remote,
+                                    length, chunk_size, 1, depth, NULL);
+        ibv_dereg_mr(slice_mr);
+        if (ret)
+        {
+            log_err("Failed to write file slice [%lu, +%lu), ret = %d ", offset, length, ret);
+            break;
+        }
+        elapsed = now_ns() - slice_start;
+        offset += length;
+        /* 分片的WRITE都已完成, 数据已在服务端的页缓存中, 此时才推进进度 */
+        ret = file_stream_commit(qp, comp_channel, cq, value_mr, &resp->progress, offset);
+        if (ret)
+        {
+            log_err("Failed to record file progress %lu, ret = %d ", offset, ret);
+            break;
+        }
+        log_info("File: %lu / %lu bytes (%.1f%%), slice %.3f Gb/s ", offset, f->size,
+                 100.0 * offset / f->size, (double)length * 8 / elapsed);
+    }
+    elapsed = now_ns() - start;
+    if (!ret)
+    {
+        length = offset - resp->resume_offset;
+        log_info("File: sent %lu bytes (%lu skipped by resume) in %.3f s, %.3f Gb/s ", length,
+                 resp->resume_offset, elapsed / 1e9, elapsed ? (double)length * 8 / elapsed : 0);
+    }
+    if (value_mr)
+    {
+        rdma_buffer_free(value_mr);
+    }
+    return ret;
+}
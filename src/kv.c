@@ -0,0 +1,455 @@
+#include "kv.h"
+#include <stddef.h>
+
+/* FNV-1a的初始值与乘数 */
+#define KV_HASH_SEED (0xcbf29ce484222325ULL)
+#define KV_HASH_PRIME (0x100000001b3ULL)
+
+/* 客户端本地缓冲区的布局: 桶窗口 | 条目 | 请求 | 响应 */
+#define KV_SCRATCH_BUCKETS (0)
+#define KV_SCRATCH_ENTRY (KV_PROBE_WINDOW * sizeof(struct kv_bucket))
+#define KV_SCRATCH_REQUEST (KV_SCRATCH_ENTRY + KV_MAX_MSG_SIZE)
+#define KV_SCRATCH_RESPONSE (KV_SCRATCH_REQUEST + KV_MAX_MSG_SIZE)
+#define KV_SCRATCH_SIZE (KV_SCRATCH_RESPONSE + sizeof(struct kv_response))
+
+uint64_t kv_hash64(uint64_t seed, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t hash    = seed;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= KV_HASH_PRIME;
+    }
+    return hash;
+}
+
+/* 键的哈希, 0保留给空桶 */
+static uint64_t kv_key_hash(const void *key, uint16_t key_len)
+{
+    uint64_t hash = kv_hash64(KV_HASH_SEED, key, key_len);
+    return hash ? hash : 1;
+}
+
+static uint64_t kv_bucket_checksum(const struct kv_bucket *bucket)
+{
+    return kv_hash64(KV_HASH_SEED, bucket, offsetof(struct kv_bucket, checksum));
+}
+
+static uint64_t kv_entry_checksum(const struct kv_entry *entry)
+{
+    return kv_hash64(KV_HASH_SEED, (const char *)entry + sizeof(entry->checksum),
+                     sizeof(*entry) - sizeof(entry->checksum) + entry->key_len + entry->value_len);
+}
+
+/* 条目按8字节对齐追加 */
+static inline uint32_t kv_entry_size(uint16_t key_len, uint32_t value_len)
+{
+    return (uint32_t)((sizeof(struct kv_entry) + key_len + value_len + 7) & ~7UL);
+}
+
+struct kv_table *kv_table_create(struct ibv_pd *pd, uint32_t num_buckets, uint64_t log_size)
+{
+    struct kv_table *table;
+    uint64_t bucket_bytes, size;
+    if (!num_buckets || !log_size)
+    {
+        log_err("Invalid KV table: %u buckets, %lu bytes of log ", num_buckets, log_size);
+        return NULL;
+    }
+    table = calloc(1, sizeof(*table));
+    if (!table)
+    {
+        log_err("Failed to allocate KV table, -ENOMEM ");
+        return NULL;
+    }
+    /* 末尾多出probe_window - 1个桶, 探测窗口不需要回绕 */
+    bucket_bytes = (uint64_t)(num_buckets + KV_PROBE_WINDOW - 1) * sizeof(struct kv_bucket);
+    size         = sizeof(struct kv_header) + bucket_bytes + log_size;
+    /* 客户端只读, PUT由服务端在本地完成 */
+    table->mr = rdma_buffer_alloc(pd, size, (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    if (!table->mr)
+    {
+        log_err("Failed to allocate KV region of %lu bytes ", size);
+        free(table);
+        return NULL;
+    }
+    table->header  = table->mr->addr;
+    table->buckets = (struct kv_bucket *)(table->header + 1);
+    table->log     = (char *)table->buckets + bucket_bytes;
+    memset(table->header, 0, sizeof(struct kv_header) + bucket_bytes);
+    table->header->num_buckets   = num_buckets;
+    table->header->probe_window  = KV_PROBE_WINDOW;
+    table->header->bucket_offset = sizeof(struct kv_header);
+    table->header->log_offset    = sizeof(struct kv_header) + bucket_bytes;
+    table->header->log_size      = log_size;
+    table->header->magic         = KV_MAGIC;
+    log_info("KV table with %u buckets and %lu bytes of log is created at %p ", num_buckets,
+             log_size, table->header);
+    return table;
+}
+
+void kv_table_destroy(struct kv_table *table)
+{
+    if (!table)
+    {
+        return;
+    }
+    rdma_buffer_free(table->mr);
+    free(table);
+}
+
+int kv_table_put(struct kv_table *table,
+                 const void *key,
+                 uint16_t key_len,
+                 const void *value,
+                 uint32_t value_len,
+                 uint32_t *version)
+{
+    struct kv_header *header  = table->header;
+    struct kv_bucket *bucket  = NULL, *b, update;
+    struct kv_entry *entry, *old;
+    uint64_t hash             = kv_key_hash(key, key_len);
+    uint32_t start            = (uint32_t)(hash % header->num_buckets);
+    uint32_t size             = kv_entry_size(key_len, value_len);
+    if (!key_len || key_len > KV_MAX_KEY_SIZE || size > KV_MAX_MSG_SIZE)
+    {
+        log_err("Invalid KV put: key of %u bytes, value of %u bytes ", key_len, value_len);
+        return -EINVAL;
+    }
+    /* 在窗口内查找同一个键, 找不到时使用第一个空桶 */
+    for (uint32_t i = 0; i < header->probe_window; i++)
+    {
+        b = &table->buckets[start + i];
+        if (!b->key_hash)
+        {
+            bucket = bucket ? bucket : b;
+            continue;
+        }
+        if (b->key_hash != hash)
+        {
+            continue;
+        }
+        old = (struct kv_entry *)((char *)header + b->entry_offset);
+        if (old->key_len == key_len && !memcmp(old->data, key, key_len))
+        {
+            bucket = b;
+            break;
+        }
+    }
+    if (!bucket)
+    {
+        log_err("No free bucket within the probe window of bucket %u ", start);
+        return -ENOSPC;
+    }
+    if (table->log_tail + size > header->log_size)
+    {
+        log_err("KV log is full, %lu of %lu bytes used ", table->log_tail, header->log_size);
+        return -ENOSPC;
+    }
+
+    /* 先完整写入新条目, 此时还没有桶指向它 */
+    entry            = (struct kv_entry *)(table->log + table->log_tail);
+    entry->version   = bucket->key_hash ? bucket->version + 1 : 1;
+    entry->key_len   = key_len;
+    entry->reserved  = 0;
+    entry->value_len = value_len;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, value, value_len);
+    entry->checksum = kv_entry_checksum(entry);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    /* 再更新桶, RDMA READ可能读到新旧字段的混合, 由桶的校验和发现 */
+    update.key_hash     = hash;
+    update.entry_offset = header->log_offset + table->log_tail;
+    update.entry_len    = size;
+    update.version      = entry->version;
+    update.checksum     = kv_bucket_checksum(&update);
+    memcpy(bucket, &update, sizeof(update));
+    table->log_tail += size;
+    if (version)
+    {
+        *version = update.version;
+    }
+    return 0;
+}
+
+void kv_serve_request(struct kv_table *table,
+                      const void *msg,
+                      uint32_t len,
+                      struct kv_response *resp)
+{
+    const struct kv_request *req = msg;
+    uint32_t version             = 0;
+    resp->version                = 0;
+    if (len < sizeof(*req) || len < sizeof(*req) + req->key_len + req->value_len)
+    {
+        log_err("KV request of %u bytes is truncated ", len);
+        resp->status = -EPROTO;
+        return;
+    }
+    switch (req->op)
+    {
+        case KV_OP_PUT:
+            resp->status  = kv_table_put(table, req->data, req->key_len,
+                                         req->data + req->key_len, req->value_len, &version);
+            resp->version = version;
+            break;
+        default:
+            log_err("Unknown KV op %u ", req->op);
+            resp->status = -EOPNOTSUPP;
+            break;
+    }
+}
+
+/* 把区域中[offset, offset + length)读到本地缓冲区的scratch_offset处, 同步等待完成 */
+static int kv_read(struct kv_client *kv, uint64_t scratch_offset, uint64_t offset, uint32_t length)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    struct ibv_wc wc;
+    int ret = -1;
+    if (offset + length > kv->region.length)
+    {
+        log_err("KV read of %u bytes at %lu is outside the region ", length, offset);
+        return -EPROTO;
+    }
+    sge.addr   = (uint64_t)kv->scratch_mr->addr + scratch_offset;
+    sge.length = length;
+    sge.lkey   = kv->scratch_mr->lkey;
+    bzero(&wr, sizeof(wr));
+    wr.sg_list             = &sge;
+    wr.num_sge             = 1;
+    wr.opcode              = IBV_WR_RDMA_READ;
+    wr.send_flags          = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = kv->region.address + offset;
+    wr.wr.rdma.rkey        = kv->region.stag.remote_stag;
+    ret                    = ibv_post_send(kv->qp, &wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post KV read, errno: %d ", ret);
+        return -ret;
+    }
+    ret = collect_work_completions(kv->comp_channel, kv->cq, &wc, 1, 1);
+    return ret < 0 ? ret : 0;
+}
+
+int kv_client_open(struct kv_client *kv,
+                   struct ibv_pd *pd,
+                   struct ibv_qp *qp,
+                   struct ibv_comp_channel *comp_channel,
+                   struct ibv_cq *cq,
+                   struct rdma_buffer_attr *region)
+{
+    struct kv_header *header;
+    int ret = -1;
+    bzero(kv, sizeof(*kv));
+    kv->qp           = qp;
+    kv->comp_channel = comp_channel;
+    kv->cq           = cq;
+    kv->region       = *region;
+    kv->scratch_mr   = rdma_buffer_alloc(pd, KV_SCRATCH_SIZE, IBV_ACCESS_LOCAL_WRITE);
+    if (!kv->scratch_mr)
+    {
+        log_err("Failed to allocate KV scratch buffer, -ENOMEM ");
+        return -ENOMEM;
+    }
+    ret = kv_read(kv, KV_SCRATCH_ENTRY, 0, sizeof(*header));
+    if (ret)
+    {
+        return ret;
+    }
+    header = (struct kv_header *)((char *)kv->scratch_mr->addr + KV_SCRATCH_ENTRY);
+    if (header->magic != KV_MAGIC || !header->num_buckets || !header->probe_window ||
+        header->probe_window > KV_PROBE_WINDOW ||
+        header->bucket_offset + (uint64_t)(header->num_buckets + header->probe_window - 1) *
+                                    sizeof(struct kv_bucket) > kv->region.length)
+    {
+        log_err("Server buffer does not hold a KV table ");
+        return -EPROTO;
+    }
+    kv->header = *header;
+    debug("KV table has %u buckets, probe window %u, %lu bytes of log ", header->num_buckets,
+          header->probe_window, header->log_size);
+    return 0;
+}
+
+void kv_client_close(struct kv_client *kv)
+{
+    if (kv->scratch_mr)
+    {
+        rdma_buffer_free(kv->scratch_mr);
+        kv->scratch_mr = NULL;
+    }
+}
+
+/*
+ * 读取桶所指的条目并与桶核对。
+ * 返回0表示键匹配, 1表示是哈希冲突的其他键, -EAGAIN表示读到了不一致的数据。
+ */
+static int kv_read_entry(struct kv_client *kv,
+                         const struct kv_bucket *bucket,
+                         const void *key,
+                         uint16_t key_len)
+{
+    struct kv_entry *entry =
+        (struct kv_entry *)((char *)kv->scratch_mr->addr + KV_SCRATCH_ENTRY);
+    int ret = -1;
+    if (bucket->entry_len < sizeof(*entry) || bucket->entry_len > KV_MAX_MSG_SIZE)
+    {
+        return -EAGAIN;
+    }
+    ret = kv_read(kv, KV_SCRATCH_ENTRY, bucket->entry_offset, bucket->entry_len);
+    if (ret)
+    {
+        return ret;
+    }
+    if (entry->version != bucket->version ||
+        sizeof(*entry) + entry->key_len + entry->value_len > bucket->entry_len ||
+        entry->checksum != kv_entry_checksum(entry))
+    {
+        return -EAGAIN;
+    }
+    return (entry->key_len == key_len && !memcmp(entry->data, key, key_len)) ? 0 : 1;
+}
+
+int kv_get(struct kv_client *kv,
+           const void *key,
+           uint16_t key_len,
+           void *value,
+           uint32_t value_cap,
+           uint32_t *value_len)
+{
+    char *scratch             = kv->scratch_mr->addr;
+    struct kv_bucket *buckets = (struct kv_bucket *)(scratch + KV_SCRATCH_BUCKETS);
+    struct kv_entry *entry    = (struct kv_entry *)(scratch + KV_SCRATCH_ENTRY);
+    struct kv_bucket bucket;
+    uint64_t hash  = kv_key_hash(key, key_len);
+    uint32_t start = (uint32_t)(hash % kv->header.num_buckets);
+    int ret = -1, torn;
+    for (int attempt = 0; attempt < KV_MAX_RETRIES; attempt++)
+    {
+        ret = kv_read(kv, KV_SCRATCH_BUCKETS,
+                      kv->header.bucket_offset + (uint64_t)start * sizeof(struct kv_bucket),
+                      kv->header.probe_window * sizeof(struct kv_bucket));
+        if (ret)
+        {
+            return ret;
+        }
+        torn = 0;
+        for (uint32_t i = 0; i < kv->header.probe_window; i++)
+        {
+            bucket = buckets[i];
+            if (!bucket.key_hash && !bucket.checksum)
+            {
+                continue;
+            }
+            if (bucket.checksum != kv_bucket_checksum(&bucket))
+            {
+                torn = 1;
+                continue;
+            }
+            if (bucket.key_hash != hash)
+            {
+                continue;
+            }
+            ret = kv_read_entry(kv, &bucket, key, key_len);
+            if (ret == -EAGAIN)
+            {
+                torn = 1;
+                continue;
+            }
+            if (ret < 0)
+            {
+                return ret;
+            }
+            if (ret == 0)
+            {
+                if (entry->value_len > value_cap)
+                {
+                    log_err("Value of %u bytes does not fit in %u bytes ", entry->value_len,
+                            value_cap);
+                    return -EMSGSIZE;
+                }
+                memcpy(value, entry->data + entry->key_len, entry->value_len);
+                *value_len = entry->value_len;
+                return 0;
+            }
+        }
+        /* 窗口内所有桶都一致时才能确定键不存在 */
+        if (!torn)
+        {
+            return -ENOENT;
+        }
+        debug("Torn read of KV bucket window %u, retrying ", start);
+    }
+    log_err("KV get kept reading inconsistent data after %d attempts ", KV_MAX_RETRIES);
+    return -EAGAIN;
+}
+
+int kv_put(struct kv_client *kv,
+           const void *key,
+           uint16_t key_len,
+           const void *value,
+           uint32_t value_len)
+{
+    char *scratch            = kv->scratch_mr->addr;
+    struct kv_request *req   = (struct kv_request *)(scratch + KV_SCRATCH_REQUEST);
+    struct kv_response *resp = (struct kv_response *)(scratch + KV_SCRATCH_RESPONSE);
+    struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+    struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+    struct ibv_sge send_sge, recv_sge;
+    struct ibv_wc wc[2];
+    uint32_t len = sizeof(*req) + key_len + value_len;
+    int ret      = -1;
+    if (!key_len || key_len > KV_MAX_KEY_SIZE || len > KV_MAX_MSG_SIZE)
+    {
+        log_err("Invalid KV put: key of %u bytes, value of %u bytes ", key_len, value_len);
+        return -EINVAL;
+    }
+    req->op        = KV_OP_PUT;
+    req->key_len   = key_len;
+    req->reserved  = 0;
+    req->value_len = value_len;
+    memcpy(req->data, key, key_len);
+    memcpy(req->data + key_len, value, value_len);
+
+    /* 先投递接收响应的WR, 服务端处理完请求后立即回复 */
+    recv_sge.addr   = (uint64_t)resp;
+    recv_sge.length = sizeof(*resp);
+    recv_sge.lkey   = kv->scratch_mr->lkey;
+    bzero(&recv_wr, sizeof(recv_wr));
+    recv_wr.sg_list = &recv_sge;
+    recv_wr.num_sge = 1;
+    ret             = ibv_post_recv(kv->qp, &recv_wr, &bad_recv_wr);
+    if (ret)
+    {
+        log_err("Failed to post KV response receive, errno: %d ", ret);
+        return -ret;
+    }
+    send_sge.addr   = (uint64_t)req;
+    send_sge.length = len;
+    send_sge.lkey   = kv->scratch_mr->lkey;
+    bzero(&send_wr, sizeof(send_wr));
+    send_wr.sg_list    = &send_sge;
+    send_wr.num_sge    = 1;
+    send_wr.opcode     = IBV_WR_SEND;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    ret                = ibv_post_send(kv->qp, &send_wr, &bad_send_wr);
+    if (ret)
+    {
+        log_err("Failed to post KV request, errno: %d ", ret);
+        return -ret;
+    }
+    ret = collect_work_completions(kv->comp_channel, kv->cq, wc, 2, 2);
+    if (ret != 2)
+    {
+        log_err("Failed to get KV put completions, ret = %d ", ret);
+        return ret < 0 ? ret : -EIO;
+    }
+    if (resp->status)
+    {
+        log_err("Server rejected KV put, status: %d ", resp->status);
+    }
+    return resp->status;
+}
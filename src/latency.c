@@ -0,0 +1,259 @@
+#include "latency.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+__thread struct lat_thread *lat_self = NULL;
+/* 未校准时按1纳秒每刻度计算 (非x86/aarch64下lat_now()本身就是纳秒) */
+double lat_ns_per_tick = 1.0;
+
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lat_thread *lat_threads = NULL;
+static uint32_t lat_num_threads       = 0;
+static const char *lat_path           = NULL;
+
+static const char *const lat_stage_names[LAT_NUM_STAGES] = {
+    [LAT_STAGE_POST]   = "post_to_doorbell",
+    [LAT_STAGE_WIRE]   = "doorbell_to_completion",
+    [LAT_STAGE_HANDLE] = "completion_handling",
+    [LAT_STAGE_TOTAL]  = "total",
+};
+
+static void lat_histogram_init(struct lat_histogram *h)
+{
+    atomic_init(&h->count, 0);
+    atomic_init(&h->sum_ns, 0);
+    atomic_init(&h->min_ns, UINT64_MAX);
+    atomic_init(&h->max_ns, 0);
+    for (uint32_t i = 0; i < LAT_NUM_BUCKETS; i++)
+    {
+        atomic_init(&h->buckets[i], 0);
+    }
+}
+
+struct lat_thread *lat_thread_register()
+{
+    struct lat_thread *t = calloc(1, sizeof(*t));
+    if (!t)
+    {
+        log_err("Failed to allocate latency histograms, -ENOMEM ");
+        return NULL;
+    }
+    for (int s = 0; s < LAT_NUM_STAGES; s++)
+    {
+        lat_histogram_init(&t->stages[s]);
+    }
+    pthread_mutex_lock(&lat_lock);
+    t->id       = lat_num_threads++;
+    t->next     = lat_threads;
+    lat_threads = t;
+    pthread_mutex_unlock(&lat_lock);
+    lat_self = t;
+    return t;
+}
+
+/* 桶的代表值 (区间中点), 与lat_bucket()互逆 */
+static uint64_t lat_bucket_value(uint32_t idx)
+{
+    uint32_t group = idx / LAT_SUB_BUCKETS, sub = idx % LAT_SUB_BUCKETS;
+    uint64_t lower;
+    if (!group)
+    {
+        return idx;
+    }
+    lower = (uint64_t)(LAT_SUB_BUCKETS + sub) << (group - 1);
+    return lower + ((1ULL << (group - 1)) >> 1);
+}
+
+static uint64_t lat_percentile(const struct lat_histogram *h, uint64_t count, double p)
+{
+    uint64_t rank = (uint64_t)(p * (double)count), seen = 0;
+    uint64_t max  = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    uint64_t v;
+    if (rank >= count)
+    {
+        rank = count - 1;
+    }
+    for (uint32_t i = 0; i < LAT_NUM_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen > rank)
+        {
+            /* 桶的中点可能超出实际的最大值 */
+            v = lat_bucket_value(i);
+            return v > max ? max : v;
+        }
+    }
+    return max;
+}
+
+/* 累加到合并的直方图, 只有输出线程在持锁时访问它 */
+static void lat_histogram_merge(struct lat_histogram *dst, const struct lat_histogram *src)
+{
+    uint64_t v;
+    lat_add(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+    lat_add(&dst->sum_ns, atomic_load_explicit(&src->sum_ns, memory_order_relaxed));
+    v = atomic_load_explicit(&src->min_ns, memory_order_relaxed);
+    if (v < atomic_load_explicit(&dst->min_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&dst->min_ns, v, memory_order_relaxed);
+    }
+    v = atomic_load_explicit(&src->max_ns, memory_order_relaxed);
+    if (v > atomic_load_explicit(&dst->max_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&dst->max_ns, v, memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < LAT_NUM_BUCKETS; i++)
+    {
+        lat_add(&dst->buckets[i], atomic_load_explicit(&src->buckets[i], memory_order_relaxed));
+    }
+}
+
+static void lat_dump_stages(FILE *out, const struct lat_histogram *stages)
+{
+    const struct lat_histogram *h;
+    uint64_t count, b;
+    int first;
+    for (int s = 0; s < LAT_NUM_STAGES; s++)
+    {
+        h     = &stages[s];
+        count = atomic_load_explicit(&h->count, memory_order_relaxed);
+        fprintf(out, "%s\"%s\": {\"count\": %lu", s ? ", " : "", lat_stage_names[s], count);
+        if (count)
+        {
+            fprintf(out,
+                    ", \"min_ns\": %lu, \"avg_ns\": %lu, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+                    "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu",
+                    atomic_load_explicit(&h->min_ns, memory_order_relaxed),
+                    atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / count,
+                    lat_percentile(h, count, 0.50), lat_percentile(h, count, 0.90),
+                    lat_percentile(h, count, 0.99), lat_percentile(h, count, 0.999),
+                    atomic_load_explicit(&h->max_ns, memory_order_relaxed));
+        }
+        /* 只输出非空的桶, 以[代表值, 个数]表示 */
+        fprintf(out, ", \"buckets\": [");
+        first = 1;
+        for (uint32_t i = 0; i < LAT_NUM_BUCKETS; i++)
+        {
+            b = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+            if (b)
+            {
+                fprintf(out, "%s[%lu, %lu]", first ? "" : ", ", lat_bucket_value(i), b);
+                first = 0;
+            }
+        }
+        fprintf(out, "]}");
+    }
+}
+
+void lat_dump()
+{
+    static struct lat_histogram total[LAT_NUM_STAGES];
+    FILE *out = stderr;
+    pthread_mutex_lock(&lat_lock);
+    if (lat_path)
+    {
+        out = fopen(lat_path, "w");
+        if (!out)
+        {
+            log_err("Failed to open %s, errno: %d ", lat_path, -errno);
+            pthread_mutex_unlock(&lat_lock);
+            return;
+        }
+    }
+    for (int s = 0; s < LAT_NUM_STAGES; s++)
+    {
+        lat_histogram_init(&total[s]);
+    }
+    fprintf(out, "{\"ns_per_tick\": %.6f, \"threads\": [", lat_ns_per_tick);
+    for (struct lat_thread *t = lat_threads; t; t = t->next)
+    {
+        fprintf(out, "%s{\"thread\": %u, ", t == lat_threads ? "" : ", ", t->id);
+        lat_dump_stages(out, t->stages);
+        fprintf(out, "}");
+        for (int s = 0; s < LAT_NUM_STAGES; s++)
+        {
+            lat_histogram_merge(&total[s], &t->stages[s]);
+        }
+    }
+    fprintf(out, "], \"total\": {");
+    lat_dump_stages(out, total);
+    fprintf(out, "}}\n");
+    if (out != stderr)
+    {
+        fclose(out);
+    }
+    pthread_mutex_unlock(&lat_lock);
+}
+
+/* 以CLOCK_MONOTONIC为基准估计每个计数器刻度的纳秒数 */
+static void lat_calibrate()
+{
+    struct timespec start, end, delay = {.tv_sec = 0, .tv_nsec = 20 * 1000 * 1000};
+    uint64_t t0, t1;
+    int64_t ns;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    t0 = lat_now();
+    nanosleep(&delay, NULL);
+    t1 = lat_now();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    if (t1 > t0 && ns > 0)
+    {
+        lat_ns_per_tick = (double)ns / (double)(t1 - t0);
+    }
+}
+
+/* 每收到一次SIGUSR1输出一次当前的直方图 */
+static void *lat_signal_main(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+    for (;;)
+    {
+        if (sigwait(set, &sig) == 0 && sig == SIGUSR1)
+        {
+            lat_dump();
+        }
+    }
+    return NULL;
+}
+
+int lat_init(const char *path)
+{
+    static sigset_t set;
+    pthread_t tid;
+    int ret = -1;
+    if (!LAT_ENABLED)
+    {
+        if (path)
+        {
+            log_warn("Built without RDMA_LATENCY_TRACE, %s will not be written ", path);
+        }
+        return 0;
+    }
+    lat_path = path;
+    lat_calibrate();
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    ret = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (ret)
+    {
+        log_err("Failed to block SIGUSR1, errno: %d ", ret);
+        return -ret;
+    }
+    ret = pthread_create(&tid, NULL, lat_signal_main, &set);
+    if (ret)
+    {
+        log_err("Failed to create the latency dump thread, errno: %d ", ret);
+        return -ret;
+    }
+    pthread_detach(tid);
+    if (atexit(lat_dump))
+    {
+        log_err("Failed to register the latency dump at exit ");
+        return -EINVAL;
+    }
+    debug("Latency tracing enabled, %.4f ns per tick ", lat_ns_per_tick);
+    return 0;
+}
@@ -0,0 +1,768 @@
+#include "mr_pool.h"
+#include "utils.h"
+
+/*
+ * 每个保护域一个内存池:
+ *  - slab: 按2的幂分级, 从少量大的arena MR中切分, 释放后进入对应级别的空闲链表,
+ *    稳态下的rdma_buffer_alloc()/rdma_buffer_free()不再进入内核。
+ *    同一arena中的slab共享一个MR, 因此只服务仅本地访问的分配, 其rkey从不发布给对端。
+ *  - 远端缓冲区: 带远端权限的分配各自注册, 每个rkey只覆盖一个缓冲区。释放时以ibv_rereg_mr()
+ *    撤销远端权限后按级别保留, 再次分配时重新授予请求的权限; 设备重新授权后rkey不变时,
+ *    之前的持有者仍可访问, 此时不再回收, 改为每次注册。
+ *  - 注册缓存: 按地址区间缓存用户缓冲区的注册, rdma_buffer_register()命中时直接复用,
+ *    引用计数归零的条目按LRU保留至多MR_CACHE_MAX_IDLE_ENTRIES个。
+ *    带远端权限的注册不按页扩展, 只有区间与权限都相同的请求才复用, rkey不会覆盖相邻的缓冲区。
+ */
+
+struct mr_arena
+{
+    struct ibv_mr *mr;
+    struct host_buffer buffer;
+    char *base;
+    size_t size, used;
+    struct mr_arena *next;
+};
+
+struct mr_cache_entry
+{
+    struct ibv_mr *mr;
+    uintptr_t start, end;
+    int access;
+    uint32_t refcnt;
+    int stale; /* 已失效但仍被引用, 不再参与查找, 引用归零时释放 */
+    struct mr_cache_entry *prev, *next;
+};
+
+struct mr_pool
+{
+    struct ibv_pd *pd;
+    size_t arena_size;
+    pthread_mutex_t lock;
+    struct mr_arena *arenas;
+    struct rdma_mr_handle *free_slabs[MR_POOL_NUM_CLASSES];
+    struct rdma_mr_handle *free_remote[MR_POOL_NUM_CLASSES];
+    uint32_t idle_remote[MR_POOL_NUM_CLASSES];
+    int no_remote_recycle; /* 设备重新授权时不更换rkey */
+    /* 缓存条目按最近使用排序, 头部最新 */
+    struct mr_cache_entry *cache;
+    uint32_t idle_entries;
+    struct mr_pool_stats stats;
+    struct mr_pool *next;
+};
+
+static struct mr_pool *pools       = NULL;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mr_pool *find_pool(struct ibv_pd *pd)
+{
+    struct mr_pool *pool;
+    pthread_mutex_lock(&pools_lock);
+    for (pool = pools; pool && pool->pd != pd; pool = pool->next)
+        ;
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+int mr_pool_create(struct ibv_pd *pd, size_t arena_size)
+{
+    struct mr_pool *pool;
+    if (!pd)
+    {
+        log_err("Protection domain is NULL");
+        return -EINVAL;
+    }
+    if (find_pool(pd))
+    {
+        return 0;
+    }
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+    {
+        log_err("Failed to allocate memory pool, -ENOMEM ");
+        return -ENOMEM;
+    }
+    pool->pd         = pd;
+    pool->arena_size = arena_size;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_lock(&pools_lock);
+    pool->next = pools;
+    pools      = pool;
+    pthread_mutex_unlock(&pools_lock);
+    debug("Memory pool is created for pd %p, arena size: %zu ", pd, arena_size);
+    return 0;
+}
+
+static void cache_unlink(struct mr_pool *pool, struct mr_cache_entry *entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        pool->cache = entry->next;
+    }
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+static void cache_push_front(struct mr_pool *pool, struct mr_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = pool->cache;
+    if (pool->cache)
+    {
+        pool->cache->prev = entry;
+    }
+    pool->cache = entry;
+}
+
+static void cache_drop(struct mr_pool *pool, struct mr_cache_entry *entry)
+{
+    cache_unlink(pool, entry);
+    if (entry->refcnt == 0)
+    {
+        pool->idle_entries--;
+    }
+    pool->stats.cache_entries--;
+    debug("Cached registration dropped: 0x%lx - 0x%lx ", entry->start, entry->end);
+    ibv_dereg_mr(entry->mr);
+    free(entry);
+}
+
+/* 注销并释放一个远端缓冲区 */
+static void remote_destroy(struct rdma_mr_handle *handle)
+{
+    if (ibv_dereg_mr(handle->backing))
+    {
+        log_err("Failed to deregister remote buffer %p, errno: %d ", handle->view.addr, -errno);
+    }
+    host_buffer_free(&handle->buffer);
+    free(handle);
+}
+
+void mr_pool_destroy(struct ibv_pd *pd)
+{
+    struct mr_pool **pp, *pool = NULL;
+    struct mr_arena *arena;
+    struct rdma_mr_handle *handle;
+    int i;
+    pthread_mutex_lock(&pools_lock);
+    for (pp = &pools; *pp; pp = &(*pp)->next)
+    {
+        if ((*pp)->pd == pd)
+        {
+            pool = *pp;
+            *pp  = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pools_lock);
+    if (!pool)
+    {
+        return;
+    }
+    if (pool->stats.slab_bytes_used)
+    {
+        log_warn("Destroying memory pool with %lu bytes of slabs still in use ",
+                 pool->stats.slab_bytes_used);
+    }
+    while (pool->cache)
+    {
+        if (pool->cache->refcnt)
+        {
+            log_warn("Cached registration 0x%lx is still referenced ", pool->cache->start);
+        }
+        cache_drop(pool, pool->cache);
+    }
+    for (i = 0; i < MR_POOL_NUM_CLASSES; i++)
+    {
+        while ((handle = pool->free_slabs[i]) != NULL)
+        {
+            pool->free_slabs[i] = handle->next_free;
+            free(handle);
+        }
+        while ((handle = pool->free_remote[i]) != NULL)
+        {
+            pool->free_remote[i] = handle->next_free;
+            remote_destroy(handle);
+        }
+    }
+    while ((arena = pool->arenas) != NULL)
+    {
+        pool->arenas = arena->next;
+        ibv_dereg_mr(arena->mr);
+        host_buffer_free(&arena->buffer);
+        free(arena);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    debug("Memory pool of pd %p is destroyed ", pd);
+}
+
+void mr_cache_invalidate(void *addr, size_t len)
+{
+    uintptr_t start = (uintptr_t)addr, end = start + len;
+    struct mr_cache_entry *entry, *next;
+    struct mr_pool *pool;
+    pthread_mutex_lock(&pools_lock);
+    for (pool = pools; pool; pool = pool->next)
+    {
+        pthread_mutex_lock(&pool->lock);
+        for (entry = pool->cache; entry; entry = next)
+        {
+            next = entry->next;
+            if (entry->start >= end || entry->end <= start)
+            {
+                continue;
+            }
+            if (entry->refcnt)
+            {
+                /* 区间中仍有其他缓冲区在使用该注册, 待引用归零时再释放 */
+                entry->stale = 1;
+                continue;
+            }
+            cache_drop(pool, entry);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+int mr_pool_get_stats(struct ibv_pd *pd, struct mr_pool_stats *stats)
+{
+    struct mr_pool *pool = find_pool(pd);
+    if (!pool)
+    {
+        return -ENOENT;
+    }
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* 返回能容纳size的最小级别, 超出最大级别时返回-1 */
+static int slab_class_of(size_t size)
+{
+    int shift = MR_POOL_MIN_SLAB_SHIFT;
+    while (((size_t)1 << shift) < size)
+    {
+        if (++shift > MR_POOL_MAX_SLAB_SHIFT)
+        {
+            return -1;
+        }
+    }
+    return shift - MR_POOL_MIN_SLAB_SHIFT;
+}
+
+static struct mr_arena *arena_create(struct mr_pool *pool, size_t min_size)
+{
+    struct mr_arena *arena = NULL;
+    size_t size            = pool->arena_size > min_size ? pool->arena_size : min_size;
+    arena                  = calloc(1, sizeof(*arena));
+    if (!arena)
+    {
+        return NULL;
+    }
+    /* arena与独立分配的缓冲区使用相同的页面来源, 大页可显著减少MTT条目 */
+    if (host_buffer_alloc(&arena->buffer, size, get_buffer_backing()))
+    {
+        free(arena);
+        return NULL;
+    }
+    arena->base = arena->buffer.addr;
+    arena->mr   = ibv_reg_mr(pool->pd, arena->base, size, MR_POOL_ACCESS);
+    if (!arena->mr)
+    {
+        log_err("Failed to register arena of %zu bytes, errno: %d ", size, -errno);
+        host_buffer_free(&arena->buffer);
+        free(arena);
+        return NULL;
+    }
+    arena->size  = size;
+    arena->next  = pool->arenas;
+    pool->arenas = arena;
+    pool->stats.arena_bytes += size;
+    debug("Arena registered: %p , len: %zu , stag: 0x%x ", arena->base, size, arena->mr->lkey);
+    return arena;
+}
+
+/* 从arena中按slab大小对齐切分一个新的slab */
+static struct rdma_mr_handle *slab_carve(struct mr_pool *pool, int slab_class)
+{
+    size_t slab_size = (size_t)1 << (slab_class + MR_POOL_MIN_SLAB_SHIFT);
+    size_t align     = slab_size < 4096 ? slab_size : 4096;
+    struct rdma_mr_handle *handle;
+    struct mr_arena *arena;
+    size_t offset = 0;
+    for (arena = pool->arenas; arena; arena = arena->next)
+    {
+        offset = (arena->used + align - 1) & ~(align - 1);
+        if (offset + slab_size <= arena->size)
+        {
+            break;
+        }
+    }
+    if (!arena)
+    {
+        arena = arena_create(pool, slab_size);
+        if (!arena)
+        {
+            return NULL;
+        }
+        offset = 0;
+    }
+    handle = calloc(1, sizeof(*handle));
+    if (!handle)
+    {
+        return NULL;
+    }
+    arena->used          = offset + slab_size;
+    handle->view         = *arena->mr;
+    handle->view.addr    = arena->base + offset;
+    handle->kind         = RDMA_MR_SLAB;
+    handle->backing      = arena->mr;
+    handle->u.slab_class = slab_class;
+    return handle;
+}
+
+struct ibv_mr *mr_pool_alloc(struct ibv_pd *pd, size_t size, int access)
+{
+    struct rdma_mr_handle *handle;
+    struct mr_pool *pool;
+    int slab_class;
+    if ((slab_class = slab_class_of(size)) < 0)
+    {
+        return NULL;
+    }
+    pool = find_pool(pd);
+    /* 带远端权限的缓冲区不能与其他slab共享rkey */
+    if (!pool || !pool->arena_size || (access & ~MR_POOL_ACCESS))
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.slab_allocs++;
+    handle = pool->free_slabs[slab_class];
+    if (handle)
+    {
+        pool->free_slabs[slab_class] = handle->next_free;
+        pool->stats.slab_hits++;
+    }
+    else
+    {
+        handle = slab_carve(pool, slab_class);
+    }
+    if (handle)
+    {
+        pool->stats.slab_bytes_used += (size_t)1 << (slab_class + MR_POOL_MIN_SLAB_SHIFT);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!handle)
+    {
+        return NULL;
+    }
+    handle->next_free   = NULL;
+    handle->view.length = size;
+    /* 与calloc()语义一致, 也避免把上一个使用者的数据暴露给新的对端 */
+    memset(handle->view.addr, 0, size);
+    debug("Slab allocated: %p , size: %zu , class: %d ", handle->view.addr, size, slab_class);
+    return &handle->view;
+}
+
+/* 重新授予空闲远端缓冲区请求的权限, rkey必须与上一个使用者持有的不同 */
+static int remote_rekey(struct mr_pool *pool, struct rdma_mr_handle *handle, int access)
+{
+    uint32_t old_rkey = handle->view.rkey;
+    if (ibv_rereg_mr(handle->backing, IBV_REREG_MR_CHANGE_ACCESS, NULL, NULL, 0, access))
+    {
+        log_warn("Failed to re-register remote buffer %p, errno: %d ", handle->view.addr,
+                 -errno);
+        return -EINVAL;
+    }
+    if (handle->backing->rkey == old_rkey)
+    {
+        log_warn("Re-registration keeps rkey 0x%x, remote buffers are no longer recycled ",
+                 old_rkey);
+        pool->no_remote_recycle = 1;
+        return -EPERM;
+    }
+    return 0;
+}
+
+struct ibv_mr *mr_pool_alloc_remote(struct ibv_pd *pd, size_t size, int access)
+{
+    struct rdma_mr_handle *handle = NULL;
+    struct mr_pool *pool;
+    int slab_class;
+    if ((slab_class = slab_class_of(size)) < 0)
+    {
+        return NULL;
+    }
+    pool = find_pool(pd);
+    if (!pool || !pool->arena_size || pool->no_remote_recycle)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.remote_allocs++;
+    handle = pool->free_remote[slab_class];
+    if (handle)
+    {
+        pool->free_remote[slab_class] = handle->next_free;
+        pool->idle_remote[slab_class]--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (handle && remote_rekey(pool, handle, access))
+    {
+        remote_destroy(handle);
+        handle = NULL;
+    }
+    if (handle)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.remote_hits++;
+        pthread_mutex_unlock(&pool->lock);
+        /* 不把上一个使用者的数据暴露给新的对端 */
+        memset(handle->view.addr, 0, size);
+    }
+    else
+    {
+        /* 按级别大小分配, 释放后可以服务同一级别的其他请求 */
+        handle = calloc(1, sizeof(*handle));
+        if (!handle)
+        {
+            return NULL;
+        }
+        if (host_buffer_alloc(&handle->buffer,
+                              (size_t)1 << (slab_class + MR_POOL_MIN_SLAB_SHIFT),
+                              get_buffer_backing()))
+        {
+            free(handle);
+            return NULL;
+        }
+        handle->backing = ibv_reg_mr(pd, handle->buffer.addr, handle->buffer.size, access);
+        if (!handle->backing)
+        {
+            log_err("Failed to register remote buffer, errno: %d ", -errno);
+            host_buffer_free(&handle->buffer);
+            free(handle);
+            return NULL;
+        }
+        handle->kind         = RDMA_MR_REMOTE;
+        handle->owns_buffer  = 1;
+        handle->u.slab_class = slab_class;
+    }
+    handle->next_free   = NULL;
+    handle->view        = *handle->backing;
+    handle->view.length = size;
+    debug("Remote buffer allocated: %p , size: %zu , rkey: 0x%x ", handle->view.addr, size,
+          handle->view.rkey);
+    return &handle->view;
+}
+
+void mr_pool_free_remote(struct rdma_mr_handle *handle)
+{
+    struct mr_pool *pool = find_pool(handle->view.pd);
+    int slab_class       = handle->u.slab_class;
+    void *addr           = handle->view.addr;
+    /* 先撤销远端权限, 之后发布出去的rkey不能再访问该缓冲区 */
+    if (!pool || pool->no_remote_recycle ||
+        ibv_rereg_mr(handle->backing, IBV_REREG_MR_CHANGE_ACCESS, NULL, NULL, 0,
+                     IBV_ACCESS_LOCAL_WRITE))
+    {
+        remote_destroy(handle);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_remote[slab_class] < MR_POOL_MAX_IDLE_REMOTE)
+    {
+        handle->next_free             = pool->free_remote[slab_class];
+        pool->free_remote[slab_class] = handle;
+        pool->idle_remote[slab_class]++;
+        handle = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (handle)
+    {
+        remote_destroy(handle);
+        return;
+    }
+    debug("Remote buffer freed: %p ", addr);
+}
+
+int mr_pool_free(struct rdma_mr_handle *handle)
+{
+    struct mr_pool *pool = find_pool(handle->view.pd);
+    int slab_class       = handle->u.slab_class;
+    if (!pool)
+    {
+        log_err("Slab %p does not belong to any memory pool ", handle->view.addr);
+        return -ENOENT;
+    }
+    pthread_mutex_lock(&pool->lock);
+    handle->next_free            = pool->free_slabs[slab_class];
+    pool->free_slabs[slab_class] = handle;
+    pool->stats.slab_bytes_used -= (size_t)1 << (slab_class + MR_POOL_MIN_SLAB_SHIFT);
+    pthread_mutex_unlock(&pool->lock);
+    debug("Slab freed: %p ", handle->view.addr);
+    return 0;
+}
+
+struct ibv_mr *mr_cache_register(struct ibv_pd *pd, void *addr, size_t size, int access)
+{
+    uintptr_t start = (uintptr_t)addr, end = start + size;
+    uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    struct mr_cache_entry *entry;
+    struct rdma_mr_handle *handle;
+    struct mr_pool *pool = find_pool(pd);
+    int remote           = !!(access & ~IBV_ACCESS_LOCAL_WRITE);
+    if (!pool)
+    {
+        return NULL;
+    }
+    handle = calloc(1, sizeof(*handle));
+    if (!handle)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.cache_lookups++;
+    for (entry = pool->cache; entry; entry = entry->next)
+    {
+        if (entry->stale)
+        {
+            continue;
+        }
+        if (remote ? (entry->start == start && entry->end == end && entry->access == access)
+                   : (entry->start <= start && end <= entry->end &&
+                      (entry->access & access) == access))
+        {
+            break;
+        }
+    }
+    if (entry)
+    {
+        pool->stats.cache_hits++;
+        if (entry->refcnt++ == 0)
+        {
+            pool->idle_entries--;
+        }
+        cache_unlink(pool, entry);
+    }
+    else
+    {
+        /* 仅本地访问的注册按页对齐, 让相邻的小缓冲区也能命中同一条目 */
+        entry = calloc(1, sizeof(*entry));
+        if (entry)
+        {
+            entry->start  = remote ? start : start & ~page_mask;
+            entry->end    = remote ? end : (end + page_mask) & ~page_mask;
+            entry->access = access;
+            entry->refcnt = 1;
+            entry->mr     = ibv_reg_mr(pd, (void *)entry->start, entry->end - entry->start, access);
+            if (!entry->mr)
+            {
+                log_err("Failed to register memory region, errno: %d ", -errno);
+                free(entry);
+                entry = NULL;
+            }
+            else
+            {
+                pool->stats.cache_entries++;
+            }
+        }
+    }
+    if (entry)
+    {
+        cache_push_front(pool, entry);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!entry)
+    {
+        free(handle);
+        return NULL;
+    }
+    handle->view        = *entry->mr;
+    handle->view.addr   = addr;
+    handle->view.length = size;
+    handle->kind        = RDMA_MR_CACHED;
+    handle->backing     = entry->mr;
+    handle->u.entry     = entry;
+    debug("Registered (cached): %p , len: %zu , stag: 0x%x ", addr, size, entry->mr->lkey);
+    return &handle->view;
+}
+
+int mr_cache_deregister(struct rdma_mr_handle *handle)
+{
+    struct mr_cache_entry *entry = handle->u.entry, *victim;
+    struct mr_pool *pool         = find_pool(handle->view.pd);
+    if (!pool)
+    {
+        log_err("Registration %p does not belong to any memory pool ", handle->view.addr);
+        return -ENOENT;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (--entry->refcnt == 0 && entry->stale)
+    {
+        pool->idle_entries++;
+        cache_drop(pool, entry);
+    }
+    else if (entry->refcnt == 0)
+    {
+        pool->idle_entries++;
+        /* 超出上限时从尾部 (最久未使用) 开始淘汰空闲条目 */
+        for (victim = pool->cache; victim && victim->next; victim = victim->next)
+            ;
+        while (pool->idle_entries > MR_CACHE_MAX_IDLE_ENTRIES && victim)
+        {
+            struct mr_cache_entry *prev = victim->prev;
+            if (victim->refcnt == 0)
+            {
+                cache_drop(pool, victim);
+            }
+            victim = prev;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    debug("Deregistered (cached): %p ", handle->view.addr);
+    free(handle);
+    return 0;
+}
+
+/* 启用了ODP注册的保护域 */
+struct odp_domain
+{
+    struct ibv_pd *pd;
+    enum mr_odp_mode mode;
+    int access;                 /* 显式ODP注册可以使用的访问权限 */
+    struct ibv_mr *implicit_mr; /* MR_ODP_IMPLICIT时覆盖整个地址空间, 仅本地访问 */
+    struct odp_domain *next;
+};
+
+static struct odp_domain *odp_domains = NULL;
+static pthread_mutex_t odp_lock      = PTHREAD_MUTEX_INITIALIZER;
+
+static struct odp_domain *find_odp_domain(struct ibv_pd *pd)
+{
+    struct odp_domain *d;
+    pthread_mutex_lock(&odp_lock);
+    for (d = odp_domains; d && d->pd != pd; d = d->next)
+        ;
+    pthread_mutex_unlock(&odp_lock);
+    return d;
+}
+
+int mr_odp_enable(struct ibv_pd *pd, enum mr_odp_mode mode)
+{
+    struct odp_domain *d;
+    int access;
+    if (!pd)
+    {
+        log_err("Protection domain is NULL");
+        return -EINVAL;
+    }
+    d = find_odp_domain(pd);
+    if (d)
+    {
+        return d->mode;
+    }
+    mode = device_odp_mode(pd->context, mode, &access);
+    if (mode == MR_ODP_OFF)
+    {
+        return MR_ODP_OFF;
+    }
+    d = calloc(1, sizeof(*d));
+    if (!d)
+    {
+        log_err("Failed to allocate ODP domain, -ENOMEM ");
+        return -ENOMEM;
+    }
+    d->pd     = pd;
+    d->access = access;
+    if (mode == MR_ODP_IMPLICIT)
+    {
+        /* 隐式MR不授予远端权限, 否则其rkey可以访问进程的全部内存 */
+        d->implicit_mr =
+            ibv_reg_mr(pd, NULL, SIZE_MAX, (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND));
+        if (!d->implicit_mr)
+        {
+            log_warn("Failed to register implicit ODP MR, errno: %d, using explicit ", -errno);
+            mode = MR_ODP_EXPLICIT;
+        }
+    }
+    d->mode = mode;
+    pthread_mutex_lock(&odp_lock);
+    d->next     = odp_domains;
+    odp_domains = d;
+    pthread_mutex_unlock(&odp_lock);
+    log_info("On-demand paging (%s) is enabled for pd %p ", mr_odp_mode_str(mode), pd);
+    return mode;
+}
+
+void mr_odp_disable(struct ibv_pd *pd)
+{
+    struct odp_domain **pp, *d = NULL;
+    pthread_mutex_lock(&odp_lock);
+    for (pp = &odp_domains; *pp; pp = &(*pp)->next)
+    {
+        if ((*pp)->pd == pd)
+        {
+            d   = *pp;
+            *pp = d->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&odp_lock);
+    if (!d)
+    {
+        return;
+    }
+    if (d->implicit_mr && ibv_dereg_mr(d->implicit_mr))
+    {
+        log_err("Failed to deregister implicit ODP MR, errno: %d ", -errno);
+    }
+    free(d);
+}
+
+struct ibv_mr *mr_odp_register(struct ibv_pd *pd, void *addr, size_t size, int access)
+{
+    struct odp_domain *d = find_odp_domain(pd);
+    struct rdma_mr_handle *handle;
+    if (!d || (access & ~d->access))
+    {
+        return NULL;
+    }
+    handle = calloc(1, sizeof(*handle));
+    if (!handle)
+    {
+        return NULL;
+    }
+    if (d->implicit_mr && !(access & ~IBV_ACCESS_LOCAL_WRITE))
+    {
+        handle->view        = *d->implicit_mr;
+        handle->view.addr   = addr;
+        handle->view.length = size;
+        handle->kind        = RDMA_MR_IMPLICIT;
+        handle->backing     = d->implicit_mr;
+        debug("Registered (implicit ODP): %p , len: %zu , stag: 0x%x ", addr, size,
+              handle->view.lkey);
+        return &handle->view;
+    }
+    handle->backing = ibv_reg_mr(pd, addr, size, access | IBV_ACCESS_ON_DEMAND);
+    if (!handle->backing)
+    {
+        log_warn("Failed to register %zu bytes on demand, errno: %d, pinning instead ", size,
+                 -errno);
+        free(handle);
+        return NULL;
+    }
+    handle->view = *handle->backing;
+    handle->kind = RDMA_MR_DIRECT;
+    debug("Registered (ODP): %p , len: %zu , stag: 0x%x ", addr, size, handle->view.lkey);
+    return &handle->view;
+}
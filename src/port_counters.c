@@ -0,0 +1,264 @@
+#include "port_counters.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "utils.h"
+
+_Atomic uint64_t port_app_bytes = 0;
+
+/* 已知的计数器, 同一类别的字节与包数只取第一个存在的, 其余类别累加 */
+static const struct
+{
+    const char *dir, *name;
+    enum port_counter_kind kind;
+    uint32_t scale;
+} port_counter_table[] = {
+    {"counters", "port_xmit_data", PORT_COUNTER_TX_BYTES, 4},
+    {"counters", "port_rcv_data", PORT_COUNTER_RX_BYTES, 4},
+    {"counters", "port_xmit_packets", PORT_COUNTER_TX_PACKETS, 1},
+    {"hw_counters", "sent_pkts", PORT_COUNTER_TX_PACKETS, 1}, /* rxe */
+    {"counters", "port_rcv_packets", PORT_COUNTER_RX_PACKETS, 1},
+    {"hw_counters", "rcvd_pkts", PORT_COUNTER_RX_PACKETS, 1}, /* rxe */
+    {"hw_counters", "local_ack_timeout_err", PORT_COUNTER_RETRANSMITS, 1},
+    {"hw_counters", "packet_seq_err", PORT_COUNTER_RETRANSMITS, 1},
+    {"hw_counters", "implied_nak_seq_err", PORT_COUNTER_RETRANSMITS, 1},
+    {"hw_counters", "completer_retry_err", PORT_COUNTER_RETRANSMITS, 1}, /* rxe */
+    {"hw_counters", "rcvd_seq_err", PORT_COUNTER_RETRANSMITS, 1},        /* rxe */
+    {"hw_counters", "out_of_sequence", PORT_COUNTER_OUT_OF_SEQUENCE, 1},
+    {"hw_counters", "out_of_seq_request", PORT_COUNTER_OUT_OF_SEQUENCE, 1}, /* rxe */
+    {"hw_counters", "rnr_nak_retry_err", PORT_COUNTER_RNR_NAKS, 1},
+    {"hw_counters", "rcvd_rnr_err", PORT_COUNTER_RNR_NAKS, 1}, /* rxe */
+    {"hw_counters", "send_rnr_err", PORT_COUNTER_RNR_NAKS, 1}, /* rxe */
+};
+
+static const char *const port_counter_names[PORT_NUM_COUNTER_KINDS] = {
+    [PORT_COUNTER_TX_BYTES]        = "tx",
+    [PORT_COUNTER_RX_BYTES]        = "rx",
+    [PORT_COUNTER_TX_PACKETS]      = "tx_pkts",
+    [PORT_COUNTER_RX_PACKETS]      = "rx_pkts",
+    [PORT_COUNTER_RETRANSMITS]     = "retrans",
+    [PORT_COUNTER_OUT_OF_SEQUENCE] = "oos",
+    [PORT_COUNTER_RNR_NAKS]        = "rnr",
+};
+
+static int port_counter_is_bytes(enum port_counter_kind kind)
+{
+    return kind == PORT_COUNTER_TX_BYTES || kind == PORT_COUNTER_RX_BYTES;
+}
+
+static int port_counter_read(int fd, uint64_t *value)
+{
+    char buf[32];
+    char *end = NULL;
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+    {
+        return -EIO;
+    }
+    buf[n] = '\0';
+    *value = strtoull(buf, &end, 10);
+    return end == buf ? -EINVAL : 0;
+}
+
+/* 打开表中存在且可读的计数器 */
+static void port_counters_open(struct port_sampler *s, const char *dev, uint8_t port_num)
+{
+    struct port_counter *c;
+    char path[256];
+    int exclusive;
+    for (size_t i = 0; i < sizeof(port_counter_table) / sizeof(port_counter_table[0]); i++)
+    {
+        exclusive = port_counter_is_bytes(port_counter_table[i].kind) ||
+                    port_counter_table[i].kind == PORT_COUNTER_TX_PACKETS ||
+                    port_counter_table[i].kind == PORT_COUNTER_RX_PACKETS;
+        if ((exclusive && s->available[port_counter_table[i].kind]) ||
+            s->num_counters == PORT_SAMPLER_MAX_COUNTERS)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/class/infiniband/%s/ports/%u/%s/%s", dev, port_num,
+                 port_counter_table[i].dir, port_counter_table[i].name);
+        c     = &s->counters[s->num_counters];
+        c->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (c->fd < 0)
+        {
+            continue;
+        }
+        if (port_counter_read(c->fd, &c->last))
+        {
+            close(c->fd);
+            continue;
+        }
+        c->kind  = port_counter_table[i].kind;
+        c->scale = port_counter_table[i].scale;
+        s->available[c->kind] = 1;
+        s->num_counters++;
+        debug("Sampling %s ", path);
+    }
+}
+
+/* 读取一次所有计数器并输出与上次采样之间的增量 */
+static void port_sampler_sample(struct port_sampler *s, const char *label)
+{
+    uint64_t deltas[PORT_NUM_COUNTER_KINDS] = {0};
+    uint64_t now = now_ns(), value, app;
+    double secs  = (double)(now - s->last_ns) / 1e9;
+    char line[512];
+    int len;
+    for (uint32_t i = 0; i < s->num_counters; i++)
+    {
+        struct port_counter *c = &s->counters[i];
+        if (port_counter_read(c->fd, &value))
+        {
+            continue;
+        }
+        /* 计数器被清零或回绕时本区间记为0 */
+        if (value >= c->last)
+        {
+            deltas[c->kind] += (value - c->last) * c->scale;
+        }
+        c->last = value;
+    }
+    app = atomic_load_explicit(&port_app_bytes, memory_order_relaxed);
+    if (secs <= 0)
+    {
+        secs = 1e-9;
+    }
+    len = snprintf(line, sizeof(line), "[COUNTERS] %s %s t=%.3fs app=%.3fGb/s", s->name, label,
+                   (double)(now - s->start_ns) / 1e9, (double)(app - s->app_last) * 8 / secs / 1e9);
+    for (int k = 0; k < PORT_NUM_COUNTER_KINDS && len < (int)sizeof(line); k++)
+    {
+        atomic_fetch_add_explicit(&s->totals[k], deltas[k], memory_order_relaxed);
+        if (!s->available[k])
+        {
+            len += snprintf(line + len, sizeof(line) - len, " %s=-", port_counter_names[k]);
+        }
+        else if (port_counter_is_bytes(k))
+        {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%.3fGb/s", port_counter_names[k],
+                            (double)deltas[k] * 8 / secs / 1e9);
+        }
+        else
+        {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%lu", port_counter_names[k],
+                            deltas[k]);
+        }
+    }
+    fprintf(stderr, "%s\n", line);
+    s->last_ns  = now;
+    s->app_last = app;
+}
+
+static void *port_sampler_main(void *arg)
+{
+    struct port_sampler *s = arg;
+    struct timespec deadline;
+    uint64_t next = s->start_ns;
+    int ret;
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop)
+    {
+        next += s->interval_ns;
+        deadline.tv_sec  = (time_t)(next / 1000000000ULL);
+        deadline.tv_nsec = (long)(next % 1000000000ULL);
+        /* 间隔到期或被port_sampler_stop()唤醒 */
+        ret = 0;
+        while (!s->stop && ret != ETIMEDOUT)
+        {
+            ret = pthread_cond_timedwait(&s->cond, &s->lock, &deadline);
+        }
+        if (!s->stop)
+        {
+            port_sampler_sample(s, "interval");
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+struct port_sampler *port_sampler_start(struct ibv_context *verbs,
+                                        uint8_t port_num,
+                                        uint32_t interval_ms)
+{
+    const char *dev = ibv_get_device_name(verbs->device);
+    struct port_sampler *s;
+    pthread_condattr_t attr;
+    int ret = -1;
+    if (!interval_ms)
+    {
+        log_err("Counter sampling interval must be positive");
+        return NULL;
+    }
+    s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        log_err("Failed to allocate the counter sampler, -ENOMEM ");
+        return NULL;
+    }
+    snprintf(s->name, sizeof(s->name), "%s/%u", dev, port_num);
+    port_counters_open(s, dev, port_num);
+    if (!s->num_counters)
+    {
+        log_warn("No readable counters under /sys/class/infiniband/%s/ports/%u ", dev, port_num);
+        free(s);
+        return NULL;
+    }
+    s->interval_ns = (uint64_t)interval_ms * 1000000ULL;
+    s->start_ns = s->last_ns = now_ns();
+    s->app_start = s->app_last = atomic_load_explicit(&port_app_bytes, memory_order_relaxed);
+    /* 截止时间按CLOCK_MONOTONIC计算, 与now_ns()一致 */
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    ret = pthread_create(&s->thread, NULL, port_sampler_main, s);
+    if (ret)
+    {
+        log_err("Failed to create the counter sampler, errno: %d ", ret);
+        for (uint32_t i = 0; i < s->num_counters; i++)
+        {
+            close(s->counters[i].fd);
+        }
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return NULL;
+    }
+    log_info("Sampling %u counters of %s every %u ms ", s->num_counters, s->name, interval_ms);
+    return s;
+}
+
+void port_sampler_stop(struct port_sampler *s)
+{
+    double secs;
+    if (!s)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    port_sampler_sample(s, "final");
+    secs = (double)(s->last_ns - s->start_ns) / 1e9;
+    fprintf(stderr,
+            "[COUNTERS] %s total t=%.3fs app=%lu B tx=%lu B rx=%lu B tx_pkts=%lu rx_pkts=%lu "
+            "retrans=%lu oos=%lu rnr=%lu\n",
+            s->name, secs, s->app_last - s->app_start,
+            port_sampler_total(s, PORT_COUNTER_TX_BYTES),
+            port_sampler_total(s, PORT_COUNTER_RX_BYTES),
+            port_sampler_total(s, PORT_COUNTER_TX_PACKETS),
+            port_sampler_total(s, PORT_COUNTER_RX_PACKETS),
+            port_sampler_total(s, PORT_COUNTER_RETRANSMITS),
+            port_sampler_total(s, PORT_COUNTER_OUT_OF_SEQUENCE),
+            port_sampler_total(s, PORT_COUNTER_RNR_NAKS));
+    for (uint32_t i = 0; i < s->num_counters; i++)
+    {
+        close(s->counters[i].fd);
+    }
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
@@ -0,0 +1,176 @@
+#include "rdma_atomic.h"
+
+int rdma_post_atomic(struct ibv_qp *qp,
+                     enum ibv_wr_opcode opcode,
+                     struct ibv_sge *result,
+                     uint64_t remote_addr,
+                     uint32_t rkey,
+                     uint64_t compare_add,
+                     uint64_t swap,
+                     uint64_t wr_id)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    int ret = -1;
+    bzero(&wr, sizeof(wr));
+    wr.wr_id                 = wr_id;
+    wr.sg_list               = result;
+    wr.num_sge               = 1;
+    wr.opcode                = opcode;
+    wr.send_flags            = IBV_SEND_SIGNALED;
+    wr.wr.atomic.remote_addr = remote_addr;
+    wr.wr.atomic.rkey        = rkey;
+    wr.wr.atomic.compare_add = compare_add;
+    wr.wr.atomic.swap        = swap;
+    ret                      = ibv_post_send(qp, &wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post atomic operation, errno: %d ", ret);
+        return -ret;
+    }
+    return 0;
+}
+
+int rdma_atomic_word_init(struct rdma_atomic_word *word,
+                          struct ibv_pd *pd,
+                          struct ibv_qp *qp,
+                          struct ibv_comp_channel *comp_channel,
+                          struct ibv_cq *cq,
+                          struct rdma_buffer_attr *remote,
+                          uint64_t offset)
+{
+    bzero(word, sizeof(*word));
+    if ((remote->address + offset) % sizeof(uint64_t) ||
+        offset + sizeof(uint64_t) > remote->length)
+    {
+        log_err("Atomic word at offset %lu is unaligned or outside the remote buffer ", offset);
+        return -EINVAL;
+    }
+    word->qp           = qp;
+    word->comp_channel = comp_channel;
+    word->cq           = cq;
+    word->remote_addr  = remote->address + offset;
+    word->rkey         = remote->stag.remote_stag;
+    word->result_mr    = rdma_buffer_alloc(pd, sizeof(uint64_t), IBV_ACCESS_LOCAL_WRITE);
+    if (!word->result_mr)
+    {
+        log_err("Failed to allocate atomic result buffer, -ENOMEM ");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void rdma_atomic_word_destroy(struct rdma_atomic_word *word)
+{
+    if (word->result_mr)
+    {
+        rdma_buffer_free(word->result_mr);
+        word->result_mr = NULL;
+    }
+}
+
+/* 执行一个原子操作并等待其完成, 旧值写入result_mr */
+static int atomic_sync(struct rdma_atomic_word *word,
+                       enum ibv_wr_opcode opcode,
+                       uint64_t compare_add,
+                       uint64_t swap,
+                       uint64_t *old)
+{
+    struct ibv_sge sge;
+    struct ibv_wc wc;
+    int ret    = -1;
+    sge.addr   = (uint64_t)word->result_mr->addr;
+    sge.length = sizeof(uint64_t);
+    sge.lkey   = word->result_mr->lkey;
+    ret = rdma_post_atomic(word->qp, opcode, &sge, word->remote_addr, word->rkey, compare_add,
+                           swap, 0);
+    if (ret)
+    {
+        return ret;
+    }
+    ret = collect_work_completions(word->comp_channel, word->cq, &wc, 1, 1);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (old)
+    {
+        *old = *(volatile uint64_t *)word->result_mr->addr;
+    }
+    return 0;
+}
+
+int rdma_fetch_add(struct rdma_atomic_word *word, uint64_t add, uint64_t *old)
+{
+    return atomic_sync(word, IBV_WR_ATOMIC_FETCH_AND_ADD, add, 0, old);
+}
+
+int rdma_compare_swap(struct rdma_atomic_word *word,
+                      uint64_t compare,
+                      uint64_t swap,
+                      uint64_t *old)
+{
+    return atomic_sync(word, IBV_WR_ATOMIC_CMP_AND_SWP, compare, swap, old);
+}
+
+int rdma_counter_next(struct rdma_atomic_word *word, uint64_t delta, uint64_t *value)
+{
+    return rdma_fetch_add(word, delta, value);
+}
+
+int rdma_spin_lock(struct rdma_atomic_word *word, uint64_t owner, uint64_t *attempts)
+{
+    uint64_t old = 0, tries = 0, backoff_us = 1, deadline;
+    int ret      = -1;
+    if (!owner)
+    {
+        log_err("Lock owner must not be 0 ");
+        return -EINVAL;
+    }
+    for (;;)
+    {
+        tries++;
+        ret = rdma_compare_swap(word, 0, owner, &old);
+        if (ret)
+        {
+            return ret;
+        }
+        if (old == 0)
+        {
+            break;
+        }
+        if (old == owner)
+        {
+            log_err("Lock is already held by owner 0x%lx ", owner);
+            return -EDEADLK;
+        }
+        /* 每次重试都要经过网络, 退避可减少对持有者释放锁的干扰 */
+        deadline = now_ns() + backoff_us * 1000ULL;
+        while (now_ns() < deadline)
+            ;
+        if (backoff_us < RDMA_SPIN_LOCK_MAX_BACKOFF_US)
+        {
+            backoff_us <<= 1;
+        }
+    }
+    if (attempts)
+    {
+        *attempts = tries;
+    }
+    return 0;
+}
+
+int rdma_spin_unlock(struct rdma_atomic_word *word, uint64_t owner)
+{
+    uint64_t old = 0;
+    int ret      = rdma_compare_swap(word, owner, 0, &old);
+    if (ret)
+    {
+        return ret;
+    }
+    if (old != owner)
+    {
+        log_err("Lock is held by 0x%lx, not by 0x%lx ", old, owner);
+        return -EPERM;
+    }
+    return 0;
+}
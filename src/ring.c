@@ -0,0 +1,317 @@
+#include "ring.h"
+
+int ring_receiver_init(struct ring_receiver *r, struct ibv_pd *pd, struct ibv_qp *qp, uint64_t size)
+{
+    bzero(r, sizeof(*r));
+    if (!size || size % RING_SLOT_ALIGN || size > RING_MAX_SIZE)
+    {
+        log_err("Invalid ring size %lu, must be a multiple of %d up to %lu ", size,
+                RING_SLOT_ALIGN, RING_MAX_SIZE);
+        return -EINVAL;
+    }
+    r->qp      = qp;
+    r->size    = size;
+    r->ring_mr = rdma_buffer_alloc(pd, size, (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    if (!r->ring_mr)
+    {
+        log_err("Failed to allocate ring of %lu bytes ", size);
+        return -ENOMEM;
+    }
+    if (rdma_write_u64_prepare(pd, &r->credit_mr))
+    {
+        return -ENOMEM;
+    }
+    debug("Ring of %lu bytes is created at %p ", size, r->ring_mr->addr);
+    return 0;
+}
+
+int ring_receiver_set_credit(struct ring_receiver *r, struct rdma_buffer_attr *credit)
+{
+    if (credit->length < sizeof(uint64_t) || credit->address % sizeof(uint64_t))
+    {
+        log_err("Invalid ring credit word at 0x%lx, length %lu ", credit->address,
+                credit->length);
+        return -EINVAL;
+    }
+    r->credit_addr = credit->address;
+    r->credit_rkey = credit->stag.remote_stag;
+    return 0;
+}
+
+void ring_receiver_destroy(struct ring_receiver *r)
+{
+    if (r->credit_mr)
+    {
+        rdma_buffer_free(r->credit_mr);
+        r->credit_mr = NULL;
+    }
+    if (r->ring_mr)
+    {
+        rdma_buffer_free(r->ring_mr);
+        r->ring_mr = NULL;
+    }
+}
+
+const void *ring_receiver_consume(struct ring_receiver *r, uint32_t imm, uint32_t *len)
+{
+    uint64_t offset, head_offset = r->head % r->size;
+    imm    = ntohl(imm);
+    offset = (uint64_t)(imm >> RING_IMM_LEN_BITS) * RING_SLOT_ALIGN;
+    *len   = imm & RING_MAX_MSG_SIZE;
+    if (offset + *len > r->size)
+    {
+        log_err("Ring message [%lu, +%u) is outside the ring ", offset, *len);
+        return NULL;
+    }
+    /* RC按序到达, 偏移不是当前head时只能是发送端跳到了环首 */
+    if (offset != head_offset)
+    {
+        if (offset)
+        {
+            log_err("Ring message at %lu, expected %lu ", offset, head_offset);
+            return NULL;
+        }
+        r->head += r->size - head_offset;
+    }
+    r->head += ring_slot_size(*len);
+    r->messages++;
+    r->bytes += *len;
+    return (char *)r->ring_mr->addr + offset;
+}
+
+int ring_receiver_return_credits(struct ring_receiver *r)
+{
+    int ret = -1;
+    if (r->head - r->credited < r->size / RING_CREDIT_FRACTION)
+    {
+        return 0;
+    }
+    ret = rdma_write_u64(r->qp, r->credit_mr, r->head, r->credit_addr, r->credit_rkey,
+                         IBV_SEND_SIGNALED);
+    if (ret)
+    {
+        log_err("Failed to return ring credits ");
+        return ret;
+    }
+    r->credited = r->head;
+    return 0;
+}
+
+int ring_sender_init(struct ring_sender *s,
+                     struct ibv_pd *pd,
+                     struct ibv_qp *qp,
+                     struct ibv_comp_channel *comp_channel,
+                     struct ibv_cq *cq,
+                     uint32_t depth)
+{
+    bzero(s, sizeof(*s));
+    s->qp              = qp;
+    s->comp_channel    = comp_channel;
+    s->cq              = cq;
+    s->depth           = depth;
+    s->signal_interval = get_signal_interval(depth);
+    s->credit_mr       = rdma_buffer_alloc(pd, sizeof(uint64_t),
+                                           (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    s->staging_mr      = rdma_buffer_alloc(pd, (uint64_t)depth * (RING_MAX_MSG_SIZE + 1),
+                                           IBV_ACCESS_LOCAL_WRITE);
+    if (!s->credit_mr || !s->staging_mr)
+    {
+        log_err("Failed to allocate ring sender buffers, -ENOMEM ");
+        return -ENOMEM;
+    }
+    *(volatile uint64_t *)s->credit_mr->addr = 0;
+    return 0;
+}
+
+int ring_sender_set_ring(struct ring_sender *s, struct rdma_buffer_attr *ring)
+{
+    if (!ring->length || ring->length % RING_SLOT_ALIGN || ring->length > RING_MAX_SIZE)
+    {
+        log_err("Server buffer of %lu bytes is not a ring ", ring->length);
+        return -EPROTO;
+    }
+    s->ring_addr = ring->address;
+    s->size      = ring->length;
+    s->ring_rkey = ring->stag.remote_stag;
+    return 0;
+}
+
+void ring_sender_destroy(struct ring_sender *s)
+{
+    if (s->credit_mr)
+    {
+        rdma_buffer_free(s->credit_mr);
+        s->credit_mr = NULL;
+    }
+    if (s->staging_mr)
+    {
+        rdma_buffer_free(s->staging_mr);
+        s->staging_mr = NULL;
+    }
+}
+
+/* 回收完成的WR, min_wc为0时只做非阻塞检查。wr_id为WR的序号, 其之前的WR也都已完成 */
+static int ring_reap(struct ring_sender *s, int min_wc)
+{
+    struct ibv_wc wc[WC_BATCH];
+    int ret = -1;
+    if (min_wc)
+    {
+        ret = collect_work_completions(s->comp_channel, s->cq, wc, min_wc, WC_BATCH);
+    }
+    else
+    {
+        ret = ibv_poll_cq(s->cq, WC_BATCH, wc);
+        for (int i = 0; i < ret; i++)
+        {
+            if (wc[i].status != IBV_WC_SUCCESS)
+            {
+                log_err("Ring write failed with status: %s ", ibv_wc_status_str(wc[i].status));
+                return -EIO;
+            }
+        }
+    }
+    if (ret < 0)
+    {
+        return ret;
+    }
+    for (int i = 0; i < ret; i++)
+    {
+        if (wc[i].wr_id + 1 > s->completed)
+        {
+            s->completed = wc[i].wr_id + 1;
+        }
+    }
+    return 0;
+}
+
+/* 投递一个WR, 间隔signal_interval个或发送队列将满时请求完成 */
+static int ring_post(struct ring_sender *s, struct ibv_send_wr *wr)
+{
+    struct ibv_send_wr *bad_wr = NULL;
+    int ret                    = -1;
+    wr->wr_id                  = s->posted;
+    if (s->posted + 1 - s->last_signaled >= s->signal_interval ||
+        s->posted + 1 - s->completed >= s->depth)
+    {
+        wr->send_flags |= IBV_SEND_SIGNALED;
+        s->last_signaled = s->posted + 1;
+    }
+    ret = ibv_post_send(s->qp, wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post ring write, errno: %d ", ret);
+        return -ret;
+    }
+    s->posted++;
+    return 0;
+}
+
+int ring_send(struct ring_sender *s, const void *msg, uint32_t len)
+{
+    volatile uint64_t *credit = s->credit_mr->addr;
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+    uint64_t offset = s->tail % s->size, pad = 0, slot = ring_slot_size(len);
+    int ret         = -1;
+    if (len > RING_MAX_MSG_SIZE || slot > s->size)
+    {
+        log_err("Ring message of %u bytes is too large ", len);
+        return -EMSGSIZE;
+    }
+    /* 消息不跨越环尾 */
+    if (offset + slot > s->size)
+    {
+        pad = s->size - offset;
+    }
+    /* 环满时等待接收端写回head, 同时检查之前的WR是否出错 */
+    while (s->tail + pad + slot - *credit > s->size)
+    {
+        ret = ring_reap(s, 0);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    if (s->posted - s->completed >= s->depth)
+    {
+        ret = ring_reap(s, 1);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    s->tail += pad;
+    offset = s->tail % s->size;
+
+    bzero(&wr, sizeof(wr));
+    wr.opcode              = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data            = htonl((uint32_t)(offset / RING_SLOT_ALIGN) << RING_IMM_LEN_BITS | len);
+    wr.wr.rdma.remote_addr = s->ring_addr + offset;
+    wr.wr.rdma.rkey        = s->ring_rkey;
+    wr.sg_list             = &sge;
+    wr.num_sge             = len ? 1 : 0;
+    sge.length             = len;
+    if (len <= get_inline_threshold())
+    {
+        sge.addr      = (uint64_t)msg;
+        sge.lkey      = 0;
+        wr.send_flags = IBV_SEND_INLINE;
+    }
+    else
+    {
+        /* 槽按WR序号轮转, 在途WR不超过depth个, 槽在WR完成前不会被覆盖 */
+        sge.addr = (uint64_t)s->staging_mr->addr + (s->posted % s->depth) * (RING_MAX_MSG_SIZE + 1);
+        sge.lkey = s->staging_mr->lkey;
+        memcpy((void *)sge.addr, msg, len);
+    }
+    ret = ring_post(s, &wr);
+    if (ret)
+    {
+        return ret;
+    }
+    s->tail += slot;
+    return 0;
+}
+
+int ring_sender_flush(struct ring_sender *s)
+{
+    struct ibv_send_wr wr;
+    int ret = -1;
+    if (s->posted == s->completed)
+    {
+        return 0;
+    }
+    /* 最后一个WR没有请求完成时, 补一个请求完成的零长度WRITE, 它完成时之前的WR都已完成 */
+    if (s->last_signaled != s->posted)
+    {
+        if (s->posted - s->completed >= s->depth)
+        {
+            ret = ring_reap(s, 1);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        bzero(&wr, sizeof(wr));
+        wr.opcode              = IBV_WR_RDMA_WRITE;
+        wr.send_flags          = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = s->ring_addr;
+        wr.wr.rdma.rkey        = s->ring_rkey;
+        ret                    = ring_post(s, &wr);
+        if (ret)
+        {
+            return ret;
+        }
+        s->last_signaled = s->posted;
+    }
+    while (s->completed < s->posted)
+    {
+        ret = ring_reap(s, 1);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
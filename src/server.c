@@ -2,17 +2,101 @@
 
 void usage()
 {
-    printf("Usage:");
-    printf("    server [-a <server-address>] [-p <server-port>]");
-    printf("default port: %d", DEFAULT_PORT);
+    printf("Usage:\n");
+    printf("    server [-a <server-address>] [-p <server-port>] \n");
+    printf("           [-m <event|poll|adaptive>] [-u <spin-budget-us>] [-d <queue-depth>] \n");
+    printf("           [-E <cq-mod-count>[,<cq-mod-period-us>]] \n");
+    printf("           [-P <mr-pool-arena-size>] [-H <heap|thp|2m|1g>] [-I <inline-bytes>] \n");
+    printf("           [-O <off|explicit|implicit>] [-w <prewarm-bundles>] [-C <shared-cqs>] \n");
+    printf("           [-S <srq-depth>] [-R <srq-recv-size>] \n");
+    printf("           [-K <kv-buckets>] [-V <kv-log-size>] [-W <ring-size>] [-o <output-dir>] \n");
+    printf("           [-M <counter-interval-ms>] \n");
+    printf("default port: %d, default queue depth: %d\n", DEFAULT_PORT, DEFAULT_QUEUE_DEPTH);
+    printf("default inline threshold: %d bytes, 0 disables inline sends\n",
+           DEFAULT_MAX_INLINE_DATA);
+    printf("default SRQ depth: 0 (per-connection receives), SRQ receive size: %d bytes\n",
+           DEFAULT_SRQ_RECV_SIZE);
+    printf("default memory pool arena: %lu bytes, 0 disables the pool\n",
+           MR_POOL_DEFAULT_ARENA_SIZE);
+    printf("default KV buckets: 0 (KV mode disabled), default KV log: %lu bytes\n",
+           KV_DEFAULT_LOG_SIZE);
+    printf("default ring size: 0 (ring channel disabled), e.g. -W %d\n", RING_DEFAULT_SIZE);
+    printf("-o receives files streamed by client -f into <output-dir>, default: disabled\n");
+    printf("default on-demand paging: off, registrations pin their pages\n");
+    printf("default pre-warmed bundles: 0, each connection creates its own CQ and QP\n");
+    printf("default shared CQs per device: 0, each connection polls its own CQ\n");
+    printf("default counter sampling: 0 (off), e.g. -M %d\n", PORT_SAMPLER_DEFAULT_INTERVAL_MS);
+    printf("default completion mode: event, default spin budget: %d us\n", DEFAULT_SPIN_BUDGET_US);
+    printf("default CQ moderation: 0 (off), default moderation period: %d us\n",
+           DEFAULT_CQ_MOD_PERIOD_US);
     exit(1);
 }
 
+static const char *const setup_phase_names[SERVER_SETUP_NUM_PHASES] = {
+    [SERVER_SETUP_DEVICE]    = "device",
+    [SERVER_SETUP_CQ]        = "cq",
+    [SERVER_SETUP_QP]        = "qp",
+    [SERVER_SETUP_ACCEPT]    = "accept",
+    [SERVER_SETUP_ESTABLISH] = "establish",
+    [SERVER_SETUP_METADATA]  = "metadata",
+};
+
+static void handle_signal(int signo)
+{
+    (void)signo;
+    server_stop = 1;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        log_err("Failed to set fd %d non-blocking, errno: %d ", fd, -errno);
+        return -errno;
+    }
+    return 0;
+}
+
+static void conn_list_remove(struct client_conn **list, struct client_conn *conn)
+{
+    if (conn->prev)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        *list = conn->next;
+    }
+    if (conn->next)
+    {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+static void conn_list_push(struct client_conn **list, struct client_conn *conn)
+{
+    conn->prev = NULL;
+    conn->next = *list;
+    if (*list)
+    {
+        (*list)->prev = conn;
+    }
+    *list = conn;
+}
+
 static int start_rdma_server(struct sockaddr_in *server_addr)
 {
-    struct rdma_cm_event *cm_event = NULL;
-    int ret                        = -1;
-    cm_channel                     = rdma_create_event_channel();
+    struct epoll_event ev;
+    int ret = -1;
+    /* 统计区域在创建任何设备上下文之前分配, 设备创建时注册 */
+    ret = create_server_stats();
+    if (ret)
+    {
+        return ret;
+    }
+    cm_channel = rdma_create_event_channel();
     if (!cm_channel)
     {
         log_err("Creating cm event channel failed with errno: %d ", -errno);
@@ -25,285 +109,2200 @@ static int start_rdma_server(struct sockaddr_in *server_addr)
         log_err("Creating cm id failed with errno: %d ", -errno);
         return -errno;
     }
-    debug("RDMA CM id is created at %p ", cm_server_id);
-    ret = rdma_bind_addr(cm_server_id, (struct sockaddr *)server_addr);
+    debug("RDMA CM id is created at %p ", cm_server_id);
+    ret = rdma_bind_addr(cm_server_id, (struct sockaddr *)server_addr);
+    if (ret)
+    {
+        log_err("Failed to bind server address, errno: %d ", -errno);
+        return -errno;
+    }
+    debug("Server RDMA CM id is successfully binded ");
+    /* backlog = 8, same as TCP */
+    ret = rdma_listen(cm_server_id, 8);
+    if (ret)
+    {
+        log_err("Failed to listen on RDMA CM id, errno: %d ", -errno);
+        return -errno;
+    }
+    log_info("Server is listening successfully at: %s , port: %d ",
+             inet_ntoa(server_addr->sin_addr), ntohs(server_addr->sin_port));
+
+    /* CM事件与各连接的完成事件统一由epoll驱动, 所有fd均设为非阻塞 */
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        log_err("Failed to create epoll instance, errno: %d ", -errno);
+        return -errno;
+    }
+    ret = set_nonblocking(cm_channel->fd);
+    if (ret)
+    {
+        return ret;
+    }
+    bzero(&ev, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL; /* NULL 表示CM事件通道 */
+    ret         = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cm_channel->fd, &ev);
+    if (ret)
+    {
+        log_err("Failed to add cm channel to epoll, errno: %d ", -errno);
+        return -errno;
+    }
+    /* 绑定到具体设备时在第一个连接到来前预热, 否则在该设备的首个连接之后补充 */
+    if (prewarm_bundles && cm_server_id->verbs)
+    {
+        if (!get_server_device(cm_server_id->verbs))
+        {
+            return -ENOMEM;
+        }
+        refill_conn_bundles(devices);
+        log_info("%u connection bundles are pre-warmed on device %s ", devices->num_bundles,
+                 ibv_get_device_name(cm_server_id->verbs->device));
+    }
+    return 0;
+}
+
+/*
+ * 创建设备的SRQ及srq_depth个接收缓冲区, 并全部投递。
+ * 缓冲区在一个MR中连续存放, wr_id为SRQ_WR_ID_FLAG | 序号。
+ */
+static int create_device_srq(struct server_device *dev)
+{
+    struct ibv_srq_init_attr srq_attr;
+    struct ibv_device_attr dev_attr;
+    uint32_t i;
+    if (ibv_query_device(dev->verbs, &dev_attr))
+    {
+        log_err("Failed to query device attributes, errno: %d ", -errno);
+        return -errno;
+    }
+    dev->srq_depth = srq_depth;
+    if (dev->srq_depth > (uint32_t)dev_attr.max_srq_wr)
+    {
+        log_warn("SRQ depth %u exceeds device limit, using %d ", dev->srq_depth,
+                 dev_attr.max_srq_wr);
+        dev->srq_depth = (uint32_t)dev_attr.max_srq_wr;
+    }
+    bzero(&srq_attr, sizeof(srq_attr));
+    srq_attr.attr.max_wr  = dev->srq_depth;
+    srq_attr.attr.max_sge = 1;
+    dev->srq              = ibv_create_srq(dev->pd, &srq_attr);
+    if (!dev->srq)
+    {
+        log_err("Failed to create SRQ, errno: %d ", -errno);
+        return -errno;
+    }
+    dev->srq_buffer_mr = rdma_buffer_alloc(dev->pd, (uint64_t)dev->srq_depth * srq_recv_size,
+                                           IBV_ACCESS_LOCAL_WRITE);
+    dev->srq_wrs       = calloc(dev->srq_depth, sizeof(*dev->srq_wrs));
+    dev->srq_sges      = calloc(dev->srq_depth, sizeof(*dev->srq_sges));
+    dev->srq_free      = calloc(dev->srq_depth, sizeof(*dev->srq_free));
+    if (!dev->srq_buffer_mr || !dev->srq_wrs || !dev->srq_sges || !dev->srq_free)
+    {
+        log_err("Failed to allocate %u SRQ receive buffers, -ENOMEM ", dev->srq_depth);
+        return -ENOMEM;
+    }
+    for (i = 0; i < dev->srq_depth; i++)
+    {
+        dev->srq_sges[i].addr   = (uint64_t)dev->srq_buffer_mr->addr + (uint64_t)i * srq_recv_size;
+        dev->srq_sges[i].length = srq_recv_size;
+        dev->srq_sges[i].lkey   = dev->srq_buffer_mr->lkey;
+        dev->srq_wrs[i].wr_id   = SRQ_WR_ID_FLAG | i;
+        dev->srq_wrs[i].sg_list = &dev->srq_sges[i];
+        dev->srq_wrs[i].num_sge = 1;
+        dev->srq_free[i]        = i;
+    }
+    dev->srq_num_free = dev->srq_depth;
+    log_info("SRQ with %u receives of %u bytes is created for device %s ", dev->srq_depth,
+             srq_recv_size, ibv_get_device_name(dev->verbs->device));
+    return srq_replenish(dev);
+}
+
+/* 把所有空闲的接收缓冲区链接起来, 一次ibv_post_srq_recv()全部投递 */
+static int srq_replenish(struct server_device *dev)
+{
+    struct ibv_recv_wr *head = NULL, *wr, *bad_wr = NULL;
+    int ret;
+    if (!dev->srq_num_free)
+    {
+        return 0;
+    }
+    while (dev->srq_num_free)
+    {
+        wr       = &dev->srq_wrs[dev->srq_free[--dev->srq_num_free]];
+        wr->next = head;
+        head     = wr;
+    }
+    ret = ibv_post_srq_recv(dev->srq, head, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post SRQ receives, errno: %d ", ret);
+        /* 未投递的部分放回空闲栈 */
+        for (wr = bad_wr; wr; wr = wr->next)
+        {
+            dev->srq_free[dev->srq_num_free++] = (uint32_t)(wr->wr_id & ~SRQ_WR_ID_FLAG);
+        }
+        return -ret;
+    }
+    debug("SRQ is replenished to %u receives ", dev->srq_depth);
+    return 0;
+}
+
+/* 一个SRQ接收已被消费, 缓冲区回到空闲栈, 已投递数低于水位时批量补充 */
+static int srq_release(struct server_device *dev, uint64_t wr_id)
+{
+    dev->srq_free[dev->srq_num_free++] = (uint32_t)(wr_id & ~SRQ_WR_ID_FLAG);
+    if (dev->srq_depth - dev->srq_num_free < SRQ_LOW_WATERMARK(dev->srq_depth))
+    {
+        return srq_replenish(dev);
+    }
+    return 0;
+}
+
+static void destroy_device_srq(struct server_device *dev)
+{
+    if (dev->srq && ibv_destroy_srq(dev->srq))
+    {
+        log_err("Failed to destroy the SRQ, errno: %d", -errno);
+    }
+    if (dev->srq_buffer_mr)
+    {
+        rdma_buffer_free(dev->srq_buffer_mr);
+    }
+    free(dev->srq_wrs);
+    free(dev->srq_sges);
+    free(dev->srq_free);
+    dev->srq = NULL;
+}
+
+/*
+ * 创建设备的num_shared_cqs个共享CQ, 每个有自己的完成通道并加入epoll。
+ * 事件循环是单线程的, 多个CQ的作用是把完成中断分散到设备的不同完成向量上。
+ */
+static int create_shared_cqs(struct server_device *dev)
+{
+    struct ibv_device_attr dev_attr;
+    struct shared_cq *scq;
+    struct epoll_event ev;
+    int cqe = SHARED_CQ_MAX_SIZE;
+    if (ibv_query_device(dev->verbs, &dev_attr))
+    {
+        log_err("Failed to query device attributes, errno: %d ", -errno);
+        return -errno;
+    }
+    if (cqe > dev_attr.max_cqe)
+    {
+        cqe = dev_attr.max_cqe;
+    }
+    dev->shared_cqs = calloc(num_shared_cqs, sizeof(*dev->shared_cqs));
+    if (!dev->shared_cqs)
+    {
+        log_err("Failed to allocate %u shared CQs, -ENOMEM ", num_shared_cqs);
+        return -ENOMEM;
+    }
+    for (; dev->num_shared_cqs < num_shared_cqs; dev->num_shared_cqs++)
+    {
+        scq               = &dev->shared_cqs[dev->num_shared_cqs];
+        scq->source       = EPOLL_SOURCE_SHARED_CQ;
+        scq->dev          = dev;
+        scq->comp_channel = ibv_create_comp_channel(dev->verbs);
+        if (!scq->comp_channel)
+        {
+            log_err("Failed to create IO completion event channel, errno: %d ", -errno);
+            return -errno;
+        }
+        if (set_nonblocking(scq->comp_channel->fd))
+        {
+            return -errno;
+        }
+        scq->cq = ibv_create_cq(dev->verbs, cqe, scq, scq->comp_channel,
+                                dev->num_shared_cqs % dev->verbs->num_comp_vectors);
+        if (!scq->cq)
+        {
+            log_err("Failed to create shared CQ, errno: %d ", -errno);
+            return -errno;
+        }
+        moderate_cq(scq->cq);
+        if (arm_cq_notification(scq->cq))
+        {
+            return -EINVAL;
+        }
+        bzero(&ev, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = scq;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, scq->comp_channel->fd, &ev))
+        {
+            log_err("Failed to add shared CQ channel to epoll, errno: %d ", -errno);
+            return -errno;
+        }
+    }
+    log_info("%u shared CQs of %d entries are created for device %s ", dev->num_shared_cqs,
+             cqe, ibv_get_device_name(dev->verbs->device));
+    return 0;
+}
+
+static void destroy_shared_cqs(struct server_device *dev)
+{
+    struct shared_cq *scq;
+    /* 创建失败时后面的CQ全为0, 最后一个可能只完成了一部分 */
+    for (uint32_t i = 0; dev->shared_cqs && i < num_shared_cqs; i++)
+    {
+        scq = &dev->shared_cqs[i];
+        if (scq->comp_channel)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, scq->comp_channel->fd, NULL);
+        }
+        if (scq->cq)
+        {
+            /* 未确认的事件会使ibv_destroy_cq()一直等待 */
+            flush_cq_events(scq->cq, &scq->unacked_events);
+        }
+        if (scq->cq && ibv_destroy_cq(scq->cq))
+        {
+            log_err("Failed to destroy the shared cq, errno: %d", -errno);
+        }
+        if (scq->comp_channel && ibv_destroy_comp_channel(scq->comp_channel))
+        {
+            log_err("Failed to destroy the completion channel, errno: %d", -errno);
+        }
+    }
+    free(dev->shared_cqs);
+    dev->shared_cqs     = NULL;
+    dev->num_shared_cqs = 0;
+}
+
+/* 选出剩余容量最多且能容纳cqe个完成的共享CQ, 都已满时返回NULL */
+static struct shared_cq *pick_shared_cq(struct server_device *dev, uint32_t cqe)
+{
+    struct shared_cq *best = NULL, *scq;
+    for (uint32_t i = 0; i < dev->num_shared_cqs; i++)
+    {
+        scq = &dev->shared_cqs[i];
+        if (scq->load + cqe <= (uint32_t)scq->cq->cqe && (!best || scq->load < best->load))
+        {
+            best = scq;
+        }
+    }
+    if (!best)
+    {
+        log_err("All %u shared CQs are full, raise -C or lower -d ", dev->num_shared_cqs);
+        return NULL;
+    }
+    best->load += cqe;
+    return best;
+}
+
+static void qp_table_insert(struct server_device *dev, struct client_conn *conn)
+{
+    struct client_conn **head = &dev->qp_table[conn->qp->qp_num & (QP_TABLE_SIZE - 1)];
+    conn->qp_next             = *head;
+    *head                     = conn;
+}
+
+static void qp_table_remove(struct server_device *dev, struct client_conn *conn)
+{
+    struct client_conn **pp;
+    for (pp = &dev->qp_table[conn->qp->qp_num & (QP_TABLE_SIZE - 1)]; *pp; pp = &(*pp)->qp_next)
+    {
+        if (*pp == conn)
+        {
+            *pp = conn->qp_next;
+            break;
+        }
+    }
+}
+
+static struct client_conn *qp_table_lookup(struct server_device *dev, uint32_t qp_num)
+{
+    struct client_conn *conn = dev->qp_table[qp_num & (QP_TABLE_SIZE - 1)];
+    while (conn && conn->qp->qp_num != qp_num)
+    {
+        conn = conn->qp_next;
+    }
+    return conn;
+}
+
+static void destroy_conn_bundle(struct conn_bundle *bundle)
+{
+    if (bundle->qp && ibv_destroy_qp(bundle->qp))
+    {
+        log_err("Failed to destroy the pooled QP, errno: %d", -errno);
+    }
+    if (bundle->shared_cq)
+    {
+        bundle->shared_cq->load -= CQ_CAPACITY(bundle->shared_cq->dev->bundle_depth);
+    }
+    else if (bundle->cq && ibv_destroy_cq(bundle->cq))
+    {
+        log_err("Failed to destroy the pooled CQ, errno: %d", -errno);
+    }
+    if (bundle->comp_channel && ibv_destroy_comp_channel(bundle->comp_channel))
+    {
+        log_err("Failed to destroy the pooled completion channel, errno: %d", -errno);
+    }
+    free(bundle);
+}
+
+/*
+ * 创建一个连接资源包: 非阻塞的完成通道、CQ与处于RESET状态的QP。
+ * 队列参数与init_client_resources()相同, SRQ模式下QP绑定设备的SRQ。
+ */
+static struct conn_bundle *create_conn_bundle(struct server_device *dev)
+{
+    struct ibv_qp_init_attr qp_init_attr;
+    struct conn_bundle *bundle = calloc(1, sizeof(*bundle));
+    if (!bundle)
+    {
+        log_err("Failed to allocate connection bundle, -ENOMEM ");
+        return NULL;
+    }
+    if (dev->shared_cqs)
+    {
+        /* 池中的QP一直绑定同一个共享CQ, 其占用在资源包销毁时才释放 */
+        bundle->shared_cq = pick_shared_cq(dev, CQ_CAPACITY(dev->bundle_depth));
+        if (!bundle->shared_cq)
+        {
+            goto err;
+        }
+        bundle->cq = bundle->shared_cq->cq;
+        goto qp;
+    }
+    bundle->comp_channel = ibv_create_comp_channel(dev->verbs);
+    if (!bundle->comp_channel)
+    {
+        log_err("Failed to create IO completion event channel, errno: %d ", -errno);
+        goto err;
+    }
+    if (set_nonblocking(bundle->comp_channel->fd))
+    {
+        goto err;
+    }
+    /* CQ上下文不使用, 连接通过epoll的data.ptr找到 */
+    bundle->cq = ibv_create_cq(dev->verbs, CQ_CAPACITY(dev->bundle_depth), NULL,
+                               bundle->comp_channel, 0);
+    if (!bundle->cq)
+    {
+        log_err("Failed to create CQ, errno: %d ", -errno);
+        goto err;
+    }
+    moderate_cq(bundle->cq);
+qp:
+    bzero(&qp_init_attr, sizeof(qp_init_attr));
+    qp_init_attr.cap.max_send_wr  = dev->bundle_depth;
+    qp_init_attr.cap.max_recv_wr  = dev->bundle_depth;
+    qp_init_attr.cap.max_send_sge = MAX_SGE;
+    qp_init_attr.cap.max_recv_sge = MAX_SGE;
+    qp_init_attr.send_cq          = bundle->cq;
+    qp_init_attr.recv_cq          = bundle->cq;
+    qp_init_attr.qp_type          = IBV_QPT_RC;
+    qp_init_attr.srq              = dev->srq;
+    bundle->qp                    = create_qp_inline(dev->pd, &qp_init_attr);
+    if (!bundle->qp)
+    {
+        goto err;
+    }
+    return bundle;
+err:
+    destroy_conn_bundle(bundle);
+    return NULL;
+}
+
+/* 在事件循环中把设备的资源包补充到目标数量, 不占用连接建立的时间 */
+static void refill_conn_bundles(struct server_device *dev)
+{
+    struct conn_bundle *bundle;
+    while (dev->num_bundles < dev->bundle_target)
+    {
+        bundle = create_conn_bundle(dev);
+        if (!bundle)
+        {
+            /* 资源不足时不再反复重试, 之后池空的连接即时创建资源 */
+            log_warn("Pre-warming stopped at %u bundles on device %s ", dev->num_bundles,
+                     ibv_get_device_name(dev->verbs->device));
+            dev->bundle_target = dev->num_bundles;
+            return;
+        }
+        bundle->next = dev->bundles;
+        dev->bundles = bundle;
+        dev->num_bundles++;
+    }
+}
+
+/*
+ * 连接断开后归还资源包: QP复位到RESET, 丢弃CQ中残留的完成与通道中未取出的事件。
+ * 池已满或复位失败时直接销毁。
+ */
+static void release_conn_bundle(struct server_device *dev, struct conn_bundle *bundle)
+{
+    struct ibv_qp_attr attr;
+    struct ibv_wc wc[WC_BATCH];
+    struct ibv_cq *cq;
+    void *context;
+    uint32_t events = 0;
+    if (dev->num_bundles >= dev->bundle_target)
+    {
+        destroy_conn_bundle(bundle);
+        return;
+    }
+    bzero(&attr, sizeof(attr));
+    attr.qp_state = IBV_QPS_RESET;
+    if (ibv_modify_qp(bundle->qp, &attr, IBV_QP_STATE))
+    {
+        log_warn("Failed to reset the pooled QP, errno: %d, destroying it ", -errno);
+        destroy_conn_bundle(bundle);
+        return;
+    }
+    /*
+     * 复位不保证清除CQ中该QP的完成 (rxe会保留断开时的flush错误), 而池中的QP保留qp_num,
+     * 残留的完成会被分发给之后取出该资源包的连接。连接已不在qp_table中, 先把共享CQ轮询干净:
+     * 其他连接的完成照常处理, 该QP的完成只归还SRQ缓冲区。
+     */
+    if (bundle->shared_cq && poll_shared_cq(bundle->shared_cq) < 0)
+    {
+        destroy_conn_bundle(bundle);
+        return;
+    }
+    while (!bundle->shared_cq && ibv_poll_cq(bundle->cq, WC_BATCH, wc) > 0)
+        ;
+    while (bundle->comp_channel && !ibv_get_cq_event(bundle->comp_channel, &cq, &context))
+    {
+        events++;
+    }
+    if (events)
+    {
+        ibv_ack_cq_events(bundle->cq, events);
+    }
+    bundle->next = dev->bundles;
+    dev->bundles = bundle;
+    dev->num_bundles++;
+}
+
+static void destroy_conn_bundles(struct server_device *dev)
+{
+    struct conn_bundle *bundle;
+    while ((bundle = dev->bundles) != NULL)
+    {
+        dev->bundles = bundle->next;
+        destroy_conn_bundle(bundle);
+    }
+    dev->num_bundles = 0;
+}
+
+/* 分配统计区域并填写头部, 各设备在创建时注册它 */
+static int create_server_stats()
+{
+    if (host_buffer_alloc(&stats_buf, SERVER_STATS_SIZE(SERVER_STATS_MAX_CONNS),
+                          BUFFER_BACKING_HEAP))
+    {
+        log_err("Failed to allocate the stats region, -ENOMEM ");
+        return -ENOMEM;
+    }
+    memset(stats_buf.addr, 0, stats_buf.size);
+    live_stats            = stats_buf.addr;
+    live_stats->magic     = SERVER_STATS_MAGIC;
+    live_stats->version   = SERVER_STATS_VERSION;
+    live_stats->max_conns = SERVER_STATS_MAX_CONNS;
+    stats_start_ns        = now_ns();
+    return 0;
+}
+
+static void destroy_server_stats()
+{
+    if (!live_stats)
+    {
+        return;
+    }
+    /* 各设备上的注册已在destroy_server_devices()中注销 */
+    mr_cache_invalidate(stats_buf.addr, stats_buf.size);
+    host_buffer_free(&stats_buf);
+    live_stats = NULL;
+}
+
+/* 为连接分配统计槽位, 槽位用尽时只计入全局计数器 */
+static void attach_conn_stats(struct client_conn *conn)
+{
+    struct server_conn_stats *slot;
+    conn->stats = &stats_overflow;
+    live_stats->total_conns++;
+    for (uint64_t i = 0; i < SERVER_STATS_MAX_CONNS; i++)
+    {
+        slot = server_stats_conn(live_stats, i);
+        if (slot->in_use)
+        {
+            continue;
+        }
+        memset(slot, 0, sizeof(*slot));
+        slot->conn_id      = ++stats_next_conn_id;
+        slot->connected_ns = now_ns() - stats_start_ns;
+        slot->state        = conn->state;
+        slot->in_use       = 1;
+        conn->stats        = slot;
+        return;
+    }
+}
+
+static void detach_conn_stats(struct client_conn *conn)
+{
+    if (conn->stats && conn->stats != &stats_overflow)
+    {
+        conn->stats->state  = CONN_STATE_DISCONNECTED;
+        conn->stats->in_use = 0;
+    }
+    conn->stats = &stats_overflow;
+}
+
+/* 双边流量同时计入连接与全局, 两次普通的内存写, 不影响热路径 */
+static inline void count_conn_recv(struct client_conn *conn, uint64_t bytes)
+{
+    conn->stats->recv_msgs++;
+    conn->stats->recv_bytes += bytes;
+    live_stats->recv_msgs++;
+    live_stats->recv_bytes += bytes;
+}
+
+static inline void count_conn_send(struct client_conn *conn, uint64_t bytes)
+{
+    conn->stats->send_msgs++;
+    conn->stats->send_bytes += bytes;
+    live_stats->send_msgs++;
+    live_stats->send_bytes += bytes;
+}
+
+/*
+ * 刷新连接状态与资源用量, 由事件循环每轮调用, 最多每SERVER_STATS_REFRESH_NS执行一次。
+ * 头部先在本地算好再整体写回, 监控端不会读到求和过程中的中间值。
+ */
+static void refresh_server_stats()
+{
+    struct server_stats s;
+    struct mr_pool_stats pool;
+    struct server_device *dev;
+    struct client_conn *conn;
+    struct client_session *session;
+    uint64_t now = now_ns();
+    if (now - stats_refreshed_ns < SERVER_STATS_REFRESH_NS)
+    {
+        return;
+    }
+    stats_refreshed_ns = now;
+    s                  = *live_stats;
+    s.active_conns = s.active_qps = s.sessions = 0;
+    for (conn = active_conns; conn; conn = conn->next)
+    {
+        s.active_conns++;
+        s.active_qps += conn->qp != NULL;
+        conn->stats->state      = conn->state;
+        conn->stats->qp_num     = conn->qp ? conn->qp->qp_num : 0;
+        conn->stats->session_id = conn->session ? conn->session->id : 0;
+        conn->stats->qp_index   = conn->qp_index;
+    }
+    for (session = sessions; session; session = session->next)
+    {
+        s.sessions++;
+    }
+    s.devices = s.counters_available = 0;
+    s.port_tx_bytes = s.port_rx_bytes = s.port_retransmits = s.port_rnr_naks = 0;
+    s.pool_arena_bytes = s.pool_used_bytes = s.cache_entries = 0;
+    s.srq_depth = s.srq_free = s.bundles_free = 0;
+    s.shared_cq_load = s.shared_cq_capacity = 0;
+    for (dev = devices; dev; dev = dev->next)
+    {
+        s.devices++;
+        if (!mr_pool_get_stats(dev->pd, &pool))
+        {
+            s.pool_arena_bytes += pool.arena_bytes;
+            s.pool_used_bytes += pool.slab_bytes_used;
+            s.cache_entries += pool.cache_entries;
+        }
+        s.srq_depth += dev->srq_depth;
+        s.srq_free += dev->srq_num_free;
+        s.bundles_free += dev->num_bundles;
+        for (uint32_t i = 0; i < dev->num_shared_cqs; i++)
+        {
+            s.shared_cq_load += dev->shared_cqs[i].load;
+            s.shared_cq_capacity += (uint64_t)dev->shared_cqs[i].cq->cqe;
+        }
+        if (dev->sampler)
+        {
+            s.counters_available = 1;
+            s.port_tx_bytes += port_sampler_total(dev->sampler, PORT_COUNTER_TX_BYTES);
+            s.port_rx_bytes += port_sampler_total(dev->sampler, PORT_COUNTER_RX_BYTES);
+            s.port_retransmits += port_sampler_total(dev->sampler, PORT_COUNTER_RETRANSMITS);
+            s.port_rnr_naks += port_sampler_total(dev->sampler, PORT_COUNTER_RNR_NAKS);
+        }
+    }
+    s.update_seq++;
+    s.uptime_ns = now - stats_start_ns;
+    *live_stats = s;
+}
+
+/* 查找或创建设备上下文, 设备的PD与内存池在首个连接到来时创建, 服务端退出时释放 */
+static struct server_device *get_server_device(struct ibv_context *verbs)
+{
+    struct server_device *dev;
+    for (dev = devices; dev; dev = dev->next)
+    {
+        if (dev->verbs == verbs)
+        {
+            return dev;
+        }
+    }
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+    {
+        log_err("Failed to allocate device context, -ENOMEM ");
+        return NULL;
+    }
+    dev->verbs = verbs;
+    dev->pd    = ibv_alloc_pd(verbs);
+    if (!dev->pd)
+    {
+        log_err("Failed to allocate PD, errno: %d ", -errno);
+        free(dev);
+        return NULL;
+    }
+    debug("PD is created at %p for device %s ", dev->pd, ibv_get_device_name(verbs->device));
+    dev->atomic_access = device_atomic_access(verbs);
+    /* 统计区域只供远端读取 */
+    dev->stats_mr = rdma_buffer_register(dev->pd, stats_buf.addr, stats_buf.size,
+                                         IBV_ACCESS_REMOTE_READ);
+    if (!dev->stats_mr)
+    {
+        log_err("Failed to register the stats region ");
+        goto err;
+    }
+    if (mr_pool_arena_size && mr_pool_create(dev->pd, mr_pool_arena_size))
+    {
+        goto err;
+    }
+    if (srq_depth && create_device_srq(dev))
+    {
+        goto err;
+    }
+    /* SRQ的接收缓冲区在启用ODP之前分配, 始终钉住, 不依赖设备对SRQ接收缺页的支持 */
+    if (odp_mode != MR_ODP_OFF && mr_odp_enable(dev->pd, odp_mode) < 0)
+    {
+        goto err;
+    }
+    if (num_shared_cqs && create_shared_cqs(dev))
+    {
+        goto err;
+    }
+    if (kv_num_buckets)
+    {
+        dev->kv = kv_table_create(dev->pd, kv_num_buckets, kv_log_size);
+        if (!dev->kv)
+        {
+            goto err;
+        }
+    }
+    if (prewarm_bundles)
+    {
+        /* 池中的资源包按设备能力确定一次队列参数, 补充由事件循环完成 */
+        dev->bundle_depth = queue_depth;
+        if (fit_queue_depth(verbs, &dev->bundle_depth, &dev->bundle_rd_atomic))
+        {
+            goto err;
+        }
+        dev->bundle_target = prewarm_bundles;
+    }
+    dev->next = devices;
+    devices   = dev;
+    return dev;
+err:
+    kv_table_destroy(dev->kv);
+    destroy_shared_cqs(dev);
+    destroy_device_srq(dev);
+    mr_odp_disable(dev->pd);
+    mr_pool_destroy(dev->pd);
+    if (dev->stats_mr)
+    {
+        rdma_buffer_deregister(dev->stats_mr);
+    }
+    ibv_dealloc_pd(dev->pd);
+    free(dev);
+    return NULL;
+}
+
+static void destroy_server_devices()
+{
+    struct server_device *dev;
+    while ((dev = devices) != NULL)
+    {
+        devices = dev->next;
+        port_sampler_stop(dev->sampler);
+        /* 池中的QP绑定了设备的SRQ与PD, 先于它们销毁 */
+        destroy_conn_bundles(dev);
+        destroy_shared_cqs(dev);
+        destroy_device_srq(dev);
+        kv_table_destroy(dev->kv);
+        mr_odp_disable(dev->pd);
+        mr_pool_destroy(dev->pd);
+        /* 统计区域在内存池之前注册, 不属于注册缓存 */
+        rdma_buffer_deregister(dev->stats_mr);
+        if (ibv_dealloc_pd(dev->pd))
+        {
+            log_err("Failed to deallocate the pd, errno: %d", -errno);
+        }
+        free(dev);
+    }
+}
+
+/* 查找或创建会话, 同一会话的连接必须位于同一设备上才能共享缓冲区的MR */
+static struct client_session *get_client_session(struct server_device *dev,
+                                                 struct rdma_session_hello *hello)
+{
+    struct client_session *session;
+    if (!hello->num_qps || hello->num_qps > MAX_QPS_PER_SESSION ||
+        hello->qp_index >= hello->num_qps)
+    {
+        log_err("Invalid session hello: QP %u of %u ", hello->qp_index, hello->num_qps);
+        return NULL;
+    }
+    for (session = sessions; hello->session_id && session; session = session->next)
+    {
+        if (session->id != hello->session_id)
+        {
+            continue;
+        }
+        if (session->dev != dev)
+        {
+            log_err("QP %u of session 0x%lx arrived on a different device ", hello->qp_index,
+                    hello->session_id);
+            return NULL;
+        }
+        session->refs++;
+        return session;
+    }
+    session = calloc(1, sizeof(*session));
+    if (!session)
+    {
+        log_err("Failed to allocate session, -ENOMEM ");
+        return NULL;
+    }
+    session->id      = hello->session_id;
+    session->num_qps = hello->num_qps;
+    session->refs    = 1;
+    session->dev     = dev;
+    session->next    = sessions;
+    sessions         = session;
+    debug("Session 0x%lx is created with %u QPs ", session->id, session->num_qps);
+    return session;
+}
+
+static void put_client_session(struct client_session *session)
+{
+    struct client_session **pp;
+    if (--session->refs)
+    {
+        return;
+    }
+    for (pp = &sessions; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == session)
+        {
+            *pp = session->next;
+            break;
+        }
+    }
+    if (session->server_buffer_mr)
+    {
+        rdma_buffer_free(session->server_buffer_mr);
+    }
+    debug("Session 0x%lx is released ", session->id);
+    free(session);
+}
+
+/*
+ * 把池中处于RESET状态的QP按cm_id的路径迁移到RTS, 之后由rdma_accept()以qp_num完成连接。
+ * 访问权限与rdma_create_qp()创建的QP相同, 另按设备能力允许远端原子操作。
+ */
+static int attach_bundle_qp(struct client_conn *conn)
+{
+    static const enum ibv_qp_state states[] = {IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS};
+    struct ibv_qp_attr attr;
+    int mask, ret;
+    for (size_t i = 0; i < sizeof(states) / sizeof(states[0]); i++)
+    {
+        bzero(&attr, sizeof(attr));
+        attr.qp_state = states[i];
+        ret           = rdma_init_qp_attr(conn->cm_id, &attr, &mask);
+        if (ret)
+        {
+            log_err("Failed to get attributes of QP state %d, errno: %d ", states[i], -errno);
+            return -errno;
+        }
+        if (states[i] == IBV_QPS_INIT)
+        {
+            attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                                   IBV_ACCESS_REMOTE_WRITE | conn->dev->atomic_access;
+        }
+        else if (states[i] == IBV_QPS_RTR)
+        {
+            attr.max_dest_rd_atomic = conn->rd_atomic;
+        }
+        else
+        {
+            attr.max_rd_atomic = conn->rd_atomic;
+        }
+        ret = ibv_modify_qp(conn->qp, &attr, mask);
+        if (ret)
+        {
+            log_err("Failed to move pooled QP to state %d, errno: %d ", states[i], ret);
+            return -ret;
+        }
+    }
+    debug("Pooled QP %u is attached to connection %p ", conn->qp->qp_num, conn);
+    return 0;
+}
+
+/* 从设备的池中取出资源包, 池为空时即时创建一个 */
+static int checkout_conn_bundle(struct client_conn *conn)
+{
+    struct server_device *dev = conn->dev;
+    struct conn_bundle *bundle = dev->bundles;
+    if (bundle)
+    {
+        dev->bundles = bundle->next;
+        dev->num_bundles--;
+        conn->pre_warmed = 1;
+        setup_pooled_conns++;
+    }
+    else
+    {
+        bundle = create_conn_bundle(dev);
+        if (!bundle)
+        {
+            return -ENOMEM;
+        }
+    }
+    conn->bundle                = bundle;
+    conn->io_completion_channel = bundle->comp_channel;
+    conn->cq                    = bundle->cq;
+    conn->qp                    = bundle->qp;
+    conn->queue_depth           = dev->bundle_depth;
+    conn->max_rd_atomic         = dev->bundle_rd_atomic;
+    return 0;
+}
+
+static int init_client_resources(struct client_conn *conn, uint8_t initiator_depth)
+{
+    struct ibv_qp_init_attr qp_init_attr;
+    struct epoll_event ev;
+    int ret = -1;
+    if (!conn || !conn->cm_id)
+    {
+        log_err("Client id is not created");
+        return -EINVAL;
+    }
+    /*
+     * 通过一个合理的连接标识符cm_id，创建PD、QP、MR、CQ等资源
+     */
+    conn->dev = get_server_device(conn->cm_id->verbs);
+    if (!conn->dev)
+    {
+        return -ENOMEM;
+    }
+    conn->pd = conn->dev->pd;
+    /* 采样失败 (如没有sysfs计数器) 不影响连接, 之后的连接不再尝试 */
+    if (counter_interval_ms && !conn->dev->sampler_tried)
+    {
+        conn->dev->sampler_tried = 1;
+        conn->dev->sampler = port_sampler_start(conn->cm_id->verbs, conn->cm_id->port_num,
+                                                counter_interval_ms);
+    }
+    setup_timer_mark(&conn->setup, SERVER_SETUP_DEVICE);
+
+    if (prewarm_bundles)
+    {
+        ret = checkout_conn_bundle(conn);
+        if (ret)
+        {
+            return ret;
+        }
+        goto watch;
+    }
+    conn->queue_depth = queue_depth;
+    ret = fit_queue_depth(conn->cm_id->verbs, &conn->queue_depth, &conn->max_rd_atomic);
+    if (ret)
+    {
+        return ret;
+    }
+    if (conn->dev->shared_cqs)
+    {
+        /* 完成进入设备的共享CQ, 由事件循环按qp_num分发给连接 */
+        conn->shared_cq = pick_shared_cq(conn->dev, CQ_CAPACITY(conn->queue_depth));
+        if (!conn->shared_cq)
+        {
+            return -ENOSPC;
+        }
+        conn->cq = conn->shared_cq->cq;
+        goto watch;
+    }
+
+    conn->io_completion_channel = ibv_create_comp_channel(conn->cm_id->verbs);
+    if (!conn->io_completion_channel)
+    {
+        log_err("Failed to create IO completion event channel, errno: %d ", -errno);
+        return -errno;
+    }
+    debug("Completion channel is created at %p ", conn->io_completion_channel);
+    ret = set_nonblocking(conn->io_completion_channel->fd);
+    if (ret)
+    {
+        return ret;
+    }
+
+    conn->cq = ibv_create_cq(conn->cm_id->verbs, CQ_CAPACITY(conn->queue_depth), conn,
+                             conn->io_completion_channel, 0);
+    if (!conn->cq)
+    {
+        log_err("Failed to create CQ, errno: %d ", -errno);
+        return -errno;
+    }
+    moderate_cq(conn->cq);
+    debug("CQ is created at %p with %d entries ", conn->cq, conn->cq->cqe);
+
+watch:
+    /* 自适应模式下也请求通知, 保证事件循环休眠时新连接的完成能唤醒它; 共享CQ已加入epoll */
+    if (conn->io_completion_channel)
+    {
+        ret = arm_cq_notification(conn->cq);
+        if (ret)
+        {
+            return ret;
+        }
+        bzero(&ev, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = conn;
+        ret         = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->io_completion_channel->fd, &ev);
+        if (ret)
+        {
+            log_err("Failed to add completion channel to epoll, errno: %d ", -errno);
+            return -errno;
+        }
+    }
+    setup_timer_mark(&conn->setup, SERVER_SETUP_CQ);
+
+    /* 响应端资源决定客户端可同时在途的RDMA READ数, 按客户端请求与设备能力取较小值 */
+    conn->rd_atomic =
+        initiator_depth < conn->max_rd_atomic ? initiator_depth : conn->max_rd_atomic;
+    if (conn->bundle)
+    {
+        ret = attach_bundle_qp(conn);
+        goto out;
+    }
+
+    /* 创建QP */
+    bzero(&qp_init_attr, sizeof(qp_init_attr));
+    qp_init_attr.cap.max_send_wr  = conn->queue_depth;
+    qp_init_attr.cap.max_recv_wr  = conn->queue_depth;
+    qp_init_attr.cap.max_send_sge = MAX_SGE;
+    qp_init_attr.cap.max_recv_sge = MAX_SGE;
+    qp_init_attr.send_cq          = conn->cq;
+    qp_init_attr.recv_cq          = conn->cq;
+    qp_init_attr.qp_type          = IBV_QPT_RC;
+    /* SRQ模式下接收来自设备共享的SRQ, 完成仍进入本连接的CQ或共享CQ */
+    qp_init_attr.srq = conn->dev->srq;
+
+    ret = rdma_create_qp_inline(conn->cm_id, conn->pd, &qp_init_attr);
+    if (ret)
+    {
+        return ret;
+    }
+    conn->qp = conn->cm_id->qp;
+    debug("Client QP is created at %p ", conn->qp);
+out:
+    if (conn->dev->shared_cqs)
+    {
+        qp_table_insert(conn->dev, conn);
+    }
+    setup_timer_mark(&conn->setup, SERVER_SETUP_QP);
+    return ret;
+}
+
+/* 客户端元数据的接收缓冲区, 文件接收模式下是带有文件名与大小的file_request */
+static void *client_metadata_buffer(struct client_conn *conn, uint32_t *len)
+{
+    if (output_dir)
+    {
+        *len = sizeof(conn->file_request);
+        return &conn->file_request;
+    }
+    *len = sizeof(conn->client_metadata_attr);
+    return &conn->client_metadata_attr;
+}
+
+/* 为客户端元数据投递一个独立的接收, SRQ模式下元数据由共享接收缓冲区接收 */
+static int post_metadata_recv(struct client_conn *conn)
+{
+    uint32_t len;
+    void *buf = client_metadata_buffer(conn, &len);
+    int ret   = -1;
+    conn->client_metadata_mr = rdma_buffer_register(conn->pd, buf, len, (IBV_ACCESS_LOCAL_WRITE));
+
+    if (!conn->client_metadata_mr)
+    {
+        log_err("Failed to register client metadata buffer");
+        return -ENOMEM;
+    }
+    conn->client_recv_sge.addr   = (uint64_t)conn->client_metadata_mr->addr;
+    conn->client_recv_sge.length = conn->client_metadata_mr->length;
+    conn->client_recv_sge.lkey   = conn->client_metadata_mr->lkey;
+    bzero(&conn->client_recv_wr, sizeof(conn->client_recv_wr));
+    conn->client_recv_wr.wr_id   = RECV_WR_METADATA;
+    conn->client_recv_wr.sg_list = &conn->client_recv_sge;
+    conn->client_recv_wr.num_sge = 1;
+    ret = ibv_post_recv(conn->qp, &conn->client_recv_wr, &conn->bad_client_recv_wr);
+    if (ret)
+    {
+        log_err("Failed to pre-post the receive buffer, errno: %d", ret);
+        return ret;
+    }
+    debug("Receive buffer is pre-posted successfully");
+    return 0;
+}
+
+static int accept_client_connection(struct client_conn *conn)
+{
+    struct rdma_conn_param conn_param;
+    struct rdma_server_hello hello;
+    int ret = -1;
+    if (!conn->cm_id || !conn->qp)
+    {
+        log_err("Client resources are not initialized");
+        return -EINVAL;
+    }
+    if (!conn->dev->srq)
+    {
+        ret = post_metadata_recv(conn);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    /* 不再阻塞等待ESTABLISHED, 由事件循环推进状态机 */
+    memset(&conn_param, 0, sizeof(conn_param));
+    conn_param.responder_resources = conn->rd_atomic;
+    conn_param.initiator_depth     = conn->rd_atomic;
+    /* 作用于客户端的QP: 未做信用流控的SEND遇到RNR时无限重试, 而不是报错 */
+    conn_param.rnr_retry_count     = RDMA_RNR_RETRY_COUNT;
+    /* 随接受发布统计区域, 监控端无需交换元数据即可读取 */
+    hello.stats.address            = (uint64_t)conn->dev->stats_mr->addr;
+    hello.stats.length             = conn->dev->stats_mr->length;
+    hello.stats.stag.remote_stag   = conn->dev->stats_mr->rkey;
+    /* 客户端提供了信用字时告知初始信用, 即将在发送元数据前投递的接收数 */
+    hello.recv_credits             = conn->credits.credit_rkey ? (uint32_t)conn->credits.posted : 0;
+    conn_param.private_data        = &hello;
+    conn_param.private_data_len    = sizeof(hello);
+    if (conn->bundle)
+    {
+        /* 池中的QP不属于cm_id, 由qp_num告诉对端 */
+        conn_param.qp_num = conn->qp->qp_num;
+        conn_param.srq    = conn->dev->srq != NULL;
+    }
+    ret = rdma_accept(conn->cm_id, &conn_param);
+    if (ret)
+    {
+        log_err("Failed to accept the connection request, errno: %d", -errno);
+        return -errno;
+    }
+    conn->state = CONN_STATE_CONNECTING;
+    debug("Connection %p is accepted, waiting for RDMA_CM_EVENT_ESTABLISHED ", conn);
+    return 0;
+}
+
+/* 以服务端缓冲区为目的地一次投递n个链接起来的接收, 供客户端的SEND基准测试使用 */
+static int post_sink_recvs(struct client_conn *conn, uint32_t n)
+{
+    int ret = -1;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        conn->sink_recv_wrs[i].next = i + 1 < n ? &conn->sink_recv_wrs[i + 1] : NULL;
+    }
+    ret = ibv_post_recv(conn->qp, conn->sink_recv_wrs, &conn->bad_sink_recv_wr);
+    if (ret)
+    {
+        log_err("Failed to post %u sink receives, errno: %d", n, ret);
+        return -ret;
+    }
+    return 0;
+}
+
+/* 一个SEND消耗了接收, 攒满一批后一次补充, 再把新的信用写回客户端 */
+static int replenish_sink_recv(struct client_conn *conn)
+{
+    int ret = -1;
+    if (++conn->sink_pending < recv_credits_batch(&conn->credits))
+    {
+        return 0;
+    }
+    ret = post_sink_recvs(conn, conn->sink_pending);
+    if (ret)
+    {
+        return ret;
+    }
+    ret                = recv_credits_grant(&conn->credits, conn->sink_pending);
+    conn->sink_pending = 0;
+    return ret;
+}
+
+/* 输出连接建立各阶段的耗时, 并计入退出时输出的平均值 */
+static void log_conn_setup(struct client_conn *conn)
+{
+    char label[64];
+    setup_timer_mark(&conn->setup, SERVER_SETUP_METADATA);
+    snprintf(label, sizeof(label), "Connection %p setup (%s)", (void *)conn,
+             conn->pre_warmed ? "pre-warmed" : "cold");
+    setup_timer_log(&conn->setup, setup_phase_names, SERVER_SETUP_NUM_PHASES, label);
+    for (int i = 0; i < SERVER_SETUP_NUM_PHASES; i++)
+    {
+        setup_totals.ns[i] += conn->setup.ns[i];
+    }
+    setup_conns++;
+}
+
+static int send_server_metadata(struct client_conn *conn)
+{
+    struct client_session *session = conn->session;
+    void *payload                  = &conn->server_metadata_attr;
+    uint32_t payload_len           = sizeof(conn->server_metadata_attr);
+    int ret                        = -1;
+    if (output_dir)
+    {
+        memcpy(&conn->client_metadata_attr, &conn->file_request.attr,
+               sizeof(conn->client_metadata_attr));
+    }
+    log_info("Client side buffer information is received...");
+    print_rdma_buffer_attr(&conn->client_metadata_attr);
+    log_info("The client has requested buffer length of: %lu bytes",
+             conn->client_metadata_attr.length);
+
+    if (conn->dev->kv)
+    {
+        /* KV模式下发布设备的键值表, 客户端请求的长度被忽略 */
+        ret = setup_kv_service(conn);
+        if (ret)
+        {
+            return ret;
+        }
+        conn->server_metadata_attr.address          = (uint64_t)conn->dev->kv->mr->addr;
+        conn->server_metadata_attr.length           = conn->dev->kv->mr->length;
+        conn->server_metadata_attr.stag.remote_stag = conn->dev->kv->mr->rkey;
+        goto send;
+    }
+    if (ring_size)
+    {
+        /* 环形通道模式下每个连接一个环, 客户端元数据是其信用字的位置 */
+        ret = setup_ring_channel(conn);
+        if (ret)
+        {
+            return ret;
+        }
+        conn->server_metadata_attr.address          = (uint64_t)conn->ring.ring_mr->addr;
+        conn->server_metadata_attr.length           = conn->ring.size;
+        conn->server_metadata_attr.stag.remote_stag = conn->ring.ring_mr->rkey;
+        goto send;
+    }
+    if (output_dir)
+    {
+        /* 文件接收模式下发布目标文件的映射, 打开失败时把错误码告诉客户端 */
+        ret = file_sink_open(&conn->file_sink, conn->pd, output_dir, &conn->file_request,
+                             &conn->file_response);
+        if (ret)
+        {
+            log_err("Failed to open the file requested by connection %p, ret = %d ", conn, ret);
+        }
+        memcpy(&conn->server_metadata_attr, &conn->file_response.attr,
+               sizeof(conn->server_metadata_attr));
+        payload     = &conn->file_response;
+        payload_len = sizeof(conn->file_response);
+        goto send;
+    }
+
+    /* 会话中第一个发来元数据的QP分配缓冲区, 其余QP复用 */
+    if (!session->server_buffer_mr)
+    {
+        /*
+         * 客户端可对缓冲区中8字节对齐的字执行FETCH_AND_ADD/CMP_AND_SWP。
+         * 带远端权限, 不从内存池切分, rkey只覆盖本会话的缓冲区
+         */
+        session->server_buffer_mr =
+            rdma_buffer_alloc(conn->pd, conn->client_metadata_attr.length,
+                              (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                               IBV_ACCESS_REMOTE_WRITE | conn->dev->atomic_access));
+        if (!session->server_buffer_mr)
+        {
+            log_err("Failed to allocate server buffer");
+            return -ENOMEM;
+        }
+    }
+    else if (session->server_buffer_mr->length < conn->client_metadata_attr.length)
+    {
+        log_err("QP %u requested %lu bytes, session 0x%lx has %zu ", conn->qp_index,
+                conn->client_metadata_attr.length, session->id, session->server_buffer_mr->length);
+        return -EINVAL;
+    }
+
+    /* 在发送元数据之前投递接收, 客户端拿到元数据后即可开始SEND; SRQ模式下由SRQ接收 */
+    conn->sink_recv_sge.addr   = (uint64_t)session->server_buffer_mr->addr;
+    /* 单个SEND不超过4 GiB, 更大的缓冲区只用前一部分接收 */
+    conn->sink_recv_sge.length = session->server_buffer_mr->length > UINT32_MAX
+                                     ? UINT32_MAX
+                                     : (uint32_t)session->server_buffer_mr->length;
+    conn->sink_recv_sge.lkey   = session->server_buffer_mr->lkey;
+    if (!conn->dev->srq)
+    {
+        conn->sink_recv_wrs = calloc(conn->queue_depth, sizeof(*conn->sink_recv_wrs));
+        if (!conn->sink_recv_wrs)
+        {
+            log_err("Failed to allocate %u sink receives, -ENOMEM ", conn->queue_depth);
+            return -ENOMEM;
+        }
+        for (uint32_t i = 0; i < conn->queue_depth; i++)
+        {
+            conn->sink_recv_wrs[i].wr_id   = RECV_WR_SINK;
+            conn->sink_recv_wrs[i].sg_list = &conn->sink_recv_sge;
+            conn->sink_recv_wrs[i].num_sge = 1;
+        }
+        /* 即在rdma_accept()中告知客户端的初始信用 */
+        ret = post_sink_recvs(conn, conn->queue_depth);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    conn->server_metadata_attr.address          = (uint64_t)session->server_buffer_mr->addr;
+    conn->server_metadata_attr.length           = session->server_buffer_mr->length;
+    conn->server_metadata_attr.stag.remote_stag = session->server_buffer_mr->rkey;
+
+send:
+    bzero(&conn->server_send_wr, sizeof(conn->server_send_wr));
+    conn->server_send_wr.sg_list    = &conn->server_send_sge;
+    conn->server_send_wr.num_sge    = 1;
+    conn->server_send_wr.opcode     = IBV_WR_SEND;
+    conn->server_send_wr.send_flags = IBV_SEND_SIGNALED;
+    conn->server_send_sge.addr      = (uint64_t)payload;
+    conn->server_send_sge.length    = payload_len;
+    if (payload_len <= get_inline_threshold())
+    {
+        /* 内联发送时负载在投递时就拷贝进WQE, 不需要注册 */
+        conn->server_send_wr.send_flags |= IBV_SEND_INLINE;
+    }
+    else
+    {
+        conn->server_metadata_mr =
+            rdma_buffer_register(conn->pd, payload, payload_len, (IBV_ACCESS_LOCAL_WRITE));
+        if (!conn->server_metadata_mr)
+        {
+            log_err("Failed to register server metadata buffer");
+            return -ENOMEM;
+        }
+        conn->server_send_sge.lkey = conn->server_metadata_mr->lkey;
+    }
+
+    ret = ibv_post_send(conn->qp, &conn->server_send_wr, &conn->bad_server_send_wr);
+    if (ret)
+    {
+        log_err("Failed to send the server metadata, errno: %d", -errno);
+        return -errno;
+    }
+    conn->state = CONN_STATE_METADATA_SENT;
+    count_conn_send(conn, payload_len);
+    debug("Server metadata is sent successfully");
+    log_conn_setup(conn);
+    return 0;
+}
+
+/* 投递第idx个KV请求缓冲区的接收 */
+static int post_kv_request_recv(struct client_conn *conn, uint32_t idx)
+{
+    struct ibv_recv_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    int ret    = -1;
+    sge.addr   = (uint64_t)conn->kv_request_mr->addr + (uint64_t)idx * KV_MAX_MSG_SIZE;
+    sge.length = KV_MAX_MSG_SIZE;
+    sge.lkey   = conn->kv_request_mr->lkey;
+    bzero(&wr, sizeof(wr));
+    wr.wr_id   = RECV_WR_KV_REQUEST | ((uint64_t)idx << RECV_WR_INDEX_SHIFT);
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    ret        = ibv_post_recv(conn->qp, &wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post KV request receive, errno: %d", ret);
+        return -ret;
+    }
+    return 0;
+}
+
+/*
+ * 准备KV模式下PUT请求的接收与响应的发送。
+ * SRQ模式下请求由共享接收缓冲区接收, 否则每个连接投递queue_depth个请求缓冲区。
+ */
+static int setup_kv_service(struct client_conn *conn)
+{
+    int ret = -1;
+    bzero(&conn->kv_send_wr, sizeof(conn->kv_send_wr));
+    conn->kv_send_wr.sg_list    = &conn->kv_send_sge;
+    conn->kv_send_wr.num_sge    = 1;
+    conn->kv_send_wr.opcode     = IBV_WR_SEND;
+    conn->kv_send_wr.send_flags = IBV_SEND_SIGNALED;
+    conn->kv_send_sge.addr      = (uint64_t)&conn->kv_response;
+    conn->kv_send_sge.length    = sizeof(conn->kv_response);
+    if (sizeof(conn->kv_response) <= get_inline_threshold())
+    {
+        conn->kv_send_wr.send_flags |= IBV_SEND_INLINE;
+    }
+    else
+    {
+        conn->kv_response_mr = rdma_buffer_register(conn->pd, &conn->kv_response,
+                                                    sizeof(conn->kv_response),
+                                                    (IBV_ACCESS_LOCAL_WRITE));
+        if (!conn->kv_response_mr)
+        {
+            log_err("Failed to register KV response buffer");
+            return -ENOMEM;
+        }
+        conn->kv_send_sge.lkey = conn->kv_response_mr->lkey;
+    }
+    if (conn->dev->srq)
+    {
+        return 0;
+    }
+    conn->kv_request_mr = rdma_buffer_alloc(
+        conn->pd, (uint64_t)conn->queue_depth * KV_MAX_MSG_SIZE, IBV_ACCESS_LOCAL_WRITE);
+    if (!conn->kv_request_mr)
+    {
+        log_err("Failed to allocate KV request buffers");
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < conn->queue_depth; i++)
+    {
+        ret = post_kv_request_recv(conn, i);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* 在本地执行一个KV请求并把结果发回客户端 */
+static int serve_kv_request(struct client_conn *conn, const void *msg, uint32_t len)
+{
+    struct ibv_send_wr *bad_wr = NULL;
+    int ret                    = -1;
+    kv_serve_request(conn->dev->kv, msg, len, &conn->kv_response);
+    ret = ibv_post_send(conn->qp, &conn->kv_send_wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to send KV response, errno: %d", ret);
+        return -ret;
+    }
+    conn->stats->kv_ops++;
+    live_stats->kv_ops++;
+    count_conn_send(conn, conn->kv_send_sge.length);
+    return 0;
+}
+
+/* 投递一个不带缓冲区的接收, 供客户端的一个WRITE_WITH_IMM消耗 */
+static int post_ring_recv(struct client_conn *conn)
+{
+    struct ibv_recv_wr wr, *bad_wr = NULL;
+    int ret = -1;
+    bzero(&wr, sizeof(wr));
+    wr.wr_id = RECV_WR_RING;
+    ret      = ibv_post_recv(conn->qp, &wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post ring receive, errno: %d", ret);
+        return -ret;
+    }
+    return 0;
+}
+
+/* 创建本连接的环并记录客户端的信用字, SRQ模式下WRITE_WITH_IMM消耗共享接收 */
+static int setup_ring_channel(struct client_conn *conn)
+{
+    int ret = ring_receiver_init(&conn->ring, conn->pd, conn->qp, ring_size);
+    if (ret)
+    {
+        return ret;
+    }
+    ret = ring_receiver_set_credit(&conn->ring, &conn->client_metadata_attr);
+    if (ret)
+    {
+        return ret;
+    }
+    for (uint32_t i = 0; !conn->dev->srq && i < conn->queue_depth; i++)
+    {
+        ret = post_ring_recv(conn);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * 处理一个WRITE_WITH_IMM到达的消息: 在环中原地读取, 消息开头的8字节为客户端的序号,
+ * 处理后按需写回信用。
+ */
+static int handle_ring_message(struct client_conn *conn, struct ibv_wc *wc)
+{
+    const void *msg;
+    uint64_t seq;
+    uint32_t len;
+    msg = ring_receiver_consume(&conn->ring, wc->imm_data, &len);
+    if (!msg)
+    {
+        return -EPROTO;
+    }
+    conn->stats->ring_msgs++;
+    live_stats->ring_msgs++;
+    if (len >= sizeof(seq))
+    {
+        memcpy(&seq, msg, sizeof(seq));
+        if (seq != conn->ring.messages - 1)
+        {
+            log_err("Ring message %lu carries sequence %lu ", conn->ring.messages - 1, seq);
+            return -EPROTO;
+        }
+    }
+    return ring_receiver_return_credits(&conn->ring);
+}
+
+/*
+ * 释放一个连接的全部资源。
+ * 连接先被移入zombie_conns, 待本轮epoll事件全部处理完毕后再真正释放,
+ * 避免同一轮中后续事件引用已释放的连接。
+ */
+static int disconnect_and_cleanup(struct client_conn *conn)
+{
+    int ret = -1;
+    if (conn->state == CONN_STATE_DISCONNECTED)
+    {
+        return 0;
+    }
+    conn->state = CONN_STATE_DISCONNECTED;
+    conn_list_remove(&active_conns, conn);
+    conn_list_push(&zombie_conns, conn);
+    detach_conn_stats(conn);
+
+    if (conn->io_completion_channel)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->io_completion_channel->fd, NULL);
+    }
+    if (conn->qp && conn->dev->shared_cqs)
+    {
+        /* 共享CQ上此后到达的完成找不到连接, 只归还SRQ缓冲区 */
+        qp_table_remove(conn->dev, conn);
+    }
+    if (conn->qp && !conn->bundle)
+    {
+        rdma_destroy_qp(conn->cm_id);
+    }
+    ret = rdma_destroy_id(conn->cm_id);
+    if (ret)
+    {
+        log_err("Failed to destroy the cm id, errno: %d", -errno);
+    }
+    if (conn->io_completion_channel)
+    {
+        /* 归还或销毁CQ之前确认累计的事件 */
+        flush_cq_events(conn->cq, &conn->unacked_events);
+    }
+    if (conn->bundle)
+    {
+        /* 资源包归还设备的池, QP复位后不再有接收指向会话的缓冲区 */
+        release_conn_bundle(conn->dev, conn->bundle);
+        conn->io_completion_channel = NULL;
+        conn->cq                    = NULL;
+        conn->qp                    = NULL;
+    }
+    else if (conn->shared_cq)
+    {
+        conn->shared_cq->load -= CQ_CAPACITY(conn->queue_depth);
+    }
+    else if (conn->cq)
+    {
+        ret = ibv_destroy_cq(conn->cq);
+        if (ret)
+        {
+            log_err("Failed to destroy the cq, errno: %d", -errno);
+        }
+    }
+    if (conn->io_completion_channel)
+    {
+        ret = ibv_destroy_comp_channel(conn->io_completion_channel);
+        if (ret)
+        {
+            log_err("Failed to destroy the completion channel, errno: %d", -errno);
+        }
+    }
+
+    /* QP已销毁, 不再有接收指向会话的缓冲区 */
+    if (conn->session)
+    {
+        put_client_session(conn->session);
+        conn->session = NULL;
+    }
+    if (conn->server_metadata_mr)
+    {
+        rdma_buffer_deregister(conn->server_metadata_mr);
+    }
+    if (conn->kv_response_mr)
+    {
+        rdma_buffer_deregister(conn->kv_response_mr);
+    }
+    if (conn->kv_request_mr)
+    {
+        rdma_buffer_free(conn->kv_request_mr);
+    }
+    if (conn->ring.messages)
+    {
+        log_info("Ring of connection %p received %lu messages, %lu bytes ", conn,
+                 conn->ring.messages, conn->ring.bytes);
+    }
+    ring_receiver_destroy(&conn->ring);
+    recv_credits_destroy(&conn->credits);
+    free(conn->sink_recv_wrs);
+    conn->sink_recv_wrs = NULL;
+    file_sink_close(&conn->file_sink);
+    if (conn->client_metadata_mr)
+    {
+        rdma_buffer_deregister(conn->client_metadata_mr);
+    }
+    debug("Connection %p is cleaned up ", conn);
+    return 0;
+}
+
+static void reap_zombie_conns()
+{
+    struct client_conn *conn;
+    while ((conn = zombie_conns) != NULL)
+    {
+        conn_list_remove(&zombie_conns, conn);
+        /* 连接结构体中的元数据曾被注册, 释放前使注册缓存中对应的区间失效 */
+        mr_cache_invalidate(conn, sizeof(*conn));
+        free(conn);
+    }
+}
+
+static int handle_connect_request(struct rdma_cm_id *cm_id,
+                                  struct rdma_conn_param *req,
+                                  struct rdma_session_hello *hello)
+{
+    struct client_conn *conn = NULL;
+    int ret                  = -1;
+    conn                     = calloc(1, sizeof(*conn));
+    if (!conn)
+    {
+        log_err("Failed to allocate connection, -ENOMEM ");
+        rdma_reject(cm_id, NULL, 0);
+        rdma_destroy_id(cm_id);
+        return -ENOMEM;
+    }
+    setup_timer_start(&conn->setup);
+    conn->cm_id     = cm_id;
+    conn->state     = CONN_STATE_CONNECTING;
+    cm_id->context  = conn;
+    conn_list_push(&active_conns, conn);
+    attach_conn_stats(conn);
+    debug("Client RDMA CM id %p is bound to connection %p ", cm_id, conn);
+
+    ret = init_client_resources(conn, req->initiator_depth);
     if (ret)
     {
-        log_err("Failed to bind server address, errno: %d ", -errno);
-        return -errno;
+        log_err("Failed to initialize client resources, ret = %d ", ret);
+        goto reject;
     }
-    debug("Server RDMA CM id is successfully binded ");
-    /* backlog = 8, same as TCP */
-    ret = rdma_listen(cm_server_id, 8);
-    if (ret)
+    conn->qp_index = hello->qp_index;
+    conn->session  = get_client_session(conn->dev, hello);
+    if (!conn->session)
     {
-        log_err("Failed to listen on RDMA CM id, errno: %d ", -errno);
-        return -errno;
+        goto reject;
     }
-    log_info("Server is listening successfully at: %s , port: %d ",
-             inet_ntoa(server_addr->sin_addr), ntohs(server_addr->sin_port));
-    ret = process_rdma_cm_event(cm_channel, RDMA_CM_EVENT_CONNECT_REQUEST, &cm_event);
+    /* 只有SEND基准的接收按连接投递并做信用流控, SRQ与其他模式的接收不计信用 */
+    ret = recv_credits_init(&conn->credits, conn->pd, conn->qp, &hello->credit,
+                            (conn->dev->srq || conn->dev->kv || ring_size || output_dir)
+                                ? 0
+                                : conn->queue_depth);
     if (ret)
     {
-        log_err("Failed to get cm event, ret: %d ", ret);
-        return ret;
+        goto reject;
     }
-    cm_client_id = cm_event->id;
-    ret          = rdma_ack_cm_event(cm_event);
+    ret = accept_client_connection(conn);
     if (ret)
     {
-        log_err("Failed to acknowledge the cm event, errno: %d ", -errno);
-        return -errno;
+        log_err("Failed to accept client connection, ret = %d ", ret);
+        goto reject;
     }
-    debug("Client RDMA CM client is created at %p ", cm_client_id);
-    return ret;
+    setup_timer_mark(&conn->setup, SERVER_SETUP_ACCEPT);
+    return 0;
+reject:
+    rdma_reject(cm_id, NULL, 0);
+    live_stats->rejected_conns++;
+    disconnect_and_cleanup(conn);
+    /* 单个连接失败不影响服务端继续运行 */
+    return 0;
 }
 
-static int init_client_resources()
+static int process_cm_events()
 {
+    struct rdma_cm_event *cm_event = NULL;
+    struct sockaddr_in remote_sockaddr;
+    struct rdma_conn_param req;
+    struct rdma_session_hello hello;
+    struct rdma_cm_id *id;
+    struct client_conn *conn;
+    enum rdma_cm_event_type type;
+    int status;
     int ret = -1;
-    if (!cm_client_id)
+    /* cm_channel为非阻塞, 一次性处理完所有待处理事件 */
+    while (!rdma_get_cm_event(cm_channel, &cm_event))
     {
-        log_err("Client id is not created");
-        return -EINVAL;
+        type   = cm_event->event;
+        status = cm_event->status;
+        id     = cm_event->id;
+        conn   = id->context;
+        req    = cm_event->param.conn;
+        /*
+         * private_data在确认事件后失效, 先拷贝; 旧客户端不携带时单独成为一个会话,
+         * 不携带信用字时不做流控
+         */
+        bzero(&hello, sizeof(hello));
+        hello.num_qps = 1;
+        if (type == RDMA_CM_EVENT_CONNECT_REQUEST && req.private_data &&
+            req.private_data_len >= offsetof(struct rdma_session_hello, credit))
+        {
+            memcpy(&hello, req.private_data,
+                   req.private_data_len < sizeof(hello) ? req.private_data_len : sizeof(hello));
+        }
+        req.private_data     = NULL;
+        req.private_data_len = 0;
+        /* 先确认事件, 否则后续rdma_destroy_id会阻塞 */
+        ret = rdma_ack_cm_event(cm_event);
+        if (ret)
+        {
+            log_err("Failed to acknowledge the cm event, errno: %d ", -errno);
+            return -errno;
+        }
+        debug("A new %s type event is received, status: %d ", rdma_event_str(type), status);
+        switch (type)
+        {
+            case RDMA_CM_EVENT_CONNECT_REQUEST:
+                ret = handle_connect_request(id, &req, &hello);
+                if (ret)
+                {
+                    return ret;
+                }
+                break;
+            case RDMA_CM_EVENT_ESTABLISHED:
+                if (conn->state == CONN_STATE_CONNECTING)
+                {
+                    conn->state = CONN_STATE_ESTABLISHED;
+                    setup_timer_mark(&conn->setup, SERVER_SETUP_ESTABLISH);
+                }
+                memcpy(&remote_sockaddr, rdma_get_peer_addr(id), sizeof(struct sockaddr_in));
+                log_info("A new connection is accepted from: %s, session 0x%lx, QP %u/%u",
+                         inet_ntoa(remote_sockaddr.sin_addr), conn->session->id,
+                         conn->qp_index + 1, conn->session->num_qps);
+                break;
+            case RDMA_CM_EVENT_DISCONNECTED:
+                log_info("A disconnect event is received from client");
+                disconnect_and_cleanup(conn);
+                break;
+            case RDMA_CM_EVENT_REJECTED:
+            case RDMA_CM_EVENT_UNREACHABLE:
+            case RDMA_CM_EVENT_CONNECT_ERROR:
+                log_err("Connection %p failed with event %s, status: %d ", conn,
+                        rdma_event_str(type), status);
+                if (conn)
+                {
+                    disconnect_and_cleanup(conn);
+                }
+                break;
+            case RDMA_CM_EVENT_DEVICE_REMOVAL:
+                log_err("RDMA device is removed, shutting down ");
+                server_stop = 1;
+                break;
+            default:
+                debug("Ignoring cm event %s ", rdma_event_str(type));
+                break;
+        }
     }
-    /*
-     * 通过一个合理的连接标识符cm_client_id，创建PD、QP、MR、CQ等资源
-     */
-    pd = ibv_alloc_pd(cm_client_id->verbs);
-    if (!pd)
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
     {
-        log_err("Failed to allocate PD, errno: %d ", -errno);
+        log_err("Failed to retrieve a cm event, errno: %d ", -errno);
         return -errno;
     }
-    debug("PD is created at %p ", pd);
+    return 0;
+}
 
-    io_completion_channel = ibv_create_comp_channel(cm_client_id->verbs);
-    if (!io_completion_channel)
+/*
+ * SRQ模式下处理本连接消费的一个共享接收: 第一个消息是客户端元数据, 拷贝出来后回复服务端元数据,
+ * 之后的SEND在KV模式下作为请求处理, 否则直接丢弃。缓冲区在处理后立即归还。
+ */
+static int handle_srq_recv(struct client_conn *conn, struct ibv_wc *wc)
+{
+    struct server_device *dev = conn->dev;
+    uint64_t idx              = wc->wr_id & ~SRQ_WR_ID_FLAG;
+    char *msg                 = (char *)dev->srq_buffer_mr->addr + idx * srq_recv_size;
+    void *buf;
+    uint32_t len;
+    int metadata = 0, ret;
+    if (conn->metadata_received && dev->kv)
     {
-        log_err("Failed to create IO completion event channel, errno: %d ", -errno);
-        return -errno;
+        ret = serve_kv_request(conn, msg, wc->byte_len);
+        srq_release(dev, wc->wr_id);
+        return ret;
     }
-    debug("Completion channel is created at %p ", io_completion_channel);
-
-    cq = ibv_create_cq(cm_client_id->verbs, CQ_CAPACITY, NULL, io_completion_channel, 0);
-    if (!cq)
+    if (!conn->metadata_received)
     {
-        log_err("Failed to create CQ, errno: %d ", -errno);
-        return -errno;
+        buf = client_metadata_buffer(conn, &len);
+        if (wc->byte_len < len)
+        {
+            log_err("Metadata message of %u bytes is too short ", wc->byte_len);
+            srq_release(dev, wc->wr_id);
+            return -EPROTO;
+        }
+        memcpy(buf, msg, len);
+        conn->metadata_received = 1;
+        metadata                = 1;
     }
-    debug("CQ is created at %p with %d entries ", cq, cq->cqe);
-
-    ret = ibv_req_notify_cq(cq, 0);
+    ret = srq_release(dev, wc->wr_id);
     if (ret)
     {
-        log_err("Failed to request notifications on CQ, errno: %d ", -errno);
-        return -errno;
+        return ret;
     }
+    return metadata ? send_server_metadata(conn) : 0;
+}
 
-    /* 创建QP */
-    bzero(&qp_init_attr, sizeof(qp_init_attr));
-    qp_init_attr.cap.max_send_wr  = MAX_WR;
-    qp_init_attr.cap.max_recv_wr  = MAX_WR;
-    qp_init_attr.cap.max_send_sge = MAX_SGE;
-    qp_init_attr.cap.max_recv_sge = MAX_SGE;
-    qp_init_attr.send_cq          = cq;
-    qp_init_attr.recv_cq          = cq;
-    qp_init_attr.qp_type          = IBV_QPT_RC;
-
-    ret = rdma_create_qp(cm_client_id, pd, &qp_init_attr);
-    if (ret)
+/* 主动断开出错的连接, 之后到达的该连接的完成只归还SRQ缓冲区 */
+static void fail_conn(struct client_conn *conn)
+{
+    if (!conn->disconnecting)
     {
-        log_err("Failed to create QP, errno: %d ", -errno);
-        return -errno;
+        conn->disconnecting = 1;
+        rdma_disconnect(conn->cm_id);
     }
-    client_qp = cm_client_id->qp;
-    debug("Client QP is created at %p ", client_qp);
-    return ret;
 }
 
-static int accept_client_connection()
+/* 处理连接的一个完成, 返回非0时调用方断开该连接 */
+static int handle_conn_wc(struct client_conn *conn, struct ibv_wc *wc)
 {
-    struct rdma_conn_param conn_param;
-    struct rdma_cm_event *cm_event = NULL;
-    struct sockaddr_in remote_sockaddr;
-    int ret = -1;
-    if (!cm_client_id || !client_qp)
+    uint32_t idx;
+    if (conn->disconnecting || wc->status != IBV_WC_SUCCESS)
     {
-        log_err("Client resources are not initialized");
-        return -EINVAL;
+        if (!conn->disconnecting)
+        {
+            log_err("Work completion (WC) has error status: %s ",
+                    ibv_wc_status_str(wc->status));
+        }
+        /* 出错的完成不可信其opcode, 按wr_id归还已消费的SRQ缓冲区 */
+        if (wc->wr_id & SRQ_WR_ID_FLAG)
+        {
+            srq_release(conn->dev, wc->wr_id);
+        }
+        return conn->disconnecting ? 0 : -EIO;
     }
-    client_metadata_mr = rdma_buffer_register(pd, &client_metadata_attr, sizeof(client_metadata_attr),
-                                              (IBV_ACCESS_LOCAL_WRITE));
-
-    if (!client_metadata_mr)
+    /* 服务端的应用吞吐按收到的消息计算, 客户端的单边读写只体现在端口计数器中 */
+    if (wc->opcode & IBV_WC_RECV)
     {
-        log_err("Failed to register client metadata buffer");
-        return -ENOMEM;
+        port_sampler_account(wc->byte_len);
+        count_conn_recv(conn, wc->byte_len);
     }
-    client_recv_sge.addr     = (uint64_t)client_metadata_mr->addr;
-    client_recv_sge.length = client_metadata_mr->length;
-    client_recv_sge.lkey   = client_metadata_mr->lkey;
-    bzero(&conn_param, sizeof(conn_param));
-    client_recv_wr.sg_list = &client_recv_sge;
-    client_recv_wr.num_sge = 1;
-    ret                    = ibv_post_recv(client_qp, &client_recv_wr, &bad_client_recv_wr);
-    if (ret)
+    switch (wc->opcode)
     {
-        log_err("Failed to pre-post the receive buffer, errno: %d", ret);
-        return ret;
+        case IBV_WC_RECV:
+            if (wc->wr_id & SRQ_WR_ID_FLAG)
+            {
+                if (handle_srq_recv(conn, wc))
+                {
+                    log_err("Failed to handle SRQ receive, disconnecting %p ", conn);
+                    return -EPROTO;
+                }
+                break;
+            }
+            if (RECV_WR_KIND(wc->wr_id) == RECV_WR_KV_REQUEST)
+            {
+                idx = (uint32_t)(wc->wr_id >> RECV_WR_INDEX_SHIFT);
+                if (serve_kv_request(conn,
+                                     (char *)conn->kv_request_mr->addr +
+                                         (uint64_t)idx * KV_MAX_MSG_SIZE,
+                                     wc->byte_len))
+                {
+                    return -EPROTO;
+                }
+                return post_kv_request_recv(conn, idx);
+            }
+            if (wc->wr_id == RECV_WR_SINK)
+            {
+                return replenish_sink_recv(conn);
+            }
+            if (send_server_metadata(conn))
+            {
+                log_err("Failed to send server metadata, disconnecting %p ", conn);
+                return -EPROTO;
+            }
+            break;
+        case IBV_WC_RECV_RDMA_WITH_IMM:
+            /* 消息在环中, 接收本身不带数据, 先补充接收再处理 */
+            if (((wc->wr_id & SRQ_WR_ID_FLAG) ? srq_release(conn->dev, wc->wr_id)
+                                               : post_ring_recv(conn)) ||
+                handle_ring_message(conn, wc))
+            {
+                log_err("Failed to handle ring message, disconnecting %p ", conn);
+                return -EPROTO;
+            }
+            break;
+        case IBV_WC_SEND:
+            conn->state = CONN_STATE_SERVING;
+            debug("Connection %p is serving remote memory ops ", conn);
+            break;
+        default:
+            debug("Ignoring work completion with opcode %d ", wc->opcode);
+            break;
     }
-    debug("Receive buffer is pre-posted successfully");
-    memset(&conn_param, 0, sizeof(conn_param));
-    conn_param.initiator_depth     = 3;
-    conn_param.responder_resources = 3;
-    ret                            = rdma_accept(cm_client_id, &conn_param);
-    if (ret)
+    return 0;
+}
+
+/* 轮询并处理一个连接CQ上的所有完成, 返回处理的完成数 */
+static int poll_conn_cq(struct client_conn *conn)
+{
+    struct ibv_wc wc[WC_BATCH];
+    int ret = -1, i, total_wc = 0;
+    while ((ret = ibv_poll_cq(conn->cq, WC_BATCH, wc)) > 0)
     {
-        log_err("Failed to accept the connection request, errno: %d", -errno);
+        total_wc += ret;
+        for (i = 0; i < ret; i++)
+        {
+            if (handle_conn_wc(conn, &wc[i]))
+            {
+                fail_conn(conn);
+            }
+        }
+    }
+    if (ret < 0)
+    {
+        log_err("Failed to poll cq for wc, errno: %d ", -errno);
         return -errno;
     }
-    debug("Waiting for: RDMA_CM_EVENT_ESTABLISHED event ...");
-    ret = process_rdma_cm_event(cm_channel, RDMA_CM_EVENT_ESTABLISHED, &cm_event);
-    if (ret)
+    return total_wc;
+}
+
+/* 轮询一个共享CQ, 按qp_num把每个完成分发给所属连接, 返回处理的完成数 */
+static int poll_shared_cq(struct shared_cq *scq)
+{
+    struct ibv_wc wc[WC_BATCH];
+    struct client_conn *conn;
+    int ret = -1, i, total_wc = 0;
+    while ((ret = ibv_poll_cq(scq->cq, WC_BATCH, wc)) > 0)
     {
-        log_err("Failed to receive the cm event, ret = %d", ret);
-        return ret;
+        total_wc += ret;
+        for (i = 0; i < ret; i++)
+        {
+            conn = qp_table_lookup(scq->dev, wc[i].qp_num);
+            if (!conn)
+            {
+                /* 连接已断开, 其QP销毁前留下的完成 */
+                debug("Dropping completion of unknown QP %u ", wc[i].qp_num);
+                if (wc[i].wr_id & SRQ_WR_ID_FLAG)
+                {
+                    srq_release(scq->dev, wc[i].wr_id);
+                }
+                continue;
+            }
+            if (handle_conn_wc(conn, &wc[i]))
+            {
+                fail_conn(conn);
+            }
+        }
     }
-    ret = rdma_ack_cm_event(cm_event);
-    if (ret)
+    if (ret < 0)
     {
-        log_err("Failed to acknowledge the cm event, errno: %d", -errno);
+        log_err("Failed to poll shared cq for wc, errno: %d ", -errno);
         return -errno;
     }
-    memcpy(&remote_sockaddr, rdma_get_peer_addr(cm_client_id), sizeof(struct sockaddr_in));
-    log_info("A new connection is accepted from: %s", inet_ntoa(remote_sockaddr.sin_addr));
-    return ret;
+    return total_wc;
 }
 
-static int send_server_metadata()
+/* 在所有活跃连接的CQ与所有共享CQ上轮询一遍, 返回处理的完成数 */
+static int poll_all_conns()
 {
-    struct ibv_wc wc;
-    int ret = -1;
-    ret     = process_work_completion_events(io_completion_channel, &wc, 1);
-    if (ret != 1)
+    struct client_conn *conn, *next;
+    struct server_device *dev;
+    int ret, total_wc = 0;
+    for (conn = active_conns; conn; conn = next)
     {
-        log_err("Failed to receive the work completion, ret = %d", ret);
-        return ret;
+        next = conn->next;
+        if (!conn->io_completion_channel)
+        {
+            continue;
+        }
+        ret = poll_conn_cq(conn);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        total_wc += ret;
     }
-    log_info("Client side buffer information is received...");
-    print_rdma_buffer_attr(&client_metadata_attr);
-    log_info("The client has requested buffer length of: %u bytes", client_metadata_attr.length);
-
-    server_buffer_mr = rdma_buffer_alloc(
-        pd, client_metadata_attr.length,
-        (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE));
-    if (!server_buffer_mr)
+    for (dev = devices; dev; dev = dev->next)
     {
-        log_err("Failed to allocate server buffer");
-        return -ENOMEM;
+        for (uint32_t i = 0; i < dev->num_shared_cqs; i++)
+        {
+            ret = poll_shared_cq(&dev->shared_cqs[i]);
+            if (ret < 0)
+            {
+                return ret;
+            }
+            total_wc += ret;
+        }
     }
+    return total_wc;
+}
 
-    server_metadata_attr.address         = (uint64_t)server_buffer_mr->addr;
-    server_metadata_attr.length          = (uint32_t)server_buffer_mr->length;
-    server_metadata_attr.stag.local_stag = (uint32_t)server_buffer_mr->lkey;
-    server_metadata_mr                   = rdma_buffer_register(
-                          pd, &server_metadata_attr, sizeof(server_metadata_attr), (IBV_ACCESS_LOCAL_WRITE));
-    if (!server_metadata_mr)
+/* 为所有活跃连接的CQ与所有共享CQ请求完成通知, 自适应模式进入休眠前调用 */
+static int arm_all_conns()
+{
+    struct client_conn *conn;
+    struct server_device *dev;
+    for (conn = active_conns; conn; conn = conn->next)
     {
-        log_err("Failed to register server metadata buffer");
-        return -ENOMEM;
+        if (conn->io_completion_channel && ibv_req_notify_cq(conn->cq, 0))
+        {
+            log_err("Failed to request notifications on CQ, errno: %d ", -errno);
+            return -errno;
+        }
     }
-
-    server_send_sge.addr   = (uint64_t) &server_metadata_attr;
-    server_send_sge.length = sizeof(server_metadata_attr);
-    server_send_sge.lkey   = server_metadata_mr->lkey;
-    bzero(&server_send_wr, sizeof(server_send_wr));
-    server_send_wr.sg_list    = &server_send_sge;
-    server_send_wr.num_sge    = 1;
-    server_send_wr.opcode     = IBV_WR_SEND;
-    server_send_wr.send_flags = IBV_SEND_SIGNALED;
-
-    ret = ibv_post_send(client_qp, &server_send_wr, &bad_server_send_wr);
-    if (ret)
+    for (dev = devices; dev; dev = dev->next)
     {
-        log_err("Failed to send the server metadata, errno: %d", -errno);
-        return -errno;
+        for (uint32_t i = 0; i < dev->num_shared_cqs; i++)
+        {
+            if (ibv_req_notify_cq(dev->shared_cqs[i].cq, 0))
+            {
+                log_err("Failed to request notifications on CQ, errno: %d ", -errno);
+                return -errno;
+            }
+        }
     }
-    debug("Server metadata is sent successfully");
     return 0;
 }
 
-static int disconnect_and_cleanup()
+/*
+ * 取出完成通道上的一个事件并累计到pending中批量确认, 事件模式下重新请求通知;
+ * 通道上没有事件时返回1
+ */
+static int take_cq_event(struct ibv_comp_channel *channel, uint32_t *pending)
 {
-    struct rdma_cm_event *cm_event = NULL;
-    int ret                        = -1;
-    debug("Wait for: RDMA_CM_EVENT_DISCONNECTED event ...");
-    ret = process_rdma_cm_event(cm_client_id->channel, RDMA_CM_EVENT_DISCONNECTED, &cm_event);
-
-    if (ret)
+    struct ibv_cq *cq_ptr = NULL;
+    void *context         = NULL;
+    if (ibv_get_cq_event(channel, &cq_ptr, &context))
     {
-        log_err("Failed to receive the cm event, ret = %d", ret);
-        return ret;
+        /* 非阻塞通道上的伪唤醒 */
+        return 1;
     }
-
-    ret = rdma_ack_cm_event(cm_event);
-    if (ret)
+    ack_cq_event(cq_ptr, pending);
+    /* 仅事件模式在每次唤醒后重新请求通知, 自适应模式在休眠前统一请求 */
+    if (get_wc_poll_mode(NULL) == WC_MODE_EVENT && ibv_req_notify_cq(cq_ptr, 0))
     {
-        log_err("Failed to acknowledge the cm event, errno: %d", -errno);
+        log_err("Failed to request notifications on CQ, errno: %d ", -errno);
         return -errno;
     }
+    return 0;
+}
 
-    log_info("A disconnect event is received from client");
-
-    rdma_destroy_qp(cm_client_id);
-    ret = rdma_destroy_id(cm_client_id);
+/* 设备不支持CQ中断合并时, 一次唤醒后继续轮询, 直到攒够一批完成或超过合并时长 */
+static int process_shared_cq_events(struct shared_cq *scq)
+{
+    uint64_t woke_ns;
+    int ret = take_cq_event(scq->comp_channel, &scq->unacked_events), total = 0;
     if (ret)
     {
-        log_err("Failed to destroy the cm id, errno: %d", -errno);
+        return ret < 0 ? ret : 0;
     }
-    ret = ibv_destroy_cq(cq);
-    if (ret)
+    woke_ns = now_ns();
+    do
     {
-        log_err("Failed to destroy the cq, errno: %d", -errno);
-    }
+        ret = poll_shared_cq(scq);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        total += ret;
+    } while (cq_coalesce_continue(total, woke_ns));
+    return 0;
+}
 
-    ret = ibv_destroy_comp_channel(io_completion_channel);
+static int process_cq_events(struct client_conn *conn)
+{
+    uint64_t woke_ns;
+    int ret = take_cq_event(conn->io_completion_channel, &conn->unacked_events), total = 0;
     if (ret)
     {
-        log_err("Failed to destroy the completion channel, errno: %d", -errno);
+        return ret < 0 ? ret : 0;
     }
+    woke_ns = now_ns();
+    do
+    {
+        ret = poll_conn_cq(conn);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        total += ret;
+    } while (cq_coalesce_continue(total, woke_ns));
+    return 0;
+}
 
-    rdma_buffer_free(server_buffer_mr);
-    rdma_buffer_deregister(server_metadata_mr);
-    rdma_buffer_deregister(client_metadata_mr);
-    ret = ibv_dealloc_pd(pd);
-    if (ret)
+/*
+ * 事件模式下阻塞在epoll上; 忙轮询模式下epoll超时为0并持续轮询所有CQ;
+ * 自适应模式下忙轮询直到空闲超过spin预算, 然后请求通知并阻塞在epoll上。
+ */
+static int run_event_loop()
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    uint32_t spin_budget_us;
+    enum wc_poll_mode mode = get_wc_poll_mode(&spin_budget_us);
+    uint64_t idle_since    = now_ns();
+    /* 单边读写不产生事件, 采样端口计数器时至少每个采样间隔醒来刷新一次统计区域 */
+    int idle_timeout       = counter_interval_ms ? (int)counter_interval_ms : -1;
+    int timeout            = (mode == WC_MODE_EVENT) ? idle_timeout : 0;
+    int n, i, ret;
+    while (!server_stop)
     {
-        log_err("Failed to deallocate the pd, errno: %d", -errno);
+        n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log_err("epoll_wait failed, errno: %d ", -errno);
+            return -errno;
+        }
+        for (i = 0; i < n; i++)
+        {
+            enum epoll_source *source = events[i].data.ptr;
+            if (!source)
+            {
+                ret = process_cm_events();
+            }
+            else if (*source == EPOLL_SOURCE_SHARED_CQ)
+            {
+                ret = process_shared_cq_events((struct shared_cq *)source);
+            }
+            else if (((struct client_conn *)source)->state != CONN_STATE_DISCONNECTED)
+            {
+                ret = process_cq_events((struct client_conn *)source);
+            }
+            else
+            {
+                ret = 0;
+            }
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        if (mode != WC_MODE_EVENT)
+        {
+            ret = poll_all_conns();
+            if (ret < 0)
+            {
+                return ret;
+            }
+            if (ret > 0 || n > 0)
+            {
+                idle_since = now_ns();
+                timeout    = 0;
+            }
+            else if (mode == WC_MODE_ADAPTIVE && timeout == 0 &&
+                     now_ns() - idle_since >= (uint64_t)spin_budget_us * 1000ULL)
+            {
+                ret = arm_all_conns();
+                if (ret)
+                {
+                    return ret;
+                }
+                /* 请求通知后再轮询一次, 避免错过请求前到达的完成 */
+                ret = poll_all_conns();
+                if (ret < 0)
+                {
+                    return ret;
+                }
+                timeout = ret > 0 ? 0 : idle_timeout;
+            }
+        }
+        reap_zombie_conns();
+        for (struct server_device *dev = devices; dev; dev = dev->next)
+        {
+            refill_conn_bundles(dev);
+        }
+        refresh_server_stats();
     }
+    return 0;
+}
 
-    ret = rdma_destroy_id(cm_server_id);
-    if (ret)
+static void shutdown_server()
+{
+    struct setup_timer avg;
+    while (active_conns)
+    {
+        rdma_disconnect(active_conns->cm_id);
+        disconnect_and_cleanup(active_conns);
+    }
+    reap_zombie_conns();
+    if (setup_conns)
+    {
+        char label[96];
+        avg = setup_totals;
+        for (int i = 0; i < SERVER_SETUP_NUM_PHASES; i++)
+        {
+            avg.ns[i] /= setup_conns;
+        }
+        snprintf(label, sizeof(label), "Average setup of %lu connections (%lu pre-warmed)",
+                 setup_conns, setup_pooled_conns);
+        setup_timer_log(&avg, setup_phase_names, SERVER_SETUP_NUM_PHASES, label);
+    }
+    destroy_server_devices();
+    destroy_server_stats();
+    if (cm_server_id && rdma_destroy_id(cm_server_id))
     {
         log_err("Failed to destroy the cm id, errno: %d", -errno);
     }
-    rdma_destroy_event_channel(cm_channel);
+    if (cm_channel)
+    {
+        rdma_destroy_event_channel(cm_channel);
+    }
+    if (epoll_fd >= 0)
+    {
+        close(epoll_fd);
+    }
     log_info("Server Shutdown complete.");
-    return 0;
 }
 
 int main(int argc, char **argv)
 {
     int ret, option;
     struct sockaddr_in server_sockaddr;
+    enum wc_poll_mode wc_mode = WC_MODE_EVENT;
+    uint32_t spin_budget_us   = DEFAULT_SPIN_BUDGET_US;
+    enum buffer_backing backing;
+    struct stat st;
+    uint64_t size;
+    uint16_t cq_mod_count, cq_mod_period_us;
     bzero(&server_sockaddr, sizeof(server_sockaddr));
     /* AF_INET: IPv4, SOCK_STREAM: TCP */
     server_sockaddr.sin_family = AF_INET;
     /* 0.0.0.0: listen on all interfaces */
     server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     /* 解析命令行参数 */
-    while ((option = getopt(argc, argv, "a:p:")) != -1)
+    while ((option = getopt(argc, argv, "a:p:m:u:E:d:P:H:I:S:R:K:V:W:o:O:w:C:M:")) != -1)
     {
         switch (option)
         {
@@ -316,7 +2315,95 @@ int main(int argc, char **argv)
                 }
                 break;
             case 'p':
-                server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0)); 
+                server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+                break;
+            case 'm':
+                ret = parse_wc_poll_mode(optarg, &wc_mode);
+                if (ret)
+                {
+                    usage();
+                }
+                break;
+            case 'u':
+                spin_budget_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'E':
+                if (parse_cq_moderation(optarg, &cq_mod_count, &cq_mod_period_us))
+                {
+                    usage();
+                }
+                set_cq_moderation(cq_mod_count, cq_mod_period_us);
+                break;
+            case 'd':
+                queue_depth = strtoul(optarg, NULL, 0);
+                if (!queue_depth)
+                {
+                    usage();
+                }
+                break;
+            case 'P':
+                if (parse_size(optarg, &size))
+                {
+                    usage();
+                }
+                mr_pool_arena_size = size;
+                break;
+            case 'H':
+                if (parse_buffer_backing(optarg, &backing))
+                {
+                    usage();
+                }
+                set_buffer_backing(backing);
+                break;
+            case 'O':
+                if (parse_mr_odp_mode(optarg, &odp_mode))
+                {
+                    usage();
+                }
+                break;
+            case 'I':
+                set_inline_threshold(strtoul(optarg, NULL, 0));
+                break;
+            case 'S':
+                srq_depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                if (parse_size(optarg, &size) || size < sizeof(struct rdma_buffer_attr) ||
+                    size > UINT32_MAX)
+                {
+                    usage();
+                }
+                srq_recv_size = (uint32_t)size;
+                break;
+            case 'K':
+                kv_num_buckets = strtoul(optarg, NULL, 0);
+                break;
+            case 'V':
+                if (parse_size(optarg, &size) || !size)
+                {
+                    usage();
+                }
+                kv_log_size = size;
+                break;
+            case 'W':
+                if (parse_size(optarg, &size) || !size || size % RING_SLOT_ALIGN ||
+                    size > RING_MAX_SIZE)
+                {
+                    usage();
+                }
+                ring_size = size;
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'w':
+                prewarm_bundles = strtoul(optarg, NULL, 0);
+                break;
+            case 'C':
+                num_shared_cqs = strtoul(optarg, NULL, 0);
+                break;
+            case 'M':
+                counter_interval_ms = strtoul(optarg, NULL, 0);
                 break;
             default:
                 usage();
@@ -334,34 +2421,45 @@ int main(int argc, char **argv)
         log_info("Server port is not specified, use default port: %d ", DEFAULT_PORT);
         server_sockaddr.sin_port = htons(DEFAULT_PORT);
     }
-    ret = start_rdma_server(&server_sockaddr);
-    if (ret)
+    if ((kv_num_buckets != 0) + (ring_size != 0) + (output_dir != NULL) > 1)
     {
-        log_err("RDMA server failed to start cleanly, ret = %d ", ret);
-        return ret;
+        log_err("-K, -W and -o are mutually exclusive");
+        usage();
     }
-    ret = init_client_resources();
-    if (ret)
+    if (output_dir)
     {
-        log_err("Failed to initialize client resources, ret = %d ", ret);
-        return ret;
+        if (stat(output_dir, &st) || !S_ISDIR(st.st_mode))
+        {
+            log_err("Output directory %s does not exist ", output_dir);
+            return -ENOENT;
+        }
+        if (srq_depth && srq_recv_size < sizeof(struct file_request))
+        {
+            log_err("SRQ receive size %u is smaller than file requests of %zu bytes ",
+                    srq_recv_size, sizeof(struct file_request));
+            usage();
+        }
     }
-    ret = accept_client_connection();
-    if (ret)
+    if (kv_num_buckets && srq_depth && srq_recv_size < KV_MAX_MSG_SIZE)
     {
-        log_err("Failed to accept client connection, ret = %d ", ret);
-        return ret;
+        log_warn("SRQ receive size %u is smaller than KV requests of up to %d bytes ",
+                 srq_recv_size, KV_MAX_MSG_SIZE);
     }
-    ret = send_server_metadata();
+    set_wc_poll_mode(wc_mode, spin_budget_us);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    ret = start_rdma_server(&server_sockaddr);
     if (ret)
     {
-        log_err("Failed to send server metadata, ret = %d ", ret);
+        log_err("RDMA server failed to start cleanly, ret = %d ", ret);
         return ret;
     }
-    ret = disconnect_and_cleanup();
+    /* 持续处理连接请求, 每个连接独立推进状态机, 直到收到SIGINT/SIGTERM */
+    ret = run_event_loop();
     if (ret)
     {
-        log_err("Failed to disconnect and cleanup resources, ret = %d ", ret);
-        return ret;
+        log_err("Server event loop failed, ret = %d ", ret);
     }
-}
\ No newline at end of file
+    shutdown_server();
+    return ret;
+}
@@ -0,0 +1,377 @@
+#include "stats.h"
+
+void usage()
+{
+    printf("Usage:\n");
+    printf("    stats [-a <server-address>] [-p <server-port>] [-i <interval-ms>] [-n <count>] \n");
+    printf("Reads the live statistics region of a running server with RDMA READs. \n");
+    printf("default IP: 127.0.0.1, default port: %d\n", DEFAULT_PORT);
+    printf("default interval: %d ms, default count: 0 (until interrupted)\n",
+           STATS_DEFAULT_INTERVAL_MS);
+    exit(1);
+}
+
+static const char *const conn_state_names[] = {
+    [CONN_STATE_CONNECTING]    = "connecting",
+    [CONN_STATE_ESTABLISHED]   = "established",
+    [CONN_STATE_METADATA_SENT] = "metadata",
+    [CONN_STATE_SERVING]       = "serving",
+    [CONN_STATE_DISCONNECTED]  = "closed",
+};
+
+static void handle_signal(int signo)
+{
+    (void)signo;
+    stats_stop = 1;
+}
+
+/* 建立一个只用于RDMA READ的连接, 从服务端的接受事件中取得统计区域 */
+static int connect_to_server(struct sockaddr_in *s_addr)
+{
+    struct rdma_cm_event *cm_event = NULL;
+    struct ibv_qp_init_attr qp_init_attr;
+    struct rdma_conn_param conn_param;
+    struct rdma_session_hello hello;
+    struct rdma_server_hello server_hello;
+    int ret = -1;
+    ret     = rdma_create_id(cm_channel, &cm_client_id, NULL, RDMA_PS_TCP);
+    if (ret)
+    {
+        log_err("Creating cm id failed with errno: %d ", -errno);
+        return -errno;
+    }
+    ret = rdma_resolve_addr(cm_client_id, NULL, (struct sockaddr *)s_addr, 2000);
+    if (ret)
+    {
+        log_err("Failed to resolve addr, errno: %d ", -errno);
+        return -errno;
+    }
+    ret = process_rdma_cm_event(cm_channel, RDMA_CM_EVENT_ADDR_RESOLVED, &cm_event);
+    if (ret)
+    {
+        log_err("Failed to get cm event, ret: %d ", ret);
+        return ret;
+    }
+    rdma_ack_cm_event(cm_event);
+    ret = rdma_resolve_route(cm_client_id, 2000);
+    if (ret)
+    {
+        log_err("Failed to resolve route, errno: %d ", -errno);
+        return -errno;
+    }
+    ret = process_rdma_cm_event(cm_channel, RDMA_CM_EVENT_ROUTE_RESOLVED, &cm_event);
+    if (ret)
+    {
+        log_err("Failed to get cm event, ret: %d ", ret);
+        return ret;
+    }
+    rdma_ack_cm_event(cm_event);
+
+    pd = ibv_alloc_pd(cm_client_id->verbs);
+    if (!pd)
+    {
+        log_err("Failed to alloc pd, errno: %d ", -errno);
+        return -errno;
+    }
+    /* 同一时刻只有一个READ在途, 忙轮询即可 */
+    cq = ibv_create_cq(cm_client_id->verbs, CQ_CAPACITY(1), NULL, NULL, 0);
+    if (!cq)
+    {
+        log_err("Failed to create CQ, errno: %d ", -errno);
+        return -errno;
+    }
+    bzero(&qp_init_attr, sizeof(qp_init_attr));
+    qp_init_attr.qp_type          = IBV_QPT_RC;
+    qp_init_attr.cap.max_send_wr  = 1;
+    qp_init_attr.cap.max_recv_wr  = 1;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    qp_init_attr.send_cq          = cq;
+    qp_init_attr.recv_cq          = cq;
+    ret = rdma_create_qp(cm_client_id, pd, &qp_init_attr);
+    if (ret)
+    {
+        log_err("Failed to create QP, errno: %d ", -errno);
+        return -errno;
+    }
+
+    bzero(&conn_param, sizeof(conn_param));
+    conn_param.initiator_depth     = 1;
+    conn_param.responder_resources = 1;
+    conn_param.retry_count         = 3;
+    /* 单独成为一个会话, 服务端不会为它分配缓冲区, 直到收到元数据 */
+    bzero(&hello, sizeof(hello));
+    hello.num_qps               = 1;
+    conn_param.private_data     = &hello;
+    conn_param.private_data_len = sizeof(hello);
+    ret                         = rdma_connect(cm_client_id, &conn_param);
+    if (ret)
+    {
+        log_err("Failed to connect to remote host, errno: %d ", -errno);
+        return -errno;
+    }
+    ret = process_rdma_cm_event(cm_channel, RDMA_CM_EVENT_ESTABLISHED, &cm_event);
+    if (ret)
+    {
+        log_err("Failed to get cm event, ret: %d ", ret);
+        return ret;
+    }
+    /* private_data在确认事件后失效, 先拷贝 */
+    bzero(&server_hello, sizeof(server_hello));
+    if (cm_event->param.conn.private_data &&
+        cm_event->param.conn.private_data_len >= sizeof(server_hello))
+    {
+        memcpy(&server_hello, cm_event->param.conn.private_data, sizeof(server_hello));
+    }
+    rdma_ack_cm_event(cm_event);
+    remote_stats = server_hello.stats;
+    if (remote_stats.length < sizeof(struct server_stats))
+    {
+        log_err("The server does not publish a stats region ");
+        return -EPROTONOSUPPORT;
+    }
+
+    /* 本地两份快照: stats_mr接收本次READ, prev_stats保存上次的结果 */
+    stats_mr = rdma_buffer_alloc(pd, remote_stats.length, IBV_ACCESS_LOCAL_WRITE);
+    prev_stats = calloc(1, remote_stats.length);
+    if (!stats_mr || !prev_stats)
+    {
+        log_err("Failed to allocate %lu bytes for stats snapshots, -ENOMEM ",
+                remote_stats.length);
+        return -ENOMEM;
+    }
+    log_info("Reading %lu bytes of stats at 0x%lx every %u ms ", remote_stats.length,
+             remote_stats.address, interval_ms);
+    return 0;
+}
+
+/* 以一个RDMA READ读取整个统计区域并等待完成 */
+static int read_server_stats()
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    struct ibv_wc wc;
+    int ret = -1;
+    sge.addr   = (uint64_t)stats_mr->addr;
+    sge.length = (uint32_t)remote_stats.length;
+    sge.lkey   = stats_mr->lkey;
+    bzero(&wr, sizeof(wr));
+    wr.sg_list             = &sge;
+    wr.num_sge             = 1;
+    wr.opcode              = IBV_WR_RDMA_READ;
+    wr.send_flags          = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = remote_stats.address;
+    wr.wr.rdma.rkey        = remote_stats.stag.remote_stag;
+    ret                    = ibv_post_send(cm_client_id->qp, &wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post the stats READ, errno: %d ", ret);
+        return -ret;
+    }
+    while ((ret = ibv_poll_cq(cq, 1, &wc)) == 0)
+    {
+        cpu_relax();
+    }
+    if (ret < 0)
+    {
+        log_err("Failed to poll cq for wc, errno: %d ", -errno);
+        return -errno;
+    }
+    if (wc.status != IBV_WC_SUCCESS)
+    {
+        log_err("Stats READ failed with status: %s ", ibv_wc_status_str(wc.status));
+        return -EIO;
+    }
+    return 0;
+}
+
+/* 每秒的速率, 时间取服务端的运行时长, 不受两端时钟的影响 */
+static double per_sec(uint64_t cur, uint64_t prev, double secs)
+{
+    return secs > 0 && cur >= prev ? (double)(cur - prev) / secs : 0.0;
+}
+
+static void render_server_stats(const struct server_stats *cur, const struct server_stats *prev)
+{
+    const struct server_conn_stats *c, *p;
+    double secs = (double)(cur->uptime_ns - prev->uptime_ns) / 1e9;
+    char age[32];
+    printf("uptime %.1f s, update %lu: %lu conns (%lu QPs, %lu sessions), %lu accepted, "
+           "%lu rejected\n",
+           (double)cur->uptime_ns / 1e9, cur->update_seq, cur->active_conns, cur->active_qps,
+           cur->sessions, cur->total_conns, cur->rejected_conns);
+    printf("  recv %.0f msg/s %.3f Gb/s, send %.0f msg/s %.3f Gb/s, kv %.0f op/s, "
+           "ring %.0f msg/s\n",
+           per_sec(cur->recv_msgs, prev->recv_msgs, secs),
+           per_sec(cur->recv_bytes, prev->recv_bytes, secs) * 8 / 1e9,
+           per_sec(cur->send_msgs, prev->send_msgs, secs),
+           per_sec(cur->send_bytes, prev->send_bytes, secs) * 8 / 1e9,
+           per_sec(cur->kv_ops, prev->kv_ops, secs),
+           per_sec(cur->ring_msgs, prev->ring_msgs, secs));
+    if (cur->counters_available)
+    {
+        printf("  port tx %.3f Gb/s, rx %.3f Gb/s, retransmits %lu, RNR NAKs %lu\n",
+               per_sec(cur->port_tx_bytes, prev->port_tx_bytes, secs) * 8 / 1e9,
+               per_sec(cur->port_rx_bytes, prev->port_rx_bytes, secs) * 8 / 1e9,
+               cur->port_retransmits - prev->port_retransmits,
+               cur->port_rnr_naks - prev->port_rnr_naks);
+    }
+    else
+    {
+        printf("  port counters: not sampled, start the server with -M for one-sided traffic\n");
+    }
+    printf("  %lu devices, pool %lu / %lu bytes, %lu cached MRs, SRQ %lu / %lu free, "
+           "%lu bundles, shared CQ %lu / %lu\n",
+           cur->devices, cur->pool_used_bytes, cur->pool_arena_bytes, cur->cache_entries,
+           cur->srq_free, cur->srq_depth, cur->bundles_free, cur->shared_cq_load,
+           cur->shared_cq_capacity);
+    printf("  %6s %8s %18s %4s %-12s %10s %12s %10s %12s %10s\n", "conn", "qp_num", "session",
+           "idx", "state", "age[s]", "recv[msg/s]", "recv[Gb/s]", "send[msg/s]", "kv[op/s]");
+    for (uint64_t i = 0; i < cur->max_conns; i++)
+    {
+        c = server_stats_conn((struct server_stats *)cur, i);
+        p = server_stats_conn((struct server_stats *)prev, i);
+        if (!c->in_use)
+        {
+            continue;
+        }
+        /* 槽位被新连接复用时没有可比较的上次值 */
+        if (p->conn_id != c->conn_id)
+        {
+            p = c;
+        }
+        /* uptime_ns只在刷新时更新, 刚建立的连接可能晚于它 */
+        snprintf(age, sizeof(age), "%.1f",
+                 cur->uptime_ns > c->connected_ns
+                     ? (double)(cur->uptime_ns - c->connected_ns) / 1e9
+                     : 0.0);
+        printf("  %6lu %8lu %#18lx %4lu %-12s %10s %12.0f %10.3f %12.0f %10.0f\n", c->conn_id,
+               c->qp_num, c->session_id, c->qp_index,
+               c->state <= CONN_STATE_DISCONNECTED ? conn_state_names[c->state] : "?", age,
+               per_sec(c->recv_msgs, p->recv_msgs, secs),
+               per_sec(c->recv_bytes, p->recv_bytes, secs) * 8 / 1e9,
+               per_sec(c->send_msgs, p->send_msgs, secs), per_sec(c->kv_ops, p->kv_ops, secs));
+    }
+    fflush(stdout);
+}
+
+static void disconnect_and_cleanup()
+{
+    struct rdma_cm_event *cm_event = NULL;
+    if (cm_client_id && cm_client_id->qp)
+    {
+        if (rdma_disconnect(cm_client_id))
+        {
+            log_err("Failed to disconnect, errno: %d ", -errno);
+        }
+        else if (!process_rdma_cm_event(cm_channel, RDMA_CM_EVENT_DISCONNECTED, &cm_event))
+        {
+            rdma_ack_cm_event(cm_event);
+        }
+        rdma_destroy_qp(cm_client_id);
+    }
+    if (stats_mr)
+    {
+        rdma_buffer_free(stats_mr);
+    }
+    free(prev_stats);
+    if (cq && ibv_destroy_cq(cq))
+    {
+        log_err("Failed to destroy the cq, errno: %d ", -errno);
+    }
+    if (pd && ibv_dealloc_pd(pd))
+    {
+        log_err("Failed to deallocate the pd, errno: %d ", -errno);
+    }
+    if (cm_client_id && rdma_destroy_id(cm_client_id))
+    {
+        log_err("Failed to destroy the cm id, errno: %d ", -errno);
+    }
+    if (cm_channel)
+    {
+        rdma_destroy_event_channel(cm_channel);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in server_sockaddr;
+    struct server_stats *cur;
+    struct timespec delay;
+    int ret, option;
+    bzero(&server_sockaddr, sizeof(server_sockaddr));
+    server_sockaddr.sin_family      = AF_INET;
+    server_sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    while ((option = getopt(argc, argv, "a:p:i:n:")) != -1)
+    {
+        switch (option)
+        {
+            case 'a':
+                ret = get_addr(optarg, (struct sockaddr *)&server_sockaddr);
+                if (ret)
+                {
+                    log_err("Invalid IP ");
+                    return ret;
+                }
+                break;
+            case 'p':
+                server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+                break;
+            case 'i':
+                interval_ms = strtoul(optarg, NULL, 0);
+                if (!interval_ms)
+                {
+                    usage();
+                }
+                break;
+            case 'n':
+                num_samples = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+                break;
+        }
+    }
+    if (!server_sockaddr.sin_port)
+    {
+        server_sockaddr.sin_port = htons(DEFAULT_PORT);
+    }
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    cm_channel = rdma_create_event_channel();
+    if (!cm_channel)
+    {
+        log_err("Creating cm event channel failed, errno: %d ", -errno);
+        return -errno;
+    }
+    ret = connect_to_server(&server_sockaddr);
+    if (ret)
+    {
+        disconnect_and_cleanup();
+        return ret;
+    }
+    cur = stats_mr->addr;
+    /* 第一次读取只作为基准 */
+    ret = read_server_stats();
+    if (!ret && (cur->magic != SERVER_STATS_MAGIC || cur->version != SERVER_STATS_VERSION ||
+                 SERVER_STATS_SIZE(cur->max_conns) > remote_stats.length))
+    {
+        log_err("Unsupported stats region: magic 0x%lx, version %lu ", cur->magic, cur->version);
+        ret = -EPROTO;
+    }
+    delay.tv_sec  = interval_ms / 1000;
+    delay.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+    for (uint32_t i = 0; !ret && !stats_stop && (!num_samples || i < num_samples); i++)
+    {
+        memcpy(prev_stats, cur, remote_stats.length);
+        nanosleep(&delay, NULL);
+        ret = read_server_stats();
+        if (!ret)
+        {
+            render_server_stats(cur, prev_stats);
+        }
+    }
+    disconnect_and_cleanup();
+    return ret;
+}
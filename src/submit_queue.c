@@ -0,0 +1,224 @@
+#include "submit_queue.h"
+#include <sched.h>
+
+/* 投递线程取出一个请求, 环为空或提交者尚未写完槽时返回NULL */
+static struct submit_request *submit_dequeue(struct submit_queue *q)
+{
+    struct submit_slot *slot = &q->slots[q->head & q->mask];
+    struct submit_request *req;
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != q->head + 1)
+    {
+        return NULL;
+    }
+    req = slot->req;
+    /* 槽在下一圈的同一位置重新可写 */
+    atomic_store_explicit(&slot->seq, q->head + q->mask + 1, memory_order_release);
+    q->head++;
+    return req;
+}
+
+/* 把完成交还给提交者, 返回处理的完成数 */
+static int submit_reap(struct submit_queue *q)
+{
+    struct ibv_wc wc[WC_BATCH];
+    struct submit_request *req;
+    struct submit_client *client;
+    int n = ibv_poll_cq(q->cq, WC_BATCH, wc);
+    if (n < 0)
+    {
+        log_err("Failed to poll cq for wc, errno: %d ", -errno);
+        return -errno;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        req         = (struct submit_request *)(uintptr_t)wc[i].wr_id;
+        client      = req->client;
+        req->status = wc[i].status;
+        if (wc[i].status != IBV_WC_SUCCESS)
+        {
+            log_err("Submitted WR failed with status: %s ", ibv_wc_status_str(wc[i].status));
+            atomic_fetch_add_explicit(&client->errors, 1, memory_order_relaxed);
+        }
+        /* 置done之后请求归还提交者, 不能再访问 */
+        atomic_store_explicit(&req->done, 1, memory_order_release);
+        atomic_fetch_add_explicit(&client->completed, 1, memory_order_release);
+    }
+    q->inflight -= n;
+    return n;
+}
+
+/*
+ * 投递线程: 发送队列有空位时把环中的请求链入批中, 环取空或批满时一次投递整条链,
+ * 然后轮询CQ。收到停止请求后, 直到环与发送队列都排空才退出。
+ */
+static void *submit_poster_main(void *arg)
+{
+    struct submit_queue *q = arg;
+    struct submit_request *req;
+    int ret = 0, progress;
+    for (;;)
+    {
+        progress = 0;
+        while (q->inflight < q->depth && (req = submit_dequeue(q)) != NULL)
+        {
+            req->wr.wr_id   = (uint64_t)(uintptr_t)req;
+            req->wr.sg_list = req->sge;
+            req->wr.next    = NULL;
+            /* 每个请求都要交还给提交者, 不能使用选择性完成 */
+            req->wr.send_flags |= IBV_SEND_SIGNALED;
+            ret = wr_batch_add(&q->batch, &req->wr);
+            if (ret)
+            {
+                goto out;
+            }
+            q->inflight++;
+            q->posted++;
+            progress++;
+        }
+        ret = wr_batch_flush(&q->batch);
+        if (ret)
+        {
+            goto out;
+        }
+        ret = q->inflight ? submit_reap(q) : 0;
+        if (ret < 0)
+        {
+            goto out;
+        }
+        progress += ret;
+        ret = 0;
+        if (!progress)
+        {
+            if (atomic_load_explicit(&q->stop, memory_order_acquire) && !q->inflight &&
+                atomic_load_explicit(&q->tail, memory_order_acquire) == q->head)
+            {
+                break;
+            }
+            /* 空闲时让出CPU, 避免与同核的提交者争抢 */
+            sched_yield();
+        }
+    }
+out:
+    if (ret)
+    {
+        log_err("Submission poster stopped, ret = %d ", ret);
+        atomic_store_explicit(&q->ret, ret, memory_order_release);
+    }
+    return NULL;
+}
+
+int submit_queue_init(struct submit_queue *q,
+                      struct ibv_qp *qp,
+                      struct ibv_cq *cq,
+                      uint32_t capacity,
+                      uint32_t depth)
+{
+    uint64_t slots = 1;
+    int ret        = -1;
+    bzero(q, sizeof(*q));
+    if (!depth)
+    {
+        log_err("Submission queue depth must be positive");
+        return -EINVAL;
+    }
+    while (slots < capacity)
+    {
+        slots <<= 1;
+    }
+    q->qp    = qp;
+    q->cq    = cq;
+    q->depth = depth;
+    q->mask  = slots - 1;
+    q->slots = calloc(slots, sizeof(*q->slots));
+    if (!q->slots)
+    {
+        log_err("Failed to allocate %lu submission slots, -ENOMEM ", slots);
+        return -ENOMEM;
+    }
+    for (uint64_t i = 0; i < slots; i++)
+    {
+        atomic_init(&q->slots[i].seq, i);
+    }
+    ret = wr_batch_init_default(&q->batch, qp, depth);
+    if (ret)
+    {
+        free(q->slots);
+        return ret;
+    }
+    ret = pthread_create(&q->poster, NULL, submit_poster_main, q);
+    if (ret)
+    {
+        log_err("Failed to create the submission poster, errno: %d ", ret);
+        wr_batch_destroy(&q->batch);
+        free(q->slots);
+        return -ret;
+    }
+    debug("Submission queue with %lu slots and depth %u is started ", slots, depth);
+    return 0;
+}
+
+int submit_queue_destroy(struct submit_queue *q)
+{
+    atomic_store_explicit(&q->stop, 1, memory_order_release);
+    pthread_join(q->poster, NULL);
+    debug("Submission queue posted %lu WRs with %lu doorbells ", q->posted, q->batch.doorbells);
+    wr_batch_destroy(&q->batch);
+    free(q->slots);
+    q->slots = NULL;
+    return atomic_load_explicit(&q->ret, memory_order_acquire);
+}
+
+int submit_post(struct submit_queue *q, struct submit_request *req, struct submit_client *client)
+{
+    struct submit_slot *slot;
+    uint64_t pos, seq;
+    int ret = atomic_load_explicit(&q->ret, memory_order_acquire);
+    if (ret)
+    {
+        return ret;
+    }
+    req->client = client;
+    atomic_store_explicit(&req->done, 0, memory_order_relaxed);
+    pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &q->slots[pos & q->mask];
+        seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos)
+        {
+            /* 槽可写, 抢到入队位置后独占它; 失败时pos被更新为最新的位置 */
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if ((int64_t)(seq - pos) < 0)
+        {
+            /* 上一圈的请求还没被取走, 环已满 */
+            return -EAGAIN;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    slot->req = req;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+int submit_wait(struct submit_queue *q, struct submit_client *client, uint64_t target)
+{
+    int ret;
+    while (atomic_load_explicit(&client->completed, memory_order_acquire) < target)
+    {
+        ret = atomic_load_explicit(&q->ret, memory_order_acquire);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
@@ -1,4 +1,10 @@
 #include "utils.h"
+#include <pthread.h>
+#include "credit.h"
+#include "latency.h"
+#include "mr_pool.h"
+#include "port_counters.h"
+#include "wr_batch.h"
 
 int get_addr(char *dst, struct sockaddr *addr)
 {
@@ -47,37 +53,443 @@ int process_rdma_cm_event(struct rdma_event_channel *echannel,
     return ret;
 }
 
-int process_work_completion_events(struct ibv_comp_channel *comp_channel,
-                                   struct ibv_wc *wc,
-                                   int max_wc)
+/* 进程内所有CQ共用的工作完成获取方式 */
+static enum wc_poll_mode wc_mode = WC_MODE_EVENT;
+static uint64_t wc_spin_budget_ns = DEFAULT_SPIN_BUDGET_US * 1000ULL;
+
+/* 不超过该大小的SEND/WRITE以内联方式投递 */
+static uint32_t inline_threshold = DEFAULT_MAX_INLINE_DATA;
+
+/* CQ中断合并, cq_mod_sw表示设备不支持ibv_modify_cq(), 唤醒后由软件合并 */
+static uint16_t cq_mod_count = 0, cq_mod_period_us = DEFAULT_CQ_MOD_PERIOD_US;
+static int cq_mod_sw = 0;
+
+/* 本线程在collect_work_completions()中取得但尚未确认的完成事件, 线程退出时由析构函数确认 */
+static __thread struct ibv_cq *thread_event_cq = NULL;
+static __thread uint32_t thread_unacked_events = 0;
+static pthread_key_t thread_events_key;
+static pthread_once_t thread_events_once = PTHREAD_ONCE_INIT;
+
+/* 流式传输中每隔多少个WR请求一次完成, 0表示按队列深度自动选择 */
+static uint32_t signal_interval = 0;
+
+void set_wc_poll_mode(enum wc_poll_mode mode, uint32_t spin_budget_us)
+{
+    wc_mode           = mode;
+    wc_spin_budget_ns = (uint64_t)spin_budget_us * 1000ULL;
+}
+
+enum wc_poll_mode get_wc_poll_mode(uint32_t *spin_budget_us)
+{
+    if (spin_budget_us)
+    {
+        *spin_budget_us = (uint32_t)(wc_spin_budget_ns / 1000ULL);
+    }
+    return wc_mode;
+}
+
+void set_inline_threshold(uint32_t bytes)
+{
+    inline_threshold = bytes;
+}
+
+uint32_t get_inline_threshold()
+{
+    return inline_threshold;
+}
+
+int rdma_create_qp_inline(struct rdma_cm_id *id, struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+{
+    attr->cap.max_inline_data = inline_threshold;
+    if (!rdma_create_qp(id, pd, attr))
+    {
+        return 0;
+    }
+    if (!inline_threshold)
+    {
+        log_err("Failed to create QP, errno: %d ", -errno);
+        return -errno;
+    }
+    log_warn("Failed to create QP with %u bytes of inline data, errno: %d, disabling inline ",
+             inline_threshold, -errno);
+    inline_threshold          = 0;
+    attr->cap.max_inline_data = 0;
+    if (rdma_create_qp(id, pd, attr))
+    {
+        log_err("Failed to create QP, errno: %d ", -errno);
+        return -errno;
+    }
+    return 0;
+}
+
+struct ibv_qp *create_qp_inline(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
+{
+    struct ibv_qp *qp;
+    attr->cap.max_inline_data = inline_threshold;
+    qp                        = ibv_create_qp(pd, attr);
+    if (qp || !inline_threshold)
+    {
+        if (!qp)
+        {
+            log_err("Failed to create QP, errno: %d ", -errno);
+        }
+        return qp;
+    }
+    log_warn("Failed to create QP with %u bytes of inline data, errno: %d, disabling inline ",
+             inline_threshold, -errno);
+    inline_threshold          = 0;
+    attr->cap.max_inline_data = 0;
+    qp                        = ibv_create_qp(pd, attr);
+    if (!qp)
+    {
+        log_err("Failed to create QP, errno: %d ", -errno);
+    }
+    return qp;
+}
+
+void setup_timer_log(const struct setup_timer *t,
+                     const char *const *names,
+                     int num_phases,
+                     const char *label)
+{
+    char buf[512];
+    uint64_t total = 0;
+    int len        = 0;
+    for (int i = 0; i < num_phases && len < (int)sizeof(buf); i++)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s %.1f", i ? ", " : "", names[i],
+                        t->ns[i] / 1e3);
+        total += t->ns[i];
+    }
+    log_info("%s: %.1f us (%s) ", label, total / 1e3, buf);
+}
+
+void set_signal_interval(uint32_t interval)
+{
+    signal_interval = interval;
+}
+
+uint32_t get_signal_interval(uint32_t depth)
+{
+    uint32_t interval = signal_interval ? signal_interval : depth / 2;
+    /* 在途的WR中至少要有一个请求了完成, 否则发送队列满时无从回收 */
+    if (interval > depth)
+    {
+        interval = depth;
+    }
+    return interval ? interval : 1;
+}
+
+int parse_wc_poll_mode(const char *str, enum wc_poll_mode *mode)
+{
+    if (!strcmp(str, "event"))
+    {
+        *mode = WC_MODE_EVENT;
+    }
+    else if (!strcmp(str, "poll"))
+    {
+        *mode = WC_MODE_POLL;
+    }
+    else if (!strcmp(str, "adaptive"))
+    {
+        *mode = WC_MODE_ADAPTIVE;
+    }
+    else
+    {
+        log_err("Unknown completion mode: %s ", str);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void set_cq_moderation(uint16_t count, uint16_t period_us)
+{
+    cq_mod_count     = count;
+    cq_mod_period_us = period_us;
+}
+
+int parse_cq_moderation(const char *str, uint16_t *count, uint16_t *period_us)
+{
+    char *end           = NULL;
+    unsigned long value = strtoul(str, &end, 0);
+    if (end == str || value > UINT16_MAX)
+    {
+        log_err("Invalid CQ moderation count: %s ", str);
+        return -EINVAL;
+    }
+    *count     = (uint16_t)value;
+    *period_us = DEFAULT_CQ_MOD_PERIOD_US;
+    if (*end == ',')
+    {
+        str   = end + 1;
+        value = strtoul(str, &end, 0);
+        if (end == str || value > UINT16_MAX)
+        {
+            log_err("Invalid CQ moderation period: %s ", str);
+            return -EINVAL;
+        }
+        *period_us = (uint16_t)value;
+    }
+    if (*end != '\0')
+    {
+        log_err("Invalid CQ moderation, expected <count>[,<period-us>]: %s ", str);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void moderate_cq(struct ibv_cq *cq)
+{
+    struct ibv_modify_cq_attr attr;
+    int ret;
+    if (!cq_mod_count || wc_mode == WC_MODE_POLL || cq_mod_sw)
+    {
+        return;
+    }
+    bzero(&attr, sizeof(attr));
+    attr.attr_mask          = IBV_CQ_ATTR_MODERATE;
+    attr.moderate.cq_count  = cq_mod_count;
+    attr.moderate.cq_period = cq_mod_period_us;
+    ret                     = ibv_modify_cq(cq, &attr);
+    if (ret)
+    {
+        /* 设备通常是同一种, 一个CQ不支持就不再尝试 */
+        log_warn("CQ moderation is not supported, errno: %d, coalescing in software ", -ret);
+        cq_mod_sw = 1;
+        return;
+    }
+    debug("CQ moderation: %u completions or %u us ", cq_mod_count, cq_mod_period_us);
+}
+
+int cq_coalesce_continue(int handled, uint64_t woke_ns)
+{
+    return cq_mod_sw && wc_mode == WC_MODE_EVENT && handled < cq_mod_count &&
+           now_ns() - woke_ns < (uint64_t)cq_mod_period_us * 1000ULL;
+}
+
+void ack_cq_event(struct ibv_cq *cq, uint32_t *pending)
+{
+    if (++*pending >= CQ_EVENT_ACK_BATCH)
+    {
+        ibv_ack_cq_events(cq, *pending);
+        *pending = 0;
+    }
+}
+
+void flush_cq_events(struct ibv_cq *cq, uint32_t *pending)
+{
+    if (*pending)
+    {
+        ibv_ack_cq_events(cq, *pending);
+        *pending = 0;
+    }
+}
+
+void flush_thread_cq_events()
+{
+    flush_cq_events(thread_event_cq, &thread_unacked_events);
+}
+
+static void thread_events_exit(void *arg)
+{
+    (void)arg;
+    flush_thread_cq_events();
+}
+
+static void create_thread_events_key()
+{
+    pthread_key_create(&thread_events_key, thread_events_exit);
+}
+
+/* 累计本线程的一个完成事件, 换了CQ时先确认之前那个CQ的事件 */
+static void ack_thread_cq_event(struct ibv_cq *cq)
+{
+    if (cq != thread_event_cq)
+    {
+        flush_thread_cq_events();
+        thread_event_cq = cq;
+        /* 析构函数只在值非NULL时调用 */
+        pthread_once(&thread_events_once, create_thread_events_key);
+        pthread_setspecific(thread_events_key, cq);
+    }
+    ack_cq_event(cq, &thread_unacked_events);
+}
+
+int arm_cq_notification(struct ibv_cq *cq)
+{
+    if (wc_mode == WC_MODE_POLL)
+    {
+        return 0;
+    }
+    if (ibv_req_notify_cq(cq, 0))
+    {
+        log_err("Failed to request notifications on CQ, errno: %d ", -errno);
+        return -errno;
+    }
+    return 0;
+}
+
+/* 在cq上轮询直到获取至少min_wc个完成或出错, 不涉及完成通道 */
+static int poll_cq_busy(struct ibv_cq *cq, struct ibv_wc *wc, int min_wc, int max_wc)
+{
+    int ret, total_wc = 0;
+    while (total_wc < min_wc)
+    {
+        ret = ibv_poll_cq(cq, max_wc - total_wc, wc + total_wc);
+        if (ret < 0)
+        {
+            log_err("Failed to poll cq for wc, errno: %d ", -errno);
+            return -errno;
+        }
+        total_wc += ret;
+    }
+    return total_wc;
+}
+
+/* 阻塞等待完成通道上的下一个事件, 累计确认并重新请求通知 */
+static int wait_cq_event(struct ibv_comp_channel *comp_channel)
 {
     struct ibv_cq *cq_ptr = NULL;
     void *context         = NULL;
-    int ret = -1, total_wc = 0;
-    /* 等待完成队列中的事件 */
-    ret = ibv_get_cq_event(comp_channel, &cq_ptr, &context);
-    if (ret)
+    if (ibv_get_cq_event(comp_channel, &cq_ptr, &context))
     {
         log_err("Failed to get cq event, errno: %d ", -errno);
         return -errno;
     }
-    ret = ibv_req_notify_cq(cq_ptr, 0);
-    if (ret)
+    ack_thread_cq_event(cq_ptr);
+    if (ibv_req_notify_cq(cq_ptr, 0))
     {
         log_err("Failed to request notifications on CQ, errno: %d ", -errno);
         return -errno;
     }
-    total_wc = 0;
-    do
+    return 0;
+}
+
+/*
+ * 事件模式: 先轮询已有的完成, 不足min_wc时阻塞在完成通道上。
+ * 每次唤醒后都先重新请求通知再轮询, 因此不会丢失唤醒; 提前轮询走的完成
+ * 只会在之后造成一次伪唤醒。软件合并时唤醒后继续轮询, 一次唤醒取得一批完成。
+ */
+static int poll_cq_event(struct ibv_comp_channel *comp_channel,
+                         struct ibv_cq *cq,
+                         struct ibv_wc *wc,
+                         int min_wc,
+                         int max_wc)
+{
+    uint64_t woke_ns = 0;
+    int ret, total_wc = 0, woke_wc = 0;
+    for (;;)
     {
-        ret = ibv_poll_cq(cq_ptr, max_wc - total_wc, wc + total_wc);
+        ret = ibv_poll_cq(cq, max_wc - total_wc, wc + total_wc);
         if (ret < 0)
         {
             log_err("Failed to poll cq for wc, errno: %d ", -errno);
             return -errno;
         }
         total_wc += ret;
-    } while (total_wc < max_wc);
+        if (woke_ns && total_wc < max_wc && cq_coalesce_continue(total_wc - woke_wc, woke_ns))
+        {
+            if (!ret)
+            {
+                cpu_relax();
+            }
+            continue;
+        }
+        if (total_wc >= min_wc)
+        {
+            return total_wc;
+        }
+        /* 等待完成队列中的事件 */
+        ret = wait_cq_event(comp_channel);
+        if (ret)
+        {
+            return ret;
+        }
+        woke_ns = now_ns();
+        woke_wc = total_wc;
+    }
+}
+
+/*
+ * 自适应模式: 忙轮询直到spin预算耗尽, 然后请求通知并再轮询一次以消除竞争,
+ * 仍不足min_wc时才阻塞在完成通道上。之前遗留的通知只会造成一次伪唤醒。
+ */
+static int poll_cq_adaptive(struct ibv_comp_channel *comp_channel,
+                            struct ibv_cq *cq,
+                            struct ibv_wc *wc,
+                            int min_wc,
+                            int max_wc)
+{
+    uint64_t spin_start = now_ns();
+    int ret, total_wc = 0;
+    while (total_wc < min_wc)
+    {
+        ret = ibv_poll_cq(cq, max_wc - total_wc, wc + total_wc);
+        if (ret < 0)
+        {
+            log_err("Failed to poll cq for wc, errno: %d ", -errno);
+            return -errno;
+        }
+        if (ret > 0)
+        {
+            total_wc += ret;
+            spin_start = now_ns();
+            continue;
+        }
+        if (now_ns() - spin_start < wc_spin_budget_ns)
+        {
+            cpu_relax();
+            continue;
+        }
+        if (ibv_req_notify_cq(cq, 0))
+        {
+            log_err("Failed to request notifications on CQ, errno: %d ", -errno);
+            return -errno;
+        }
+        ret = ibv_poll_cq(cq, max_wc - total_wc, wc + total_wc);
+        if (ret < 0)
+        {
+            log_err("Failed to poll cq for wc, errno: %d ", -errno);
+            return -errno;
+        }
+        if (ret == 0)
+        {
+            ret = wait_cq_event(comp_channel);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        total_wc += ret;
+        spin_start = now_ns();
+    }
+    return total_wc;
+}
+
+int collect_work_completions(struct ibv_comp_channel *comp_channel,
+                             struct ibv_cq *cq,
+                             struct ibv_wc *wc,
+                             int min_wc,
+                             int max_wc)
+{
+    int total_wc = 0;
+    switch (wc_mode)
+    {
+        case WC_MODE_POLL:
+            total_wc = poll_cq_busy(cq, wc, min_wc, max_wc);
+            break;
+        case WC_MODE_ADAPTIVE:
+            total_wc = poll_cq_adaptive(comp_channel, cq, wc, min_wc, max_wc);
+            break;
+        case WC_MODE_EVENT:
+        default:
+            total_wc = poll_cq_event(comp_channel, cq, wc, min_wc, max_wc);
+            break;
+    }
+    if (total_wc < 0)
+    {
+        return total_wc;
+    }
     /* 检查完成队列中的状态与操作是否成功 */
     for (int i = 0; i < total_wc; i++)
     {
@@ -88,11 +500,644 @@ int process_work_completion_events(struct ibv_comp_channel *comp_channel,
             return -wc[i].status;
         }
     }
-    ibv_ack_cq_events(cq_ptr, 1);
     return total_wc;
 }
 
-struct ibv_mr *rdma_buffer_alloc(struct ibv_pd *pd, uint32_t size, enum ibv_access_flags permission)
+int process_work_completion_events(struct ibv_comp_channel *comp_channel,
+                                   struct ibv_cq *cq,
+                                   struct ibv_wc *wc,
+                                   int max_wc)
+{
+    return collect_work_completions(comp_channel, cq, wc, max_wc, max_wc);
+}
+
+int rdma_write_u64_prepare(struct ibv_pd *pd, struct ibv_mr **mr)
+{
+    *mr = NULL;
+    if (sizeof(uint64_t) <= get_inline_threshold())
+    {
+        return 0;
+    }
+    *mr = rdma_buffer_alloc(pd, sizeof(uint64_t), (IBV_ACCESS_LOCAL_WRITE));
+    if (!*mr)
+    {
+        log_err("Failed to allocate the source of 8-byte writes ");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+int rdma_write_u64(struct ibv_qp *qp,
+                   struct ibv_mr *mr,
+                   uint64_t value,
+                   uint64_t remote_addr,
+                   uint32_t rkey,
+                   int send_flags)
+{
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_sge sge;
+    int ret = -1;
+    bzero(&wr, sizeof(wr));
+    wr.sg_list             = &sge;
+    wr.num_sge             = 1;
+    wr.opcode              = IBV_WR_RDMA_WRITE;
+    wr.send_flags          = send_flags;
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey        = rkey;
+    sge.length             = sizeof(value);
+    if (mr)
+    {
+        /* 计数器单调递增, 上一个WRITE尚未读取源时被覆盖也只会写入更新的值 */
+        *(volatile uint64_t *)mr->addr = value;
+        sge.addr                       = (uint64_t)mr->addr;
+        sge.lkey                       = mr->lkey;
+    }
+    else
+    {
+        /* 内联时投递即拷贝, 可以直接使用栈上的值 */
+        sge.addr = (uint64_t)&value;
+        sge.lkey = 0;
+        wr.send_flags |= IBV_SEND_INLINE;
+    }
+    ret = ibv_post_send(qp, &wr, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post 8-byte RDMA WRITE to 0x%lx, errno: %d ", remote_addr, ret);
+        return -ret;
+    }
+    return 0;
+}
+
+int rdma_pipelined_ops(struct ibv_qp *qp,
+                       struct ibv_comp_channel *comp_channel,
+                       struct ibv_cq *cq,
+                       enum ibv_wr_opcode opcode,
+                       struct ibv_mr *local_mr,
+                       uint32_t length,
+                       struct rdma_buffer_attr *remote,
+                       uint32_t num_ops,
+                       uint32_t depth,
+                       struct send_credits *credits)
+{
+    /* 每次操作就是只有一个分块的区域 */
+    return rdma_chunked_transfer(qp, comp_channel, cq, opcode, local_mr, remote, length, length,
+                                 num_ops, depth, credits);
+}
+
+/* 第index个分块的长度, 最后一个分块可能更小 */
+static inline uint32_t chunk_length(uint64_t index, uint64_t length, uint32_t chunk_size)
+{
+    uint64_t offset = index * chunk_size;
+    return length - offset < chunk_size ? (uint32_t)(length - offset) : chunk_size;
+}
+
+int rdma_chunked_transfer(struct ibv_qp *qp,
+                          struct ibv_comp_channel *comp_channel,
+                          struct ibv_cq *cq,
+                          enum ibv_wr_opcode opcode,
+                          struct ibv_mr *local_mr,
+                          struct rdma_buffer_attr *remote,
+                          uint64_t length,
+                          uint32_t chunk_size,
+                          uint32_t num_passes,
+                          uint32_t depth,
+                          struct send_credits *credits)
+{
+    struct ibv_wc wc[WC_BATCH];
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+    struct wr_batch batch;
+    uint64_t num_chunks, total, posted = 0, completed = 0, offset;
+    uint64_t completed_bytes = 0;
+    uint32_t interval, max_inline = 0;
+    /* 延迟分解: 按wr_id对depth取模存放时间戳, rung为第一个尚未敲门铃的WR */
+    struct lat_stamp *stamps = NULL;
+    uint64_t rung = 0, reaped = 0, done_at, first, first_bytes;
+    int ret;
+    if (!depth || !chunk_size || !length)
+    {
+        log_err("Queue depth, chunk size and length must be positive");
+        return -EINVAL;
+    }
+    if (local_mr->length < length || (opcode != IBV_WR_SEND && remote->length < length))
+    {
+        log_err("Transfer of %lu bytes exceeds the local or remote buffer ", length);
+        return -EINVAL;
+    }
+    /* 只有SEND消耗接收端的接收 */
+    if (opcode != IBV_WR_SEND || !send_credits_enabled(credits))
+    {
+        credits = NULL;
+    }
+    num_chunks = (length + chunk_size - 1) / chunk_size;
+    total      = num_chunks * num_passes;
+    interval   = get_signal_interval(depth);
+    sge.lkey   = local_mr->lkey;
+    /* READ的数据由远端返回, 不能内联 */
+    if (opcode != IBV_WR_RDMA_READ)
+    {
+        max_inline = inline_threshold;
+    }
+    bzero(&wr, sizeof(wr));
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode  = opcode;
+    if (opcode != IBV_WR_SEND)
+    {
+        wr.wr.rdma.rkey = remote->stag.remote_stag;
+    }
+    if (LAT_ENABLED)
+    {
+        stamps = calloc(depth, sizeof(*stamps));
+        if (!stamps)
+        {
+            log_err("Failed to allocate %u latency stamps, -ENOMEM ", depth);
+            return -ENOMEM;
+        }
+    }
+    ret = wr_batch_init_default(&batch, qp, depth);
+    if (ret)
+    {
+        free(stamps);
+        return ret;
+    }
+    while (completed < total)
+    {
+        /*
+         * 发送队列槽位在请求了完成的WR完成时才回收, posted - completed即占用的槽位数;
+         * 启用流控时还受接收端授予的信用限制
+         */
+        while (posted < total && posted - completed < depth &&
+               (!credits || send_credits_available(credits)))
+        {
+            offset     = posted % num_chunks * chunk_size;
+            sge.addr   = (uint64_t)local_mr->addr + offset;
+            sge.length = chunk_length(posted % num_chunks, length, chunk_size);
+            if (opcode != IBV_WR_SEND)
+            {
+                wr.wr.rdma.remote_addr = remote->address + offset;
+            }
+            /*
+             * 每interval个WR、发送队列将满、信用将用尽或最后一个WR请求完成, 其余WR不产生CQE;
+             * 因信用暂停投递时最后一个WR总是请求了完成, 等待完成不会永远阻塞
+             */
+            wr.send_flags = ((posted + 1) % interval == 0 || posted + 1 == total ||
+                             posted + 1 - completed == depth ||
+                             (credits && send_credits_available(credits) == 1))
+                                ? IBV_SEND_SIGNALED
+                                : 0;
+            if (sge.length <= max_inline)
+            {
+                wr.send_flags |= IBV_SEND_INLINE;
+            }
+            wr.wr_id      = posted;
+            if (LAT_ENABLED)
+            {
+                stamps[posted % depth].post = lat_now();
+            }
+            /* 攒成链后一次投递, 多个WR只敲一次门铃 */
+            ret = wr_batch_add(&batch, &wr);
+            if (ret)
+            {
+                goto out;
+            }
+            posted++;
+            if (credits)
+            {
+                send_credits_use(credits, 1);
+            }
+            /* 批满或超时时整条链已在wr_batch_add()中投递 */
+            if (LAT_ENABLED && !batch.count)
+            {
+                lat_stamp_doorbell(stamps, depth, &rung, posted);
+            }
+        }
+        /* 等待完成之前必须投递批中剩余的WR */
+        ret = wr_batch_flush(&batch);
+        if (ret)
+        {
+            goto out;
+        }
+        if (LAT_ENABLED)
+        {
+            lat_stamp_doorbell(stamps, depth, &rung, posted);
+        }
+        /* 所有WR都已完成但信用用尽: 没有完成可等, 等待接收端写回信用 */
+        if (credits && posted == completed)
+        {
+            ret = send_credits_wait(credits);
+            if (ret)
+            {
+                goto out;
+            }
+            continue;
+        }
+        ret = collect_work_completions(comp_channel, cq, wc, 1, WC_BATCH);
+        if (ret < 0)
+        {
+            log_err("Failed to get work completions, ret = %d ", ret);
+            goto out;
+        }
+        first       = completed;
+        first_bytes = completed_bytes;
+        if (LAT_ENABLED)
+        {
+            reaped = lat_now();
+        }
+        /*
+         * RC按序完成, 一个CQE意味着它之前未请求完成的WR也都已完成:
+         * 回收到wr_id为止的槽位, 并由wr_id还原这些分块的长度累计已完成的字节数
+         */
+        for (int i = 0; i < ret; i++)
+        {
+            if (wc[i].wr_id < completed || wc[i].wr_id >= posted)
+            {
+                log_err("Unexpected completion of WR %lu, %lu already completed ", wc[i].wr_id,
+                        completed);
+                ret = -EIO;
+                goto out;
+            }
+            for (; completed <= wc[i].wr_id; completed++)
+            {
+                completed_bytes += chunk_length(completed % num_chunks, length, chunk_size);
+            }
+        }
+        port_sampler_account(completed_bytes - first_bytes);
+        /* 一个CQE覆盖的未请求完成的WR与它同时被取到 */
+        if (LAT_ENABLED)
+        {
+            done_at = lat_now();
+            for (; first < completed; first++)
+            {
+                lat_record_wr(&stamps[first % depth], reaped, done_at);
+            }
+        }
+    }
+    ret = 0;
+    if (completed_bytes != length * num_passes)
+    {
+        log_err("Completed %lu bytes, expected %lu ", completed_bytes, length * num_passes);
+        ret = -EIO;
+    }
+out:
+    wr_batch_destroy(&batch);
+    free(stamps);
+    return ret;
+}
+
+int parse_size(const char *str, uint64_t *size)
+{
+    char *end    = NULL;
+    uint64_t val = strtoull(str, &end, 0);
+    if (end == str)
+    {
+        log_err("Invalid size: %s ", str);
+        return -EINVAL;
+    }
+    switch (*end)
+    {
+        case 'g':
+        case 'G':
+            val <<= 10;
+            /* fall through */
+        case 'm':
+        case 'M':
+            val <<= 10;
+            /* fall through */
+        case 'k':
+        case 'K':
+            val <<= 10;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (*end != '\0' && strcasecmp(end, "b") && strcasecmp(end, "ib"))
+    {
+        log_err("Invalid size suffix: %s ", str);
+        return -EINVAL;
+    }
+    *size = val;
+    return 0;
+}
+
+int fit_queue_depth(struct ibv_context *verbs, uint32_t *depth, uint8_t *rd_atomic)
+{
+    struct ibv_device_attr dev_attr;
+    uint32_t max_depth;
+    if (ibv_query_device(verbs, &dev_attr))
+    {
+        log_err("Failed to query device attributes, errno: %d ", -errno);
+        return -errno;
+    }
+    /* 发送队列与接收队列共用一个CQ, 深度同时受QP与CQ容量的限制 */
+    max_depth = (uint32_t)dev_attr.max_qp_wr;
+    if ((uint32_t)dev_attr.max_cqe / 2 < max_depth)
+    {
+        max_depth = (uint32_t)dev_attr.max_cqe / 2;
+    }
+    if (*depth > max_depth)
+    {
+        log_warn("Queue depth %u exceeds device limit, using %u ", *depth, max_depth);
+        *depth = max_depth;
+    }
+    if (rd_atomic)
+    {
+        *rd_atomic = dev_attr.max_qp_init_rd_atom < dev_attr.max_qp_rd_atom
+                         ? (uint8_t)dev_attr.max_qp_init_rd_atom
+                         : (uint8_t)dev_attr.max_qp_rd_atom;
+    }
+    return 0;
+}
+
+int fit_chunk_size(struct ibv_context *verbs, uint8_t port_num, uint32_t *chunk_size)
+{
+    struct ibv_port_attr port_attr;
+    uint32_t mtu, fitted = *chunk_size;
+    if (ibv_query_port(verbs, port_num, &port_attr))
+    {
+        log_err("Failed to query port %u attributes, errno: %d ", port_num, -errno);
+        return -errno;
+    }
+    /* IBV_MTU_256 = 1, 之后每级翻倍 */
+    mtu = 128U << port_attr.active_mtu;
+    if (fitted > port_attr.max_msg_sz)
+    {
+        fitted = port_attr.max_msg_sz;
+    }
+    fitted = fitted < mtu ? mtu : fitted / mtu * mtu;
+    if (fitted != *chunk_size)
+    {
+        log_warn("Chunk size %u does not fit port MTU %u, using %u ", *chunk_size, mtu, fitted);
+        *chunk_size = fitted;
+    }
+    return 0;
+}
+
+int device_atomic_access(struct ibv_context *verbs)
+{
+    struct ibv_device_attr dev_attr;
+    if (ibv_query_device(verbs, &dev_attr))
+    {
+        log_err("Failed to query device attributes, errno: %d ", -errno);
+        return 0;
+    }
+    return dev_attr.atomic_cap == IBV_ATOMIC_NONE ? 0 : IBV_ACCESS_REMOTE_ATOMIC;
+}
+
+enum mr_odp_mode device_odp_mode(struct ibv_context *verbs,
+                                 enum mr_odp_mode requested,
+                                 int *access)
+{
+    const uint32_t needed = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV | IBV_ODP_SUPPORT_WRITE |
+                            IBV_ODP_SUPPORT_READ;
+    const char *name      = ibv_get_device_name(verbs->device);
+    struct ibv_device_attr_ex attr;
+    uint32_t rc_caps;
+    *access = 0;
+    if (requested == MR_ODP_OFF)
+    {
+        return MR_ODP_OFF;
+    }
+    if (ibv_query_device_ex(verbs, NULL, &attr))
+    {
+        log_err("Failed to query extended device attributes, errno: %d ", -errno);
+        return MR_ODP_OFF;
+    }
+    rc_caps = attr.odp_caps.per_transport_caps.rc_odp_caps;
+    if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT) || (rc_caps & needed) != needed)
+    {
+        log_warn("Device %s does not support on-demand paging on RC, pinning registrations ",
+                 name);
+        return MR_ODP_OFF;
+    }
+    *access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    if (rc_caps & IBV_ODP_SUPPORT_ATOMIC)
+    {
+        *access |= device_atomic_access(verbs);
+    }
+    if (requested == MR_ODP_IMPLICIT && !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT))
+    {
+        log_warn("Device %s does not support implicit on-demand paging, using explicit ", name);
+        return MR_ODP_EXPLICIT;
+    }
+    return requested;
+}
+
+static const char *odp_mode_names[] = {
+    [MR_ODP_OFF]      = "off",
+    [MR_ODP_EXPLICIT] = "explicit",
+    [MR_ODP_IMPLICIT] = "implicit",
+};
+
+int parse_mr_odp_mode(const char *str, enum mr_odp_mode *mode)
+{
+    for (int i = 0; i < (int)(sizeof(odp_mode_names) / sizeof(odp_mode_names[0])); i++)
+    {
+        if (!strcasecmp(str, odp_mode_names[i]))
+        {
+            *mode = (enum mr_odp_mode)i;
+            return 0;
+        }
+    }
+    log_err("Unknown on-demand paging mode: %s ", str);
+    return -EINVAL;
+}
+
+const char *mr_odp_mode_str(enum mr_odp_mode mode)
+{
+    return odp_mode_names[mode];
+}
+
+#ifndef MAP_HUGE_SHIFT
+#    define MAP_HUGE_SHIFT (26)
+#endif
+#define HUGE_2M_SHIFT (21)
+#define HUGE_1G_SHIFT (30)
+
+static enum buffer_backing default_backing = BUFFER_BACKING_HEAP;
+
+static const char *backing_names[] = {
+    [BUFFER_BACKING_HEAP]    = "heap",
+    [BUFFER_BACKING_THP]     = "thp",
+    [BUFFER_BACKING_HUGE_2M] = "2m",
+    [BUFFER_BACKING_HUGE_1G] = "1g",
+};
+
+int parse_buffer_backing(const char *str, enum buffer_backing *backing)
+{
+    for (int i = 0; i < (int)(sizeof(backing_names) / sizeof(backing_names[0])); i++)
+    {
+        if (!strcasecmp(str, backing_names[i]))
+        {
+            *backing = (enum buffer_backing)i;
+            return 0;
+        }
+    }
+    log_err("Unknown buffer backing: %s ", str);
+    return -EINVAL;
+}
+
+const char *buffer_backing_str(enum buffer_backing backing)
+{
+    return backing_names[backing];
+}
+
+void set_buffer_backing(enum buffer_backing backing)
+{
+    default_backing = backing;
+}
+
+enum buffer_backing get_buffer_backing()
+{
+    return default_backing;
+}
+
+/* 以hugetlbfs大页映射匿名内存, shift为页大小的log2 */
+static void *map_hugetlb(size_t size, int shift, size_t *mapped_size)
+{
+    size_t page = (size_t)1 << shift;
+    void *addr;
+    *mapped_size = (size + page - 1) & ~(page - 1);
+    addr         = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+/*
+ * 映射按2 MiB对齐的匿名内存并建议内核使用透明大页。
+ * 匿名页本身为零且只在首次访问时分配, 与其他页面来源一样不预先缺页。
+ */
+static void *map_thp(size_t size, size_t *mapped_size)
+{
+    size_t align = (size_t)1 << HUGE_2M_SHIFT;
+    char *addr, *aligned;
+    *mapped_size = (size + align - 1) & ~(align - 1);
+    /* 多映射一个对齐单位, 再裁掉首尾多出的部分 */
+    addr = mmap(NULL, *mapped_size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+    aligned = (char *)(((uintptr_t)addr + align - 1) & ~(uintptr_t)(align - 1));
+    if (aligned > addr)
+    {
+        munmap(addr, aligned - addr);
+    }
+    munmap(aligned + *mapped_size, addr + align - aligned);
+    /* 内核不支持透明大页时madvise失败, 内存仍然可用 */
+    madvise(aligned, *mapped_size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+int host_buffer_alloc(struct host_buffer *buf, size_t size, enum buffer_backing backing)
+{
+    bzero(buf, sizeof(*buf));
+    buf->size = size;
+    switch (backing)
+    {
+        case BUFFER_BACKING_HUGE_1G:
+            buf->addr = map_hugetlb(size, HUGE_1G_SHIFT, &buf->mapped_size);
+            if (buf->addr)
+            {
+                buf->backing = BUFFER_BACKING_HUGE_1G;
+                break;
+            }
+            debug("1 GiB hugepages unavailable for %zu bytes, falling back ", size);
+            /* fall through */
+        case BUFFER_BACKING_HUGE_2M:
+            buf->addr = map_hugetlb(size, HUGE_2M_SHIFT, &buf->mapped_size);
+            if (buf->addr)
+            {
+                buf->backing = BUFFER_BACKING_HUGE_2M;
+                break;
+            }
+            debug("2 MiB hugepages unavailable for %zu bytes, falling back ", size);
+            /* fall through */
+        case BUFFER_BACKING_THP:
+            buf->addr = map_thp(size, &buf->mapped_size);
+            if (buf->addr)
+            {
+                buf->backing = BUFFER_BACKING_THP;
+                break;
+            }
+            debug("Aligned mapping unavailable for %zu bytes, falling back ", size);
+            /* fall through */
+        case BUFFER_BACKING_HEAP:
+        default:
+            buf->mapped_size = size;
+            buf->addr        = calloc(1, size ? size : 1);
+            buf->backing     = BUFFER_BACKING_HEAP;
+            break;
+    }
+    if (!buf->addr)
+    {
+        log_err("Failed to allocate %zu bytes of host memory ", size);
+        return -ENOMEM;
+    }
+    if (buf->backing != backing)
+    {
+        log_warn("Requested %s pages for %zu bytes, got %s ", buffer_backing_str(backing), size,
+                 buffer_backing_str(buf->backing));
+    }
+    return 0;
+}
+
+void host_buffer_free(struct host_buffer *buf)
+{
+    if (!buf->addr)
+    {
+        return;
+    }
+    switch (buf->backing)
+    {
+        case BUFFER_BACKING_HUGE_1G:
+        case BUFFER_BACKING_HUGE_2M:
+        case BUFFER_BACKING_THP:
+            munmap(buf->addr, buf->mapped_size);
+            break;
+        case BUFFER_BACKING_HEAP:
+        default:
+            free(buf->addr);
+            break;
+    }
+    buf->addr = NULL;
+}
+
+/* 直接调用ibv_reg_mr()注册, 并包装为句柄 */
+static struct ibv_mr *register_direct(struct ibv_pd *pd,
+                                      void *addr,
+                                      uint64_t size,
+                                      enum ibv_access_flags permission,
+                                      struct host_buffer *owned)
+{
+    struct rdma_mr_handle *handle = calloc(1, sizeof(*handle));
+    if (!handle)
+    {
+        log_err("Failed to allocate memory region handle");
+        return NULL;
+    }
+    handle->backing = ibv_reg_mr(pd, addr, size, permission);
+    if (!handle->backing)
+    {
+        log_err("Failed to register memory region, errno: %d ", -errno);
+        free(handle);
+        return NULL;
+    }
+    handle->view        = *handle->backing;
+    handle->kind        = RDMA_MR_DIRECT;
+    if (owned)
+    {
+        handle->owns_buffer = 1;
+        handle->buffer      = *owned;
+    }
+    debug("Registered: %p , len: %zu , stag: 0x%x ", handle->view.addr, handle->view.length,
+          handle->view.lkey);
+    return &handle->view;
+}
+
+struct ibv_mr *rdma_buffer_alloc(struct ibv_pd *pd, uint64_t size, enum ibv_access_flags permission)
 {
     struct ibv_mr *mr = NULL;
     if (!pd)
@@ -100,37 +1145,72 @@ struct ibv_mr *rdma_buffer_alloc(struct ibv_pd *pd, uint32_t size, enum ibv_acce
         log_err("Protection domain is NULL");
         return NULL;
     }
-    void *buf = calloc(1, size);
-    if (!buf)
+    /* 优先从该PD的内存池中取预注册的slab, 带远端权限时取回收的单独注册 */
+    mr = mr_pool_alloc(pd, size, permission);
+    if (!mr && (permission & ~IBV_ACCESS_LOCAL_WRITE))
+    {
+        mr = mr_pool_alloc_remote(pd, size, permission);
+    }
+    if (mr)
+    {
+        return mr;
+    }
+    struct host_buffer buf;
+    if (host_buffer_alloc(&buf, size, default_backing))
     {
         log_err("Failed to allocate buffer");
         return NULL;
     }
-    debug("Buffer allocated: %p , size: %u ", buf, size);
-    mr = rdma_buffer_register(pd, buf, size, permission);
+    debug("Buffer allocated: %p , size: %lu , backing: %s ", buf.addr, size,
+          buffer_backing_str(buf.backing));
+    /* 启用了ODP时不钉住页面, 大而稀疏访问的缓冲区只为实际访问的页面付出代价 */
+    mr = mr_odp_register(pd, buf.addr, size, permission);
+    if (mr)
+    {
+        ((struct rdma_mr_handle *)mr)->owns_buffer = 1;
+        ((struct rdma_mr_handle *)mr)->buffer      = buf;
+        return mr;
+    }
+    mr = register_direct(pd, buf.addr, size, permission, &buf);
     if (!mr)
     {
-        free(buf);
+        host_buffer_free(&buf);
     }
     return mr;
 }
 
 void rdma_buffer_free(struct ibv_mr *mr)
 {
+    struct rdma_mr_handle *handle = (struct rdma_mr_handle *)mr;
     if (!mr)
     {
         log_err("Memory region is NULL, ignoring ");
         return;
     }
-    void *to_free = mr->addr;
+    if (handle->kind == RDMA_MR_SLAB)
+    {
+        mr_pool_free(handle);
+        return;
+    }
+    if (handle->kind == RDMA_MR_REMOTE)
+    {
+        mr_pool_free_remote(handle);
+        return;
+    }
+    if (!handle->owns_buffer)
+    {
+        log_err("Memory region %p was not allocated by rdma_buffer_alloc() ", mr->addr);
+        return;
+    }
+    struct host_buffer to_free = handle->buffer;
     rdma_buffer_deregister(mr);
-    debug("Buffer freed: %p ", to_free);
-    free(to_free);
+    debug("Buffer freed: %p ", to_free.addr);
+    host_buffer_free(&to_free);
 }
 
 struct ibv_mr *rdma_buffer_register(struct ibv_pd *pd,
                                     void *addr,
-                                    uint32_t size,
+                                    uint64_t size,
                                     enum ibv_access_flags permission)
 {
     struct ibv_mr *mr = NULL;
@@ -139,27 +1219,50 @@ struct ibv_mr *rdma_buffer_register(struct ibv_pd *pd,
         log_err("Protection domain is NULL, ignoring ");
         return NULL;
     }
-    mr = ibv_reg_mr(pd, addr, size, permission);
-    if (!mr)
+    /* 启用了ODP时注册不钉住页面, 开销很小, 不经过注册缓存 */
+    mr = mr_odp_register(pd, addr, size, permission);
+    if (mr)
     {
-        log_err("Failed to register memory region, errno: %d ", -errno);
-        return NULL;
+        return mr;
     }
-    debug("Registered: %p , len: %u , stag: 0x%x ", mr->addr, (unsigned int)mr->length,
-              mr->lkey);
-    return mr;
+    /* 优先复用该PD注册缓存中覆盖此区间的注册 */
+    mr = mr_cache_register(pd, addr, size, permission);
+    if (mr)
+    {
+        return mr;
+    }
+    return register_direct(pd, addr, size, permission, NULL);
 }
 
 void rdma_buffer_deregister(struct ibv_mr *mr)
 {
+    struct rdma_mr_handle *handle = (struct rdma_mr_handle *)mr;
     if (!mr)
     {
         log_err("Memory region is NULL, ignoring ");
         return;
     }
-    debug("Deregistered: %p , len: %u , stag : 0x%x ", mr->addr, (unsigned int)mr->length,
-              mr->lkey);
-    ibv_dereg_mr(mr);
+    switch (handle->kind)
+    {
+        case RDMA_MR_CACHED:
+            mr_cache_deregister(handle);
+            break;
+        case RDMA_MR_SLAB:
+        case RDMA_MR_REMOTE:
+            log_err("Pooled buffer %p must be released with rdma_buffer_free() ", mr->addr);
+            break;
+        case RDMA_MR_IMPLICIT:
+            debug("Deregistered (implicit ODP): %p ", mr->addr);
+            free(handle);
+            break;
+        case RDMA_MR_DIRECT:
+        default:
+            debug("Deregistered: %p , len: %zu , stag : 0x%x ", mr->addr, mr->length,
+                  mr->lkey);
+            ibv_dereg_mr(handle->backing);
+            free(handle);
+            break;
+    }
 }
 
 void print_rdma_buffer_attr(struct rdma_buffer_attr *attr)
@@ -172,7 +1275,7 @@ void print_rdma_buffer_attr(struct rdma_buffer_attr *attr)
     printf("--------------------------------------\n");
     printf("Buffer attribute:\n");  
     printf("  Address: 0x%lx\n", attr->address);
-    printf("  Length: %u\n", attr->length);
+    printf("  Length: %lu\n", attr->length);
     printf("  Stag: 0x%x\n", attr->stag.local_stag);
     printf("--------------------------------------\n");
 }
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "wr_batch.h"
+
+/* 进程内默认的批处理参数 */
+static uint32_t post_batch_size       = DEFAULT_POST_BATCH_SIZE;
+static uint32_t post_flush_timeout_us = DEFAULT_POST_FLUSH_US;
+
+void set_post_batch(uint32_t batch_size, uint32_t flush_timeout_us)
+{
+    post_batch_size       = batch_size ? batch_size : 1;
+    post_flush_timeout_us = flush_timeout_us;
+}
+
+uint32_t get_post_batch(uint32_t *flush_timeout_us)
+{
+    if (flush_timeout_us)
+    {
+        *flush_timeout_us = post_flush_timeout_us;
+    }
+    return post_batch_size;
+}
+
+int wr_batch_init(struct wr_batch *batch,
+                  struct ibv_qp *qp,
+                  uint32_t batch_size,
+                  uint32_t flush_timeout_us)
+{
+    bzero(batch, sizeof(*batch));
+    if (!batch_size)
+    {
+        log_err("Batch size must be positive");
+        return -EINVAL;
+    }
+    batch->wrs  = calloc(batch_size, sizeof(*batch->wrs));
+    batch->sges = calloc((size_t)batch_size * MAX_SGE, sizeof(*batch->sges));
+    if (!batch->wrs || !batch->sges)
+    {
+        log_err("Failed to allocate WR batch of %u, -ENOMEM ", batch_size);
+        wr_batch_destroy(batch);
+        return -ENOMEM;
+    }
+    batch->qp               = qp;
+    batch->capacity         = batch_size;
+    batch->flush_timeout_ns = (uint64_t)flush_timeout_us * 1000ULL;
+    return 0;
+}
+
+int wr_batch_init_default(struct wr_batch *batch, struct ibv_qp *qp, uint32_t max_size)
+{
+    uint32_t size = post_batch_size < max_size ? post_batch_size : max_size;
+    return wr_batch_init(batch, qp, size ? size : 1, post_flush_timeout_us);
+}
+
+void wr_batch_destroy(struct wr_batch *batch)
+{
+    free(batch->wrs);
+    free(batch->sges);
+    batch->wrs   = NULL;
+    batch->sges  = NULL;
+    batch->count = 0;
+}
+
+int wr_batch_add(struct wr_batch *batch, const struct ibv_send_wr *wr)
+{
+    struct ibv_send_wr *slot;
+    if (wr->num_sge > MAX_SGE)
+    {
+        log_err("WR has %d SGEs, at most %d are supported ", wr->num_sge, MAX_SGE);
+        return -EINVAL;
+    }
+    slot          = &batch->wrs[batch->count];
+    *slot         = *wr;
+    slot->sg_list = &batch->sges[batch->count * MAX_SGE];
+    slot->next    = NULL;
+    memcpy(slot->sg_list, wr->sg_list, wr->num_sge * sizeof(*wr->sg_list));
+    if (batch->count)
+    {
+        batch->wrs[batch->count - 1].next = slot;
+    }
+    else if (batch->flush_timeout_ns)
+    {
+        batch->first_ns = now_ns();
+    }
+    batch->count++;
+    if (batch->count == batch->capacity ||
+        (batch->flush_timeout_ns && now_ns() - batch->first_ns >= batch->flush_timeout_ns))
+    {
+        return wr_batch_flush(batch);
+    }
+    return 0;
+}
+
+int wr_batch_flush(struct wr_batch *batch)
+{
+    struct ibv_send_wr *bad_wr = NULL;
+    uint32_t count             = batch->count;
+    int ret;
+    if (!count)
+    {
+        return 0;
+    }
+    batch->count = 0;
+    ret          = ibv_post_send(batch->qp, batch->wrs, &bad_wr);
+    if (ret)
+    {
+        log_err("Failed to post a chain of %u WRs at WR %ld, errno: %d ", count,
+                bad_wr ? (long)(bad_wr - batch->wrs) : -1L, ret);
+        return -ret;
+    }
+    batch->doorbells++;
+    return 0;
+}